@@ -36,8 +36,49 @@
 #import <Foundation/Foundation.h>
 #import "AQNotifyingBitfield.h"
 
+/**
+ A resolved named enumeration: the location and width of its bits within the state machine.
+ 
+ Keys are plain values, so they can be stored and passed around freely. Methods taking a key use it
+ directly rather than looking up a name, which makes them the cheapest way to use an enumeration.
+ */
+typedef struct AQStateKey
+{
+	/// The index of the enumeration's first bit, or `NSNotFound` for a key referring to nothing.
+	NSUInteger	offset;
+	
+	/// The number of bits allocated to the enumeration.
+	NSUInteger	width;
+	
+} AQStateKey;
+
+/// Returns `YES` if a key refers to an enumeration, `NO` if it was returned for an unknown name.
+static inline BOOL AQStateKeyIsValid( AQStateKey key )
+{
+	return ( key.offset != NSNotFound );
+}
+
+/// A value to store in an enumeration, for use with setValues:count:.
+typedef struct AQStateKeyValue
+{
+	/// The key of the enumeration to modify.
+	AQStateKey	key;
+	
+	/// The new value for the enumeration.
+	UInt64		value;
+	
+} AQStateKeyValue;
+
 /**
  This is intended to be a singleton class.
+ 
+ State may be read from any number of threads at once. Reads never wait for a lock: they copy the
+ state words they need and retry on the rare occasion a change was published meanwhile. The state is
+ divided into shards of 512 bits, and a change waits only for others touching the same shards, so
+ changes to different parts of the state are made concurrently. The exceptions are changes to bits
+ watched by a change block or by entry and exit blocks, and every change to persistent state: these also
+ pass through the underlying bitfield, one at a time. Changes are visible to readers before any
+ notifications for them are delivered.
  */
 @interface AQAppStateMachine : NSObject
 
@@ -47,6 +88,27 @@
  */
 + (AQAppStateMachine *) appStateMachine;
 
+/// @name Persistent State
+
+/**
+ Create a state machine whose state bits are stored in a memory-mapped file, using AQMappedBitfield.
+ 
+ If the file already exists, the state machine starts out with the state it held when the file was
+ last written, without replaying any state changes. Named enumerations must still be declared, in the
+ same order as before, so that they map onto the same bits.
+ @param path The path of the state file, which is created if necessary.
+ @param error On failure, set to an error describing why the file couldn't be used.
+ @return A new state machine, or `nil` if the file couldn't be attached.
+ */
+- (id) initWithPersistentStateAtPath: (NSString *) path error: (NSError **) error;
+
+/**
+ Write the state bits out to the persistent state file, if there is one.
+ @param error On failure, set to an error describing why the file couldn't be written.
+ @return `YES` if the state was written, or the state machine has no state file; `NO` otherwise.
+ */
+- (BOOL) synchronizePersistentState: (NSError **) error;
+
 /// @name Core State Changing API
 
 /**
@@ -61,6 +123,7 @@
  Store a 32-bit value in a given range of bits.
  @param value The value to set.
  @param range The range of bits within the state machine upon which to operate.
+ @exception NSInvalidArgumentException Thrown if _range_ is longer than 32 bits.
  */
 - (void) setScalar32Value: (UInt32) value forStateBitsInRange: (NSRange) range;
 
@@ -68,86 +131,119 @@
  Store a 64-bit value in a given range of bits.
  @param value The value to set.
  @param range The range of bits within the state machine upon which to operate.
+ @exception NSInvalidArgumentException Thrown if _range_ is longer than 64 bits.
  */
 - (void) setScalar64Value: (UInt64) value forStateBitsInRange: (NSRange) range;
 
+/**
+ Make a group of state changes, delivering notifications once they're all complete.
+ 
+ Any state may be changed within _updates_, using either the core API or named enumerations. Each
+ notification block runs at most once for the whole batch, however many of the states it watches were
+ changed. Batches may be nested; notifications are delivered when the outermost batch completes. Other
+ threads' changes wait until the batch is complete.
+ @param updates A block which changes the state machine's values.
+ */
+- (void) performBatchUpdates: (void (^)(void)) updates;
+
 /// @name Core notification API
 
 /**
  Run a notification block when a given bit is modified.
  @param index The index of the bit to watch for changes.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForChangesToStateBitAtIndex: (NSUInteger) index
-								usingBlock: (void (^)(void)) block;
+- (id) notifyForChangesToStateBitAtIndex: (NSUInteger) index
+							  usingBlock: (void (^)(void)) block;
 
 /**
  Run a notification block when any bit in a range is modified.
  @param range The range of bits to watch for changes.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForChangesToStateBitsInRange: (NSRange) range
-								 usingBlock: (void (^)(void)) block;
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range
+							   usingBlock: (void (^)(void)) block;
+
+/**
+ Run a notification block when any bit in a range is modified, passing it the values of those bits before
+ and after the modification.
+ 
+ The values are recorded as the change is made, so _block_ can use them instead of reading the state
+ machine again. Within performBatchUpdates:, the values before are those from before the batch began.
+ @param range The range of bits to watch for changes.
+ @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
+ */
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range
+						 usingChangeBlock: (void (^)(AQBitfieldChange * change)) block;
 
 /**
  Run a notification block when any bit within a masked range is modified.
  @param range The range of bits to watch for changes.
  @param mask A mask showing which bits within the range should be monitored.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForChangesToStateBitsInRange: (NSRange) range
-						  maskedWithInteger: (NSUInteger) mask
-								 usingBlock: (void (^)(void)) block;
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range
+						maskedWithInteger: (NSUInteger) mask
+							   usingBlock: (void (^)(void)) block;
 
 /**
  Run a notification block when any bit within a masked eight-byte range is modified.
  @param range The range of bits to watch for changes.
  @param mask A mask showing which bits within the range should be monitored.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForChangesToStateBitsInRange: (NSRange) range
-					 maskedWith64BitInteger: (UInt64) mask
-								 usingBlock: (void (^)(void))block;
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range
+				   maskedWith64BitInteger: (UInt64) mask
+							   usingBlock: (void (^)(void))block;
 
 /**
  Run a notification block when any bit within a masked range is modified.
  @param range The range of bits to watch for changes.
  @param mask A bitfield mask showing which bits within the range should be monitored.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForChangesToStateBitsInRange: (NSRange) range
-							 maskedWithBits: (AQBitfield *) mask
-								 usingBlock: (void (^)(void)) block;
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range
+						   maskedWithBits: (AQBitfield *) mask
+							   usingBlock: (void (^)(void)) block;
 
 /**
  Run a notification block when the bits in a given range exactly match a given value.
  @param range The range of bits to watch for changes.
  @param value The value against which to compare the range's bits.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-							  toIntegerValue: (NSUInteger) value
-								  usingBlock: (void (^)(void)) block;
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+							toIntegerValue: (NSUInteger) value
+								usingBlock: (void (^)(void)) block;
 
 /**
  Run a notification block when the bits in a given range exactly match a given 64-bit value.
  @param range The range of bits to watch for changes.
  @param value The value against which to compare the range's bits.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-								to64BitValue: (UInt64) value
-								  usingBlock: (void (^)(void)) block;
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+							  to64BitValue: (UInt64) value
+								usingBlock: (void (^)(void)) block;
 
 /**
  Run a notification block when the bits in a given range exactly match a given bitfield value.
  @param range The range of bits to watch for changes.
  @param value The value against which to compare the range's bits.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-									 toValue: (AQBitfield *) value
-								  usingBlock: (void (^)(void)) block;
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								   toValue: (AQBitfield *) value
+								usingBlock: (void (^)(void)) block;
 
 /**
  Run a notification block when the bits in a given range exactly match a given masked value.
@@ -155,11 +251,12 @@
  @param mask A mask denoting which bits within the range should be compared.
  @param value The value against which to compare the range's bits.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-								  maskedWith: (NSUInteger) mask
-							  toIntegerValue: (NSUInteger) value
-								  usingBlock: (void (^)(void)) block;
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								maskedWith: (NSUInteger) mask
+							toIntegerValue: (NSUInteger) value
+								usingBlock: (void (^)(void)) block;
 
 /**
  Run a notification block when the bits in a given range exactly match a given masked 64-bit value.
@@ -167,11 +264,12 @@
  @param mask A mask denoting which bits within the range should be compared.
  @param value The value against which to compare the range's bits.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-								  maskedWith: (UInt64) mask
-								to64BitValue: (UInt64) value
-								  usingBlock: (void (^)(void)) block;
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								maskedWith: (UInt64) mask
+							  to64BitValue: (UInt64) value
+								usingBlock: (void (^)(void)) block;
 
 /**
  Run a notification block when the bits in a given range exactly match a given masked bitfield.
@@ -179,11 +277,44 @@
  @param mask A mask bitfield denoting which bits within the range should be compared.
  @param value The bitfield against which to compare the range's bits.
  @param block The block to run when a modification occurs.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-								  maskedWith: (AQBitfield *) mask
-									 toValue: (AQBitfield *) value
-								  usingBlock: (void (^)(void)) block;
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								maskedWith: (AQBitfield *) mask
+								   toValue: (AQBitfield *) value
+								usingBlock: (void (^)(void)) block;
+
+/**
+ Run notification blocks only when the bits in a given range start or stop matching a masked bitfield.
+ 
+ Unlike the other equality notifications, which run their block after every change to the range for
+ as long as it matches, these only run when the match begins or ends. Whether the range matched before
+ and after each change is decided using the values recorded as the change was made, so a notification
+ arriving late never mistakes one change for another. Changes which arrive together are treated as one,
+ so a match which begins and ends again before the first of them is delivered is not reported.
+ @param range The range of bits to watch for changes.
+ @param mask A mask bitfield denoting which bits within the range should be compared, or `nil` to compare them all.
+ @param value The bitfield against which to compare the range's bits.
+ @param entryBlock The block to run when the range starts to match _value_. May be `nil`.
+ @param exitBlock The block to run when the range stops matching _value_. May be `nil`.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
+ */
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								maskedWith: (AQBitfield *) mask
+								   toValue: (AQBitfield *) value
+						   usingEntryBlock: (void (^)(void)) entryBlock
+								 exitBlock: (void (^)(void)) exitBlock;
+
+/**
+ Remove a notification, so that its blocks no longer run.
+ 
+ The notification is taken out of every lookup structure and its blocks are released; this takes
+ logarithmic time at worst, however many notifications are installed. A block already queued to
+ run when the notification is removed is skipped.
+ @param token A token returned by any of the state machine's notification methods. Tokens for
+ notifications which have already been removed are ignored.
+ */
+- (void) removeNotifier: (id) token;
 
 @end
 
@@ -200,15 +331,17 @@
  Create a named enumeration from an implicit enumeration up to 32 bits in size.
  @param maxValue The highest value contained in the enumeration.
  @param name The name to assign the enumeration.
+ @return A key for the new enumeration, for use with the methods in AQAppStateMachine(StateKeys).
  */
-- (void) addStateMachineValuesFromZeroTo: (NSUInteger) maxValue withName: (NSString *) name;
+- (AQStateKey) addStateMachineValuesFromZeroTo: (NSUInteger) maxValue withName: (NSString *) name;
 
 /**
  Create a named enumeration from an implicit enumeration up to 64 bits in size.
  @param maxValue The highest value contained in the enumeration.
  @param name The name to assign the enumeration.
+ @return A key for the new enumeration, for use with the methods in AQAppStateMachine(StateKeys).
  */
-- (void) add64BitStateMachineValuesFromZeroTo: (UInt64) maxValue withName: (NSString *) name;
+- (AQStateKey) add64BitStateMachineValuesFromZeroTo: (UInt64) maxValue withName: (NSString *) name;
 
 /**
  Create a named enumeration from an implicit enumeration up to 32 bits in size.
@@ -216,8 +349,16 @@
  All other named enumeration creators funnel through this function.
  @param length The length of enumeration to create.
  @param name The name to assign the new enumeration.
+ @return A key for the new enumeration, for use with the methods in AQAppStateMachine(StateKeys).
+ */
+- (AQStateKey) addStateMachineValuesUsingBitfieldOfLength: (NSUInteger) length withName: (NSString *) name;
+
+/**
+ Look up the key for an existing named enumeration.
+ @param name The name of the enumeration.
+ @return The enumeration's key. If there is no enumeration with the given name, the key's offset is `NSNotFound`.
  */
-- (void) addStateMachineValuesUsingBitfieldOfLength: (NSUInteger) length withName: (NSString *) name;
+- (AQStateKey) keyForEnumerationWithName: (NSString *) name;
 
 /// @name Modifying named enumeration values
 
@@ -225,6 +366,7 @@
  Set a scalar value (up to 64 bits in size) for a named enumeration.
  @param value The new value for the enumeration.
  @param name The name of the enumeration to modify.
+ @exception NSInvalidArgumentException Thrown if the enumeration is wider than 64 bits.
  */
 - (void) setValue: (UInt64) value forEnumerationWithName: (NSString *) name;
 
@@ -242,19 +384,32 @@
  */
 - (void) clearBitAtIndex: (NSUInteger) index ofEnumerationWithName: (NSString *) name;
 
+/**
+ Set the values of several named enumerations as a single change.
+ 
+ Readers see either none of the new values or all of them, and notifications are delivered once all the
+ values have been set, with each notifier running at most once however many of its enumerations changed.
+ @param values A dictionary mapping enumeration names to `NSNumber` values. Names with no registered
+ enumeration are ignored.
+ @exception NSInvalidArgumentException Thrown, before any value is set, if any enumeration is wider than 64 bits.
+ */
+- (void) setValuesForEnumerationsWithNames: (NSDictionary *) values;
+
 /// @name Reading named enumeration values
 
 /**
  Fetch the current 32-bit scalar value for a named enumeration.
  @param name The name of the enumeration to modify.
- @result The value within the enumeration, trimmed to 32 bits if necessary.
+ @result The value within the enumeration.
+ @exception NSRangeException Thrown if the enumeration is wider than 32 bits.
  */
 - (UInt32) valueForEnumerationWithName: (NSString *) name;
 
 /**
  Fetch the current 64-bit scalar value for a named enumeration.
  @param name The name of the enumeration to modify.
- @result The value within the enumeration, trimmed to 64 bits if necessary.
+ @result The value within the enumeration.
+ @exception NSRangeException Thrown if the enumeration is wider than 64 bits.
  */
 - (UInt64) largeValueForEnumerationWithName: (NSString *) name;
 
@@ -265,6 +420,18 @@
  */
 - (AQBitfield *) bitsForEnumerationWithName: (NSString *) name;
 
+/**
+ Fetch the current values of several named enumerations at once.
+ 
+ All the values are read from the same copy of the state, so each one reflects exactly the same set
+ of completed changes, even while other threads are modifying the state machine.
+ @param names The names of the enumerations to read.
+ @result A dictionary mapping each name to its value: an `NSNumber` for enumerations of up to 64 bits, or
+ an AQBitfield for larger ones, holding the enumeration's bits at their indices within the state machine, as
+ returned by bitsForEnumerationWithName:. Names with no registered enumeration are omitted.
+ */
+- (NSDictionary *) valuesForEnumerationsWithNames: (NSArray *) names;
+
 /**
  Determine whether a given bit is set within a named enumeration.
  @param index The index within the enumeration of the bit to test.
@@ -303,69 +470,112 @@
  Request notification of all changes to a named enumeration.
  @param name The name of the enumeration to monitor.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyChangesToStateMachineValuesWithName: (NSString *) name
-										usingBlock: (void (^)(void)) block;
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+									  usingBlock: (void (^)(void)) block;
+
+/**
+ Request notification of all changes to a named enumeration, along with its values before and after each one.
+ 
+ The change's valueBefore and valueAfter properties hold the enumeration's old and new values.
+ @param name The name of the enumeration to monitor.
+ @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
+ */
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+								usingChangeBlock: (void (^)(AQBitfieldChange * change)) block;
 
 /**
  Request notification of all changes matching a 32-bit mask to a named enumeration.
  @param name The name of the enumeration to monitor.
  @param mask A mask denoting which bits within the enumeration to monitor.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyChangesToStateMachineValuesWithName: (NSString *) name
-									  matchingMask: (NSUInteger) mask
-										usingBlock: (void (^)(void)) block;
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+									matchingMask: (NSUInteger) mask
+									  usingBlock: (void (^)(void)) block;
 
 /**
  Request notification of all changes matching a 64-bit mask to a named enumeration.
  @param name The name of the enumeration to monitor.
  @param mask A mask denoting which bits within the enumeration to monitor.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyChangesToStateMachineValuesWithName: (NSString *) name
-								 matching64BitMask: (UInt64) mask
-										usingBlock: (void (^)(void)) block;
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+							   matching64BitMask: (UInt64) mask
+									  usingBlock: (void (^)(void)) block;
 
 /**
  Request notification of all changes matching a bitfield mask to a named enumeration.
  @param name The name of the enumeration to monitor.
  @param mask A bitfield denoting which bits within the enumeration to monitor.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyChangesToStateMachineValuesWithName: (NSString *) name
-							  matchingMaskBitfield: (AQBitfield *) mask
-										usingBlock: (void (^)(void)) block;
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+							matchingMaskBitfield: (AQBitfield *) mask
+									  usingBlock: (void (^)(void)) block;
 
 /**
  Request notification whenever the content of a named enumeration matches a 32-bit scalar value.
  @param name The name of the enumeration to monitor.
  @param value The value against which to compare the enumeration.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										  toInteger: (NSUInteger) value
-										 usingBlock: (void (^)(void)) block;
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+										toInteger: (NSUInteger) value
+									   usingBlock: (void (^)(void)) block;
 
 /**
  Request notification whenever the content of a named enumeration matches a 64-bit scalar value.
  @param name The name of the enumeration to monitor.
  @param value The value against which to compare the enumeration.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
+ */
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+										 toUInt64: (UInt64) value
+									   usingBlock: (void (^)(void)) block;
+
+/**
+ Request notification when a named enumeration starts or stops matching a 64-bit value.
+ 
+ The blocks only run when the match begins or ends, as described for
+ notifyForEqualityOfStateBitsInRange:maskedWith:toValue:usingEntryBlock:exitBlock:.
+ @param name The name of the enumeration to monitor.
+ @param value The value against which to compare.
+ @param entryBlock The block to run when the enumeration takes on _value_. May be `nil`.
+ @param exitBlock The block to run when the enumeration changes away from _value_. May be `nil`.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										   toUInt64: (UInt64) value
-										 usingBlock: (void (^)(void)) block;
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+										 toUInt64: (UInt64) value
+								  usingEntryBlock: (void (^)(void)) entryBlock
+										exitBlock: (void (^)(void)) exitBlock;
 
 /**
  Request notification whenever the content of a named enumeration matches a bitfield.
  @param name The name of the enumeration to monitor.
  @param bits The bitfield against which to compare the enumeration.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-											 toBits: (AQBitfield *) bits
-										 usingBlock: (void (^)(void)) block;
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+										   toBits: (AQBitfield *) bits
+									   usingBlock: (void (^)(void)) block;
 
 /**
  Request notification whenever the masked content of a named enumeration matches a 32-bit scalar value.
@@ -373,11 +583,13 @@
  @param mask A mask defining which bits to compare.
  @param value The value against which to compare the enumeration.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										 maskedWith: (NSUInteger) mask
-										  toInteger: (NSUInteger) value
-										 usingBlock: (void (^)(void)) block;
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+									   maskedWith: (NSUInteger) mask
+										toInteger: (NSUInteger) value
+									   usingBlock: (void (^)(void)) block;
 
 /**
  Request notification whenever the masked content of a named enumeration matches a 64-bit scalar value.
@@ -385,11 +597,13 @@
  @param mask A mask defining which bits to compare.
  @param value The value against which to compare the enumeration.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
  */
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										 maskedWith: (UInt64) mask
-										   toUInt64: (UInt64) value
-										 usingBlock: (void (^)(void)) block;
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+									   maskedWith: (UInt64) mask
+										 toUInt64: (UInt64) value
+									   usingBlock: (void (^)(void)) block;
 
 /**
  Request notification whenever the masked content of a named enumeration matches a bitfield.
@@ -397,11 +611,179 @@
  @param mask A mask defining which bits to compare.
  @param bits The bitfield against which to compare the enumeration.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil` if
+ no enumeration has the given name.
+ */
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+									   maskedWith: (AQBitfield *) mask
+										   toBits: (AQBitfield *) bits
+									   usingBlock: (void (^)(void)) block;
+
+@end
+
+/**
+ The same operations as AQAppStateMachine(NamedStateEnumerations), addressing each enumeration by
+ its key rather than its name.
+ 
+ Keys are returned when an enumeration is created, or by keyForEnumerationWithName:. Passing a key
+ whose offset is `NSNotFound` does nothing, and reads return zero, `nil` or `NO`.
+ */
+@interface AQAppStateMachine (StateKeys)
+
+/// @name Modifying enumeration values
+
+/**
+ Set a scalar value (up to 64 bits in size) for an enumeration.
+ @param value The new value for the enumeration.
+ @param key The key of the enumeration to modify.
+ @exception NSInvalidArgumentException Thrown if the enumeration is wider than 64 bits.
+ */
+- (void) setValue: (UInt64) value forStateKey: (AQStateKey) key;
+
+/**
+ Set (to 1) an individual bit within an enumeration.
+ @param index The index of the bit to set within the enumeration.
+ @param key The key of the enumeration to modify.
+ */
+- (void) setBitAtIndex: (NSUInteger) index ofStateKey: (AQStateKey) key;
+
+/**
+ Clear (set to 0) an individual bit within an enumeration.
+ @param index The index of the bit to clear within the enumeration.
+ @param key The key of the enumeration to modify.
+ */
+- (void) clearBitAtIndex: (NSUInteger) index ofStateKey: (AQStateKey) key;
+
+/**
+ Set the values of several enumerations as a single change.
+ 
+ Readers see either none of the new values or all of them, and notifications are delivered once all the
+ values have been set, with each notifier running at most once however many of its enumerations changed.
+ @param values An array of keys and the values to store in them. Entries with invalid keys are ignored.
+ @param count The number of entries in _values_.
+ @exception NSInvalidArgumentException Thrown, before any value is set, if any enumeration is wider than 64 bits.
+ */
+- (void) setValues: (const AQStateKeyValue *) values count: (NSUInteger) count;
+
+/// @name Reading enumeration values
+
+/**
+ Fetch the current 32-bit scalar value for an enumeration.
+ @param key The key of the enumeration to read.
+ @result The value within the enumeration.
+ @exception NSRangeException Thrown if the enumeration is wider than 32 bits.
+ */
+- (UInt32) valueForStateKey: (AQStateKey) key;
+
+/**
+ Fetch the current 64-bit scalar value for an enumeration.
+ @param key The key of the enumeration to read.
+ @result The value within the enumeration.
+ @exception NSRangeException Thrown if the enumeration is wider than 64 bits.
+ */
+- (UInt64) largeValueForStateKey: (AQStateKey) key;
+
+/**
+ Fetch a bitfield representing the current value of an enumeration.
+ @param key The key of the enumeration to read.
+ @result A bitfield matching the current value of the enumeration.
+ */
+- (AQBitfield *) bitsForStateKey: (AQStateKey) key;
+
+/**
+ Determine whether a given bit is set within an enumeration.
+ @param index The index within the enumeration of the bit to test.
+ @param key The key of the enumeration to read.
+ @result `YES` if the specified bit is set to 1, `NO` otherwise.
+ */
+- (BOOL) bitIsSetAtIndex: (NSUInteger) index forStateKey: (AQStateKey) key;
+
+/// @name Notifications on enumerations
+
+/**
+ Request notification of all changes to an enumeration.
+ @param key The key of the enumeration to monitor.
+ @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil`
+ for a key referring to nothing.
+ */
+- (id) notifyChangesToStateKey: (AQStateKey) key usingBlock: (void (^)(void)) block;
+
+/**
+ Request notification of all changes to an enumeration, along with its values before and after each one.
+ @param key The key of the enumeration to monitor.
+ @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil`
+ for a key referring to nothing.
+ */
+- (id) notifyChangesToStateKey: (AQStateKey) key usingChangeBlock: (void (^)(AQBitfieldChange * change)) block;
+
+/**
+ Request notification of all changes matching a 64-bit mask to an enumeration.
+ @param key The key of the enumeration to monitor.
+ @param mask A mask denoting which bits within the enumeration to monitor.
+ @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil`
+ for a key referring to nothing.
+ */
+- (id) notifyChangesToStateKey: (AQStateKey) key
+			 matching64BitMask: (UInt64) mask
+					usingBlock: (void (^)(void)) block;
+
+/**
+ Request notification whenever the content of an enumeration matches a 64-bit scalar value.
+ @param key The key of the enumeration to monitor.
+ @param value The value against which to compare the enumeration.
+ @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil`
+ for a key referring to nothing.
+ */
+- (id) notifyEqualityOfStateKey: (AQStateKey) key
+					   toUInt64: (UInt64) value
+					 usingBlock: (void (^)(void)) block;
+
+/**
+ Request notification whenever the masked content of an enumeration matches a 64-bit scalar value.
+ @param key The key of the enumeration to monitor.
+ @param mask A mask defining which bits to compare.
+ @param value The value against which to compare the enumeration.
+ @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil`
+ for a key referring to nothing.
+ */
+- (id) notifyEqualityOfStateKey: (AQStateKey) key
+					 maskedWith: (UInt64) mask
+					   toUInt64: (UInt64) value
+					 usingBlock: (void (^)(void)) block;
+
+/**
+ Request notification whenever the content of an enumeration matches a bitfield.
+ @param key The key of the enumeration to monitor.
+ @param bits The bitfield against which to compare the enumeration.
+ @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil`
+ for a key referring to nothing.
+ */
+- (id) notifyEqualityOfStateKey: (AQStateKey) key
+						 toBits: (AQBitfield *) bits
+					 usingBlock: (void (^)(void)) block;
+
+/**
+ Request notification when an enumeration starts or stops matching a 64-bit value.
+ 
+ The blocks only run when the match begins or ends, as described for
+ notifyForEqualityOfStateBitsInRange:maskedWith:toValue:usingEntryBlock:exitBlock:.
+ @param key The key of the enumeration to monitor.
+ @param value The value against which to compare.
+ @param entryBlock The block to run when the enumeration takes on _value_. May be `nil`.
+ @param exitBlock The block to run when the enumeration changes away from _value_. May be `nil`.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:, or `nil`
+ for a key referring to nothing.
  */
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										 maskedWith: (AQBitfield *) mask
-											 toBits: (AQBitfield *) bits
-										 usingBlock: (void (^)(void)) block;
+- (id) notifyEqualityOfStateKey: (AQStateKey) key
+					   toUInt64: (UInt64) value
+				usingEntryBlock: (void (^)(void)) entryBlock
+					  exitBlock: (void (^)(void)) exitBlock;
 
 @end
 
@@ -418,10 +800,11 @@
  @param names The names of the enumerations to monitor.
  @param masks A list of `AQBitfield` or `NSNumber` masks denoting which bits within the corresponding enumeration to monitor. Use `NSNull` to specify no mask.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyChangesToStateMachineValuesWithNames: (NSArray *) names
-									  matchingMasks: (NSArray *) masks
-										 usingBlock: (void (^)(void)) block;
+- (id) notifyChangesToStateMachineValuesWithNames: (NSArray *) names
+									matchingMasks: (NSArray *) masks
+									   usingBlock: (void (^)(void)) block;
 
 /**
  Request notification when any item from a group of named enumerations matches an associated value.
@@ -429,11 +812,30 @@
  @param masks A list of `AQBitfield` or `NSNumber` masks denoting which bits within the corresponding enumeration to monitor. Use `NSNull` to specify no mask.
  @param values A list of `AQBitfield` or `NSNumber` values denoting values to compare against the corresponding enumeration.
  @param block A block to run upon any changes.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
  */
-- (void) notifyEqualityOfStateMachineValuesWithNames: (NSArray *) names
-									   matchingMasks: (NSArray *) masks
-											toValues: (NSArray *) values
-										  usingBlock: (void (^)(void)) block;
+- (id) notifyEqualityOfStateMachineValuesWithNames: (NSArray *) names
+									 matchingMasks: (NSArray *) masks
+										  toValues: (NSArray *) values
+										usingBlock: (void (^)(void)) block;
+
+/**
+ Request notification when a group of named enumerations starts or stops matching their associated values.
+ 
+ The blocks only run when the match begins or ends, as described for
+ notifyForEqualityOfStateBitsInRange:maskedWith:toValue:usingEntryBlock:exitBlock:.
+ @param names The names of the enumerations to monitor.
+ @param masks A list of `AQBitfield` or `NSNumber` masks denoting which bits within the corresponding enumeration to monitor. Use `NSNull` to specify no mask.
+ @param values A list of `AQBitfield` or `NSNumber` values denoting values to compare against the corresponding enumeration.
+ @param entryBlock The block to run when every enumeration comes to match its value. May be `nil`.
+ @param exitBlock The block to run when any enumeration stops matching its value. May be `nil`.
+ @return An opaque token identifying the new notification, which can be passed to removeNotifier:.
+ */
+- (id) notifyEqualityOfStateMachineValuesWithNames: (NSArray *) names
+									 matchingMasks: (NSArray *) masks
+										  toValues: (NSArray *) values
+								   usingEntryBlock: (void (^)(void)) entryBlock
+										 exitBlock: (void (^)(void)) exitBlock;
 
 @end
 
@@ -34,19 +34,262 @@
 //
 
 #import "AQAppStateMachine.h"
+#import "AQMappedBitfield.h"
 #import "AQRange.h"
 #import "AQStateMaskMatchingDescriptor.h"
 #import "AQStateMaskedEqualityMatchingDescriptor.h"
 #import <dispatch/dispatch.h>
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
+
+// a published copy of the state bits, which readers use in place of the bitfield itself
+typedef struct _AQStateWords
+{
+	struct _AQStateWords *	retired;		// the smaller copy this one replaced
+	NSUInteger				count;
+	UInt64					words[];
+	
+} _AQStateWords;
+
+static _AQStateWords * _AllocStateWords( NSUInteger count )
+{
+	_AQStateWords * result = calloc(1, sizeof(_AQStateWords) + count * sizeof(UInt64));
+	result->count = count;
+	return ( result );
+}
+
+static inline NSRange _WordRangeForBits( NSRange range )
+{
+	if ( range.length == 0 )
+		return ( NSMakeRange(0, 0) );
+	
+	NSUInteger first = range.location >> 6;
+	return ( NSMakeRange(first, ((NSMaxRange(range) - 1) >> 6) - first + 1) );
+}
+
+// reads up to 64 bits from a run of words copied from the state, the first of which is word number 'base'
+static inline UInt64 _BitsFromWords( const UInt64 * words, NSUInteger base, NSRange range )
+{
+	if ( range.length == 0 )
+		return ( 0ull );
+	
+	NSUInteger index = (range.location >> 6) - base;
+	NSUInteger shift = range.location & 63;
+	UInt64 value = words[index] >> shift;
+	if ( shift + range.length > 64 )
+		value |= words[index+1] << (64 - shift);
+	if ( range.length < 64 )
+		value &= (1ull << range.length) - 1;
+	
+	return ( value );
+}
+
+// writes up to 64 bits into a run of words, the first of which is word number 'base'
+static inline void _SetBitsInWords( UInt64 * words, NSUInteger base, NSRange range, UInt64 value )
+{
+	if ( range.length == 0 )
+		return;
+	
+	UInt64 mask = (range.length < 64 ? (1ull << range.length) - 1 : ~0ull);
+	NSUInteger index = (range.location >> 6) - base;
+	NSUInteger shift = range.location & 63;
+	value &= mask;
+	
+	words[index] = (words[index] & ~(mask << shift)) | (value << shift);
+	if ( shift + range.length > 64 )
+		words[index+1] = (words[index+1] & ~(mask >> (64 - shift))) | (value >> (64 - shift));
+}
+
+// writers lock only the shards holding the words they modify: each cache line of eight words belongs to
+// one shard, with consecutive lines dealt out to consecutive shards
+#define kAQStateShardCount	16
+#define kAQAllStateShards	0xffffu
+
+typedef struct _AQStateShard
+{
+	pthread_mutex_t		lock;
+	volatile int32_t	sequence;		// odd while a writer is publishing words in this shard
+	
+} __attribute__((aligned(64))) _AQStateShard;
+
+static inline NSUInteger _ShardForWord( NSUInteger index )
+{
+	return ( (index >> 3) % kAQStateShardCount );
+}
+
+static inline UInt32 _ShardsForWords( NSRange wordRange )
+{
+	if ( wordRange.length == 0 )
+		return ( 0 );
+	
+	NSUInteger first = wordRange.location >> 3;
+	NSUInteger last = (NSMaxRange(wordRange) - 1) >> 3;
+	if ( last - first + 1 >= kAQStateShardCount )
+		return ( kAQAllStateShards );
+	
+	UInt32 result = 0;
+	for ( NSUInteger line = first; line <= last; line++ )
+		result |= 1u << (line % kAQStateShardCount);
+	
+	return ( result );
+}
+
+// records the sequence of each shard about to be read, returning NO if any of them is being written
+static inline BOOL _BeginReadingShards( const _AQStateShard * shards, UInt32 mask, int32_t * sequences )
+{
+	for ( NSUInteger i = 0; i < kAQStateShardCount; i++ )
+	{
+		if ( (mask & (1u << i)) == 0 )
+			continue;
+		
+		sequences[i] = shards[i].sequence;
+		if ( (sequences[i] & 1) != 0 )
+			return ( NO );
+	}
+	
+	OSMemoryBarrier();
+	return ( YES );
+}
+
+// returns YES if no writer published to any of the shards since _BeginReadingShards()
+static inline BOOL _FinishReadingShards( const _AQStateShard * shards, UInt32 mask, const int32_t * sequences )
+{
+	OSMemoryBarrier();
+	for ( NSUInteger i = 0; i < kAQStateShardCount; i++ )
+	{
+		if ( (mask & (1u << i)) != 0 && shards[i].sequence != sequences[i] )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+// the single-word equality descriptors comparing the same bits of one word, keyed by the value each expects
+@interface _AQValueTable : NSObject
+{
+@public
+	NSUInteger				_wordIndex;
+	UInt64					_mask;
+	NSRange					_bits;			// from the lowest to the highest bit in the mask
+	NSMutableDictionary *	_idsByValue;	// NSNumber -> NSMutableIndexSet of descriptor IDs
+}
+- (id) initWithWordIndex: (NSUInteger) index mask: (UInt64) mask;
+@end
+
+@implementation _AQValueTable
+
+- (id) initWithWordIndex: (NSUInteger) index mask: (UInt64) mask
+{
+	self = [super init];
+	if ( self == nil )
+		return ( nil );
+	
+	NSUInteger low = __builtin_ctzll(mask);
+	NSUInteger high = 63 - __builtin_clzll(mask);
+	
+	_wordIndex = index;
+	_mask = mask;
+	_bits = NSMakeRange(index * 64 + low, high - low + 1);
+	_idsByValue = [NSMutableDictionary new];
+	
+	return ( self );
+}
+
+#if !USING_ARC
+- (void) dealloc
+{
+	[_idsByValue release];
+	[super dealloc];
+}
+#endif
+
+@end
+
+// a descriptor's notification block; the entry's index in the dispatch table is the descriptor's ID
+@interface _AQDispatchEntry : NSObject
+{
+@public
+	AQStateMaskMatchingDescriptor *	_descriptor;
+	dispatch_block_t				_block;
+	NSRange							_range;
+	NSUInteger						_descriptorID;
+	BOOL							_isEquality;
+	BOOL							_tabled;		// equality only: found through a value table instead of the word index
+	_AQValueTable *					_table;			// tabled only: the table holding this entry, under _value
+	UInt64							_value;
+	BOOL							_counted;		// equality only: _mismatches is kept up to date
+	volatile int32_t				_mismatches;	// equality only: compared bits which differ from the value
+	volatile int32_t				_pending;		// non-zero while a run is queued but hasn't yet started
+	volatile BOOL					_removed;		// set by removeNotifier:; the block no longer runs
+	OSSpinLock						_lock;			// guards _block and _descriptor against removal while a run takes them
+}
+@end
+
+@implementation _AQDispatchEntry
+
+#if !USING_ARC
+- (void) dealloc
+{
+	[_descriptor release];
+	[_block release];
+	[_table release];
+	[super dealloc];
+}
+#endif
+
+@end
+
+// the token for a notifier installed on _stateBits itself, recording the words it keeps _stateBits watching
+@interface _AQBitfieldNotifier : NSObject
+{
+@public
+	id						_token;
+	NSRange					_words;
+	BOOL					_removed;
+}
+@end
+
+@implementation _AQBitfieldNotifier
+
+#if !USING_ARC
+- (void) dealloc
+{
+	[_token release];
+	[super dealloc];
+}
+#endif
+
+@end
 
 @implementation AQAppStateMachine
 {
 	AQNotifyingBitfield *	_stateBits;
 	NSMutableDictionary *	_namedRanges;
-	NSMutableArray *		_matchDescriptors;
-	NSMutableDictionary *	_notifierLookup;
 	dispatch_queue_t		_syncQ;
 	NSUInteger				_nextRangeStart;
+	
+	// descriptor notifications share one dispatcher: for each 64-bit word of state, the IDs of the descriptors watching it
+	NSMutableArray *		_dispatchEntries;
+	NSMutableArray *		_descriptorsByWord;
+	NSMutableArray *		_valueTablesByWord;		// for each word, an array of _AQValueTable
+	NSMutableIndexSet *		_freeDescriptorIDs;		// slots in _dispatchEntries left by removed notifications
+	NSMutableIndexSet *		_batchModifiedBits;		// the bits modified by the current batch, dispatched when it ends
+	NSUInteger				_dispatchDepth;
+	
+	// readers never take a lock: they copy words from _readWords, retrying if the sequence of any shard they read changed meanwhile.
+	// writers lock their shards in ascending order, and changing the descriptors or the size of the state locks all of them.
+	// the locks are always taken in the order shards, then _bitsLock, then _syncQ: a batch holds the first two while its
+	// block runs, so nothing may lock a shard or _bitsLock from within _syncQ
+	_AQStateWords * volatile	_readWords;
+	_AQStateShard *				_shards;
+	pthread_mutex_t				_bitsLock;		// held only while _stateBits itself is used
+	
+	// the published words are the state itself. _stateBits is kept up to date only for the words which its own change and
+	// transition notifiers watch, or for all of them when it's persistent; other words are written in place under their shards
+	BOOL						_persistent;
+	NSMutableIndexSet *			_bitfieldWatchedWords;	// changed with every shard locked
+	NSUInteger *				_bitfieldWatchCounts;	// for each word, the notifiers on _stateBits watching it
+	NSUInteger					_bitfieldWatchCountCapacity;
 }
 
 + (AQAppStateMachine *) appStateMachine
@@ -65,440 +308,1416 @@
 		return ( nil );
 	
 	// start out with 32 bits
-	_stateBits = [[AQNotifyingBitfield alloc] init];
+	_stateBits = [[AQNotifyingBitfield alloc] initWithCapacity: 32];
 	_namedRanges = [NSMutableDictionary new];
-	_matchDescriptors = [NSMutableArray new];
-	_notifierLookup = [NSMutableDictionary new];
+	_dispatchEntries = [NSMutableArray new];
+	_descriptorsByWord = [NSMutableArray new];
+	_valueTablesByWord = [NSMutableArray new];
+	_freeDescriptorIDs = [NSMutableIndexSet new];
+	_bitfieldWatchedWords = [NSMutableIndexSet new];
 	_syncQ = dispatch_queue_create("net.alanquatermain.state-machine.sync", DISPATCH_QUEUE_SERIAL);
+	_readWords = _AllocStateWords(1);
+	
+	_batchModifiedBits = [NSMutableIndexSet new];
+	
+	// recursive, so notification blocks and batches can make further changes
+	pthread_mutexattr_t attrs;
+	pthread_mutexattr_init(&attrs);
+	pthread_mutexattr_settype(&attrs, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&_bitsLock, &attrs);
+	
+	// each shard gets a cache line of its own, so writers in different shards don't contend for one
+	posix_memalign((void **)&_shards, __alignof__(_AQStateShard), kAQStateShardCount * sizeof(_AQStateShard));
+	for ( NSUInteger i = 0; i < kAQStateShardCount; i++ )
+	{
+		pthread_mutex_init(&_shards[i].lock, &attrs);
+		_shards[i].sequence = 0;
+	}
+	pthread_mutexattr_destroy(&attrs);
+	
+	return ( self );
+}
+
+- (id) initWithPersistentStateAtPath: (NSString *) path error: (NSError **) error
+{
+	AQMappedBitfield * stateBits = [[AQMappedBitfield alloc] initWithContentsOfFile: path error: error];
+	if ( stateBits == nil )
+	{
+#if !USING_ARC
+		[self release];
+#endif
+		return ( nil );
+	}
+	
+	self = [self init];
+	if ( self == nil )
+	{
+#if !USING_ARC
+		[stateBits release];
+#endif
+		return ( nil );
+	}
+	
+#if !USING_ARC
+	[_stateBits release];
+#endif
+	_stateBits = stateBits;
+	_persistent = YES;
+	[self _publishStateBitsInRange: NSMakeRange(0, [_stateBits count])];
 	
 	return ( self );
 }
 
+- (BOOL) synchronizePersistentState: (NSError **) error
+{
+	if ( [_stateBits isKindOfClass: [AQMappedBitfield class]] == NO )
+		return ( YES );
+	
+	pthread_mutex_lock(&_bitsLock);
+	BOOL result = [(AQMappedBitfield *)_stateBits flush: error];
+	pthread_mutex_unlock(&_bitsLock);
+	
+	return ( result );
+}
+
 - (void) dealloc
 {
 	if ( _syncQ != NULL )
 		dispatch_release(_syncQ);
+	
+	while ( _readWords != NULL )
+	{
+		_AQStateWords * retired = _readWords->retired;
+		free(_readWords);
+		_readWords = retired;
+	}
+	pthread_mutex_destroy(&_bitsLock);
+	for ( NSUInteger i = 0; i < kAQStateShardCount; i++ )
+		pthread_mutex_destroy(&_shards[i].lock);
+	free(_shards);
+	free(_bitfieldWatchCounts);
+	
 #if !USING_ARC
 	[_stateBits release];
 	[_namedRanges release];
-	[_matchDescriptors release];
-	[_notifierLookup release];
+	[_dispatchEntries release];
+	[_descriptorsByWord release];
+	[_valueTablesByWord release];
+	[_freeDescriptorIDs release];
+	[_batchModifiedBits release];
+	[_bitfieldWatchedWords release];
 	[super dealloc];
 #endif
 }
 
-- (void) _runNotificationBlocksForChangeInRange: (NSRange) range
+// copies words from the published state; writers only hold their shards' sequences odd while they update them
+- (void) _readStateWords: (UInt64 *) buffer inRange: (NSRange) wordRange
 {
-	for ( AQStateMaskMatchingDescriptor * match in _matchDescriptors )
+	UInt32 shards = _ShardsForWords(wordRange);
+	int32_t sequences[kAQStateShardCount];
+	for ( ;; )
 	{
-		if ( [match isKindOfClass: [AQStateMaskedEqualityMatchingDescriptor class]] )
+		if ( _BeginReadingShards(_shards, shards, sequences) )
 		{
-			if ( [(AQStateMaskedEqualityMatchingDescriptor *)match matchesBitfield: _stateBits] == NO )
-				continue;
+			// superseded copies are kept until dealloc, so this is always safe to read
+			_AQStateWords * published = _readWords;
+			const volatile UInt64 * words = published->words;
+			for ( NSUInteger i = 0; i < wordRange.length; i++ )
+			{
+				NSUInteger index = wordRange.location + i;
+				buffer[i] = (index < published->count ? words[index] : 0ull);
+			}
+			
+			if ( _FinishReadingShards(_shards, shards, sequences) )
+				return;
 		}
-		else if ( [match matchesRange: range] == NO )
+	}
+}
+
+- (UInt64) _stateBitsInRange: (NSRange) range
+{
+	UInt64 words[2];
+	NSRange wordRange = _WordRangeForBits(range);
+	[self _readStateWords: words inRange: wordRange];
+	return ( _BitsFromWords(words, wordRange.location, range) );
+}
+
+// returns a new bitfield holding the bits within range at their original indices, from words copied from the state
+static AQBitfield * _NewBitfieldFromWords( const UInt64 * words, NSUInteger base, NSRange range )
+{
+	AQBitfield * result = [[AQBitfield alloc] initWithCapacity: NSMaxRange(range)];
+	for ( NSUInteger i = 0; i < range.length; i += 64 )
+	{
+		NSRange chunk = NSMakeRange(range.location + i, MIN(range.length - i, (NSUInteger)64));
+		[result setBitsInRange: chunk from64BitValue: _BitsFromWords(words, base, chunk)];
+	}
+	
+	return ( result );
+}
+
+// returns a bitfield holding the bits within range at their original indices, read from a single consistent state
+- (AQBitfield *) _snapshotOfStateBitsInRange: (NSRange) range
+{
+	NSRange wordRange = _WordRangeForBits(range);
+	UInt64 * words = malloc(MAX(wordRange.length, (NSUInteger)1) * sizeof(UInt64));
+	[self _readStateWords: words inRange: wordRange];
+	
+	AQBitfield * result = _NewBitfieldFromWords(words, wordRange.location, range);
+	free(words);
+	
+#if USING_ARC
+	return ( result );
+#else
+	return ( [result autorelease] );
+#endif
+}
+
+// called with every shard locked whenever a change reaches beyond the published words
+- (void) _growPublishedWordsTo: (NSUInteger) limit
+{
+	if ( limit <= _readWords->count )
+		return;
+	
+	// readers may still be using the old copy, so it's retired rather than freed
+	_AQStateWords * words = _AllocStateWords(MAX(limit, _readWords->count * 2));
+	memcpy(words->words, _readWords->words, _readWords->count * sizeof(UInt64));
+	words->retired = _readWords;
+	OSMemoryBarrier();
+	_readWords = words;
+}
+
+// called with the given shards locked; readers retry until _finishPublishingShards: is called
+- (void) _beginPublishingShards: (UInt32) shards
+{
+	for ( NSUInteger i = 0; i < kAQStateShardCount; i++ )
+	{
+		if ( (shards & (1u << i)) != 0 )
+			OSAtomicIncrement32Barrier(&_shards[i].sequence);
+	}
+}
+
+// makes the sequences even again, so readers accept the words they copy
+- (void) _finishPublishingShards: (UInt32) shards
+{
+	[self _beginPublishingShards: shards];
+}
+
+// called with the shards of the given words locked, after modifying their bits; readers see the words change all at once
+- (void) _publishStateWordsInRanges: (const NSRange *) wordRanges count: (NSUInteger) count
+{
+	NSUInteger limit = 0;
+	UInt32 shards = 0;
+	for ( NSUInteger i = 0; i < count; i++ )
+	{
+		limit = MAX(limit, NSMaxRange(wordRanges[i]));
+		shards |= _ShardsForWords(wordRanges[i]);
+	}
+	if ( limit == 0 )
+		return;
+	
+	// only done with every shard locked (see _lockShardsForWordsInRanges:count:)
+	[self _growPublishedWordsTo: limit];
+	
+	[self _beginPublishingShards: shards];
+	for ( NSUInteger i = 0; i < count; i++ )
+	{
+		for ( NSUInteger j = wordRanges[i].location; j < NSMaxRange(wordRanges[i]); j++ )
+			_readWords->words[j] = [_stateBits scalarBitsFrom64BitRange: NSMakeRange(j * 64, 64)];
+	}
+	[self _finishPublishingShards: shards];
+}
+
+// called with the shards of the modified words locked, after modifying the bits within range
+- (void) _publishStateBitsInRange: (NSRange) range
+{
+	NSRange wordRange = _WordRangeForBits(range);
+	[self _publishStateWordsInRanges: &wordRange count: 1];
+}
+
+// evaluates a descriptor directly against the published words, so nothing is copied or allocated
+- (BOOL) _stateMatchesDescriptor: (AQStateMaskedEqualityMatchingDescriptor *) match
+{
+	int32_t sequences[kAQStateShardCount];
+	for ( ;; )
+	{
+		if ( _BeginReadingShards(_shards, kAQAllStateShards, sequences) )
 		{
-			continue;
+			_AQStateWords * published = _readWords;
+			BOOL result = [match matchesWords: published->words count: published->count];
+			
+			if ( _FinishReadingShards(_shards, kAQAllStateShards, sequences) )
+				return ( result );
 		}
+	}
+}
+
+// called with the shards of the words locked, once they have been published
+- (void) _updateMismatchCountsForWordsInRange: (NSRange) wordRange previousWords: (const UInt64 *) oldWords
+{
+	NSUInteger indexedWords = [_descriptorsByWord count];
+	for ( NSUInteger i = 0; i < wordRange.length; i++ )
+	{
+		NSUInteger index = wordRange.location + i;
+		UInt64 oldWord = oldWords[i];
+		UInt64 newWord = (index < _readWords->count ? _readWords->words[index] : 0ull);
+		if ( oldWord == newWord || index >= indexedWords )
+			continue;
 		
-		dispatch_block_t block = (dispatch_block_t)[_notifierLookup objectForKey: [match uniqueID]];
-		if ( block != nil )
-			block();
+		// only the descriptors watching this word can have gained or lost mismatched bits
+		[[_descriptorsByWord objectAtIndex: index] enumerateIndexesUsingBlock: ^(NSUInteger idx, BOOL *stop) {
+			_AQDispatchEntry * entry = [_dispatchEntries objectAtIndex: idx];
+			if ( entry->_counted == NO )
+				return;
+			
+			AQStateMaskedEqualityMatchingDescriptor * match = (AQStateMaskedEqualityMatchingDescriptor *)entry->_descriptor;
+			// descriptors spanning several shards may be adjusted by more than one writer at a time
+			int32_t delta = (int32_t)[match mismatchDeltaForWordAtIndex: index from: oldWord to: newWord];
+			if ( delta != 0 )
+				OSAtomicAdd32Barrier(delta, &entry->_mismatches);
+		}];
+	}
+}
+
+- (void) _runDispatchEntry: (_AQDispatchEntry *) entry
+{
+	// removal releases the block and descriptor, so the run takes its own references to them first
+	OSSpinLockLock(&entry->_lock);
+	dispatch_block_t block = entry->_block;
+	AQStateMaskMatchingDescriptor * descriptor = entry->_descriptor;
+#if !USING_ARC
+	[block retain];
+	[descriptor retain];
+#endif
+	OSSpinLockUnlock(&entry->_lock);
+	
+	if ( block == nil )
+		return;
+	
+	// writers in different shards adjust a count one after another, each after publishing its words, so it can
+	// pass through zero while the state doesn't match: it only rules out a run, and the state itself decides
+	BOOL matches = YES;
+	if ( entry->_isEquality )
+	{
+		if ( entry->_counted && entry->_mismatches != 0 )
+			matches = NO;
+		else
+			matches = [self _stateMatchesDescriptor: (AQStateMaskedEqualityMatchingDescriptor *)descriptor];
 	}
+	
+	if ( matches )
+		block();
+	
+#if !USING_ARC
+	[block release];
+	[descriptor release];
+#endif
 }
 
-- (void) _notifyForChangesToStatesMatchingDescriptor: (AQStateMaskMatchingDescriptor *) desc
-										  usingBlock: (void (^)(void)) block
+- (void) _queueDispatchEntry: (_AQDispatchEntry *) entry
 {
-	[_matchDescriptors addObject: desc];
-	[_notifierLookup setObject: block forKey: [desc uniqueID]];
+	// the block checks the current state when it runs, so a burst of changes needs only one queued run
+	if ( OSAtomicCompareAndSwap32Barrier(0, 1, &entry->_pending) == false )
+		return;
 	
-	NSRange notifyRange = desc.fullRange;
-	[_stateBits notifyModificationOfBitsInRange: notifyRange usingBlock: ^(NSRange range) {
-		// find and run any stored blocks
-		[self _runNotificationBlocksForChangeInRange: range];
+	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		OSAtomicCompareAndSwap32Barrier(1, 0, &entry->_pending);
+		[self _runDispatchEntry: entry];
+	});
+}
+
+// called with the shards of the words locked: YES if any descriptor is indexed or tabled under them
+- (BOOL) _descriptorsWatchWordsInRange: (NSRange) wordRange
+{
+	NSUInteger indexedWords = [_descriptorsByWord count];
+	NSUInteger tabledWords = [_valueTablesByWord count];
+	for ( NSUInteger i = wordRange.location; i < NSMaxRange(wordRange); i++ )
+	{
+		if ( i < indexedWords && [[_descriptorsByWord objectAtIndex: i] count] != 0 )
+			return ( YES );
+		if ( i < tabledWords && [[_valueTablesByWord objectAtIndex: i] count] != 0 )
+			return ( YES );
+	}
+	
+	return ( NO );
+}
+
+// called with the shards of the changed bits locked, once the outermost change is complete and published
+- (void) _dispatchNotificationsForChangedBits: (NSIndexSet *) changed
+{
+	if ( [changed count] == 0 )
+		return;
+	
+	NSMutableIndexSet * changedWords = [NSMutableIndexSet new];
+	[changed enumerateRangesUsingBlock: ^(NSRange range, BOOL *stop) {
+		[changedWords addIndexesInRange: _WordRangeForBits(range)];
 	}];
+	
+	// only the descriptors indexed under the modified words are candidates, while one lookup
+	// per value table finds every single-word equality descriptor which now matches
+	NSMutableIndexSet * candidates = [NSMutableIndexSet new];
+	NSMutableIndexSet * matched = [NSMutableIndexSet new];
+	NSUInteger indexedWords = [_descriptorsByWord count];
+	NSUInteger tabledWords = [_valueTablesByWord count];
+	[changedWords enumerateIndexesUsingBlock: ^(NSUInteger index, BOOL *stop) {
+		if ( index < indexedWords )
+			[candidates addIndexes: [_descriptorsByWord objectAtIndex: index]];
+		if ( index >= tabledWords )
+			return;
+		
+		UInt64 word = (index < _readWords->count ? _readWords->words[index] : 0ull);
+		for ( _AQValueTable * table in [_valueTablesByWord objectAtIndex: index] )
+		{
+			if ( [changed intersectsIndexesInRange: table->_bits] == NO )
+				continue;
+			
+			NSIndexSet * ids = [table->_idsByValue objectForKey: [NSNumber numberWithUnsignedLongLong: word & table->_mask]];
+			if ( ids != nil )
+				[matched addIndexes: ids];
+		}
+	}];
+	
+	[candidates enumerateIndexesUsingBlock: ^(NSUInteger idx, BOOL *stop) {
+		_AQDispatchEntry * entry = [_dispatchEntries objectAtIndex: idx];
+		
+		// equality descriptors are checked against the state itself, both now and when they run
+		if ( entry->_isEquality && entry->_counted && entry->_mismatches != 0 )
+			return;
+		
+		__block BOOL affected = NO;
+		[changed enumerateRangesInRange: entry->_range options: 0 usingBlock: ^(NSRange range, BOOL *stopRanges) {
+			if ( entry->_isEquality || [entry->_descriptor matchesRange: range] )
+			{
+				affected = YES;
+				*stopRanges = YES;
+			}
+		}];
+		
+		if ( affected )
+			[self _queueDispatchEntry: entry];
+	}];
+	
+	[matched enumerateIndexesUsingBlock: ^(NSUInteger idx, BOOL *stop) {
+		[self _queueDispatchEntry: [_dispatchEntries objectAtIndex: idx]];
+	}];
+	
+#if !USING_ARC
+	[changedWords release];
+	[candidates release];
+	[matched release];
+#endif
 }
 
-- (void) notifyForChangesToStateBitAtIndex: (NSUInteger) index usingBlock: (void (^)(void)) block
+- (void) _lockShards: (UInt32) shards
 {
-	[self notifyForChangesToStateBitsInRange: NSMakeRange(index, 1) usingBlock: block];
+	// always in ascending order, so writers needing several shards can't deadlock
+	for ( NSUInteger i = 0; i < kAQStateShardCount; i++ )
+	{
+		if ( (shards & (1u << i)) != 0 )
+			pthread_mutex_lock(&_shards[i].lock);
+	}
 }
 
-- (void) notifyForChangesToStateBitsInRange: (NSRange) range usingBlock: (void (^)(void)) block
+- (void) _unlockShards: (UInt32) shards
+{
+	for ( NSUInteger i = 0; i < kAQStateShardCount; i++ )
+	{
+		if ( (shards & (1u << i)) != 0 )
+			pthread_mutex_unlock(&_shards[i].lock);
+	}
+}
+
+// returns the shards locked, which are all of them if the published state has to grow to hold the words
+- (UInt32) _lockShardsForWordsInRanges: (const NSRange *) wordRanges count: (NSUInteger) count
+{
+	UInt32 shards = 0;
+	for ( NSUInteger i = 0; i < count; i++ )
+	{
+		shards |= _ShardsForWords(wordRanges[i]);
+		
+		// the published state only ever grows, so a stale size here just means locking more than needed
+		if ( NSMaxRange(wordRanges[i]) > _readWords->count )
+			shards = kAQAllStateShards;
+	}
+	
+	[self _lockShards: shards];
+	return ( shards );
+}
+
+// called with the shards of the words and _bitsLock held: brings _stateBits up to date with any of the words
+// written in place since it last held them, which none of its notifiers can be watching
+- (void) _updateStateBitsForWordsInRanges: (const NSRange *) wordRanges count: (NSUInteger) count
+{
+	if ( _persistent )
+		return;
+	
+	for ( NSUInteger i = 0; i < count; i++ )
+	{
+		NSUInteger limit = MIN(NSMaxRange(wordRanges[i]), _readWords->count);
+		for ( NSUInteger j = wordRanges[i].location; j < limit; j++ )
+		{
+			NSRange bits = NSMakeRange(j * 64, 64);
+			UInt64 word = _readWords->words[j];
+			if ( [_stateBits scalarBitsFrom64BitRange: bits] != word )
+				[_stateBits setBitsInRange: bits from64BitValue: word];
+		}
+	}
+}
+
+// called with the shards of the words locked, when no notifier on _stateBits watches them: the values are written
+// straight into the published words, so writers in different shards proceed together
+- (void) _writeScalar64Values: (const UInt64 *) values forStateBitsInRanges: (const NSRange *) ranges count: (NSUInteger) count
+				   wordRanges: (const NSRange *) wordRanges count: (NSUInteger) wordRangeCount shards: (UInt32) shards
+{
+	NSUInteger limit = 0;
+	for ( NSUInteger i = 0; i < wordRangeCount; i++ )
+		limit = MAX(limit, NSMaxRange(wordRanges[i]));
+	[self _growPublishedWordsTo: limit];
+	
+	[self _beginPublishingShards: shards];
+	for ( NSUInteger i = 0; i < count; i++ )
+		_SetBitsInWords(_readWords->words, 0, ranges[i], values[i]);
+	[self _finishPublishingShards: shards];
+}
+
+// called with the shards of the words locked, when _stateBits has to see the change: either it's persistent, or its
+// notifiers are watching some of the words
+- (void) _setStateBitsWithScalar64Values: (const UInt64 *) values inRanges: (const NSRange *) ranges count: (NSUInteger) count
+							  wordRanges: (const NSRange *) wordRanges count: (NSUInteger) wordRangeCount
+{
+	// every value is written before any of them is published, and notifications follow once all are visible
+	pthread_mutex_lock(&_bitsLock);
+	@try
+	{
+		[self _updateStateBitsForWordsInRanges: wordRanges count: wordRangeCount];
+		[_stateBits performBatchUpdates: ^{
+			@try
+			{
+				for ( NSUInteger i = 0; i < count; i++ )
+					[_stateBits setBitsInRange: ranges[i] from64BitValue: values[i]];
+			}
+			@finally
+			{
+				// whatever was changed before an exception is still published
+				[self _publishStateWordsInRanges: wordRanges count: wordRangeCount];
+			}
+		}];
+	}
+	@finally
+	{
+		pthread_mutex_unlock(&_bitsLock);
+	}
+}
+
+- (void) _setScalar64Values: (const UInt64 *) values forStateBitsInRanges: (const NSRange *) ranges count: (NSUInteger) count
+{
+	if ( count == 0 )
+		return;
+	
+	// checked up front, so either every value is written or none of them is
+	for ( NSUInteger i = 0; i < count; i++ )
+	{
+		if ( ranges[i].length > 64 )
+			[NSException raise: NSInvalidArgumentException format: @"Range supplied to -%@ must have a length of 64 or less (received range %@)", NSStringFromSelector(_cmd), NSStringFromRange(ranges[i])];
+	}
+	
+	// ranges may share words, so the words are gathered first to lock, publish and count each of them once;
+	// a single range needs no gathering
+	NSRange singleWordRange = _WordRangeForBits(ranges[0]);
+	NSRange * wordRanges = &singleWordRange;
+	NSUInteger wordRangeCount = 1;
+	NSUInteger wordCount = singleWordRange.length;
+	if ( count > 1 )
+	{
+		NSMutableIndexSet * wordIndexes = [NSMutableIndexSet new];
+		for ( NSUInteger i = 0; i < count; i++ )
+			[wordIndexes addIndexesInRange: _WordRangeForBits(ranges[i])];
+		
+		__block NSUInteger rangeCount = 0;
+		[wordIndexes enumerateRangesUsingBlock: ^(NSRange range, BOOL *stop) { rangeCount++; }];
+		
+		NSRange * gathered = malloc(MAX(rangeCount, (NSUInteger)1) * sizeof(NSRange));
+		__block NSUInteger rangeIndex = 0;
+		[wordIndexes enumerateRangesUsingBlock: ^(NSRange range, BOOL *stop) { gathered[rangeIndex++] = range; }];
+		
+		wordRanges = gathered;
+		wordRangeCount = rangeCount;
+		wordCount = [wordIndexes count];
+#if !USING_ARC
+		[wordIndexes release];
+#endif
+	}
+	
+	UInt32 shards = [self _lockShardsForWordsInRanges: wordRanges count: wordRangeCount];
+	
+	// only this writer can change these words now, so the published ones provide the previous values
+	UInt64 wordBuffer[4];
+	UInt64 * oldWords = (wordCount <= 4 ? wordBuffer : malloc(wordCount * sizeof(UInt64)));
+	UInt64 * next = oldWords;
+	BOOL watched = _persistent;
+	for ( NSUInteger i = 0; i < wordRangeCount; i++ )
+	{
+		[self _readStateWords: next inRange: wordRanges[i]];
+		next += wordRanges[i].length;
+		
+		if ( [_bitfieldWatchedWords intersectsIndexesInRange: wordRanges[i]] )
+			watched = YES;
+	}
+	
+	// notifications wait until the readers can see the change; if writing raises, whatever changed is still
+	// published and notified, and the locks are released
+	@try
+	{
+		if ( watched )
+			[self _setStateBitsWithScalar64Values: values inRanges: ranges count: count wordRanges: wordRanges count: wordRangeCount];
+		else
+			[self _writeScalar64Values: values forStateBitsInRanges: ranges count: count wordRanges: wordRanges count: wordRangeCount shards: shards];
+	}
+	@finally
+	{
+		const UInt64 * previous = oldWords;
+		for ( NSUInteger i = 0; i < wordRangeCount; i++ )
+		{
+			[self _updateMismatchCountsForWordsInRange: wordRanges[i] previousWords: previous];
+			previous += wordRanges[i].length;
+		}
+		
+		if ( oldWords != wordBuffer )
+			free(oldWords);
+		
+		if ( _dispatchDepth != 0 )
+		{
+			// a batch holds every shard, and dispatches all it changed once it ends
+			for ( NSUInteger i = 0; i < count; i++ )
+				[_batchModifiedBits addIndexesInRange: ranges[i]];
+		}
+		else
+		{
+			// most writes touch words no descriptor watches, and those need nothing allocated to dispatch
+			BOOL dispatch = NO;
+			for ( NSUInteger i = 0; i < wordRangeCount && dispatch == NO; i++ )
+				dispatch = [self _descriptorsWatchWordsInRange: wordRanges[i]];
+			
+			if ( dispatch )
+			{
+				NSMutableIndexSet * changed = [NSMutableIndexSet new];
+				for ( NSUInteger i = 0; i < count; i++ )
+					[changed addIndexesInRange: ranges[i]];
+				[self _dispatchNotificationsForChangedBits: changed];
+#if !USING_ARC
+				[changed release];
+#endif
+			}
+		}
+		
+		if ( wordRanges != &singleWordRange )
+			free(wordRanges);
+		
+		[self _unlockShards: shards];
+	}
+}
+
+// called with every shard locked; descriptors comparing the same bits of a word share one table
+- (_AQValueTable *) _addDescriptorID: (NSUInteger) descriptorID toValueTableForWordAtIndex: (NSUInteger) index
+								mask: (UInt64) mask value: (UInt64) value
+{
+	while ( [_valueTablesByWord count] <= index )
+		[_valueTablesByWord addObject: [NSMutableArray array]];
+	
+	NSMutableArray * tables = [_valueTablesByWord objectAtIndex: index];
+	_AQValueTable * table = nil;
+	for ( _AQValueTable * existing in tables )
+	{
+		if ( existing->_mask == mask )
+		{
+			table = existing;
+			break;
+		}
+	}
+	
+	if ( table == nil )
+	{
+		table = [[_AQValueTable alloc] initWithWordIndex: index mask: mask];
+		[tables addObject: table];
+#if !USING_ARC
+		[table release];
+#endif
+	}
+	
+	NSNumber * key = [NSNumber numberWithUnsignedLongLong: value];
+	NSMutableIndexSet * ids = [table->_idsByValue objectForKey: key];
+	if ( ids == nil )
+	{
+		ids = [NSMutableIndexSet indexSet];
+		[table->_idsByValue setObject: ids forKey: key];
+	}
+	
+	[ids addIndex: descriptorID];
+	return ( table );
+}
+
+// called with every shard locked
+- (void) _removeDescriptorID: (NSUInteger) descriptorID fromValueTable: (_AQValueTable *) table value: (UInt64) value
+{
+	NSNumber * key = [NSNumber numberWithUnsignedLongLong: value];
+	NSMutableIndexSet * ids = [table->_idsByValue objectForKey: key];
+	[ids removeIndex: descriptorID];
+	if ( [ids count] != 0 )
+		return;
+	
+	[table->_idsByValue removeObjectForKey: key];
+	if ( [table->_idsByValue count] == 0 )
+		[[_valueTablesByWord objectAtIndex: table->_wordIndex] removeObjectIdenticalTo: table];
+}
+
+- (id) _notifyForChangesToStatesMatchingDescriptor: (AQStateMaskMatchingDescriptor *) desc
+										usingBlock: (void (^)(void)) block
+{
+	_AQDispatchEntry * entry = [_AQDispatchEntry new];
+#if USING_ARC
+	entry->_descriptor = desc;
+#else
+	entry->_descriptor = [desc retain];
+#endif
+	entry->_block = [block copy];
+	entry->_range = desc.fullRange;
+	entry->_isEquality = [desc isKindOfClass: [AQStateMaskedEqualityMatchingDescriptor class]];
+	
+	NSRange wordRange = _WordRangeForBits(entry->_range);
+	NSUInteger wordIndex = 0;
+	UInt64 mask = 0, value = 0;
+	if ( entry->_isEquality )
+	{
+		AQStateMaskedEqualityMatchingDescriptor * match = (AQStateMaskedEqualityMatchingDescriptor *)desc;
+		entry->_tabled = [match getSingleWordIndex: &wordIndex mask: &mask value: &value];
+	}
+	
+	// dispatching writers read the tables without further locking, so they're changed with every shard locked
+	[self _lockShards: kAQAllStateShards];
+	
+	// reuse a removed notification's slot if there is one, keeping the table dense
+	NSUInteger descriptorID = [_freeDescriptorIDs firstIndex];
+	if ( descriptorID == NSNotFound )
+	{
+		descriptorID = [_dispatchEntries count];
+		[_dispatchEntries addObject: entry];
+	}
+	else
+	{
+		[_dispatchEntries replaceObjectAtIndex: descriptorID withObject: entry];
+		[_freeDescriptorIDs removeIndex: descriptorID];
+	}
+	entry->_descriptorID = descriptorID;
+	
+	if ( entry->_tabled )
+	{
+		_AQValueTable * table = [self _addDescriptorID: descriptorID toValueTableForWordAtIndex: wordIndex mask: mask value: value];
+#if USING_ARC
+		entry->_table = table;
+#else
+		entry->_table = [table retain];
+#endif
+		entry->_value = value;
+	}
+	else
+	{
+		if ( entry->_isEquality )
+		{
+			// from here on the count is adjusted as words change, rather than recomputed
+			NSUInteger mismatches = [(AQStateMaskedEqualityMatchingDescriptor *)desc mismatchCountInWords: _readWords->words count: _readWords->count];
+			entry->_counted = (mismatches != NSNotFound);
+			entry->_mismatches = (entry->_counted ? (int32_t)mismatches : 0);
+		}
+		
+		while ( [_descriptorsByWord count] < NSMaxRange(wordRange) )
+			[_descriptorsByWord addObject: [NSMutableIndexSet indexSet]];
+		for ( NSUInteger i = wordRange.location; i < NSMaxRange(wordRange); i++ )
+			[[_descriptorsByWord objectAtIndex: i] addIndex: descriptorID];
+	}
+	
+	[self _unlockShards: kAQAllStateShards];
+	
+#if USING_ARC
+	return ( entry );
+#else
+	return ( [entry autorelease] );
+#endif
+}
+
+// installs a merging notifier on _stateBits itself, which from then on sees every change to the words it watches
+- (id) _notifyForModificationOfStateBitsInRange: (NSRange) range usingChangeBlock: (AQRangeChangeNotification) block
+{
+	NSRange wordRange = _WordRangeForBits(range);
+	[self _lockShards: kAQAllStateShards];
+	pthread_mutex_lock(&_bitsLock);
+	
+	// the words may have been written in place until now, and the change records start from what _stateBits holds
+	[self _updateStateBitsForWordsInRanges: &wordRange count: 1];
+	
+	id token = [_stateBits notifyModificationOfBitsInRange: range
+												  delivery: AQNotificationDeliveryConcurrent
+													 queue: NULL
+										  usingChangeBlock: block];
+	[_stateBits setBacklog: AQNotificationBacklogMerge limit: 1 forNotifier: token];
+	
+	if ( NSMaxRange(wordRange) > _bitfieldWatchCountCapacity )
+	{
+		NSUInteger capacity = MAX(NSMaxRange(wordRange), _bitfieldWatchCountCapacity * 2);
+		_bitfieldWatchCounts = realloc(_bitfieldWatchCounts, capacity * sizeof(NSUInteger));
+		memset(_bitfieldWatchCounts + _bitfieldWatchCountCapacity, 0, (capacity - _bitfieldWatchCountCapacity) * sizeof(NSUInteger));
+		_bitfieldWatchCountCapacity = capacity;
+	}
+	for ( NSUInteger i = wordRange.location; i < NSMaxRange(wordRange); i++ )
+		_bitfieldWatchCounts[i]++;
+	[_bitfieldWatchedWords addIndexesInRange: wordRange];
+	
+	_AQBitfieldNotifier * notifier = [_AQBitfieldNotifier new];
+#if USING_ARC
+	notifier->_token = token;
+#else
+	notifier->_token = [token retain];
+#endif
+	notifier->_words = wordRange;
+	
+	pthread_mutex_unlock(&_bitsLock);
+	[self _unlockShards: kAQAllStateShards];
+	
+#if USING_ARC
+	return ( notifier );
+#else
+	return ( [notifier autorelease] );
+#endif
+}
+
+- (id) _notifyForTransitionsOfDescriptor: (AQStateMaskedEqualityMatchingDescriptor *) desc
+						 usingEntryBlock: (void (^)(void)) entryBlock
+							   exitBlock: (void (^)(void)) exitBlock
+{
+	AQRangeChangeNotification notifier = ^(NSRange range, AQBitfieldChange * change) {
+		// the descriptor's match state either side of the change comes from the values recorded as it was made
+		AQBitfield * before = change.bitsBefore;
+		AQBitfield * after = change.bitsAfter;
+		[before shiftBitsRightBy: range.location];
+		[after shiftBitsRightBy: range.location];
+		
+		BOOL wasMatching = [desc matchesBitfield: before];
+		BOOL isMatching = [desc matchesBitfield: after];
+		if ( isMatching && wasMatching == NO )
+		{
+			if ( entryBlock != nil )
+				entryBlock();
+		}
+		else if ( wasMatching && isMatching == NO )
+		{
+			if ( exitBlock != nil )
+				exitBlock();
+		}
+	};
+	
+	// merged changes run from the first one's old values to the last one's new values, so only the settled state counts
+	return ( [self _notifyForModificationOfStateBitsInRange: desc.fullRange usingChangeBlock: notifier] );
+}
+
+- (id) notifyForChangesToStateBitAtIndex: (NSUInteger) index usingBlock: (void (^)(void)) block
+{
+	return ( [self notifyForChangesToStateBitsInRange: NSMakeRange(index, 1) usingBlock: block] );
+}
+
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range usingBlock: (void (^)(void)) block
 {
 	// create match descriptor and store it
 	AQStateMaskMatchingDescriptor * desc = [[AQStateMaskMatchingDescriptor alloc] initWithRange: range matchingMask: nil];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
+}
+
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range
+						 usingChangeBlock: (void (^)(AQBitfieldChange * change)) block
+{
+	// no descriptor needed: every change within the range is of interest; a burst of changes arrives as one,
+	// running from the first change's old values to the last one's new values
+	return ( [self _notifyForModificationOfStateBitsInRange: range usingChangeBlock: ^(NSRange notifyRange, AQBitfieldChange * change) {
+		block(change);
+	}] );
 }
 
 - (void) setBit: (AQBit) aBit atIndex: (NSUInteger) index ofStateBitsInRange: (NSRange) range
 {
-	[_stateBits setBit: aBit atIndex: range.location + index];
+	NSRange bitRange = NSMakeRange(range.location + index, 1);
+	UInt64 value = (aBit != 0 ? 1ull : 0ull);
+	[self _setScalar64Values: &value forStateBitsInRanges: &bitRange count: 1];
 }
 
 - (void) setScalar32Value: (UInt32) value forStateBitsInRange: (NSRange) range
 {
-	[_stateBits setBitsInRange: range from32BitValue: value];
+	if ( range.length > 32 )
+		[NSException raise: NSInvalidArgumentException format: @"Range supplied to -%@ must have a length of 32 or less (received range %@)", NSStringFromSelector(_cmd), NSStringFromRange(range)];
+	
+	UInt64 scalar = value;
+	[self _setScalar64Values: &scalar forStateBitsInRanges: &range count: 1];
+}
+
+- (void) setScalar64Value: (UInt64) value forStateBitsInRange: (NSRange) range
+{
+	if ( range.length > 64 )
+		[NSException raise: NSInvalidArgumentException format: @"Range supplied to -%@ must have a length of 64 or less (received range %@)", NSStringFromSelector(_cmd), NSStringFromRange(range)];
+	
+	[self _setScalar64Values: &value forStateBitsInRanges: &range count: 1];
 }
 
-- (void) setScalar64Value: (UInt64) value forStateBitsInRange: (NSRange) range
+- (void) performBatchUpdates: (void (^)(void)) updates
 {
-	[_stateBits setBitsInRange: range from64BitValue: value];
+	// a batch may modify anything, so it holds every shard; the locks are recursive, so its own changes still proceed
+	[self _lockShards: kAQAllStateShards];
+	
+	pthread_mutex_lock(&_bitsLock);
+	_dispatchDepth++;
+	@try
+	{
+		[_stateBits performBatchUpdates: updates];
+	}
+	@finally
+	{
+		// the changes made before an exception are already published, so they're still notified
+		_dispatchDepth--;
+		pthread_mutex_unlock(&_bitsLock);
+		
+		if ( _dispatchDepth == 0 )
+		{
+			[self _dispatchNotificationsForChangedBits: _batchModifiedBits];
+			[_batchModifiedBits removeAllIndexes];
+		}
+		
+		[self _unlockShards: kAQAllStateShards];
+	}
 }
 
-- (void) notifyForChangesToStateBitsInRange: (NSRange) range
-						  maskedWithInteger: (NSUInteger) mask
-								 usingBlock: (void (^)(void)) block
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range
+						maskedWithInteger: (NSUInteger) mask
+							   usingBlock: (void (^)(void)) block
 {
 	AQStateMaskMatchingDescriptor * desc = [[AQStateMaskMatchingDescriptor alloc] initWith32BitMask: mask forRange: range];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
 }
 
-- (void) notifyForChangesToStateBitsInRange: (NSRange) range maskedWith64BitInteger: (UInt64) mask
-								  usingBlock: (void (^)(void))block
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range maskedWith64BitInteger: (UInt64) mask
+								usingBlock: (void (^)(void))block
 {
 	AQStateMaskMatchingDescriptor * desc = [[AQStateMaskMatchingDescriptor alloc] initWith64BitMask: mask forRange: range];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
 }
 
-- (void) notifyForChangesToStateBitsInRange: (NSRange) range
-							 maskedWithBits: (AQBitfield *) mask
-								 usingBlock: (void (^)(void)) block
+- (id) notifyForChangesToStateBitsInRange: (NSRange) range
+						   maskedWithBits: (AQBitfield *) mask
+							   usingBlock: (void (^)(void)) block
 {
 	AQStateMaskMatchingDescriptor * desc = [[AQStateMaskMatchingDescriptor alloc] initWithRange: range matchingMask: mask];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
 }
 
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-							  toIntegerValue: (NSUInteger) value
-								  usingBlock: (void (^)(void)) block
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+							toIntegerValue: (NSUInteger) value
+								usingBlock: (void (^)(void)) block
 {
 	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWith32BitValue: value forRange: range];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
 }
 
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-								to64BitValue: (UInt64) value
-								  usingBlock: (void (^)(void)) block
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+							  to64BitValue: (UInt64) value
+								usingBlock: (void (^)(void)) block
 {
 	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWith64BitValue: value forRange: range];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
 }
 
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-									 toValue: (AQBitfield *) value
-								  usingBlock: (void (^)(void)) block
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								   toValue: (AQBitfield *) value
+								usingBlock: (void (^)(void)) block
 {
 	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWithRange: range matchingValue: value];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
 }
 
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-								  maskedWith: (NSUInteger) mask
-							  toIntegerValue: (NSUInteger) value
-								  usingBlock: (void (^)(void)) block
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								maskedWith: (NSUInteger) mask
+							toIntegerValue: (NSUInteger) value
+								usingBlock: (void (^)(void)) block
 {
 	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWith32BitValue: value forRange: range matchingMask: mask];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
 }
 
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-								  maskedWith: (UInt64) mask
-								to64BitValue: (UInt64) value
-								  usingBlock: (void (^)(void)) block
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								maskedWith: (UInt64) mask
+							  to64BitValue: (UInt64) value
+								usingBlock: (void (^)(void)) block
 {
 	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWith64BitValue: value forRange: range matchingMask: mask];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[desc release];
 #endif	
+	
+	return ( token );
 }
 
-- (void) notifyForEqualityOfStateBitsInRange: (NSRange) range
-								  maskedWith: (AQBitfield *) mask
-									 toValue: (AQBitfield *) value
-								  usingBlock: (void (^)(void)) block
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								maskedWith: (AQBitfield *) mask
+								   toValue: (AQBitfield *) value
+								usingBlock: (void (^)(void)) block
 {
 	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWithRange: range matchingValue: value withMask: mask];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+#if !USING_ARC
+	[desc release];
+#endif
+	
+	return ( token );
+}
+
+- (id) notifyForEqualityOfStateBitsInRange: (NSRange) range
+								maskedWith: (AQBitfield *) mask
+								   toValue: (AQBitfield *) value
+						   usingEntryBlock: (void (^)(void)) entryBlock
+								 exitBlock: (void (^)(void)) exitBlock
+{
+	AQStateMaskedEqualityMatchingDescriptor * desc = nil;
+	if ( mask != nil )
+		desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWithRange: range matchingValue: value withMask: mask];
+	else
+		desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWithRange: range matchingValue: value];
+	
+	id token = [self _notifyForTransitionsOfDescriptor: desc usingEntryBlock: entryBlock exitBlock: exitBlock];
 #if !USING_ARC
 	[desc release];
 #endif
+	
+	return ( token );
+}
+
+- (void) removeNotifier: (id) token
+{
+	if ( [token isKindOfClass: [_AQBitfieldNotifier class]] )
+	{
+		// change and transition notifications are installed on the bitfield itself; once nothing
+		// there watches a word, it goes back to being written in place
+		_AQBitfieldNotifier * notifier = (_AQBitfieldNotifier *)token;
+		[self _lockShards: kAQAllStateShards];
+		pthread_mutex_lock(&_bitsLock);
+		
+		if ( notifier->_removed == NO )
+		{
+			notifier->_removed = YES;
+			[_stateBits removeNotifier: notifier->_token];
+			
+			for ( NSUInteger i = notifier->_words.location; i < NSMaxRange(notifier->_words); i++ )
+			{
+				if ( --_bitfieldWatchCounts[i] == 0 )
+					[_bitfieldWatchedWords removeIndex: i];
+			}
+		}
+		
+		pthread_mutex_unlock(&_bitsLock);
+		[self _unlockShards: kAQAllStateShards];
+		return;
+	}
+	
+	if ( [token isKindOfClass: [_AQDispatchEntry class]] == NO )
+		return;
+	
+	_AQDispatchEntry * entry = (_AQDispatchEntry *)token;
+	[self _lockShards: kAQAllStateShards];
+	
+	if ( entry->_removed == NO )
+	{
+		// queued runs hold their own reference to the entry, and only take the block while it's still there
+		entry->_removed = YES;
+		
+		// the caller may keep the token, so the block and whatever it captured are let go now
+		OSSpinLockLock(&entry->_lock);
+		dispatch_block_t block = entry->_block;
+		AQStateMaskMatchingDescriptor * descriptor = entry->_descriptor;
+		entry->_block = nil;
+		entry->_descriptor = nil;
+		OSSpinLockUnlock(&entry->_lock);
+#if !USING_ARC
+		[block release];
+		[descriptor release];
+#endif
+		
+		NSUInteger descriptorID = entry->_descriptorID;
+		if ( entry->_tabled )
+		{
+			[self _removeDescriptorID: descriptorID fromValueTable: entry->_table value: entry->_value];
+		}
+		else
+		{
+			NSRange wordRange = _WordRangeForBits(entry->_range);
+			for ( NSUInteger i = wordRange.location; i < NSMaxRange(wordRange); i++ )
+				[[_descriptorsByWord objectAtIndex: i] removeIndex: descriptorID];
+		}
+		
+		[_dispatchEntries replaceObjectAtIndex: descriptorID withObject: [NSNull null]];
+		[_freeDescriptorIDs addIndex: descriptorID];
+	}
+	
+	[self _unlockShards: kAQAllStateShards];
 }
 
 @end
 
 @implementation AQAppStateMachine (NamedStateEnumerations)
 
-#if 0
-static inline NSUInteger HighestOneBit32(NSUInteger x)
+static inline AQStateKey _StateKeyForRange( NSRange range )
 {
-	x |= x >> 1;
-	x |= x >> 2;
-	x |= x >> 4;
-	x |= x >> 8;
-	x |= x >> 16;
-	return ( x & ~(x >> 1) );
+	AQStateKey key = { range.location, range.length };
+	return ( key );
 }
 
+// the number of bits required to hold a value
 static inline NSUInteger HighestOneBit64(UInt64 x)
 {
-	x |= x >> 1;
-	x |= x >> 2;
-	x |= x >> 4;
-	x |= x >> 8;
-	x |= x >> 16;
-	x |= x >> 32;
-	return ( (NSUInteger)(x & ~(x >> 1)) );
-}
-#else
-static inline NSUInteger HighestOneBit32(NSUInteger x)
-{
-	NSUInteger i = 0;
-	for ( i = 0; i < 32; i++, x >>= 1 )
-	{
-		if ( x == 0 )
-			break;
-	}
-	return ( i );
+	return ( x == 0 ? 0 : (NSUInteger)(64 - __builtin_clzll(x)) );
 }
 
-static inline NSUInteger HighestOneBit64(UInt64 x)
+static inline NSUInteger HighestOneBit32(NSUInteger x)
 {
-	NSUInteger i = 0;
-	for ( i = 0; i < 64; i++, x >>= 1 )
-	{
-		if ( x == 0 )
-			break;
-	}
-	return ( i );
+	return ( MIN(HighestOneBit64(x), (NSUInteger)32) );
 }
-#endif
 
-- (void) addStateMachineValuesFromZeroTo: (NSUInteger) maxValue withName: (NSString *) name
+- (AQStateKey) addStateMachineValuesFromZeroTo: (NSUInteger) maxValue withName: (NSString *) name
 {
-	[self addStateMachineValuesUsingBitfieldOfLength: HighestOneBit32(maxValue) withName: name];
+	return ( [self addStateMachineValuesUsingBitfieldOfLength: HighestOneBit32(maxValue) withName: name] );
 }
 
-- (void) add64BitStateMachineValuesFromZeroTo: (UInt64) maxValue withName: (NSString *) name
+- (AQStateKey) add64BitStateMachineValuesFromZeroTo: (UInt64) maxValue withName: (NSString *) name
 {
-	[self addStateMachineValuesUsingBitfieldOfLength: HighestOneBit64(maxValue) withName: name];
+	return ( [self addStateMachineValuesUsingBitfieldOfLength: HighestOneBit64(maxValue) withName: name] );
 }
 
-- (void) addStateMachineValuesUsingBitfieldOfLength: (NSUInteger) length withName: (NSString *) name
+- (AQStateKey) addStateMachineValuesUsingBitfieldOfLength: (NSUInteger) length withName: (NSString *) name
 {
 	// round up to byte-size if necessary
 	length = (length + 7) & ~7;
 	
+	__block AQStateKey key;
+	__block NSUInteger capacity = 0;
 	dispatch_sync(_syncQ, ^{
 		AQRange * range = [[AQRange alloc] initWithRange: NSMakeRange(_nextRangeStart, length)];
 		[_namedRanges setObject: range forKey: name];
 		_nextRangeStart = NSMaxRange(range.range);
+		key = _StateKeyForRange(range.range);
+		capacity = _nextRangeStart;
 	});
+	
+	// allocate the new bits now rather than when they're first set; this is done outside _syncQ, since a
+	// batch holding _bitsLock may add enumerations of its own
+	pthread_mutex_lock(&_bitsLock);
+	[_stateBits reserveCapacity: capacity];
+	pthread_mutex_unlock(&_bitsLock);
+	
+	return ( key );
+}
+
+- (AQStateKey) keyForEnumerationWithName: (NSString *) name
+{
+	return ( _StateKeyForRange([self underlyingBitfieldRangeForName: name]) );
 }
 
 - (void) setValue: (UInt64) value forEnumerationWithName: (NSString *) name
 {
-	NSRange rng = [self underlyingBitfieldRangeForName: name];
-	if ( rng.location == NSNotFound )
-		return;
-	
-	[self setScalar64Value: value forStateBitsInRange: rng];
+	[self setValue: value forStateKey: [self keyForEnumerationWithName: name]];
 }
 
 - (void) setBitAtIndex: (NSUInteger) index ofEnumerationWithName: (NSString *) name
 {
-	NSRange rng = [self underlyingBitfieldRangeForName: name];
-	if ( rng.location == NSNotFound )
-		return;
-	
-	[self setBit: 1 atIndex: index ofStateBitsInRange: rng];
+	[self setBitAtIndex: index ofStateKey: [self keyForEnumerationWithName: name]];
 }
 
 - (void) clearBitAtIndex: (NSUInteger) index ofEnumerationWithName: (NSString *) name
 {
-	NSRange rng = [self underlyingBitfieldRangeForName: name];
-	if ( rng.location == NSNotFound )
-		return;
-	
-	[self setBit: 0 atIndex: index ofStateBitsInRange: rng];
+	[self clearBitAtIndex: index ofStateKey: [self keyForEnumerationWithName: name]];
 }
 
 - (UInt32) valueForEnumerationWithName: (NSString *) name
 {
-	NSRange rng = [self underlyingBitfieldRangeForName: name];
-	if ( rng.location == NSNotFound )
-		return ( 0 );
-	
-	return ( [_stateBits scalarBitsFromRange: rng] );
+	return ( [self valueForStateKey: [self keyForEnumerationWithName: name]] );
 }
 
 - (UInt64) largeValueForEnumerationWithName: (NSString *) name
 {
-	NSRange rng = [self underlyingBitfieldRangeForName: name];
-	if ( rng.location == NSNotFound )
-		return ( 0ull );
-	
-	return ( [_stateBits scalarBitsFrom64BitRange: rng] );
+	return ( [self largeValueForStateKey: [self keyForEnumerationWithName: name]] );
 }
 
 - (AQBitfield *) bitsForEnumerationWithName: (NSString *) name
 {
-	NSRange rng = [self underlyingBitfieldRangeForName: name];
-	if ( rng.location == NSNotFound )
-		return ( nil );
+	return ( [self bitsForStateKey: [self keyForEnumerationWithName: name]] );
+}
+
+- (void) setValuesForEnumerationsWithNames: (NSDictionary *) values
+{
+	NSUInteger count = [values count];
+	NSRange * ranges = malloc(MAX(count, (NSUInteger)1) * sizeof(NSRange));
+	UInt64 * scalars = malloc(MAX(count, (NSUInteger)1) * sizeof(UInt64));
+	
+	// resolve every name first, so the writes themselves happen together
+	NSUInteger valid = 0;
+	for ( NSString * name in values )
+	{
+		NSRange range = [self underlyingBitfieldRangeForName: name];
+		if ( range.location == NSNotFound )
+			continue;
+		
+		ranges[valid] = range;
+		scalars[valid] = [[values objectForKey: name] unsignedLongLongValue];
+		valid++;
+	}
 	
-	return ( [_stateBits bitfieldFromRange: rng] );
+	@try
+	{
+		[self _setScalar64Values: scalars forStateBitsInRanges: ranges count: valid];
+	}
+	@finally
+	{
+		free(ranges);
+		free(scalars);
+	}
 }
 
-- (void) notifyChangesToStateMachineValuesWithName: (NSString *) name
-										usingBlock: (void (^)(void)) block
+- (NSDictionary *) valuesForEnumerationsWithNames: (NSArray *) names
+{
+	NSMutableArray * ranges = [[NSMutableArray alloc] initWithCapacity: [names count]];
+	NSRange covered = NSMakeRange(NSNotFound, 0);
+	for ( NSString * name in names )
+	{
+		AQRange * range = [_namedRanges objectForKey: name];
+		if ( range == nil )
+		{
+			[ranges addObject: [NSNull null]];
+			continue;
+		}
+		
+		[ranges addObject: range];
+		covered = (covered.location == NSNotFound ? range.range : NSUnionRange(covered, range.range));
+	}
+	
+	// every value comes from the same copy of the state
+	NSRange wordRange = _WordRangeForBits(covered);
+	UInt64 * words = malloc(MAX(wordRange.length, (NSUInteger)1) * sizeof(UInt64));
+	[self _readStateWords: words inRange: wordRange];
+	
+	NSMutableDictionary * result = [[NSMutableDictionary alloc] initWithCapacity: [names count]];
+	[names enumerateObjectsUsingBlock: ^(__strong id name, NSUInteger idx, BOOL *stop) {
+		id obj = [ranges objectAtIndex: idx];
+		if ( obj == [NSNull null] )
+			return;
+		
+		NSRange range = ((AQRange *)obj).range;
+		if ( range.length <= 64 )
+		{
+			[result setObject: [NSNumber numberWithUnsignedLongLong: _BitsFromWords(words, wordRange.location, range)] forKey: name];
+			return;
+		}
+		
+		// the same form as bitsForEnumerationWithName:, with the bits at their indices within the state
+		AQBitfield * bits = _NewBitfieldFromWords(words, wordRange.location, range);
+		[result setObject: bits forKey: name];
+#if !USING_ARC
+		[bits release];
+#endif
+	}];
+	
+	free(words);
+#if USING_ARC
+	return ( result );
+#else
+	[ranges release];
+	return ( [result autorelease] );
+#endif
+}
+
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+									  usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForChangesToStateBitsInRange: range.range usingBlock: block];
+	return ( [self notifyForChangesToStateBitsInRange: range.range usingBlock: block] );
 }
 
-- (void) notifyChangesToStateMachineValuesWithName: (NSString *) name
-									  matchingMask: (NSUInteger) mask
-										usingBlock: (void (^)(void)) block
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+								usingChangeBlock: (void (^)(AQBitfieldChange * change)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForChangesToStateBitsInRange: range.range maskedWithInteger: mask usingBlock: block];
+	return ( [self notifyForChangesToStateBitsInRange: range.range usingChangeBlock: block] );
 }
 
-- (void) notifyChangesToStateMachineValuesWithName: (NSString *) name
-								 matching64BitMask: (UInt64) mask
-										usingBlock: (void (^)(void)) block
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+									matchingMask: (NSUInteger) mask
+									  usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForChangesToStateBitsInRange: range.range maskedWith64BitInteger: mask usingBlock: block];
+	return ( [self notifyForChangesToStateBitsInRange: range.range maskedWithInteger: mask usingBlock: block] );
 }
 
-- (void) notifyChangesToStateMachineValuesWithName: (NSString *) name
-							  matchingMaskBitfield: (AQBitfield *) mask
-										usingBlock: (void (^)(void)) block
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+							   matching64BitMask: (UInt64) mask
+									  usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForChangesToStateBitsInRange: range.range maskedWithBits: mask usingBlock: block];
+	return ( [self notifyForChangesToStateBitsInRange: range.range maskedWith64BitInteger: mask usingBlock: block] );
 }
 
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										  toInteger: (NSUInteger) value
-										 usingBlock: (void (^)(void)) block
+- (id) notifyChangesToStateMachineValuesWithName: (NSString *) name
+							matchingMaskBitfield: (AQBitfield *) mask
+									  usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForEqualityOfStateBitsInRange: range.range toIntegerValue: value usingBlock: block];
+	return ( [self notifyForChangesToStateBitsInRange: range.range maskedWithBits: mask usingBlock: block] );
 }
 
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										   toUInt64: (UInt64) value
-										 usingBlock: (void (^)(void)) block
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+										toInteger: (NSUInteger) value
+									   usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForEqualityOfStateBitsInRange: range.range to64BitValue: value usingBlock: block];
+	return ( [self notifyForEqualityOfStateBitsInRange: range.range toIntegerValue: value usingBlock: block] );
 }
 
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-											 toBits: (AQBitfield *) bits
-										 usingBlock: (void (^)(void)) block
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+										 toUInt64: (UInt64) value
+									   usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForEqualityOfStateBitsInRange: range.range toValue: bits usingBlock: block];
+	return ( [self notifyForEqualityOfStateBitsInRange: range.range to64BitValue: value usingBlock: block] );
 }
 
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										 maskedWith: (NSUInteger) mask
-										  toInteger: (NSUInteger) value
-										 usingBlock: (void (^)(void)) block
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+										   toBits: (AQBitfield *) bits
+									   usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForEqualityOfStateBitsInRange: range.range maskedWith: mask toIntegerValue: value usingBlock: block];
+	return ( [self notifyForEqualityOfStateBitsInRange: range.range toValue: bits usingBlock: block] );
 }
 
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										 maskedWith: (UInt64) mask
-										   toUInt64: (UInt64) value
-										 usingBlock: (void (^)(void)) block
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+									   maskedWith: (NSUInteger) mask
+										toInteger: (NSUInteger) value
+									   usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForEqualityOfStateBitsInRange: range.range maskedWith: mask to64BitValue: value usingBlock: block];
+	return ( [self notifyForEqualityOfStateBitsInRange: range.range maskedWith: mask toIntegerValue: value usingBlock: block] );
 }
 
-- (void) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
-										 maskedWith: (AQBitfield *) mask
-											 toBits: (AQBitfield *) bits
-										 usingBlock: (void (^)(void)) block
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+									   maskedWith: (UInt64) mask
+										 toUInt64: (UInt64) value
+									   usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return;			// nonexistent named range
+		return ( nil );			// nonexistent named range
 	
-	[self notifyForEqualityOfStateBitsInRange: range.range maskedWith: mask toValue: bits usingBlock: block];
+	return ( [self notifyForEqualityOfStateBitsInRange: range.range maskedWith: mask to64BitValue: value usingBlock: block] );
 }
 
-- (BOOL) bitIsSetAtIndex: (NSUInteger) index forName: (NSString *) name
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+									   maskedWith: (AQBitfield *) mask
+										   toBits: (AQBitfield *) bits
+									   usingBlock: (void (^)(void)) block
 {
 	AQRange * range = [_namedRanges objectForKey: name];
 	if ( range == nil )
-		return ( NO );
+		return ( nil );			// nonexistent named range
 	
-	index += range.range.location;
-	if ( [_stateBits bitAtIndex: index] == 1 )
-		return ( YES );
+	return ( [self notifyForEqualityOfStateBitsInRange: range.range maskedWith: mask toValue: bits usingBlock: block] );
+}
+
+- (id) notifyEqualityOfStateMachineValuesWithName: (NSString *) name
+										 toUInt64: (UInt64) value
+								  usingEntryBlock: (void (^)(void)) entryBlock
+										exitBlock: (void (^)(void)) exitBlock
+{
+	AQRange * range = [_namedRanges objectForKey: name];
+	if ( range == nil )
+		return ( nil );			// nonexistent named range
 	
-	return ( NO );
+	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWith64BitValue: value forRange: range.range];
+	id token = [self _notifyForTransitionsOfDescriptor: desc usingEntryBlock: entryBlock exitBlock: exitBlock];
+#if !USING_ARC
+	[desc release];
+#endif
+	
+	return ( token );
+}
+
+- (BOOL) bitIsSetAtIndex: (NSUInteger) index forName: (NSString *) name
+{
+	return ( [self bitIsSetAtIndex: index forStateKey: [self keyForEnumerationWithName: name]] );
 }
 
 - (BOOL) bitsSetAtIndexes: (NSIndexSet *) indexes forName: (NSString *) name
@@ -511,9 +1730,11 @@ static inline NSUInteger HighestOneBit64(UInt64 x)
 	if ( rangeObj.range.location != 0 )
 		[test shiftIndexesStartingAtIndex: 0 by: rangeObj.range.location];
 	
+	// test every index against the same copy of the state
+	AQBitfield * state = [self _snapshotOfStateBitsInRange: rangeObj.range];
 	__block BOOL result = YES;
 	[test enumerateRangesUsingBlock: ^(NSRange range, BOOL *stop) {
-		if ( [_stateBits countOfBit: 1 inRange: range] != range.length )
+		if ( [state countOfBit: 1 inRange: range] != range.length )
 		{
 			result = NO;
 			*stop = YES;
@@ -533,7 +1754,10 @@ static inline NSUInteger HighestOneBit64(UInt64 x)
 	if ( rangeObj == nil )
 		return ( NO );
 	
-	return ( [_stateBits bitsInRange: rangeObj.range matchBits: value] );
+	if ( rangeObj.range.length == 0 )
+		return ( NO );
+	
+	return ( [self _stateBitsInRange: NSMakeRange(rangeObj.range.location, MIN(rangeObj.range.length, (NSUInteger)64))] == (UInt64)value );
 }
 
 - (BOOL) bitValuesForName: (NSString *) name matchBits: (AQBitfield *) bits
@@ -542,16 +1766,193 @@ static inline NSUInteger HighestOneBit64(UInt64 x)
 	if ( rangeObj == nil )
 		return ( NO );
 	
-	return ( [_stateBits bitsInRange: rangeObj.range equalToBitfield: bits] );
+	AQBitfield * state = [self _snapshotOfStateBitsInRange: rangeObj.range];
+	return ( [state bitsInRange: rangeObj.range equalToBitfield: bits] );
+}
+
+@end
+
+@implementation AQAppStateMachine (StateKeys)
+
+// the key's bits within the state; keys carry everything needed, so no lookup takes place
+static inline NSRange _RangeForStateKey( AQStateKey key )
+{
+	return ( NSMakeRange(key.offset, key.width) );
+}
+
+- (void) setValue: (UInt64) value forStateKey: (AQStateKey) key
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return;
+	
+	[self setScalar64Value: value forStateBitsInRange: _RangeForStateKey(key)];
+}
+
+- (void) setBitAtIndex: (NSUInteger) index ofStateKey: (AQStateKey) key
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return;
+	
+	[self setBit: 1 atIndex: index ofStateBitsInRange: _RangeForStateKey(key)];
+}
+
+- (void) clearBitAtIndex: (NSUInteger) index ofStateKey: (AQStateKey) key
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return;
+	
+	[self setBit: 0 atIndex: index ofStateBitsInRange: _RangeForStateKey(key)];
+}
+
+- (void) setValues: (const AQStateKeyValue *) values count: (NSUInteger) count
+{
+	NSRange rangeBuffer[8];
+	UInt64 scalarBuffer[8];
+	NSRange * ranges = (count <= 8 ? rangeBuffer : malloc(count * sizeof(NSRange)));
+	UInt64 * scalars = (count <= 8 ? scalarBuffer : malloc(count * sizeof(UInt64)));
+	
+	NSUInteger valid = 0;
+	for ( NSUInteger i = 0; i < count; i++ )
+	{
+		if ( AQStateKeyIsValid(values[i].key) == NO )
+			continue;
+		
+		ranges[valid] = _RangeForStateKey(values[i].key);
+		scalars[valid] = values[i].value;
+		valid++;
+	}
+	
+	@try
+	{
+		[self _setScalar64Values: scalars forStateBitsInRanges: ranges count: valid];
+	}
+	@finally
+	{
+		if ( ranges != rangeBuffer )
+		{
+			free(ranges);
+			free(scalars);
+		}
+	}
+}
+
+- (UInt32) valueForStateKey: (AQStateKey) key
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( 0 );
+	if ( key.width > 32 )
+		[NSException raise: NSRangeException format: @"%@ specifies a range larger than the size of a 32-bit quantity", NSStringFromRange(_RangeForStateKey(key))];
+	
+	return ( (UInt32)[self _stateBitsInRange: _RangeForStateKey(key)] );
+}
+
+- (UInt64) largeValueForStateKey: (AQStateKey) key
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( 0ull );
+	if ( key.width > 64 )
+		[NSException raise: NSRangeException format: @"%@ specifies a range larger than the size of a 64-bit quantity", NSStringFromRange(_RangeForStateKey(key))];
+	
+	return ( [self _stateBitsInRange: _RangeForStateKey(key)] );
+}
+
+- (AQBitfield *) bitsForStateKey: (AQStateKey) key
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( nil );
+	
+	return ( [self _snapshotOfStateBitsInRange: _RangeForStateKey(key)] );
+}
+
+- (BOOL) bitIsSetAtIndex: (NSUInteger) index forStateKey: (AQStateKey) key
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( NO );
+	
+	return ( [self _stateBitsInRange: NSMakeRange(key.offset + index, 1)] == 1 );
+}
+
+- (id) notifyChangesToStateKey: (AQStateKey) key usingBlock: (void (^)(void)) block
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( nil );
+	
+	return ( [self notifyForChangesToStateBitsInRange: _RangeForStateKey(key) usingBlock: block] );
+}
+
+- (id) notifyChangesToStateKey: (AQStateKey) key usingChangeBlock: (void (^)(AQBitfieldChange * change)) block
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( nil );
+	
+	return ( [self notifyForChangesToStateBitsInRange: _RangeForStateKey(key) usingChangeBlock: block] );
+}
+
+- (id) notifyChangesToStateKey: (AQStateKey) key
+			 matching64BitMask: (UInt64) mask
+					usingBlock: (void (^)(void)) block
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( nil );
+	
+	return ( [self notifyForChangesToStateBitsInRange: _RangeForStateKey(key) maskedWith64BitInteger: mask usingBlock: block] );
+}
+
+- (id) notifyEqualityOfStateKey: (AQStateKey) key
+					   toUInt64: (UInt64) value
+					 usingBlock: (void (^)(void)) block
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( nil );
+	
+	return ( [self notifyForEqualityOfStateBitsInRange: _RangeForStateKey(key) to64BitValue: value usingBlock: block] );
+}
+
+- (id) notifyEqualityOfStateKey: (AQStateKey) key
+					 maskedWith: (UInt64) mask
+					   toUInt64: (UInt64) value
+					 usingBlock: (void (^)(void)) block
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( nil );
+	
+	return ( [self notifyForEqualityOfStateBitsInRange: _RangeForStateKey(key) maskedWith: mask to64BitValue: value usingBlock: block] );
+}
+
+- (id) notifyEqualityOfStateKey: (AQStateKey) key
+						 toBits: (AQBitfield *) bits
+					 usingBlock: (void (^)(void)) block
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( nil );
+	
+	return ( [self notifyForEqualityOfStateBitsInRange: _RangeForStateKey(key) toValue: bits usingBlock: block] );
+}
+
+- (id) notifyEqualityOfStateKey: (AQStateKey) key
+					   toUInt64: (UInt64) value
+				usingEntryBlock: (void (^)(void)) entryBlock
+					  exitBlock: (void (^)(void)) exitBlock
+{
+	if ( AQStateKeyIsValid(key) == NO )
+		return ( nil );
+	
+	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWith64BitValue: value forRange: _RangeForStateKey(key)];
+	id token = [self _notifyForTransitionsOfDescriptor: desc usingEntryBlock: entryBlock exitBlock: exitBlock];
+#if !USING_ARC
+	[desc release];
+#endif
+	
+	return ( token );
 }
 
 @end
 
 @implementation AQAppStateMachine (MultipleEnumerationNotifications)
 
-- (void) notifyChangesToStateMachineValuesWithNames: (NSArray *) names
-									  matchingMasks: (NSArray *) masks
-										 usingBlock: (void (^)(void)) block
+- (id) notifyChangesToStateMachineValuesWithNames: (NSArray *) names
+									matchingMasks: (NSArray *) masks
+									   usingBlock: (void (^)(void)) block
 {
 	NSParameterAssert([names count] == [masks count]);
 	NSParameterAssert(block != nil);
@@ -598,21 +1999,21 @@ static inline NSUInteger HighestOneBit64(UInt64 x)
 	
 	AQStateMaskMatchingDescriptor * desc = [[AQStateMaskMatchingDescriptor alloc] initWithRanges: ranges
 																				   matchingMasks: bitmasks];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
+	id token = [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
 #if !USING_ARC
 	[ranges release];
 	[bitmasks release];
 	[desc release];
 #endif
+	
+	return ( token );
 }
 
-- (void) notifyEqualityOfStateMachineValuesWithNames: (NSArray *) names
-									   matchingMasks: (NSArray *) masks
-											toValues: (NSArray *) values
-										  usingBlock: (void (^)(void)) block
+- (AQStateMaskedEqualityMatchingDescriptor *) _equalityDescriptorForNames: (NSArray *) names
+																	masks: (NSArray *) masks
+																   values: (NSArray *) values
 {
 	NSParameterAssert([names count] == [masks count]);
-	NSParameterAssert(block != nil);
 	
 	NSMutableArray * ranges = [NSMutableArray new];
 	[names enumerateObjectsUsingBlock: ^(__strong id obj, NSUInteger idx, BOOL *stop) {
@@ -655,14 +2056,38 @@ static inline NSUInteger HighestOneBit64(UInt64 x)
 	}];
 	
 	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWithRanges: ranges masks: bitmasks matchingValues: values];
-	[self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block];
-#if !USING_ARC
+#if USING_ARC
+	return ( desc );
+#else
 	[ranges release];
 	[bitmasks release];
-	[desc release];
+	return ( [desc autorelease] );
 #endif
 }
 
+- (id) notifyEqualityOfStateMachineValuesWithNames: (NSArray *) names
+									 matchingMasks: (NSArray *) masks
+										  toValues: (NSArray *) values
+										usingBlock: (void (^)(void)) block
+{
+	NSParameterAssert(block != nil);
+	
+	AQStateMaskedEqualityMatchingDescriptor * desc = [self _equalityDescriptorForNames: names masks: masks values: values];
+	return ( [self _notifyForChangesToStatesMatchingDescriptor: desc usingBlock: block] );
+}
+
+- (id) notifyEqualityOfStateMachineValuesWithNames: (NSArray *) names
+									 matchingMasks: (NSArray *) masks
+										  toValues: (NSArray *) values
+								   usingEntryBlock: (void (^)(void)) entryBlock
+										 exitBlock: (void (^)(void)) exitBlock
+{
+	NSParameterAssert(entryBlock != nil || exitBlock != nil);
+	
+	AQStateMaskedEqualityMatchingDescriptor * desc = [self _equalityDescriptorForNames: names masks: masks values: values];
+	return ( [self _notifyForTransitionsOfDescriptor: desc usingEntryBlock: entryBlock exitBlock: exitBlock] );
+}
+
 @end
 
 @implementation AQAppStateMachine (InteriorThingsICantHelpMyselfFromExposing)
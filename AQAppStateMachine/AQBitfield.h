@@ -38,24 +38,53 @@
 /// A register-width type representing a single bit. Its value should always be `0` or `1`.
 typedef CFBit AQBit;
 
+/// The layouts available for an AQBitfield's storage.
+typedef enum
+{
+	/// A flat array of 64-bit words covering every bit up to the highest stored one.
+	AQBitfieldStorageDense,
+	
+	/// Independent 65536-bit chunks, each stored as a sorted index array, a bitmap, or a list of runs.
+	AQBitfieldStorageSparse
+	
+} AQBitfieldStorageMode;
+
 /**
  A class representing a bitfield of indeterminate size.
+ 
+ By default bits are stored in a dense array of 64-bit words which grows as higher bits are set,
+ so scalar reads and writes touch at most two words. Use initWithCapacity: or reserveCapacity: to
+ allocate the words up-front when the number of bits in use is known ahead of time.
+ 
+ Bitfields whose set bits are scattered thinly across a wide range, or which consist of a few long
+ runs, can instead use AQBitfieldStorageSparse. This only allocates the 65536-bit chunks which
+ differ from their surroundings, and picks the most compact representation for each one.
  */
 @interface AQBitfield : NSObject <NSCopying, NSMutableCopying, NSCoding>
-{
-@protected
-	NSMutableIndexSet *		_storage;
-}
 
 /// @name Initialization
 
 /**
  Initialize an empty bitfield.
+ @return A new bitfield instance, with all bits set to zero.
+ */
+- (id) init;
+
+/**
+ Initialize an empty bitfield with storage reserved for a given number of bits.
  
  This is the designated initializer for the AQBitfield class.
+ @param numberOfBits The number of bits for which to allocate storage.
  @return A new bitfield instance, with all bits set to zero.
  */
-- (id) init;
+- (id) initWithCapacity: (NSUInteger) numberOfBits;
+
+/**
+ Initialize an empty bitfield using a particular storage layout.
+ @param mode The storage layout to use.
+ @return A new bitfield instance, with all bits set to zero.
+ */
+- (id) initWithStorageMode: (AQBitfieldStorageMode) mode;
 
 /**
  Initialize a bitfield using a 32-bit scalar value.
@@ -71,6 +100,13 @@ typedef CFBit AQBit;
  */
 - (id) initWith64BitField: (UInt64) bits;
 
+/**
+ Initialize a bitfield from data created by dataRepresentation.
+ @param data The encoded bitfield.
+ @return A new bitfield with the encoded contents and storage layout, or `nil` if _data_ is not a valid encoding.
+ */
+- (id) initWithData: (NSData *) data;
+
 /// @name Comparisons
 
 /// Returns a hash code for the object's current state.
@@ -90,6 +126,37 @@ typedef CFBit AQBit;
  */
 - (NSComparisonResult) compare: (AQBitfield *) other;
 
+/// @name Capacity
+
+/**
+ Ensure that storage is allocated for at least a given number of bits.
+ 
+ Setting bits beyond the reserved capacity is always allowed; this simply avoids reallocating
+ storage as the bitfield grows.
+ @param numberOfBits The number of bits for which to allocate storage.
+ */
+- (void) reserveCapacity: (NSUInteger) numberOfBits;
+
+/**
+ The layout used to store the receiver's bits.
+ 
+ Changing this converts the existing contents to the new layout; the bits themselves are unchanged.
+ Sparse bitfields ignore reserveCapacity:.
+ */
+@property (nonatomic) AQBitfieldStorageMode storageMode;
+
+/// @name Serialization
+
+/**
+ Returns a compact binary encoding of the receiver, suitable for initWithData:.
+ 
+ The encoding starts with a versioned little-endian header recording the storage layout, followed by
+ either the raw storage words or a list of runs of set bits, whichever is smaller. The same encoding
+ is used when archiving through NSCoding.
+ @return The encoded bitfield.
+ */
+- (NSData *) dataRepresentation;
+
 /// @name Counting
 
 /**
@@ -133,6 +200,27 @@ typedef CFBit AQBit;
  */
 - (AQBitfield *) bitfieldFromRange: (NSRange) range;
 
+/**
+ Obtain a bitfield containing a copy of the bits from a given range, moved down so that the range starts
+ at index zero.
+ 
+ This is equivalent to calling bitfieldFromRange: and shifting the result left by `range.location`, but
+ makes a single pass over the receiver's storage and allocates nothing but the result.
+ @param range The range of the receiver to extract.
+ @result A new bitfield containing the bits from the specified range, starting at index zero.
+ @exception NSRangeException Thrown if the range is beyond that allowable (`0..NSNotFound`)
+ */
+- (AQBitfield *) bitfieldByExtractingBitsInRange: (NSRange) range;
+
+/**
+ Store the bits from a range of the receiver into a destination bitfield, moved down so that the range
+ starts at index zero.
+ @param range The range of the receiver to extract.
+ @param destination The bitfield whose contents will be replaced with the result. This may be the receiver.
+ @exception NSRangeException Thrown if the range is beyond that allowable (`0..NSNotFound`)
+ */
+- (void) extractBitsInRange: (NSRange) range intoBitfield: (AQBitfield *) destination;
+
 /// @name Significant Bits
 
 /**
@@ -149,6 +237,22 @@ typedef CFBit AQBit;
  */
 - (NSUInteger) lastIndexOfBit: (AQBit) bit;
 
+/**
+ Find the lowest index above a given index containing a specified value.
+ @param bit The bit value for which to search.
+ @param index The index after which to begin searching.
+ @return The index of the next bit with the given value, or `NSNotFound` if there is none.
+ */
+- (NSUInteger) nextIndexOfBit: (AQBit) bit afterIndex: (NSUInteger) index;
+
+/**
+ Find the highest index below a given index containing a specified value.
+ @param bit The bit value for which to search.
+ @param index The index before which to begin searching.
+ @return The index of the previous bit with the given value, or `NSNotFound` if there is none.
+ */
+- (NSUInteger) previousIndexOfBit: (AQBit) bit beforeIndex: (NSUInteger) index;
+
 /**
  Obtain a 32-bit scalar value representing a range of bits within the field.
  @param range The range from which to copy the bits.
@@ -271,6 +375,95 @@ typedef CFBit AQBit;
  */
 - (BOOL) bitsInRange: (NSRange) range maskedWith: (AQBitfield *) mask equalToBitfield: (AQBitfield *) bitfield;
 
+/// @name Set Algebra
+
+/**
+ Copy all 1 bits from another bitfield within a given range.
+ @param bitfield The bitfield with which to merge the receiver.
+ @param range The range of bits to modify. Bits outside this range are unchanged.
+ */
+- (void) unionWithBitfield: (AQBitfield *) bitfield inRange: (NSRange) range;
+
+/**
+ Store the union of the receiver and another bitfield into a destination bitfield.
+ 
+ The destination keeps its storage mode, and its existing storage is reused where possible. It may
+ be the receiver or _bitfield_.
+ @param bitfield The bitfield with which to combine the receiver.
+ @param destination The bitfield whose contents will be replaced with the result.
+ */
+- (void) unionWithBitfield: (AQBitfield *) bitfield intoBitfield: (AQBitfield *) destination;
+
+/**
+ Clear all bits which are not also set in another bitfield.
+ @param bitfield The bitfield with which to intersect the receiver.
+ */
+- (void) intersectWithBitfield: (AQBitfield *) bitfield;
+
+/**
+ Clear all bits within a range which are not also set in another bitfield.
+ @param bitfield The bitfield with which to intersect the receiver.
+ @param range The range of bits to modify. Bits outside this range are unchanged.
+ */
+- (void) intersectWithBitfield: (AQBitfield *) bitfield inRange: (NSRange) range;
+
+/**
+ Store the intersection of the receiver and another bitfield into a destination bitfield.
+ @param bitfield The bitfield with which to intersect the receiver.
+ @param destination The bitfield whose contents will be replaced with the result. This may be the receiver or _bitfield_.
+ */
+- (void) intersectWithBitfield: (AQBitfield *) bitfield intoBitfield: (AQBitfield *) destination;
+
+/**
+ Toggle every bit which is set in another bitfield, i.e. a bitwise exclusive-OR.
+ @param bitfield The bitfield whose 1 bits select the bits to toggle.
+ */
+- (void) symmetricDifferenceWithBitfield: (AQBitfield *) bitfield;
+
+/**
+ Toggle every bit within a range which is set in another bitfield.
+ @param bitfield The bitfield whose 1 bits select the bits to toggle.
+ @param range The range of bits to modify. Bits outside this range are unchanged.
+ */
+- (void) symmetricDifferenceWithBitfield: (AQBitfield *) bitfield inRange: (NSRange) range;
+
+/**
+ Store the exclusive-OR of the receiver and another bitfield into a destination bitfield.
+ @param bitfield The bitfield with which to combine the receiver.
+ @param destination The bitfield whose contents will be replaced with the result. This may be the receiver or _bitfield_.
+ */
+- (void) symmetricDifferenceWithBitfield: (AQBitfield *) bitfield intoBitfield: (AQBitfield *) destination;
+
+/**
+ Clear every bit which is set in another bitfield, i.e. `self & ~bitfield`.
+ @param bitfield The bitfield whose 1 bits select the bits to clear.
+ */
+- (void) subtractBitfield: (AQBitfield *) bitfield;
+
+/**
+ Clear every bit within a range which is set in another bitfield.
+ @param bitfield The bitfield whose 1 bits select the bits to clear.
+ @param range The range of bits to modify. Bits outside this range are unchanged.
+ */
+- (void) subtractBitfield: (AQBitfield *) bitfield inRange: (NSRange) range;
+
+/**
+ Store the receiver with another bitfield's 1 bits cleared into a destination bitfield.
+ @param bitfield The bitfield whose 1 bits select the bits to clear.
+ @param destination The bitfield whose contents will be replaced with the result. This may be the receiver or _bitfield_.
+ */
+- (void) subtractBitfield: (AQBitfield *) bitfield intoBitfield: (AQBitfield *) destination;
+
+/**
+ Store the complement of a range of the receiver into a destination bitfield.
+ 
+ Bits keep their indices, and everything outside _range_ is cleared. Use flipBitsInRange: to
+ complement bits in place.
+ @param range The range of bits to complement.
+ @param destination The bitfield whose contents will be replaced with the result. This may be the receiver.
+ */
+- (void) complementBitsInRange: (NSRange) range intoBitfield: (AQBitfield *) destination;
+
 /// Bitwise Operations
 
 /**
@@ -35,86 +35,152 @@
 
 #import "AQBitfield.h"
 #import "AQBitfieldPrivate.h"
+#import "AQRangeMethods.h"
+
+static inline NSUInteger _WordsForBits( NSUInteger bits )
+{
+	return ( AQWordIndexForBit(bits) + (AQBitOffsetInWord(bits) != 0 ? 1 : 0) );
+}
+
+// the combined range of two possibly-empty ranges
+static inline NSRange _UnionOfRanges( NSRange a, NSRange b )
+{
+	if ( a.location == NSNotFound )
+		return ( b );
+	if ( b.location == NSNotFound )
+		return ( a );
+	return ( NSUnionRange(a, b) );
+}
 
 @implementation AQBitfield
 
+- (void) _setBitsFromNSIndexSet: (NSIndexSet *) indexSet
+{
+	[indexSet enumerateRangesUsingBlock: ^(NSRange range, BOOL *stop) {
+		AQBitStorageSetRange(&_storage, range, 1);
+	}];
+}
+
 - (id) _initFromNSIndexSet: (NSIndexSet *) indexSet
 {
 	self = [self init];		// call the designated initializer like a good boy, now
 	if ( self == nil )
 		return ( nil );
 	
-	[_storage addIndexes: indexSet];
+	[self _setBitsFromNSIndexSet: indexSet];
 	
 	return ( self );
 }
 
 - (id) init
+{
+	return ( [self initWithCapacity: 0] );
+}
+
+- (id) initWithCapacity: (NSUInteger) numberOfBits
 {
 	self = [super init];
 	if ( self == nil )
 		return ( nil );
 	
-	_storage = [NSMutableIndexSet new];
+	AQBitStorageInit(&_storage, _WordsForBits(numberOfBits));
+	
+	return ( self );
+}
+
+- (id) initWithStorageMode: (AQBitfieldStorageMode) mode
+{
+	self = [self initWithCapacity: 0];
+	if ( self == nil )
+		return ( nil );
+	
+	self.storageMode = mode;
 	
 	return ( self );
 }
 
 - (id) initWith32BitField: (UInt32) bits
 {
-	self = [self init];
+	self = [self initWithCapacity: 32];
 	if ( self == nil )
 		return ( nil );
 	
-	for ( NSUInteger i = 0; bits != 0; i++, bits >>= 1 )
-	{
-		if ( (bits & 1) == 1 )
-			[_storage addIndex: i];
-	}
+	AQBitStorageWriteBits(&_storage, 0, 32, bits);
 	
 	return ( self );
 }
 
 - (id) initWith64BitField: (UInt64) bits
+{
+	self = [self initWithCapacity: 64];
+	if ( self == nil )
+		return ( nil );
+	
+	AQBitStorageWriteBits(&_storage, 0, 64, bits);
+	
+	return ( self );
+}
+
+- (id) _initWithBytes: (const UInt8 *) bytes length: (NSUInteger) length
 {
 	self = [self init];
 	if ( self == nil )
 		return ( nil );
 	
-	for ( NSUInteger i = 0; bits != 0; i++, bits >>= 1ull )
+	if ( AQBitStorageDecode(&_storage, bytes, length) == NO )
 	{
-		if ( (bits & 1ull) == 1ull )
-			[_storage addIndex: i];
+#if !USING_ARC
+		[self release];
+#endif
+		return ( nil );
 	}
 	
 	return ( self );
 }
 
+- (id) initWithData: (NSData *) data
+{
+	return ( [self _initWithBytes: (const UInt8 *)[data bytes] length: [data length]] );
+}
+
 - (id) initWithCoder: (NSCoder *) aDecoder
 {
-	self = [super init];
-	_storage = [[aDecoder decodeObjectForKey: @"bitVectorData"] mutableCopy];
+	if ( [aDecoder containsValueForKey: @"bitfieldData"] )
+	{
+		NSUInteger length = 0;
+		const uint8_t * bytes = [aDecoder decodeBytesForKey: @"bitfieldData" returnedLength: &length];
+		return ( [self _initWithBytes: bytes length: length] );
+	}
+	
+	// older archives hold an NSIndexSet instead
+	self = [self initWithStorageMode: (AQBitfieldStorageMode)[aDecoder decodeIntegerForKey: @"storageMode"]];
+	if ( self == nil )
+		return ( nil );
+	
+	[self _setBitsFromNSIndexSet: [aDecoder decodeObjectForKey: @"bitVectorData"]];
 	
 	return ( self );
 }
 
-#if !USING_ARC
 - (void) dealloc
 {
-	[_storage release];
+	AQBitStorageDestroy(&_storage);
+#if !USING_ARC
 	[super dealloc];
-}
 #endif
+}
 
 - (void) encodeWithCoder: (NSCoder *) aCoder
 {
-	[aCoder encodeObject: _storage forKey: @"bitVectorData"];
+	NSData * data = [self dataRepresentation];
+	[aCoder encodeBytes: (const uint8_t *)[data bytes] length: [data length] forKey: @"bitfieldData"];
 }
 
 - (id) copyWithZone:(NSZone *)zone
 {
 	AQBitfield * bitfield = [[[self class] alloc] init];
-	[bitfield->_storage addIndexes: _storage];
+	AQBitStorageDestroy(&bitfield->_storage);
+	AQBitStorageInitCopy(&bitfield->_storage, &_storage);
 	return ( bitfield );
 }
 
@@ -125,12 +191,12 @@
 
 - (NSString *) description
 {
-	return ( [NSString stringWithFormat: @"<AQBitfield %p>{_storage = %@}", self, _storage] );
+	return ( [NSString stringWithFormat: @"<AQBitfield %p>{_storage = %@}", self, [self indexSet]] );
 }
 
 - (NSUInteger) hash
 {
-	return ( [_storage hash] );
+	return ( AQBitStorageHash(&_storage) );
 }
 
 - (BOOL) isEqual: (id) object
@@ -139,33 +205,39 @@
 		return ( NO );
 	
 	AQBitfield * other = (AQBitfield *)object;
-	return ( [_storage isEqualToIndexSet: other->_storage] );
+	return ( AQBitStorageEqual(&_storage, &other->_storage) );
 }
 
 - (NSComparisonResult) compare: (AQBitfield *) other
 {
-	NSUInteger mine = [_storage firstIndex];
-	NSUInteger theirs = [other->_storage firstIndex];
-	
-	while ( mine != NSNotFound && theirs != NSNotFound )
-	{
-		if ( mine > theirs )
-			return ( NSOrderedDescending );
-		else if ( mine > theirs )
-			return ( NSOrderedAscending );
-	}
-	
-	if ( mine != NSNotFound && theirs == NSNotFound )
-		return ( NSOrderedDescending );
-	else if ( mine == NSNotFound && theirs != NSNotFound )
-		return ( NSOrderedAscending );
-	
-	return ( NSOrderedSame );
+	return ( AQBitStorageCompare(&_storage, &other->_storage) );
+}
+
+- (void) reserveCapacity: (NSUInteger) numberOfBits
+{
+	AQBitStorageReserve(&_storage, _WordsForBits(numberOfBits));
+}
+
+- (AQBitfieldStorageMode) storageMode
+{
+	return ( _storage.mode == AQBitStorageChunked ? AQBitfieldStorageSparse : AQBitfieldStorageDense );
+}
+
+- (void) setStorageMode: (AQBitfieldStorageMode) storageMode
+{
+	AQBitStorageSetMode(&_storage, (storageMode == AQBitfieldStorageSparse ? AQBitStorageChunked : AQBitStorageDense));
+}
+
+- (NSData *) dataRepresentation
+{
+	NSMutableData * data = [NSMutableData dataWithLength: AQBitStorageEncode(&_storage, NULL)];
+	AQBitStorageEncode(&_storage, (UInt8 *)[data mutableBytes]);
+	return ( data );
 }
 
 - (NSUInteger) count
 {
-	NSUInteger last = [_storage lastIndex];
+	NSUInteger last = AQBitStorageLastIndex(&_storage, 1);
 	if ( last == NSNotFound )
 		return ( 0 );
 	
@@ -174,40 +246,49 @@
 
 - (NSRange) rangeOfAllBits
 {
-	if ( [_storage count] == 0 )
+	NSUInteger first = AQBitStorageFirstIndex(&_storage, 1);
+	if ( first == NSNotFound )
 		return ( NSMakeRange(NSNotFound, 0) );
 	
-	return ( NSMakeRange([_storage firstIndex], [_storage lastIndex]-[_storage firstIndex]) );
+	return ( NSMakeRange(first, AQBitStorageLastIndex(&_storage, 1) - first + 1) );
 }
 
 - (NSUInteger) countOfBit: (AQBit) bit inRange: (NSRange) range
 {
+	range = AQBitStorageClampRange(range);
+	NSUInteger ones = AQBitStorageCountOnes(&_storage, range);
 	if ( bit )
-		return ( [_storage countOfIndexesInRange: range] );
-	else
-		return ( range.length - [_storage countOfIndexesInRange: range] );
+		return ( ones );
+	
+	return ( range.length - ones );
 }
 
 - (BOOL) containsBit: (AQBit) bit inRange: (NSRange) range
 {
-	if ( bit )
-		return ( [_storage containsIndexesInRange: range] );
+	range = AQBitStorageClampRange(range);
+	if ( range.length == 0 )
+		return ( NO );
 	
-	return ( [_storage countOfIndexesInRange: range] < range.length );
+	// stops at the first match rather than counting the whole range
+	return ( AQBitStorageNextIndex(&_storage, range.location, bit) < NSMaxRange(range) );
 }
 
 - (AQBit) bitAtIndex: (NSUInteger) index
 {
-	if ( [_storage containsIndex: index] )
-		return ( 1 );
-	
-	return ( 0 );
+	return ( AQBitStorageBitAtIndex(&_storage, index) );
 }
 
 - (AQBitfield *) bitfieldFromRange: (NSRange) range
 {
+	if ( range.location > NSNotFound || range.length > NSNotFound - range.location )
+		[NSException raise: NSRangeException format: @"Range %@ supplied to -%@ lies beyond the end of any bitfield", NSStringFromRange(range), NSStringFromSelector(_cmd)];
+	
+	// bits keep their original indices, everything outside the range is cleared
 	AQBitfield * result = [[AQBitfield alloc] init];
-	[result->_storage addIndexes: [_storage indexesInRange: range options: 0 passingTest:^BOOL(NSUInteger idx, BOOL *stop) { return YES; }]];
+	AQBitStorageDestroy(&result->_storage);
+	AQBitStorageInitCopy(&result->_storage, &_storage);
+	AQBitStorageSetRange(&result->_storage, NSMakeRange(0, range.location), 0);
+	AQBitStorageSetRange(&result->_storage, NSMakeRange(NSMaxRange(range), NSNotFound - NSMaxRange(range)), 0);
 #if USING_ARC
 	return ( result );
 #else
@@ -215,43 +296,55 @@
 #endif
 }
 
-- (NSUInteger) firstIndexOfBit: (AQBit) bit
+- (AQBitfield *) bitfieldByExtractingBitsInRange: (NSRange) range
 {
-	if ( bit )
-		return ( [_storage firstIndex] );
-	
-	__block NSUInteger result = 0;
+	AQBitfield * result = [[AQBitfield alloc] init];
+	[self extractBitsInRange: range intoBitfield: result];
+#if USING_ARC
+	return ( result );
+#else
+	return ( [result autorelease] );
+#endif
+}
+
+- (void) extractBitsInRange: (NSRange) range intoBitfield: (AQBitfield *) destination
+{
+	if ( range.location > NSNotFound || range.length > NSNotFound - range.location )
+		[NSException raise: NSRangeException format: @"Range %@ supplied to -%@ lies beyond the end of any bitfield", NSStringFromRange(range), NSStringFromSelector(_cmd)];
 	
-	[_storage enumerateRangesUsingBlock: ^(NSRange range, BOOL *stop) {
-		if ( range.location == 0 )
-			result = NSMaxRange(range);
-		*stop = YES;
-	}];
+	NSRange before = [destination rangeOfAllBits];
+	[destination _willUpdateBitsInRange: _UnionOfRanges(before, NSMakeRange(0, range.length))];
+	AQBitStorageExtract(&destination->_storage, &_storage, range);
 	
-	return ( result );
+	NSRange changed = _UnionOfRanges(before, [destination rangeOfAllBits]);
+	if ( changed.location != NSNotFound )
+		[destination _updatedBitsInRange: changed];
+}
+
+- (NSUInteger) firstIndexOfBit: (AQBit) bit
+{
+	return ( AQBitStorageFirstIndex(&_storage, bit) );
 }
 
 - (NSUInteger) lastIndexOfBit: (AQBit) bit
 {
-	if ( bit )
-		return ( [_storage lastIndex] );
-	
-	__block NSUInteger result = NSNotFound;
-	
-	[_storage enumerateRangesWithOptions: NSEnumerationReverse usingBlock: ^(NSRange range, BOOL *stop) {
-		if ( NSMaxRange(range) < NSNotFound-1 )
-		{
-			result = NSNotFound-1;
-		}
-		else if ( range.location > 0 )
-		{
-			result = range.location-1;
-		}
-		
-		*stop = YES;
-	}];
+	return ( AQBitStorageLastIndex(&_storage, bit) );
+}
+
+- (NSUInteger) nextIndexOfBit: (AQBit) bit afterIndex: (NSUInteger) index
+{
+	if ( index >= NSNotFound - 1 )
+		return ( NSNotFound );
 	
-	return ( result );
+	return ( AQBitStorageNextIndex(&_storage, index + 1, bit) );
+}
+
+- (NSUInteger) previousIndexOfBit: (AQBit) bit beforeIndex: (NSUInteger) index
+{
+	if ( index == 0 )
+		return ( NSNotFound );
+	
+	return ( AQBitStoragePreviousIndex(&_storage, MIN(index - 1, NSNotFound - 1), bit) );
 }
 
 - (UInt32) scalarBitsFromRange: (NSRange) range
@@ -262,14 +355,7 @@
 		[NSException raise: NSRangeException format: @"%@ specifies a range larger than the size of a 32-bit quantity", NSStringFromRange(range)];
 	}
 	
-	__block UInt32 result = 0;
-	
-	[_storage enumerateIndexesInRange: range options: 0 usingBlock: ^(NSUInteger idx, BOOL *stop) {
-		idx -= range.location;
-		result |= (1 << idx);
-	}];
-	
-	return ( result );
+	return ( (UInt32)AQBitStorageReadBits(&_storage, range.location, range.length) );
 }
 
 - (UInt64) scalarBitsFrom64BitRange: (NSRange) range
@@ -280,145 +366,194 @@
 		[NSException raise: NSRangeException format: @"%@ specifies a range larger than the size of a 64-bit quantity", NSStringFromRange(range)];
 	}
 	
-	__block UInt64 result = 0ull;
-	
-	[_storage enumerateIndexesInRange: range options: 0 usingBlock: ^(NSUInteger idx, BOOL *stop) {
-		idx -= (UInt64)range.location;
-		result |= (1ull << idx);
-	}];
-	
-	return ( result );
+	return ( AQBitStorageReadBits(&_storage, range.location, range.length) );
 }
 
 - (void) flipBitAtIndex: (NSUInteger) index
 {
-	if ( [_storage containsIndex: index] )
-		[_storage removeIndex: index];
-	else
-		[_storage addIndex: index];
-	
+	[self _willUpdateBitsInRange: NSMakeRange(index, 1)];
+	AQBitStorageFlipRange(&_storage, NSMakeRange(index, 1));
 	[self _updatedBitsInRange: NSMakeRange(index, 1)];
 }
 
 - (void) flipBitsInRange: (NSRange) range
 {
-	for ( NSUInteger i = range.location; i < NSMaxRange(range); i++ )
-	{
-		if ( [_storage containsIndex: i] )
-			[_storage removeIndex: i];
-		else
-			[_storage addIndex: i];
-	}
-	
+	[self _willUpdateBitsInRange: range];
+	AQBitStorageFlipRange(&_storage, range);
 	[self _updatedBitsInRange: range];
 }
 
 - (void) setBit: (AQBit) bit atIndex: (NSUInteger) index
 {
-	if ( bit )
-		[_storage addIndex: index];
-	else
-		[_storage removeIndex: index];
-	
+	[self _willUpdateBitsInRange: NSMakeRange(index, 1)];
+	AQBitStorageSetBit(&_storage, index, bit);
 	[self _updatedBitsInRange: NSMakeRange(index, 1)];
 }
 
 - (void) setBitsInRange: (NSRange) range usingBit: (AQBit) bit
 {
-	if ( bit )
-		[_storage addIndexesInRange: range];
-	else
-		[_storage removeIndexesInRange: range];
-	
+	[self _willUpdateBitsInRange: range];
+	AQBitStorageSetRange(&_storage, range, bit);
 	[self _updatedBitsInRange: range];
 }
 
 - (void) setBitsFrom32BitValue: (UInt32) value
 {
-	NSUInteger i = 0;
-	for ( i = 0; i < 32; i++, value >>= 1 )
-	{
-		if ( (value & 1) == 1 )
-			[_storage addIndex: i];
-		else
-			[_storage removeIndex: i];
-	}
-	
-	[self _updatedBitsInRange: NSMakeRange(0, i)];
+	[self _willUpdateBitsInRange: NSMakeRange(0, 32)];
+	AQBitStorageWriteBits(&_storage, 0, 32, value);
+	[self _updatedBitsInRange: NSMakeRange(0, 32)];
 }
 
 - (void) setBitsFrom64BitValue: (UInt64) value
 {
-	NSUInteger i = 0;
-	for ( i = 0; i < 64; i++, value >>= 1 )
-	{
-		if ( (value & 1) == 1 )
-			[_storage addIndex: i];
-		else
-			[_storage removeIndex: i];
-	}
-	
-	[self _updatedBitsInRange: NSMakeRange(0, i)];
+	[self _willUpdateBitsInRange: NSMakeRange(0, 64)];
+	AQBitStorageWriteBits(&_storage, 0, 64, value);
+	[self _updatedBitsInRange: NSMakeRange(0, 64)];
 }
 
 - (void) setBitsInRange: (NSRange) range from32BitValue: (UInt32) value
 {
 	if ( range.length > 32 )
-		[NSException raise: NSInvalidArgumentException format: @"Range supplied to -%@ must have a length of 32 or less (received range %@)", NSStringFromClass([self class]), NSStringFromRange(range)];
+		[NSException raise: NSInvalidArgumentException format: @"Range supplied to -%@ must have a length of 32 or less (received range %@)", NSStringFromSelector(_cmd), NSStringFromRange(range)];
 	
-	NSUInteger i = 0;
-	for ( i = 0; i < range.length; i++, value >>= 1 )
-	{
-		if ( (value & 1) == 1 )
-			[_storage addIndex: range.location + i];
-		else
-			[_storage removeIndex: range.location + i];
-	}
-	
-	[self _updatedBitsInRange: NSMakeRange(range.location, i)];
+	[self _willUpdateBitsInRange: range];
+	AQBitStorageWriteBits(&_storage, range.location, range.length, value);
+	[self _updatedBitsInRange: range];
 }
 
 - (void) setBitsInRange: (NSRange) range from64BitValue: (UInt64) value
 {
 	if ( range.length > 64 )
-		[NSException raise: NSInvalidArgumentException format: @"Range supplied to -%@ must have a length of 64 or less (received range %@)", NSStringFromClass([self class]), NSStringFromRange(range)];
+		[NSException raise: NSInvalidArgumentException format: @"Range supplied to -%@ must have a length of 64 or less (received range %@)", NSStringFromSelector(_cmd), NSStringFromRange(range)];
 	
-	NSUInteger i = 0;
-	for ( i = 0; i < range.length; i++, value >>= 1 )
-	{
-		if ( (value & 1) == 1 )
-			[_storage addIndex: range.location + i];
-		else
-			[_storage removeIndex: range.location + i];
-	}
-	
-	[self _updatedBitsInRange: NSMakeRange(range.location, i)];
+	[self _willUpdateBitsInRange: range];
+	AQBitStorageWriteBits(&_storage, range.location, range.length, value);
+	[self _updatedBitsInRange: range];
 }
 
 - (void) unionWithBitfield: (AQBitfield *) bitfield
 {
-	[_storage addIndexes: bitfield->_storage];
-	[self _updatedBitsInRange: [bitfield rangeOfAllBits]];
+	NSRange changed = [bitfield rangeOfAllBits];
+	if ( changed.location != NSNotFound )
+		[self _willUpdateBitsInRange: changed];
+	
+	AQBitStorageOr(&_storage, &bitfield->_storage);
+	
+	if ( changed.location != NSNotFound )
+		[self _updatedBitsInRange: changed];
 }
 
-- (void) setAllBits: (AQBit) bit
+- (void) _combineWithBitfield: (AQBitfield *) bitfield operation: (AQBitOperation) op inRange: (NSRange) range
 {
-	[_storage addIndexesInRange: NSMakeRange(0, NSNotFound)];
-	[self _updatedBitsInRange: NSMakeRange(0, NSNotFound)];
+	// an intersection can only clear the receiver's own 1 bits; everything else only touches the other's
+	NSRange changed = (op == AQBitOperationAnd ? [self rangeOfAllBits] : [bitfield rangeOfAllBits]);
+	
+	range = AQBitStorageClampRange(range);
+	if ( changed.location != NSNotFound )
+		changed = NSIntersectionRange(changed, range);
+	if ( changed.length != 0 )
+		[self _willUpdateBitsInRange: changed];
+	
+	if ( range.location == 0 && NSMaxRange(range) == NSNotFound )
+		AQBitStorageCombine(&_storage, &_storage, &bitfield->_storage, op);
+	else
+		AQBitStorageCombineRange(&_storage, &bitfield->_storage, op, range);
+	
+	if ( changed.length != 0 )
+		[self _updatedBitsInRange: changed];
 }
 
-- (NSMutableIndexSet *) _zeroBasedIndexSetForIndexesInRange: (NSRange) range
+- (void) _combineWithBitfield: (AQBitfield *) bitfield operation: (AQBitOperation) op intoBitfield: (AQBitfield *) destination
 {
-	NSMutableIndexSet * tmp = [_storage mutableCopy];
-	[tmp removeIndexesInRange: NSMakeRange(NSMaxRange(range), NSUIntegerMax-NSMaxRange(range))];
-	if ( range.location != 0 )
-		[tmp shiftIndexesStartingAtIndex: range.location by: -(NSInteger)(range.location)];
+	NSRange before = [destination rangeOfAllBits];
+	
+	// the result can only have bits where one of the operands does
+	[destination _willUpdateBitsInRange: _UnionOfRanges(before, _UnionOfRanges([self rangeOfAllBits], [bitfield rangeOfAllBits]))];
+	AQBitStorageCombine(&destination->_storage, &_storage, &bitfield->_storage, op);
+	
+	NSRange changed = _UnionOfRanges(before, [destination rangeOfAllBits]);
+	if ( changed.location != NSNotFound )
+		[destination _updatedBitsInRange: changed];
+}
 
-#if USING_ARC
-	return ( tmp );
-#else
-	return ( [tmp autorelease] );
-#endif
+- (void) unionWithBitfield: (AQBitfield *) bitfield inRange: (NSRange) range
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationOr inRange: range];
+}
+
+- (void) unionWithBitfield: (AQBitfield *) bitfield intoBitfield: (AQBitfield *) destination
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationOr intoBitfield: destination];
+}
+
+- (void) intersectWithBitfield: (AQBitfield *) bitfield
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationAnd inRange: NSMakeRange(0, NSNotFound)];
+}
+
+- (void) intersectWithBitfield: (AQBitfield *) bitfield inRange: (NSRange) range
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationAnd inRange: range];
+}
+
+- (void) intersectWithBitfield: (AQBitfield *) bitfield intoBitfield: (AQBitfield *) destination
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationAnd intoBitfield: destination];
+}
+
+- (void) symmetricDifferenceWithBitfield: (AQBitfield *) bitfield
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationXor inRange: NSMakeRange(0, NSNotFound)];
+}
+
+- (void) symmetricDifferenceWithBitfield: (AQBitfield *) bitfield inRange: (NSRange) range
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationXor inRange: range];
+}
+
+- (void) symmetricDifferenceWithBitfield: (AQBitfield *) bitfield intoBitfield: (AQBitfield *) destination
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationXor intoBitfield: destination];
+}
+
+- (void) subtractBitfield: (AQBitfield *) bitfield
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationAndNot inRange: NSMakeRange(0, NSNotFound)];
+}
+
+- (void) subtractBitfield: (AQBitfield *) bitfield inRange: (NSRange) range
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationAndNot inRange: range];
+}
+
+- (void) subtractBitfield: (AQBitfield *) bitfield intoBitfield: (AQBitfield *) destination
+{
+	[self _combineWithBitfield: bitfield operation: AQBitOperationAndNot intoBitfield: destination];
+}
+
+- (void) complementBitsInRange: (NSRange) range intoBitfield: (AQBitfield *) destination
+{
+	NSRange before = [destination rangeOfAllBits];
+	
+	// copy into the destination's existing storage, then flip the range and clear around it
+	range = AQBitStorageClampRange(range);
+	[destination _willUpdateBitsInRange: _UnionOfRanges(before, range)];
+	AQBitStorageCombine(&destination->_storage, &_storage, &_storage, AQBitOperationOr);
+	AQBitStorageFlipRange(&destination->_storage, range);
+	AQBitStorageSetRange(&destination->_storage, NSMakeRange(0, range.location), 0);
+	if ( NSMaxRange(range) != NSNotFound )
+		AQBitStorageSetRange(&destination->_storage, NSMakeRange(NSMaxRange(range), NSNotFound - NSMaxRange(range)), 0);
+	
+	NSRange changed = _UnionOfRanges(before, [destination rangeOfAllBits]);
+	if ( changed.location != NSNotFound )
+		[destination _updatedBitsInRange: changed];
+}
+
+- (void) setAllBits: (AQBit) bit
+{
+	[self _willUpdateBitsInRange: NSMakeRange(0, NSNotFound)];
+	AQBitStorageSetRange(&_storage, NSMakeRange(0, NSNotFound), bit);
+	[self _updatedBitsInRange: NSMakeRange(0, NSNotFound)];
 }
 
 - (BOOL) bitsInRange: (NSRange) range matchBits: (NSUInteger) bits
@@ -426,22 +561,9 @@
 	NSParameterAssert(range.length <= sizeof(NSUInteger)*8);
 	if ( range.length == 0 )
 		return ( NO );
-	if ( bits == 0 )
-		return ( [self countOfBit: 1 inRange: range] == 0 );
 	
-	NSMutableIndexSet * tmp = [self _zeroBasedIndexSetForIndexesInRange: range];
-	NSUInteger i;
-	
-	for ( i = 0; bits > 0; i++, bits >>= 1 )
-	{
-		if ( (((bits & 1) == 1) && ([tmp containsIndex: i] == NO)) ||
-			(((bits & 1) != 1) && ([tmp containsIndex: i] == YES)) )
-		{
-			return ( NO );
-		}
-	}
-	
-	return ( [tmp indexGreaterThanIndex: i] == NSNotFound );
+	// any bits of the value beyond the range's length can never match
+	return ( AQBitStorageReadBits(&_storage, range.location, range.length) == (UInt64)bits );
 }
 
 - (BOOL) bitsInRange: (NSRange) range equalToBitfield: (AQBitfield *) bitfield
@@ -449,8 +571,10 @@
 	if ( range.length == 0 )
 		return ( NO );
 	
-	NSMutableIndexSet * tmp = [self _zeroBasedIndexSetForIndexesInRange: range];
-	return ( [tmp isEqualToIndexSet: bitfield->_storage] );
+	if ( AQBitStorageNextRun(&bitfield->_storage, range.length).location != NSNotFound )
+		return ( NO );
+	
+	return ( AQBitStorageMaskedEqual(&_storage, range.location, range.length, &bitfield->_storage, NULL) );
 }
 
 - (BOOL) bitsInRange: (NSRange) range maskedWith: (NSUInteger) mask matchBits: (NSUInteger) bits
@@ -459,49 +583,26 @@
 	if ( range.length == 0 )
 		return ( NO );
 	
-	NSMutableIndexSet * tmp = [self _zeroBasedIndexSetForIndexesInRange: range];
-	NSUInteger i;
-	for ( i = 0; bits > 0 && mask > 0; i++, bits >>= 1, mask >>= 1 )
-	{
-		// skip bits not matching the mask
-		if ( (mask & 1) == 0 )
-			continue;
-		
-		if ( (((bits & 1) == 1) && ([tmp containsIndex: i] == NO)) ||
-			 (((bits & 1) != 1) && ([tmp containsIndex: i] == YES)) )
-		{
-			return ( NO );
-		}
-	}
-	
-	return ( (mask == 0) || [tmp indexGreaterThanIndex: i] == NSNotFound );
+	UInt64 value = AQBitStorageReadBits(&_storage, range.location, range.length);
+	return ( ((value ^ (UInt64)bits) & (UInt64)mask & AQLowBitMask(range.length)) == 0ull );
 }
 
 - (BOOL) bitsInRange: (NSRange) range maskedWith: (AQBitfield *) mask equalToBitfield: (AQBitfield *) bitfield
 {
 	if ( range.length == 0 )
 		return ( NO );
+	if ( range.location > NSNotFound || range.length > NSNotFound - range.location )
+		[NSException raise: NSRangeException format: @"Range %@ supplied to -%@ lies beyond the end of any bitfield", NSStringFromRange(range), NSStringFromSelector(_cmd)];
 	
-	AQBitfield * tmp1 = [self bitfieldFromRange: range];
-	[tmp1 shiftBitsLeftBy: range.location];
-	[tmp1 maskWithBits: mask];
-	
-	AQBitfield * tmp2 = [bitfield copy];
-#if !USING_ARC
-	[tmp2 autorelease];
-#endif
-	[tmp2 maskWithBits: mask];
-	[tmp2->_storage removeIndexesInRange: NSMakeRange(range.length, NSUIntegerMax-range.length)];
-	
-	return ( [tmp1 isEqual: tmp2] );
+	return ( AQBitStorageMaskedEqual(&_storage, range.location, range.length, &bitfield->_storage, &mask->_storage) );
 }
 
 - (void) shiftBitsLeftBy: (NSUInteger) bits
 {
-	if ( [_storage count] == 0 )
+	NSRange myRange = [self rangeOfAllBits];
+	if ( myRange.location == NSNotFound )
 		return;
 	
-	NSRange myRange = [self rangeOfAllBits];
 	if ( myRange.location > bits )
 	{
 		myRange.location -= bits;
@@ -513,79 +614,30 @@
 		myRange.location = 0;
 	}
 	
-	NSInteger shift = 0 - (NSInteger)bits;
-	[_storage shiftIndexesStartingAtIndex: bits by: shift];
+	[self _willUpdateBitsInRange: myRange];
+	AQBitStorageShiftDown(&_storage, bits);
 	[self _updatedBitsInRange: myRange];
 }
 
 - (void) shiftBitsRightBy: (NSUInteger) bits
 {
-	if ( [_storage count] == 0 )
+	NSRange myRange = [self rangeOfAllBits];
+	if ( myRange.location == NSNotFound )
 		return;
 	
-	NSRange myRange = [self rangeOfAllBits];
-	if ( NSMaxRange(myRange) + bits < NSNotFound )
-	{
+	if ( bits < NSNotFound - NSMaxRange(myRange) )
 		myRange.length += bits;
-	}
 	else
-	{
-		myRange.length += NSMaxRange(myRange) - NSNotFound;
-	}
+		myRange.length = NSNotFound - myRange.location;
 	
-	[_storage shiftIndexesStartingAtIndex: 0 by: (NSInteger)bits];
+	[self _willUpdateBitsInRange: myRange];
+	AQBitStorageShiftUp(&_storage, bits);
 	[self _updatedBitsInRange: myRange];
 }
 
 - (void) maskWithBits: (AQBitfield *) mask
 {
-	NSRange range = NSMakeRange(0, MIN(self.count, mask.count));
-	__block NSRange changed = {0, 0};
-	
-	if ( [mask->_storage respondsToSelector: @selector(enumerateRangesUsingBlock:)] )
-	{
-		__block NSUInteger negativeRangeLocation = 0;
-		[mask->_storage enumerateRangesInRange: range options: 0 usingBlock: ^(NSRange range, BOOL *stop) {
-			if ( range.location > negativeRangeLocation )
-			{
-				NSRange r = NSMakeRange(negativeRangeLocation, range.location - negativeRangeLocation);
-				[_storage removeIndexesInRange: r];
-				changed = NSUnionRange(changed, r);
-			}
-			negativeRangeLocation = NSMaxRange(range);
-		}];
-		
-		if ( negativeRangeLocation <= [_storage lastIndex] )
-		{
-			NSRange r = NSMakeRange(negativeRangeLocation, NSUIntegerMax-negativeRangeLocation);
-			[_storage removeIndexesInRange: r];
-			changed = NSUnionRange(changed, r);
-		}
-	}
-	else
-	{
-		__block NSRange negativeRange = NSMakeRange(0, 0);
-		[mask->_storage enumerateIndexesInRange: range options: 0 usingBlock: ^(NSUInteger idx, BOOL *stop) {
-			if ( idx != 0 && NSMaxRange(negativeRange) < idx-1 )
-			{
-				// expand negative range to fill the area below current index and remove all indices from local storage
-				negativeRange.length = idx-negativeRange.location;
-				[_storage removeIndexesInRange: negativeRange];
-				changed = NSUnionRange(changed, negativeRange);
-			}
-			
-			negativeRange.location = idx+1;
-		}];
-		
-		if ( negativeRange.location <= [_storage lastIndex] )
-		{
-			negativeRange.length = [_storage lastIndex] - negativeRange.location;
-			[_storage removeIndexesInRange: negativeRange];
-			changed = NSUnionRange(changed, negativeRange);
-		}
-	}
-	
-	[self _updatedBitsInRange: changed];
+	[self intersectWithBitfield: mask];
 }
 
 - (AQBitfield *) bitfieldUsingMask: (AQBitfield *) mask
@@ -638,13 +690,25 @@
 
 @implementation AQBitfield (_PrivateIndexSetAccess)
 
-- (NSMutableIndexSet *) indexSet
+- (NSIndexSet *) indexSet
 {
-#if USING_ARC
-	return ( _storage );
-#else
-	return ( [[_storage retain] autorelease] );
-#endif
+	NSMutableIndexSet * result = [NSMutableIndexSet indexSet];
+	
+	NSRange run = AQBitStorageNextRun(&_storage, 0);
+	while ( run.location != NSNotFound )
+	{
+		[result addIndexesInRange: run];
+		if ( NSMaxRange(run) >= NSNotFound )
+			break;
+		run = AQBitStorageNextRun(&_storage, NSMaxRange(run));
+	}
+	
+	return ( result );
+}
+
+- (void) _willUpdateBitsInRange: (NSRange) range
+{
+	// this class does nothing-- it's for subclassers to implement
 }
 
 - (void) _updatedBitsInRange: (NSRange) range
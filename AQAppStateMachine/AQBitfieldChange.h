@@ -0,0 +1,81 @@
+//
+//  AQBitfieldChange.h
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-14.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import <Foundation/Foundation.h>
+
+@class AQBitfield;
+
+/**
+ An immutable record of a modification to a range of bits, captured as the modification was made.
+ 
+ The bits are held relative to the start of the range, so bit `0` of bitsBefore and bitsAfter
+ corresponds to the first bit of range. Notification blocks can use these values directly rather than
+ reading them back from the bitfield, which may have been modified again by the time they run.
+ */
+@interface AQBitfieldChange : NSObject <NSCopying>
+
+/**
+ Initialize a change record.
+ 
+ This is the designated initializer for the AQBitfieldChange class.
+ @param range The range of bits described by the change.
+ @param before A zero-based bitfield holding the values of the bits within _range_ before the modification.
+ @param after A zero-based bitfield holding the values of the bits within _range_ after the modification.
+ @return A new change record.
+ */
+- (id) initWithRange: (NSRange) range bitsBefore: (AQBitfield *) before bitsAfter: (AQBitfield *) after;
+
+/// The range of bits described by the change.
+@property (nonatomic, readonly) NSRange range;
+
+/// The values of the bits within range before the modification, as a zero-based bitfield.
+@property (nonatomic, readonly) AQBitfield * bitsBefore;
+
+/// The values of the bits within range after the modification, as a zero-based bitfield.
+@property (nonatomic, readonly) AQBitfield * bitsAfter;
+
+/// The first 64 bits of the range before the modification, as a scalar value.
+@property (nonatomic, readonly) UInt64 valueBefore;
+
+/// The first 64 bits of the range after the modification, as a scalar value.
+@property (nonatomic, readonly) UInt64 valueAfter;
+
+/**
+ Determine whether the modification actually changed any bits.
+ @return `YES` if any bit within range has a different value afterwards, `NO` if they were all rewritten with their existing values.
+ */
+- (BOOL) changedAnyBits;
+
+@end
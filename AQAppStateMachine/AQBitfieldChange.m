@@ -0,0 +1,133 @@
+//
+//  AQBitfieldChange.m
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-14.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQBitfieldChange.h"
+#import "AQBitfield.h"
+
+@implementation AQBitfieldChange
+{
+	AQBitfield *	_before;
+	AQBitfield *	_after;
+}
+
+@synthesize range=_range;
+
+- (id) init
+{
+	AQBitfield * empty = [AQBitfield new];
+	self = [self initWithRange: NSMakeRange(0, 0) bitsBefore: empty bitsAfter: empty];
+#if !USING_ARC
+	[empty release];
+#endif
+	return ( self );
+}
+
+- (id) initWithRange: (NSRange) range bitsBefore: (AQBitfield *) before bitsAfter: (AQBitfield *) after
+{
+	NSParameterAssert(before != nil && after != nil);
+	
+	self = [super init];
+	if ( self == nil )
+		return ( nil );
+	
+	// copies share storage with the originals, so these are cheap
+	_range = range;
+	_before = [before copy];
+	_after = [after copy];
+	
+	return ( self );
+}
+
+- (void) dealloc
+{
+#if !USING_ARC
+	[_before release];
+	[_after release];
+	[super dealloc];
+#endif
+}
+
+- (id) copyWithZone: (NSZone *) zone
+{
+	// immutable, so the same object will do
+#if USING_ARC
+	return ( self );
+#else
+	return ( [self retain] );
+#endif
+}
+
+- (NSString *) description
+{
+	return ( [NSString stringWithFormat: @"<AQBitfieldChange %p>{range = %@, before = %@, after = %@}", self, NSStringFromRange(_range), _before, _after] );
+}
+
+- (AQBitfield *) bitsBefore
+{
+	// hand out a copy, so nobody can modify ours
+	AQBitfield * result = [_before copy];
+#if USING_ARC
+	return ( result );
+#else
+	return ( [result autorelease] );
+#endif
+}
+
+- (AQBitfield *) bitsAfter
+{
+	AQBitfield * result = [_after copy];
+#if USING_ARC
+	return ( result );
+#else
+	return ( [result autorelease] );
+#endif
+}
+
+- (UInt64) valueBefore
+{
+	return ( [_before scalarBitsFrom64BitRange: NSMakeRange(0, MIN(_range.length, (NSUInteger)64))] );
+}
+
+- (UInt64) valueAfter
+{
+	return ( [_after scalarBitsFrom64BitRange: NSMakeRange(0, MIN(_range.length, (NSUInteger)64))] );
+}
+
+- (BOOL) changedAnyBits
+{
+	return ( [_before isEqual: _after] == NO );
+}
+
+@end
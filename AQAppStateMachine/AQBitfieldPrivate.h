@@ -35,8 +35,19 @@
 
 #import <Foundation/Foundation.h>
 #import "AQBitfield.h"
+#import "AQBitfieldStorage.h"
+
+@interface AQBitfield ()
+{
+@package
+	AQBitStorage	_storage;
+}
+@end
 
 @interface AQBitfield (_PrivateIndexSetAccess)
-@property (nonatomic, readonly) NSMutableIndexSet * indexSet;
+// builds a new index set from the bitfield's contents
+@property (nonatomic, readonly) NSIndexSet * indexSet;
+// called before and after every modification; the range passed beforehand covers everything which may change
+- (void) _willUpdateBitsInRange: (NSRange) range;
 - (void) _updatedBitsInRange: (NSRange) range;
 @end
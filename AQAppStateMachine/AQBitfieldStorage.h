@@ -0,0 +1,250 @@
+//
+//  AQBitfieldStorage.h
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-12.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import <Foundation/Foundation.h>
+
+/*
+ Word storage used by AQBitfield.
+ 
+ Bits are stored least-significant first in 64-bit words, using one of two layouts:
+ 
+ - Dense storage keeps a contiguous array of words. Every word at or above `count` reads as `fill`.
+ - Chunked storage splits the index space into 64K-bit chunks, and only allocates the chunks whose
+   contents differ from `fill`. Each chunk holds its bits in whichever container is smallest for
+   its density: a sorted array of indices, a 1024-word bitmap, or a list of runs.
+ 
+ In both layouts `fill` is always either all-zeroes or all-ones. This allows a bitfield to represent
+ ranges running all the way up to `NSNotFound` (such as those created by -setAllBits:) without
+ actually allocating them.
+ 
+ Copies share their word array, chunk list and chunk contents with the original. Whichever side
+ is modified first takes a private copy of what it changes: the whole word array for dense storage,
+ or the chunk list plus just the affected chunks for chunked storage.
+ 
+ None of these functions are thread-safe; AQBitfield and its subclasses provide any locking required.
+ Separate storage structures which share memory may safely be used from different threads, however.
+ */
+
+/// The number of bits held in a single storage word.
+#define AQBitsPerWord		64
+
+/// The index of the storage word containing a given bit index.
+#define AQWordIndexForBit(bit)		((NSUInteger)(bit) >> 6)
+
+/// The position of a bit within its storage word.
+#define AQBitOffsetInWord(bit)		((NSUInteger)(bit) & 63)
+
+typedef enum
+{
+	AQBitOperationAnd,
+	AQBitOperationOr,
+	AQBitOperationXor,
+	AQBitOperationAndNot		// a & ~b
+	
+} AQBitOperation;
+
+typedef enum
+{
+	AQBitStorageDense,
+	AQBitStorageChunked
+	
+} AQBitStorageMode;
+
+// defined privately by AQBitfieldStorage.m
+typedef struct AQBitChunk AQBitChunk;
+
+/**
+ Supplies the word array for dense storage from somewhere other than the heap, such as a memory-mapped
+ file. Storage with a backing is always dense, and never shares its words with any copies.
+ */
+typedef struct AQBitStorageBacking
+{
+	/**
+	 Called before every modification. Returns a word array of at least _capacity_ words, which must
+	 begin with the contents of the current array, and stores its actual size in _newCapacity_.
+	 */
+	UInt64 * (*prepareForWriting)( struct AQBitStorageBacking * backing, NSUInteger capacity, NSUInteger * newCapacity );
+	void * info;
+	
+} AQBitStorageBacking;
+
+typedef struct AQBitStorage
+{
+	AQBitStorageMode	mode;
+	UInt64 *		words;			// dense: the word array
+	NSUInteger		count;			// dense: number of words in use
+	NSUInteger		capacity;		// dense: number of words allocated
+	AQBitChunk *	chunks;			// chunked: allocated chunks, sorted by position
+	NSUInteger		chunkCount;		// chunked: number of chunks in use
+	NSUInteger		chunkCapacity;	// chunked: number of chunks allocated
+	UInt64			fill;			// value of every word not held in words or chunks; either 0 or ~0
+	AQBitStorageBacking *	backing;	// dense: supplies the word array in place of the heap, if set
+} AQBitStorage;
+
+/// Returns a mask containing the _n_ least-significant bits. _n_ may be anywhere from 0 to 64.
+static inline UInt64 AQLowBitMask( NSUInteger n )
+{
+	return ( n >= AQBitsPerWord ? ~0ull : ((1ull << n) - 1ull) );
+}
+
+/// Trims a range so that it doesn't extend beyond the last valid bit index (`NSNotFound-1`).
+static inline NSRange AQBitStorageClampRange( NSRange range )
+{
+	if ( range.location >= NSNotFound )
+		return ( NSMakeRange(NSNotFound, 0) );
+	if ( range.length > NSNotFound - range.location )
+		range.length = NSNotFound - range.location;
+	return ( range );
+}
+
+/// Looks up a word in chunked storage. Use AQBitStorageWordAtIndex() instead.
+extern UInt64 AQBitStorageChunkedWordAtIndex( const AQBitStorage * s, NSUInteger wordIndex );
+
+/// Returns the word at a given index, including those implied by the storage's fill value.
+static inline UInt64 AQBitStorageWordAtIndex( const AQBitStorage * s, NSUInteger wordIndex )
+{
+	if ( s->mode == AQBitStorageChunked )
+		return ( AQBitStorageChunkedWordAtIndex(s, wordIndex) );
+	return ( wordIndex < s->count ? s->words[wordIndex] : s->fill );
+}
+
+/// Returns the value of the bit at a given index.
+static inline CFBit AQBitStorageBitAtIndex( const AQBitStorage * s, NSUInteger index )
+{
+	return ( (CFBit)((AQBitStorageWordAtIndex(s, AQWordIndexForBit(index)) >> AQBitOffsetInWord(index)) & 1ull) );
+}
+
+/// Reads up to 64 bits starting at _location_ into the least-significant bits of the result.
+static inline UInt64 AQBitStorageReadBits( const AQBitStorage * s, NSUInteger location, NSUInteger length )
+{
+	if ( length == 0 )
+		return ( 0ull );
+	
+	NSUInteger wordIndex = AQWordIndexForBit(location);
+	NSUInteger shift = AQBitOffsetInWord(location);
+	UInt64 result = AQBitStorageWordAtIndex(s, wordIndex) >> shift;
+	if ( shift != 0 && shift + length > AQBitsPerWord )
+		result |= AQBitStorageWordAtIndex(s, wordIndex + 1) << (AQBitsPerWord - shift);
+	
+	return ( result & AQLowBitMask(length) );
+}
+
+/// @name Lifecycle
+
+/// Initializes an empty dense storage structure, reserving space for _capacity_ words.
+extern void AQBitStorageInit( AQBitStorage * s, NSUInteger capacity );
+/// Initializes an empty chunked storage structure.
+extern void AQBitStorageInitChunked( AQBitStorage * s );
+/// Initializes dense storage using existing words from _backing_. The backing must outlive the storage.
+extern void AQBitStorageInitWithBacking( AQBitStorage * s, AQBitStorageBacking * backing, UInt64 * words, NSUInteger count, NSUInteger capacity, UInt64 fill );
+/// Converts storage to a different layout, preserving its contents. Storage with a backing is always dense.
+extern void AQBitStorageSetMode( AQBitStorage * s, AQBitStorageMode mode );
+/// Releases all memory owned by a storage structure. A backing's words are left untouched.
+extern void AQBitStorageDestroy( AQBitStorage * s );
+/// Initializes _dst_ as a copy of _src_, sharing its memory until either is modified. _dst_ must not already be initialized.
+extern void AQBitStorageInitCopy( AQBitStorage * dst, const AQBitStorage * src );
+/// Ensures that at least _capacity_ words are allocated, and that the dense word array isn't shared with any copies. Chunked storage allocates on demand, so ignores this.
+extern void AQBitStorageReserve( AQBitStorage * s, NSUInteger capacity );
+/// Dense storage only: ensures that at least _count_ words are in use, filling new words with the fill value.
+extern void AQBitStorageExpose( AQBitStorage * s, NSUInteger count );
+/// Dense storage only: drops any trailing words which match the fill value.
+extern void AQBitStorageTrim( AQBitStorage * s );
+
+/// @name Modification
+
+extern void AQBitStorageSetBit( AQBitStorage * s, NSUInteger index, CFBit bit );
+extern void AQBitStorageWriteBits( AQBitStorage * s, NSUInteger location, NSUInteger length, UInt64 value );
+extern void AQBitStorageSetRange( AQBitStorage * s, NSRange range, CFBit bit );
+extern void AQBitStorageFlipRange( AQBitStorage * s, NSRange range );
+extern void AQBitStorageOr( AQBitStorage * dst, const AQBitStorage * src );
+extern void AQBitStorageAnd( AQBitStorage * dst, const AQBitStorage * src );
+
+/**
+ Stores `a op b` into _dst_, keeping dst's storage mode. _dst_ may be the same as either operand.
+ Dense destinations are written in place, and only allocate if their capacity is too small.
+ */
+extern void AQBitStorageCombine( AQBitStorage * dst, const AQBitStorage * a, const AQBitStorage * b, AQBitOperation op );
+/// Replaces the bits of _s_ within _range_ with `s op src`, leaving all other bits untouched.
+extern void AQBitStorageCombineRange( AQBitStorage * s, const AQBitStorage * src, AQBitOperation op, NSRange range );
+
+/// Moves every bit to a lower index, discarding those which fall below zero.
+extern void AQBitStorageShiftDown( AQBitStorage * s, NSUInteger bits );
+/// Moves every bit to a higher index, filling the vacated low bits with zeroes.
+extern void AQBitStorageShiftUp( AQBitStorage * s, NSUInteger bits );
+/**
+ Replaces the contents of _dst_ with the bits of _src_ within _range_, moved down so that the range
+ starts at index zero, keeping dst's storage mode. Bits beyond the range are cleared, unless it runs to
+ the end of the field. Word-aligned ranges are copied directly; others funnel-shift each pair of source
+ words into place, all in a single pass. _dst_ may be the same as _src_.
+ */
+extern void AQBitStorageExtract( AQBitStorage * dst, const AQBitStorage * src, NSRange range );
+
+/// @name Queries
+
+extern NSUInteger AQBitStorageCountOnes( const AQBitStorage * s, NSRange range );
+extern NSUInteger AQBitStorageFirstIndex( const AQBitStorage * s, CFBit bit );
+extern NSUInteger AQBitStorageLastIndex( const AQBitStorage * s, CFBit bit );
+/// Returns the lowest index at or above _location_ holding _bit_, or `NSNotFound`.
+extern NSUInteger AQBitStorageNextIndex( const AQBitStorage * s, NSUInteger location, CFBit bit );
+/// Returns the highest index at or below _location_ holding _bit_, or `NSNotFound`.
+extern NSUInteger AQBitStoragePreviousIndex( const AQBitStorage * s, NSUInteger location, CFBit bit );
+/// Returns the first range of consecutive 1 bits at or above _location_, or `{NSNotFound, 0}`.
+extern NSRange AQBitStorageNextRun( const AQBitStorage * s, NSUInteger location );
+
+extern BOOL AQBitStorageEqual( const AQBitStorage * a, const AQBitStorage * b );
+extern NSUInteger AQBitStorageHash( const AQBitStorage * s );
+extern NSComparisonResult AQBitStorageCompare( const AQBitStorage * a, const AQBitStorage * b );
+
+/**
+ Compares _length_ bits of _s_ starting at _location_ against the zero-based bits of _value_, i.e.
+ checks that `((s >> location) ^ value) & mask` is zero across the range. A `NULL` mask compares every
+ bit. Makes no allocations, and skips over any unallocated chunks of a sparse mask.
+ */
+extern BOOL AQBitStorageMaskedEqual( const AQBitStorage * s, NSUInteger location, NSUInteger length, const AQBitStorage * value, const AQBitStorage * mask );
+
+/// @name Serialization
+
+/**
+ Writes a versioned, little-endian encoding of the storage's contents and layout into _bytes_,
+ returning the number of bytes written. The words are stored either directly or as a list of runs,
+ whichever is smaller. Pass `NULL` for _bytes_ to find out how much space is required.
+ */
+extern NSUInteger AQBitStorageEncode( const AQBitStorage * s, UInt8 * bytes );
+
+/**
+ Replaces the contents of _s_ with those of data written by AQBitStorageEncode(), using the layout it
+ was encoded from. Returns `NO` and leaves _s_ unchanged if the data is malformed or from an unknown version.
+ */
+extern BOOL AQBitStorageDecode( AQBitStorage * s, const UInt8 * bytes, NSUInteger length );
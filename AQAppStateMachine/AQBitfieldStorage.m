@@ -0,0 +1,2659 @@
+//
+//  AQBitfieldStorage.m
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-12.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQBitfieldStorage.h"
+#import <libkern/OSAtomic.h>
+#import <libkern/OSByteOrder.h>
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#pragma mark - Word Utilities
+
+// these compile down to tzcnt/lzcnt/popcnt (or rbit/clz/cnt on ARM) where the target supports them
+#if defined(__GNUC__)
+
+static inline NSUInteger _LowestSetBit( UInt64 word )
+{
+	// caller guarantees word != 0
+	return ( (NSUInteger)__builtin_ctzll(word) );
+}
+
+static inline NSUInteger _HighestSetBit( UInt64 word )
+{
+	// caller guarantees word != 0
+	return ( 63 - (NSUInteger)__builtin_clzll(word) );
+}
+
+static inline NSUInteger _CountSetBits( UInt64 word )
+{
+	return ( (NSUInteger)__builtin_popcountll(word) );
+}
+
+#else
+
+static inline NSUInteger _LowestSetBit( UInt64 word )
+{
+	// caller guarantees word != 0
+	NSUInteger i = 0;
+	if ( (word & 0xFFFFFFFFull) == 0 )
+	{
+		word >>= 32;
+		i += 32;
+	}
+	while ( (word & 1ull) == 0 )
+	{
+		word >>= 1;
+		i++;
+	}
+	return ( i );
+}
+
+static inline NSUInteger _HighestSetBit( UInt64 word )
+{
+	// caller guarantees word != 0
+	NSUInteger i = 63;
+	if ( (word >> 32) == 0 )
+	{
+		word <<= 32;
+		i -= 32;
+	}
+	while ( (word & 0x8000000000000000ull) == 0 )
+	{
+		word <<= 1;
+		i--;
+	}
+	return ( i );
+}
+
+static inline NSUInteger _CountSetBits( UInt64 word )
+{
+	word = word - ((word >> 1) & 0x5555555555555555ull);
+	word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+	word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+	return ( (NSUInteger)((word * 0x0101010101010101ull) >> 56) );
+}
+
+#endif
+
+static inline NSUInteger _ClampIndex( NSUInteger index )
+{
+	return ( index < NSNotFound ? index : NSNotFound );
+}
+
+static void * _Reallocate( void * ptr, NSUInteger count, size_t size )
+{
+	void * result = realloc(ptr, MAX(count, 1) * size);
+	if ( result == NULL )
+		[NSException raise: NSMallocException format: @"Unable to allocate storage for %lu bitfield elements", (unsigned long)count];
+	
+	return ( result );
+}
+
+static inline BOOL _WordsMatch( const UInt64 * words, NSUInteger count, UInt64 value )
+{
+	for ( NSUInteger i = 0; i < count; i++ )
+	{
+		if ( words[i] != value )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+#pragma mark - Shared Buffers
+
+/*
+ Word arrays, chunk lists and chunk containers are reference-counted, so that copying storage only
+ takes another reference. Anything which is referenced more than once is duplicated by whichever
+ side writes to it first, leaving the other copies untouched.
+ */
+
+typedef struct _SharedHeader
+{
+	volatile int32_t	refCount;
+	UInt32				reserved;		// keeps the contents 64-bit aligned
+} _SharedHeader;
+
+#define _SharedHeaderOf(ptr)	(((_SharedHeader *)(ptr)) - 1)
+
+// allocates a new shared buffer, or resizes one which has only a single reference
+static void * _SharedAllocate( void * ptr, NSUInteger count, size_t size )
+{
+	_SharedHeader * header = (ptr == NULL ? NULL : _SharedHeaderOf(ptr));
+	header = (_SharedHeader *) _Reallocate(header, sizeof(_SharedHeader) + MAX(count, 1) * size, 1);
+	if ( ptr == NULL )
+		header->refCount = 1;
+	
+	return ( header + 1 );
+}
+
+static inline void * _SharedRetain( void * ptr )
+{
+	if ( ptr != NULL )
+		OSAtomicIncrement32Barrier(&_SharedHeaderOf(ptr)->refCount);
+	return ( ptr );
+}
+
+// returns YES if that was the last reference, in which case the caller must pass the buffer to _SharedFree()
+static inline BOOL _SharedDecrement( void * ptr )
+{
+	return ( ptr != NULL && OSAtomicDecrement32Barrier(&_SharedHeaderOf(ptr)->refCount) == 0 );
+}
+
+static inline void _SharedFree( void * ptr )
+{
+	free(_SharedHeaderOf(ptr));
+}
+
+static inline void _SharedRelease( void * ptr )
+{
+	if ( _SharedDecrement(ptr) )
+		_SharedFree(ptr);
+}
+
+// a buffer with only one reference can be modified in place
+static inline BOOL _SharedIsUnique( const void * ptr )
+{
+	return ( ptr == NULL || _SharedHeaderOf(ptr)->refCount == 1 );
+}
+
+#pragma mark - Chunk Containers
+
+#define _BitsPerChunk				65536u
+#define _WordsPerChunk				1024u
+#define _ChunkKeyForBit(bit)		((NSUInteger)(bit) >> 16)
+#define _ChunkKeyForWord(word)		((NSUInteger)(word) >> 10)
+
+// an array holding more indices than this is larger than a bitmap
+#define _MaxArrayCount				4096u
+// bitmaps don't revert to arrays until well below that, so a chunk hovering around the limit isn't repeatedly converted
+#define _MinBitmapCardinality		(_MaxArrayCount / 2)
+// a run list holding more runs than this is larger than a bitmap
+#define _MaxRunCount				2048u
+
+enum
+{
+	_ChunkArray,		// sorted indices of the set bits
+	_ChunkBitmap,		// every bit, one word per 64
+	_ChunkRuns			// sorted, non-adjacent runs of set bits
+};
+
+typedef struct _ChunkRun
+{
+	UInt16	start;
+	UInt16	last;		// inclusive, so that one run can cover a whole chunk
+} _ChunkRun;
+
+struct AQBitChunk
+{
+	NSUInteger	key;			// index of the chunk's first bit, divided by _BitsPerChunk
+	UInt32		type;
+	UInt32		cardinality;	// number of set bits
+	UInt32		count;			// number of values, runs or words in use
+	UInt32		capacity;		// number of values, runs or words allocated
+	union
+	{
+		UInt16 *	values;
+		UInt64 *	bitmap;
+		_ChunkRun *	runs;
+		void *		ptr;
+	} data;
+};
+
+static void _SetBitsInWords( UInt64 * words, UInt32 from, UInt32 to )
+{
+	if ( from >= to )
+		return;
+	
+	UInt32 first = from / AQBitsPerWord, last = (to - 1) / AQBitsPerWord;
+	UInt64 headMask = ~AQLowBitMask(from % AQBitsPerWord);
+	UInt64 tailMask = AQLowBitMask(((to - 1) % AQBitsPerWord) + 1);
+	
+	if ( first == last )
+	{
+		words[first] |= (headMask & tailMask);
+		return;
+	}
+	
+	words[first] |= headMask;
+	for ( UInt32 i = first + 1; i < last; i++ )
+		words[i] = ~0ull;
+	words[last] |= tailMask;
+}
+
+// returns the index of the first bit at or above 'from' with the given value, or count*64 if there are none
+static UInt32 _NextBitInWords( const UInt64 * words, UInt32 count, UInt32 from, CFBit bit )
+{
+	UInt32 end = count * AQBitsPerWord;
+	if ( from >= end )
+		return ( end );
+	
+	UInt64 flip = (bit ? 0ull : ~0ull);
+	UInt32 i = from / AQBitsPerWord;
+	UInt64 word = (words[i] ^ flip) & ~AQLowBitMask(from % AQBitsPerWord);
+	while ( word == 0ull )
+	{
+		if ( ++i == count )
+			return ( end );
+		word = words[i] ^ flip;
+	}
+	
+	return ( i * AQBitsPerWord + (UInt32)_LowestSetBit(word) );
+}
+
+// returns the index of the last bit at or below 'from' with the given value, or -1 if there are none
+static NSInteger _PreviousBitInWords( const UInt64 * words, UInt32 from, CFBit bit )
+{
+	UInt64 flip = (bit ? 0ull : ~0ull);
+	UInt32 i = from / AQBitsPerWord;
+	UInt64 word = (words[i] ^ flip) & AQLowBitMask((from % AQBitsPerWord) + 1);
+	while ( word == 0ull )
+	{
+		if ( i-- == 0 )
+			return ( -1 );
+		word = words[i] ^ flip;
+	}
+	
+	return ( (NSInteger)(i * AQBitsPerWord + _HighestSetBit(word)) );
+}
+
+static UInt32 _CountBitsInWords( const UInt64 * words, UInt32 count )
+{
+	UInt32 total = 0;
+	for ( UInt32 i = 0; i < count; i++ )
+		total += (UInt32)_CountSetBits(words[i]);
+	return ( total );
+}
+
+static UInt32 _CountRunsInWords( const UInt64 * words, UInt32 count )
+{
+	// count the set bits whose lower neighbour is clear
+	UInt32 total = 0;
+	UInt64 carry = 0ull;
+	for ( UInt32 i = 0; i < count; i++ )
+	{
+		UInt64 word = words[i];
+		total += (UInt32)_CountSetBits(word & ~((word << 1) | carry));
+		carry = word >> 63;
+	}
+	return ( total );
+}
+
+static UInt32 _AppendRun( _ChunkRun * runs, UInt32 count, UInt32 start, UInt32 last )
+{
+	if ( count != 0 && (UInt32)runs[count-1].last + 1 == start )
+	{
+		runs[count-1].last = (UInt16)last;
+		return ( count );
+	}
+	
+	runs[count].start = (UInt16)start;
+	runs[count].last = (UInt16)last;
+	return ( count + 1 );
+}
+
+static UInt32 _AppendRunsFromWords( _ChunkRun * runs, UInt32 count, const UInt64 * words, UInt32 wordCount, UInt32 base )
+{
+	UInt32 end = wordCount * AQBitsPerWord;
+	UInt32 start = _NextBitInWords(words, wordCount, 0, 1);
+	while ( start < end )
+	{
+		UInt32 stop = _NextBitInWords(words, wordCount, start, 0);
+		count = _AppendRun(runs, count, base + start, base + stop - 1);
+		start = _NextBitInWords(words, wordCount, stop, 1);
+	}
+	return ( count );
+}
+
+// index of the first value >= x
+static UInt32 _ArrayLowerBound( const AQBitChunk * c, UInt32 x )
+{
+	UInt32 lo = 0, hi = c->count;
+	while ( lo < hi )
+	{
+		UInt32 mid = (lo + hi) / 2;
+		if ( c->data.values[mid] < x )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ( lo );
+}
+
+// index of the first run ending at or above x
+static UInt32 _RunLowerBound( const AQBitChunk * c, UInt32 x )
+{
+	UInt32 lo = 0, hi = c->count;
+	while ( lo < hi )
+	{
+		UInt32 mid = (lo + hi) / 2;
+		if ( c->data.runs[mid].last < x )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ( lo );
+}
+
+// index of the first run starting above x
+static UInt32 _RunUpperBound( const AQBitChunk * c, UInt32 x )
+{
+	UInt32 lo = 0, hi = c->count;
+	while ( lo < hi )
+	{
+		UInt32 mid = (lo + hi) / 2;
+		if ( c->data.runs[mid].start <= x )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ( lo );
+}
+
+static void _ChunkInitFilled( AQBitChunk * c, NSUInteger key, UInt64 fill )
+{
+	c->key = key;
+	c->capacity = 1;
+	if ( fill == 0ull )
+	{
+		c->type = _ChunkArray;
+		c->cardinality = 0;
+		c->count = 0;
+		c->data.ptr = _SharedAllocate(NULL, c->capacity, sizeof(UInt16));
+	}
+	else
+	{
+		c->type = _ChunkRuns;
+		c->cardinality = _BitsPerChunk;
+		c->count = 1;
+		c->data.ptr = _SharedAllocate(NULL, c->capacity, sizeof(_ChunkRun));
+		c->data.runs[0].start = 0;
+		c->data.runs[0].last = (UInt16)(_BitsPerChunk - 1);
+	}
+}
+
+static size_t _ChunkElementSize( const AQBitChunk * c )
+{
+	switch ( c->type )
+	{
+		case _ChunkArray:
+			return ( sizeof(UInt16) );
+		case _ChunkRuns:
+			return ( sizeof(_ChunkRun) );
+		default:
+			return ( sizeof(UInt64) );
+	}
+}
+
+// gives a chunk its own copy of contents it shares with another storage's chunk, so they can be modified in place
+static void _ChunkMakeUnique( AQBitChunk * c )
+{
+	if ( _SharedIsUnique(c->data.ptr) )
+		return;
+	
+	void * shared = c->data.ptr;
+	c->capacity = MAX(c->count, 1);
+	c->data.ptr = _SharedAllocate(NULL, c->capacity, _ChunkElementSize(c));
+	memcpy(c->data.ptr, shared, c->count * _ChunkElementSize(c));
+	_SharedRelease(shared);
+}
+
+static void _ChunkReserve( AQBitChunk * c, UInt32 capacity )
+{
+	if ( capacity <= c->capacity )
+		return;
+	
+	UInt32 newCapacity = MAX(capacity, c->capacity * 2);
+	c->data.ptr = _SharedAllocate(c->data.ptr, newCapacity, _ChunkElementSize(c));
+	c->capacity = newCapacity;
+}
+
+static BOOL _ChunkMatchesFill( const AQBitChunk * c, UInt64 fill )
+{
+	return ( c->cardinality == (fill == 0ull ? 0 : _BitsPerChunk) );
+}
+
+static void _ChunkReadWords( const AQBitChunk * c, UInt32 first, UInt32 count, UInt64 * words )
+{
+	UInt32 lo = first * AQBitsPerWord, hi = (first + count) * AQBitsPerWord;
+	
+	if ( c->type == _ChunkBitmap )
+	{
+		memcpy(words, c->data.bitmap + first, count * sizeof(UInt64));
+		return;
+	}
+	
+	memset(words, 0, count * sizeof(UInt64));
+	
+	if ( c->type == _ChunkArray )
+	{
+		for ( UInt32 i = _ArrayLowerBound(c, lo); i < c->count && c->data.values[i] < hi; i++ )
+		{
+			UInt32 bit = c->data.values[i] - lo;
+			words[bit / AQBitsPerWord] |= (1ull << (bit % AQBitsPerWord));
+		}
+	}
+	else
+	{
+		for ( UInt32 i = _RunLowerBound(c, lo); i < c->count && c->data.runs[i].start < hi; i++ )
+		{
+			UInt32 from = MAX((UInt32)c->data.runs[i].start, lo);
+			UInt32 to = MIN((UInt32)c->data.runs[i].last + 1, hi);
+			_SetBitsInWords(words, from - lo, to - lo);
+		}
+	}
+}
+
+// replaces a chunk's contents using a specific container type
+static void _ChunkBuild( AQBitChunk * c, UInt32 type, const UInt64 * words )
+{
+	void * old = c->data.ptr;
+	
+	c->type = type;
+	c->cardinality = _CountBitsInWords(words, _WordsPerChunk);
+	
+	switch ( type )
+	{
+		case _ChunkBitmap:
+			c->count = c->capacity = _WordsPerChunk;
+			c->data.ptr = _SharedAllocate(NULL, c->capacity, sizeof(UInt64));
+			memcpy(c->data.bitmap, words, _WordsPerChunk * sizeof(UInt64));
+			break;
+			
+		case _ChunkArray:
+			c->count = 0;
+			c->capacity = MAX(c->cardinality, 1);
+			c->data.ptr = _SharedAllocate(NULL, c->capacity, sizeof(UInt16));
+			for ( UInt32 i = 0; i < _WordsPerChunk; i++ )
+			{
+				for ( UInt64 word = words[i]; word != 0ull; word &= word - 1 )
+					c->data.values[c->count++] = (UInt16)(i * AQBitsPerWord + _LowestSetBit(word));
+			}
+			break;
+			
+		case _ChunkRuns:
+			c->capacity = MAX(_CountRunsInWords(words, _WordsPerChunk), 1);
+			c->data.ptr = _SharedAllocate(NULL, c->capacity, sizeof(_ChunkRun));
+			c->count = _AppendRunsFromWords(c->data.runs, 0, words, _WordsPerChunk, 0);
+			break;
+	}
+	
+	_SharedRelease(old);
+}
+
+// replaces a chunk's contents using whichever container type is smallest
+static void _ChunkSetWords( AQBitChunk * c, const UInt64 * words )
+{
+	UInt32 cardinality = _CountBitsInWords(words, _WordsPerChunk);
+	UInt32 runs = _CountRunsInWords(words, _WordsPerChunk);
+	
+	UInt32 type = _ChunkBitmap;
+	size_t size = _WordsPerChunk * sizeof(UInt64);
+	if ( cardinality <= _MaxArrayCount && cardinality * sizeof(UInt16) < size )
+	{
+		type = _ChunkArray;
+		size = cardinality * sizeof(UInt16);
+	}
+	if ( runs * sizeof(_ChunkRun) < size )
+		type = _ChunkRuns;
+	
+	_ChunkBuild(c, type, words);
+}
+
+static void _ChunkOptimize( AQBitChunk * c )
+{
+	UInt64 words[_WordsPerChunk];
+	_ChunkReadWords(c, 0, _WordsPerChunk, words);
+	_ChunkSetWords(c, words);
+}
+
+static void _ChunkComplement( AQBitChunk * c )
+{
+	UInt64 words[_WordsPerChunk];
+	_ChunkReadWords(c, 0, _WordsPerChunk, words);
+	for ( UInt32 i = 0; i < _WordsPerChunk; i++ )
+		words[i] = ~words[i];
+	_ChunkSetWords(c, words);
+}
+
+static void _ChunkWriteWords( AQBitChunk * c, UInt32 first, UInt32 count, const UInt64 * words )
+{
+	UInt32 lo = first * AQBitsPerWord, hi = (first + count) * AQBitsPerWord;
+	
+	switch ( c->type )
+	{
+		case _ChunkBitmap:
+		{
+			_ChunkMakeUnique(c);
+			UInt32 removed = _CountBitsInWords(c->data.bitmap + first, count);
+			memcpy(c->data.bitmap + first, words, count * sizeof(UInt64));
+			c->cardinality = c->cardinality - removed + _CountBitsInWords(words, count);
+			if ( c->cardinality < _MinBitmapCardinality )
+				_ChunkOptimize(c);
+			break;
+		}
+			
+		case _ChunkArray:
+		{
+			UInt32 i = _ArrayLowerBound(c, lo), j = _ArrayLowerBound(c, hi);
+			UInt32 added = _CountBitsInWords(words, count);
+			UInt32 newCount = c->count - (j - i) + added;
+			if ( newCount > _MaxArrayCount )
+			{
+				UInt64 bitmap[_WordsPerChunk];
+				_ChunkReadWords(c, 0, _WordsPerChunk, bitmap);
+				_ChunkBuild(c, _ChunkBitmap, bitmap);
+				_ChunkWriteWords(c, first, count, words);
+				break;
+			}
+			
+			_ChunkMakeUnique(c);
+			_ChunkReserve(c, newCount);
+			memmove(c->data.values + i + added, c->data.values + j, (c->count - j) * sizeof(UInt16));
+			for ( UInt32 w = 0; w < count; w++ )
+			{
+				for ( UInt64 word = words[w]; word != 0ull; word &= word - 1 )
+					c->data.values[i++] = (UInt16)(lo + w * AQBitsPerWord + _LowestSetBit(word));
+			}
+			c->count = c->cardinality = newCount;
+			break;
+		}
+			
+		case _ChunkRuns:
+		{
+			UInt32 capacity = c->count + 2 + (count * AQBitsPerWord) / 2;
+			_ChunkRun * runs = (_ChunkRun *) _SharedAllocate(NULL, capacity, sizeof(_ChunkRun));
+			UInt32 n = 0, i = 0;
+			
+			// keep runs below the span, trimming any which cross into it
+			for ( ; i < c->count && c->data.runs[i].last < lo; i++ )
+				runs[n++] = c->data.runs[i];
+			if ( i < c->count && c->data.runs[i].start < lo )
+				n = _AppendRun(runs, n, c->data.runs[i].start, lo - 1);
+			
+			n = _AppendRunsFromWords(runs, n, words, count, lo);
+			
+			// keep runs above the span, trimming any which cross into it
+			for ( ; i < c->count; i++ )
+			{
+				if ( c->data.runs[i].last < hi )
+					continue;
+				n = _AppendRun(runs, n, MAX((UInt32)c->data.runs[i].start, hi), c->data.runs[i].last);
+			}
+			
+			_SharedRelease(c->data.runs);
+			c->data.runs = runs;
+			c->count = n;
+			c->capacity = capacity;
+			c->cardinality = 0;
+			for ( i = 0; i < n; i++ )
+				c->cardinality += (UInt32)runs[i].last - runs[i].start + 1;
+			
+			if ( n > _MaxRunCount )
+				_ChunkOptimize(c);
+			break;
+		}
+	}
+}
+
+static UInt32 _ChunkCountOnes( const AQBitChunk * c, UInt32 lo, UInt32 hi )
+{
+	UInt32 total = 0;
+	
+	switch ( c->type )
+	{
+		case _ChunkBitmap:
+		{
+			UInt32 first = lo / AQBitsPerWord, last = (hi - 1) / AQBitsPerWord;
+			for ( UInt32 i = first; i <= last; i++ )
+			{
+				UInt64 word = c->data.bitmap[i];
+				if ( i == first )
+					word &= ~AQLowBitMask(lo % AQBitsPerWord);
+				if ( i == last )
+					word &= AQLowBitMask(((hi - 1) % AQBitsPerWord) + 1);
+				total += (UInt32)_CountSetBits(word);
+			}
+			break;
+		}
+			
+		case _ChunkArray:
+			total = _ArrayLowerBound(c, hi) - _ArrayLowerBound(c, lo);
+			break;
+			
+		case _ChunkRuns:
+			for ( UInt32 i = _RunLowerBound(c, lo); i < c->count && c->data.runs[i].start < hi; i++ )
+				total += MIN((UInt32)c->data.runs[i].last + 1, hi) - MAX((UInt32)c->data.runs[i].start, lo);
+			break;
+	}
+	
+	return ( total );
+}
+
+// returns the first index at or above 'from' holding the given bit, or _BitsPerChunk
+static UInt32 _ChunkNextBit( const AQBitChunk * c, UInt32 from, CFBit bit )
+{
+	switch ( c->type )
+	{
+		case _ChunkBitmap:
+			return ( _NextBitInWords(c->data.bitmap, _WordsPerChunk, from, bit) );
+			
+		case _ChunkArray:
+		{
+			UInt32 i = _ArrayLowerBound(c, from);
+			if ( bit )
+				return ( i < c->count ? c->data.values[i] : _BitsPerChunk );
+			
+			// step over consecutive set bits
+			for ( ; i < c->count && c->data.values[i] == from; i++ )
+				from++;
+			return ( from );
+		}
+			
+		default:
+		{
+			UInt32 i = _RunLowerBound(c, from);
+			if ( bit )
+				return ( i < c->count ? MAX((UInt32)c->data.runs[i].start, from) : _BitsPerChunk );
+			
+			// runs never touch, so the bit after a run is always clear
+			if ( i < c->count && c->data.runs[i].start <= from )
+				return ( (UInt32)c->data.runs[i].last + 1 );
+			return ( from );
+		}
+	}
+}
+
+// returns the last index at or below 'from' holding the given bit, or -1
+static NSInteger _ChunkPreviousBit( const AQBitChunk * c, UInt32 from, CFBit bit )
+{
+	switch ( c->type )
+	{
+		case _ChunkBitmap:
+			return ( _PreviousBitInWords(c->data.bitmap, from, bit) );
+			
+		case _ChunkArray:
+		{
+			NSInteger i = (NSInteger)_ArrayLowerBound(c, from + 1) - 1;
+			if ( bit )
+				return ( i >= 0 ? (NSInteger)c->data.values[i] : -1 );
+			
+			NSInteger result = from;
+			for ( ; i >= 0 && (NSInteger)c->data.values[i] == result; i-- )
+				result--;
+			return ( result );
+		}
+			
+		default:
+		{
+			NSInteger i = (NSInteger)_RunUpperBound(c, from) - 1;
+			if ( bit )
+				return ( i >= 0 ? (NSInteger)MIN((UInt32)c->data.runs[i].last, from) : -1 );
+			
+			if ( i >= 0 && c->data.runs[i].last >= from )
+				return ( (NSInteger)c->data.runs[i].start - 1 );
+			return ( from );
+		}
+	}
+}
+
+#pragma mark - Chunk Lists
+
+static BOOL _FindChunk( const AQBitStorage * s, NSUInteger key, NSUInteger * index )
+{
+	NSUInteger lo = 0, hi = s->chunkCount;
+	while ( lo < hi )
+	{
+		NSUInteger mid = lo + (hi - lo) / 2;
+		if ( s->chunks[mid].key < key )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	*index = lo;
+	return ( lo < s->chunkCount && s->chunks[lo].key == key );
+}
+
+// drops a reference to a chunk list, along with the chunks it holds if that was the last one
+static void _ReleaseChunks( AQBitChunk * chunks, NSUInteger count )
+{
+	if ( _SharedDecrement(chunks) == NO )
+		return;
+	
+	for ( NSUInteger i = 0; i < count; i++ )
+		_SharedRelease(chunks[i].data.ptr);
+	_SharedFree(chunks);
+}
+
+// gives the storage its own chunk list before the list is modified; the chunks' contents remain shared
+static void _MakeChunksUnique( AQBitStorage * s )
+{
+	if ( _SharedIsUnique(s->chunks) )
+		return;
+	
+	AQBitChunk * chunks = (AQBitChunk *) _SharedAllocate(NULL, s->chunkCount, sizeof(AQBitChunk));
+	for ( NSUInteger i = 0; i < s->chunkCount; i++ )
+	{
+		chunks[i] = s->chunks[i];
+		_SharedRetain(chunks[i].data.ptr);
+	}
+	
+	_ReleaseChunks(s->chunks, s->chunkCount);
+	s->chunks = chunks;
+	s->chunkCapacity = s->chunkCount;
+}
+
+// returns an uninitialized chunk slot at the given index
+static AQBitChunk * _InsertChunkSlot( AQBitStorage * s, NSUInteger index )
+{
+	if ( s->chunkCount == s->chunkCapacity )
+	{
+		s->chunkCapacity = MAX(4, s->chunkCapacity * 2);
+		s->chunks = (AQBitChunk *) _SharedAllocate(s->chunks, s->chunkCapacity, sizeof(AQBitChunk));
+	}
+	
+	memmove(s->chunks + index + 1, s->chunks + index, (s->chunkCount - index) * sizeof(AQBitChunk));
+	s->chunkCount++;
+	return ( s->chunks + index );
+}
+
+static AQBitChunk * _InsertChunk( AQBitStorage * s, NSUInteger index, NSUInteger key, UInt64 fill )
+{
+	AQBitChunk * c = _InsertChunkSlot(s, index);
+	_ChunkInitFilled(c, key, fill);
+	return ( c );
+}
+
+static void _AppendChunkWords( AQBitStorage * s, NSUInteger key, const UInt64 * words )
+{
+	AQBitChunk * c = _InsertChunkSlot(s, s->chunkCount);
+	c->key = key;
+	c->data.ptr = NULL;
+	_ChunkSetWords(c, words);
+}
+
+static void _RemoveChunks( AQBitStorage * s, NSUInteger index, NSUInteger count )
+{
+	if ( count == 0 )
+		return;
+	
+	for ( NSUInteger i = index; i < index + count; i++ )
+		_SharedRelease(s->chunks[i].data.ptr);
+	
+	memmove(s->chunks + index, s->chunks + index + count, (s->chunkCount - index - count) * sizeof(AQBitChunk));
+	s->chunkCount -= count;
+}
+
+static void _RemoveChunkIfFill( AQBitStorage * s, NSUInteger index )
+{
+	if ( _ChunkMatchesFill(&s->chunks[index], s->fill) )
+		_RemoveChunks(s, index, 1);
+}
+
+static void _RemoveAllFillChunks( AQBitStorage * s )
+{
+	NSUInteger n = 0;
+	for ( NSUInteger i = 0; i < s->chunkCount; i++ )
+	{
+		if ( _ChunkMatchesFill(&s->chunks[i], s->fill) )
+			_SharedRelease(s->chunks[i].data.ptr);
+		else
+			s->chunks[n++] = s->chunks[i];
+	}
+	s->chunkCount = n;
+}
+
+// copies a span of words from either kind of storage
+static void _ReadWords( const AQBitStorage * s, NSUInteger first, NSUInteger count, UInt64 * words )
+{
+	if ( s->mode == AQBitStorageDense )
+	{
+		NSUInteger stored = (first < s->count ? MIN(count, s->count - first) : 0);
+		if ( stored != 0 )
+			memcpy(words, s->words + first, stored * sizeof(UInt64));
+		for ( NSUInteger i = stored; i < count; i++ )
+			words[i] = s->fill;
+		return;
+	}
+	
+	while ( count != 0 )
+	{
+		NSUInteger index;
+		UInt32 offset = (UInt32)(first % _WordsPerChunk);
+		UInt32 n = (UInt32)MIN(count, _WordsPerChunk - offset);
+		
+		if ( _FindChunk(s, _ChunkKeyForWord(first), &index) )
+		{
+			_ChunkReadWords(&s->chunks[index], offset, n, words);
+		}
+		else
+		{
+			for ( UInt32 i = 0; i < n; i++ )
+				words[i] = s->fill;
+		}
+		
+		words += n;
+		first += n;
+		count -= n;
+	}
+}
+
+UInt64 AQBitStorageChunkedWordAtIndex( const AQBitStorage * s, NSUInteger wordIndex )
+{
+	UInt64 word;
+	_ReadWords(s, wordIndex, 1, &word);
+	return ( word );
+}
+
+// returns direct access to 'count' words from 'first' where possible, otherwise copies them into 'buffer'
+static inline const UInt64 * _BorrowWords( const AQBitStorage * s, NSUInteger first, NSUInteger count, UInt64 * buffer )
+{
+	if ( s->mode == AQBitStorageDense && first + count <= s->count )
+		return ( s->words + first );
+	
+	_ReadWords(s, first, count, buffer);
+	return ( buffer );
+}
+
+// the first chunk-sized block of words at or above 'key' which holds anything but the fill value
+static NSUInteger _NextStoredKey( const AQBitStorage * s, NSUInteger key )
+{
+	if ( s->mode == AQBitStorageDense )
+		return ( key < _ChunkKeyForWord(s->count + _WordsPerChunk - 1) ? key : NSNotFound );
+	
+	NSUInteger index;
+	_FindChunk(s, key, &index);
+	return ( index < s->chunkCount ? s->chunks[index].key : NSNotFound );
+}
+
+// every word at or above this index holds the fill value
+static NSUInteger _StoredWordLimit( const AQBitStorage * s )
+{
+	if ( s->mode == AQBitStorageDense )
+		return ( s->count );
+	if ( s->chunkCount == 0 )
+		return ( 0 );
+	return ( (s->chunks[s->chunkCount-1].key + 1) * _WordsPerChunk );
+}
+
+#pragma mark - Lifecycle
+
+void AQBitStorageInit( AQBitStorage * s, NSUInteger capacity )
+{
+	memset(s, 0, sizeof(AQBitStorage));
+	s->mode = AQBitStorageDense;
+	
+	if ( capacity != 0 )
+		AQBitStorageReserve(s, capacity);
+}
+
+void AQBitStorageInitChunked( AQBitStorage * s )
+{
+	memset(s, 0, sizeof(AQBitStorage));
+	s->mode = AQBitStorageChunked;
+}
+
+void AQBitStorageInitWithBacking( AQBitStorage * s, AQBitStorageBacking * backing, UInt64 * words, NSUInteger count, NSUInteger capacity, UInt64 fill )
+{
+	AQBitStorageInit(s, 0);
+	s->backing = backing;
+	s->words = words;
+	s->count = count;
+	s->capacity = capacity;
+	s->fill = fill;
+}
+
+void AQBitStorageDestroy( AQBitStorage * s )
+{
+	if ( s->backing == NULL )
+		_SharedRelease(s->words);
+	s->backing = NULL;
+	s->words = NULL;
+	s->count = 0;
+	s->capacity = 0;
+	
+	_ReleaseChunks(s->chunks, s->chunkCount);
+	s->chunks = NULL;
+	s->chunkCount = 0;
+	s->chunkCapacity = 0;
+}
+
+void AQBitStorageInitCopy( AQBitStorage * dst, const AQBitStorage * src )
+{
+	if ( src->backing != NULL )
+	{
+		// the copy lives on the heap
+		AQBitStorageInit(dst, src->count);
+		if ( src->count != 0 )
+			memcpy(dst->words, src->words, src->count * sizeof(UInt64));
+		dst->count = src->count;
+		dst->fill = src->fill;
+		return;
+	}
+	
+	// both sides share everything until one of them is modified
+	*dst = *src;
+	_SharedRetain(dst->words);
+	_SharedRetain(dst->chunks);
+}
+
+void AQBitStorageSetMode( AQBitStorage * s, AQBitStorageMode mode )
+{
+	if ( s->mode == mode || s->backing != NULL )
+		return;
+	
+	AQBitStorage result;
+	if ( mode == AQBitStorageChunked )
+	{
+		UInt64 words[_WordsPerChunk];
+		AQBitStorageInitChunked(&result);
+		result.fill = s->fill;
+		
+		for ( NSUInteger key = 0; key * _WordsPerChunk < s->count; key++ )
+		{
+			_ReadWords(s, key * _WordsPerChunk, _WordsPerChunk, words);
+			if ( _WordsMatch(words, _WordsPerChunk, s->fill) == NO )
+				_AppendChunkWords(&result, key, words);
+		}
+	}
+	else
+	{
+		NSUInteger count = _StoredWordLimit(s);
+		AQBitStorageInit(&result, count);
+		result.fill = s->fill;
+		_ReadWords(s, 0, count, result.words);
+		result.count = count;
+		AQBitStorageTrim(&result);
+	}
+	
+	AQBitStorageDestroy(s);
+	*s = result;
+}
+
+void AQBitStorageReserve( AQBitStorage * s, NSUInteger capacity )
+{
+	if ( s->mode == AQBitStorageChunked )
+		return;
+	
+	if ( s->backing != NULL )
+	{
+		s->words = s->backing->prepareForWriting(s->backing, MAX(capacity, s->count), &s->capacity);
+		return;
+	}
+	
+	if ( _SharedIsUnique(s->words) == NO )
+	{
+		// another copy uses these words, so take a private copy of them instead of resizing
+		UInt64 * words = (UInt64 *) _SharedAllocate(NULL, MAX(capacity, s->count), sizeof(UInt64));
+		if ( s->count != 0 )
+			memcpy(words, s->words, s->count * sizeof(UInt64));
+		_SharedRelease(s->words);
+		s->words = words;
+		s->capacity = MAX(capacity, s->count);
+		return;
+	}
+	
+	if ( capacity <= s->capacity )
+		return;
+	
+	// grow geometrically so repeated single-word expansion stays amortized O(1)
+	NSUInteger newCapacity = MAX(capacity, s->capacity * 2);
+	s->words = (UInt64 *) _SharedAllocate(s->words, newCapacity, sizeof(UInt64));
+	s->capacity = newCapacity;
+}
+
+void AQBitStorageExpose( AQBitStorage * s, NSUInteger count )
+{
+	AQBitStorageReserve(s, count);
+	if ( count <= s->count )
+		return;
+	
+	for ( NSUInteger i = s->count; i < count; i++ )
+		s->words[i] = s->fill;
+	
+	s->count = count;
+}
+
+void AQBitStorageTrim( AQBitStorage * s )
+{
+	while ( s->count > 0 && s->words[s->count-1] == s->fill )
+		s->count--;
+}
+
+#pragma mark - Modification
+
+enum
+{
+	_ModifySet,
+	_ModifyFlip,
+	_ModifyWrite
+};
+
+// the bits of a value written at 'location' which land in the word starting at bit 'wordStart'
+static inline UInt64 _ValueBitsForWord( UInt64 value, NSUInteger location, NSUInteger wordStart )
+{
+	if ( wordStart >= location )
+		return ( wordStart - location < AQBitsPerWord ? value >> (wordStart - location) : 0ull );
+	return ( location - wordStart < AQBitsPerWord ? value << (location - wordStart) : 0ull );
+}
+
+// applies a modification to a closed, non-empty range of chunked storage one chunk at a time
+static void _ChunkedModify( AQBitStorage * s, NSUInteger location, NSUInteger length, int op, UInt64 value )
+{
+	NSUInteger end = location + length;
+	NSUInteger key = _ChunkKeyForBit(location);
+	NSUInteger lastKey = _ChunkKeyForBit(end - 1);
+	
+	_MakeChunksUnique(s);
+	while ( key <= lastKey )
+	{
+		NSUInteger index;
+		BOOL found = _FindChunk(s, key, &index);
+		if ( !found && op == _ModifySet && value == s->fill )
+		{
+			// unallocated chunks already hold this value, so skip ahead to the next allocated one
+			if ( index == s->chunkCount )
+				break;
+			key = s->chunks[index].key;
+			continue;
+		}
+		
+		NSUInteger chunkStart = key * _BitsPerChunk;
+		UInt32 lo = (UInt32)(MAX(location, chunkStart) - chunkStart);
+		UInt32 hi = (UInt32)(MIN(end, chunkStart + _BitsPerChunk) - chunkStart);
+		
+		if ( lo == 0 && hi == _BitsPerChunk && op != _ModifyWrite )
+		{
+			// the whole chunk changes, so there's no need to look at its contents
+			UInt64 result = (op == _ModifySet ? value : ~s->fill);
+			if ( found && op == _ModifyFlip )
+			{
+				_ChunkComplement(&s->chunks[index]);
+				_RemoveChunkIfFill(s, index);
+			}
+			else if ( found )
+			{
+				_SharedRelease(s->chunks[index].data.ptr);
+				_ChunkInitFilled(&s->chunks[index], key, result);
+				_RemoveChunkIfFill(s, index);
+			}
+			else
+			{
+				_InsertChunk(s, index, key, result);
+			}
+			
+			key++;
+			continue;
+		}
+		
+		AQBitChunk * c = (found ? &s->chunks[index] : _InsertChunk(s, index, key, s->fill));
+		UInt32 first = lo / AQBitsPerWord, count = (hi - 1) / AQBitsPerWord - first + 1;
+		UInt64 words[_WordsPerChunk];
+		
+		_ChunkReadWords(c, first, count, words);
+		for ( UInt32 i = 0; i < count; i++ )
+		{
+			UInt64 mask = ~0ull;
+			if ( i == 0 )
+				mask &= ~AQLowBitMask(lo % AQBitsPerWord);
+			if ( i == count - 1 )
+				mask &= AQLowBitMask(((hi - 1) % AQBitsPerWord) + 1);
+			
+			switch ( op )
+			{
+				case _ModifySet:
+					words[i] = (words[i] & ~mask) | (value & mask);
+					break;
+				case _ModifyFlip:
+					words[i] ^= mask;
+					break;
+				case _ModifyWrite:
+					words[i] = (words[i] & ~mask) | (_ValueBitsForWord(value, location, chunkStart + (first + i) * AQBitsPerWord) & mask);
+					break;
+			}
+		}
+		_ChunkWriteWords(c, first, count, words);
+		
+		// bulk changes can leave a different container type better suited to the result
+		if ( op != _ModifyWrite && count > 1 )
+			_ChunkOptimize(c);
+		
+		_RemoveChunkIfFill(s, index);
+		key++;
+	}
+}
+
+// allocates every chunk below 'key' which is currently implied by the fill value
+static void _MaterializeChunks( AQBitStorage * s, NSUInteger key )
+{
+	NSUInteger index;
+	_FindChunk(s, key, &index);
+	if ( index == key )
+		return;
+	
+	NSUInteger count = key + s->chunkCount - index;
+	AQBitChunk * chunks = (AQBitChunk *) _SharedAllocate(NULL, count, sizeof(AQBitChunk));
+	for ( NSUInteger i = 0, j = 0; i < key; i++ )
+	{
+		if ( j < index && s->chunks[j].key == i )
+			chunks[i] = s->chunks[j++];
+		else
+			_ChunkInitFilled(&chunks[i], i, s->fill);
+	}
+	memcpy(chunks + key, s->chunks + index, (s->chunkCount - index) * sizeof(AQBitChunk));
+	
+	// the chunks themselves have moved to the new list
+	_SharedRelease(s->chunks);
+	s->chunks = chunks;
+	s->chunkCount = count;
+	s->chunkCapacity = count;
+}
+
+// applies a set or flip to every bit from 'location' up to NSNotFound
+static void _ChunkedModifyToEnd( AQBitStorage * s, NSUInteger location, int op, UInt64 value )
+{
+	NSUInteger key = _ChunkKeyForBit(location);
+	NSUInteger chunkStart = key * _BitsPerChunk;
+	if ( location != chunkStart )
+	{
+		_ChunkedModify(s, location, chunkStart + _BitsPerChunk - location, op, value);
+		key++;
+	}
+	
+	// everything from here upwards changes, including the unallocated chunks
+	NSUInteger index;
+	_MakeChunksUnique(s);
+	_FindChunk(s, key, &index);
+	if ( op == _ModifySet && value == s->fill )
+	{
+		_RemoveChunks(s, index, s->chunkCount - index);
+		return;
+	}
+	
+	// unallocated chunks below the range keep the old fill value, so they need real storage now
+	_MaterializeChunks(s, key);
+	index = key;
+	
+	if ( op == _ModifySet )
+	{
+		_RemoveChunks(s, index, s->chunkCount - index);
+		s->fill = value;
+	}
+	else
+	{
+		for ( NSUInteger i = index; i < s->chunkCount; i++ )
+			_ChunkComplement(&s->chunks[i]);
+		s->fill = ~s->fill;
+	}
+	
+	// chunks below the range may now match the new fill value
+	_RemoveAllFillChunks(s);
+}
+
+void AQBitStorageSetBit( AQBitStorage * s, NSUInteger index, CFBit bit )
+{
+	if ( s->mode == AQBitStorageChunked )
+	{
+		if ( index < NSNotFound )
+			_ChunkedModify(s, index, 1, _ModifySet, (bit ? ~0ull : 0ull));
+		return;
+	}
+	
+	NSUInteger wordIndex = AQWordIndexForBit(index);
+	UInt64 mask = 1ull << AQBitOffsetInWord(index);
+	
+	if ( wordIndex >= s->count && ((s->fill & mask) != 0) == (bit != 0) )
+		return;		// already has this value
+	
+	AQBitStorageExpose(s, wordIndex + 1);
+	if ( bit )
+		s->words[wordIndex] |= mask;
+	else
+		s->words[wordIndex] &= ~mask;
+}
+
+void AQBitStorageWriteBits( AQBitStorage * s, NSUInteger location, NSUInteger length, UInt64 value )
+{
+	if ( length == 0 )
+		return;
+	
+	if ( s->mode == AQBitStorageChunked )
+	{
+		NSRange range = AQBitStorageClampRange(NSMakeRange(location, length));
+		if ( range.length != 0 )
+			_ChunkedModify(s, range.location, range.length, _ModifyWrite, value & AQLowBitMask(length));
+		return;
+	}
+	
+	UInt64 valueMask = AQLowBitMask(length);
+	value &= valueMask;
+	
+	NSUInteger first = AQWordIndexForBit(location);
+	NSUInteger last = AQWordIndexForBit(location + length - 1);
+	NSUInteger shift = AQBitOffsetInWord(location);
+	
+	if ( first >= s->count && value == (s->fill & valueMask) )
+		return;		// nothing would change
+	
+	AQBitStorageExpose(s, last + 1);
+	
+	s->words[first] = (s->words[first] & ~(valueMask << shift)) | (value << shift);
+	if ( last != first )
+	{
+		UInt64 highMask = AQLowBitMask(shift + length - AQBitsPerWord);
+		s->words[last] = (s->words[last] & ~highMask) | (value >> (AQBitsPerWord - shift));
+	}
+}
+
+void AQBitStorageSetRange( AQBitStorage * s, NSRange range, CFBit bit )
+{
+	range = AQBitStorageClampRange(range);
+	if ( range.length == 0 )
+		return;
+	
+	UInt64 value = (bit ? ~0ull : 0ull);
+	if ( s->mode == AQBitStorageChunked )
+	{
+		if ( NSMaxRange(range) == NSNotFound )
+			_ChunkedModifyToEnd(s, range.location, _ModifySet, value);
+		else
+			_ChunkedModify(s, range.location, range.length, _ModifySet, value);
+		return;
+	}
+	
+	NSUInteger first = AQWordIndexForBit(range.location);
+	UInt64 headMask = ~AQLowBitMask(AQBitOffsetInWord(range.location));
+	
+	if ( NSMaxRange(range) == NSNotFound )
+	{
+		// open-ended: everything from range.location upwards takes on the new value
+		if ( first >= s->count && s->fill == value )
+			return;
+		
+		AQBitStorageExpose(s, first + 1);
+		s->words[first] = (s->words[first] & ~headMask) | (value & headMask);
+		s->count = first + 1;
+		s->fill = value;
+		AQBitStorageTrim(s);
+		return;
+	}
+	
+	NSUInteger last = AQWordIndexForBit(NSMaxRange(range) - 1);
+	UInt64 tailMask = AQLowBitMask(AQBitOffsetInWord(NSMaxRange(range) - 1) + 1);
+	
+	if ( value == s->fill )
+	{
+		// words at or above count already hold this value
+		if ( first >= s->count )
+			return;
+		if ( last >= s->count )
+		{
+			last = s->count - 1;
+			tailMask = ~0ull;
+		}
+	}
+	
+	AQBitStorageExpose(s, last + 1);
+	
+	if ( first == last )
+	{
+		UInt64 mask = headMask & tailMask;
+		s->words[first] = (s->words[first] & ~mask) | (value & mask);
+		return;
+	}
+	
+	s->words[first] = (s->words[first] & ~headMask) | (value & headMask);
+	for ( NSUInteger i = first + 1; i < last; i++ )
+		s->words[i] = value;
+	s->words[last] = (s->words[last] & ~tailMask) | (value & tailMask);
+}
+
+void AQBitStorageFlipRange( AQBitStorage * s, NSRange range )
+{
+	range = AQBitStorageClampRange(range);
+	if ( range.length == 0 )
+		return;
+	
+	if ( s->mode == AQBitStorageChunked )
+	{
+		if ( NSMaxRange(range) == NSNotFound )
+			_ChunkedModifyToEnd(s, range.location, _ModifyFlip, 0ull);
+		else
+			_ChunkedModify(s, range.location, range.length, _ModifyFlip, 0ull);
+		return;
+	}
+	
+	NSUInteger first = AQWordIndexForBit(range.location);
+	UInt64 headMask = ~AQLowBitMask(AQBitOffsetInWord(range.location));
+	
+	if ( NSMaxRange(range) == NSNotFound )
+	{
+		AQBitStorageExpose(s, first + 1);
+		s->words[first] ^= headMask;
+		for ( NSUInteger i = first + 1; i < s->count; i++ )
+			s->words[i] = ~s->words[i];
+		s->fill = ~s->fill;
+		return;
+	}
+	
+	NSUInteger last = AQWordIndexForBit(NSMaxRange(range) - 1);
+	UInt64 tailMask = AQLowBitMask(AQBitOffsetInWord(NSMaxRange(range) - 1) + 1);
+	
+	AQBitStorageExpose(s, last + 1);
+	
+	if ( first == last )
+	{
+		s->words[first] ^= (headMask & tailMask);
+		return;
+	}
+	
+	s->words[first] ^= headMask;
+	for ( NSUInteger i = first + 1; i < last; i++ )
+		s->words[i] = ~s->words[i];
+	s->words[last] ^= tailMask;
+}
+
+static inline UInt64 _ApplyOperation( AQBitOperation op, UInt64 a, UInt64 b )
+{
+	switch ( op )
+	{
+		case AQBitOperationAnd:
+			return ( a & b );
+		case AQBitOperationOr:
+			return ( a | b );
+		case AQBitOperationXor:
+			return ( a ^ b );
+		default:
+			return ( a & ~b );
+	}
+}
+
+// number of words combined per pass when an operand has to be staged through a buffer
+#define _CombineBlockWords	256
+
+static void _DenseCombine( AQBitStorage * dst, const AQBitStorage * a, const AQBitStorage * b, AQBitOperation op )
+{
+	// everything above the last stored word of either operand combines their fill values
+	NSUInteger n = MAX(_StoredWordLimit(a), _StoredWordLimit(b));
+	UInt64 fill = _ApplyOperation(op, a->fill, b->fill);
+	
+	// dst may be one of the operands; exposing more of it only appends words equal to its fill value
+	if ( dst != a && dst != b )
+		dst->count = 0;
+	AQBitStorageExpose(dst, n);
+	
+	UInt64 mine[_CombineBlockWords];
+	UInt64 theirs[_CombineBlockWords];
+	for ( NSUInteger i = 0; i < n; i += _CombineBlockWords )
+	{
+		NSUInteger count = MIN(n - i, _CombineBlockWords);
+		const UInt64 * x = _BorrowWords(a, i, count, mine);
+		const UInt64 * y = _BorrowWords(b, i, count, theirs);
+		UInt64 * out = dst->words + i;
+		
+		switch ( op )
+		{
+			case AQBitOperationAnd:
+				for ( NSUInteger j = 0; j < count; j++ )
+					out[j] = x[j] & y[j];
+				break;
+			case AQBitOperationOr:
+				for ( NSUInteger j = 0; j < count; j++ )
+					out[j] = x[j] | y[j];
+				break;
+			case AQBitOperationXor:
+				for ( NSUInteger j = 0; j < count; j++ )
+					out[j] = x[j] ^ y[j];
+				break;
+			case AQBitOperationAndNot:
+				for ( NSUInteger j = 0; j < count; j++ )
+					out[j] = x[j] & ~y[j];
+				break;
+		}
+	}
+	
+	dst->fill = fill;
+	AQBitStorageTrim(dst);
+}
+
+static void _ChunkedCombine( AQBitStorage * dst, const AQBitStorage * a, const AQBitStorage * b, AQBitOperation op )
+{
+	// chunks held only by 'a' come through unchanged when b's fill value has no effect on them
+	BOOL keepsFirst = (_ApplyOperation(op, 0ull, b->fill) == 0ull && _ApplyOperation(op, ~0ull, b->fill) == ~0ull);
+	
+	AQBitStorage result;
+	AQBitStorageInitChunked(&result);
+	result.fill = _ApplyOperation(op, a->fill, b->fill);
+	
+	UInt64 * mine = (UInt64 *) _Reallocate(NULL, _WordsPerChunk * 2, sizeof(UInt64));
+	UInt64 * theirs = mine + _WordsPerChunk;
+	
+	// visit every chunk which is stored by either side
+	for ( NSUInteger key = 0; ; key++ )
+	{
+		NSUInteger myKey = _NextStoredKey(a, key);
+		NSUInteger theirKey = _NextStoredKey(b, key);
+		key = MIN(myKey, theirKey);
+		if ( key == NSNotFound )
+			break;
+		
+		if ( key != theirKey && keepsFirst && a->mode == AQBitStorageChunked )
+		{
+			// the result shares the chunk's contents rather than copying them
+			NSUInteger index;
+			_FindChunk(a, key, &index);
+			AQBitChunk * c = _InsertChunkSlot(&result, result.chunkCount);
+			*c = a->chunks[index];
+			_SharedRetain(c->data.ptr);
+			continue;
+		}
+		
+		_ReadWords(a, key * _WordsPerChunk, _WordsPerChunk, mine);
+		_ReadWords(b, key * _WordsPerChunk, _WordsPerChunk, theirs);
+		for ( UInt32 i = 0; i < _WordsPerChunk; i++ )
+			mine[i] = _ApplyOperation(op, mine[i], theirs[i]);
+		
+		if ( _WordsMatch(mine, _WordsPerChunk, result.fill) == NO )
+			_AppendChunkWords(&result, key, mine);
+	}
+	
+	free(mine);
+	AQBitStorageDestroy(dst);
+	*dst = result;
+}
+
+void AQBitStorageCombine( AQBitStorage * dst, const AQBitStorage * a, const AQBitStorage * b, AQBitOperation op )
+{
+	if ( dst->mode == AQBitStorageChunked )
+		_ChunkedCombine(dst, a, b, op);
+	else
+		_DenseCombine(dst, a, b, op);
+}
+
+void AQBitStorageOr( AQBitStorage * dst, const AQBitStorage * src )
+{
+	AQBitStorageCombine(dst, dst, src, AQBitOperationOr);
+}
+
+void AQBitStorageAnd( AQBitStorage * dst, const AQBitStorage * src )
+{
+	AQBitStorageCombine(dst, dst, src, AQBitOperationAnd);
+}
+
+void AQBitStorageCombineRange( AQBitStorage * s, const AQBitStorage * src, AQBitOperation op, NSRange range )
+{
+	range = AQBitStorageClampRange(range);
+	if ( range.length == 0 )
+		return;
+	
+	if ( s->mode == AQBitStorageChunked )
+	{
+		// restrict the operand to the range, with the operation's identity everywhere else
+		AQBitStorage restricted;
+		AQBitStorageInitChunked(&restricted);
+		AQBitStorageCombine(&restricted, src, src, AQBitOperationOr);
+		
+		CFBit identity = (op == AQBitOperationAnd ? 1 : 0);
+		AQBitStorageSetRange(&restricted, NSMakeRange(0, range.location), identity);
+		if ( NSMaxRange(range) != NSNotFound )
+			AQBitStorageSetRange(&restricted, NSMakeRange(NSMaxRange(range), NSNotFound - NSMaxRange(range)), identity);
+		
+		AQBitStorageCombine(s, s, &restricted, op);
+		AQBitStorageDestroy(&restricted);
+		return;
+	}
+	
+	NSUInteger first = AQWordIndexForBit(range.location);
+	UInt64 headMask = ~AQLowBitMask(AQBitOffsetInWord(range.location));
+	UInt64 tailMask = ~0ull;
+	NSUInteger last;
+	
+	if ( NSMaxRange(range) == NSNotFound )
+	{
+		// open-ended: the fill value changes too, so every stored word from 'first' up is affected
+		last = MAX(MAX(s->count, _StoredWordLimit(src)), first + 1) - 1;
+		AQBitStorageExpose(s, last + 1);
+	}
+	else
+	{
+		last = AQWordIndexForBit(NSMaxRange(range) - 1);
+		tailMask = AQLowBitMask(AQBitOffsetInWord(NSMaxRange(range) - 1) + 1);
+		
+		// words above both operands' stored words only change if the operation alters the fill value
+		NSUInteger limit = MAX(s->count, _StoredWordLimit(src));
+		if ( _ApplyOperation(op, s->fill, src->fill) == s->fill && last >= limit )
+		{
+			if ( first >= limit )
+				return;
+			last = limit - 1;
+			tailMask = ~0ull;
+		}
+		AQBitStorageExpose(s, last + 1);
+	}
+	
+	UInt64 buffer[_CombineBlockWords];
+	for ( NSUInteger i = first; i <= last; i += _CombineBlockWords )
+	{
+		NSUInteger count = MIN(last - i + 1, _CombineBlockWords);
+		const UInt64 * theirs = _BorrowWords(src, i, count, buffer);
+		for ( NSUInteger j = 0; j < count; j++ )
+		{
+			UInt64 mask = ~0ull;
+			if ( i + j == first )
+				mask &= headMask;
+			if ( i + j == last )
+				mask &= tailMask;
+			
+			UInt64 word = s->words[i+j];
+			s->words[i+j] = (word & ~mask) | (_ApplyOperation(op, word, theirs[j]) & mask);
+		}
+	}
+	
+	if ( NSMaxRange(range) == NSNotFound )
+		s->fill = _ApplyOperation(op, s->fill, src->fill);
+	AQBitStorageTrim(s);
+}
+
+static void _ChunkedShift( AQBitStorage * s, NSUInteger bits, BOOL up )
+{
+	NSUInteger chunkShift = bits / _BitsPerChunk;
+	NSUInteger wordShift = AQWordIndexForBit(bits);
+	NSUInteger bitShift = AQBitOffsetInWord(bits);
+	NSUInteger maxKey = _ChunkKeyForBit(NSNotFound - 1);
+	
+	// each source chunk lands across at most two destination chunks
+	NSUInteger * keys = (NSUInteger *) _Reallocate(NULL, s->chunkCount * 2, sizeof(NSUInteger));
+	NSUInteger keyCount = 0;
+	for ( NSUInteger i = 0; i < s->chunkCount; i++ )
+	{
+		NSUInteger key = s->chunks[i].key;
+		if ( up )
+		{
+			if ( key + chunkShift <= maxKey )
+				keys[keyCount++] = key + chunkShift;
+			if ( key + chunkShift + 1 <= maxKey )
+				keys[keyCount++] = key + chunkShift + 1;
+		}
+		else
+		{
+			if ( key > chunkShift )
+				keys[keyCount++] = key - chunkShift - 1;
+			if ( key >= chunkShift )
+				keys[keyCount++] = key - chunkShift;
+		}
+	}
+	
+	// shifting up a field filled with ones brings zeroes in at the bottom
+	NSUInteger zeroKeys = 0;
+	if ( up && s->fill != 0ull )
+		zeroKeys = MIN(_ChunkKeyForBit(bits - 1), maxKey) + 1;
+	
+	AQBitStorage result;
+	AQBitStorageInitChunked(&result);
+	result.fill = s->fill;
+	
+	UInt64 * source = (UInt64 *) _Reallocate(NULL, _WordsPerChunk * 2 + 1, sizeof(UInt64));
+	UInt64 * words = source + _WordsPerChunk + 1;
+	NSUInteger i = 0, zeroKey = 0, lastKey = NSNotFound;
+	
+	for ( ;; )
+	{
+		// take the next key in order from the zeroed keys or the chunk-derived ones
+		NSUInteger key = (i < keyCount ? keys[i] : NSNotFound);
+		if ( zeroKey < zeroKeys && zeroKey <= key )
+			key = zeroKey++;
+		else if ( i < keyCount )
+			i++;
+		else
+			break;
+		
+		if ( key == lastKey )
+			continue;
+		lastKey = key;
+		
+		// gather the source words whose bits land in this chunk, plus one for the funnel shift
+		NSUInteger target = key * _WordsPerChunk;
+		if ( up )
+		{
+			NSUInteger below = MIN(wordShift + 1 > target ? wordShift + 1 - target : 0, _WordsPerChunk + 1);
+			memset(source, 0, below * sizeof(UInt64));
+			_ReadWords(s, target + below - wordShift - 1, _WordsPerChunk + 1 - below, source + below);
+			for ( UInt32 j = 0; j < _WordsPerChunk; j++ )
+				words[j] = (bitShift == 0 ? source[j+1] : (source[j+1] << bitShift) | (source[j] >> (AQBitsPerWord - bitShift)));
+		}
+		else
+		{
+			_ReadWords(s, target + wordShift, _WordsPerChunk + 1, source);
+			for ( UInt32 j = 0; j < _WordsPerChunk; j++ )
+				words[j] = (bitShift == 0 ? source[j] : (source[j] >> bitShift) | (source[j+1] << (AQBitsPerWord - bitShift)));
+		}
+		
+		if ( _WordsMatch(words, _WordsPerChunk, result.fill) == NO )
+			_AppendChunkWords(&result, key, words);
+	}
+	
+	free(source);
+	free(keys);
+	AQBitStorageDestroy(s);
+	*s = result;
+}
+
+void AQBitStorageShiftDown( AQBitStorage * s, NSUInteger bits )
+{
+	if ( bits == 0 )
+		return;
+	
+	if ( s->mode == AQBitStorageChunked )
+	{
+		_ChunkedShift(s, bits, NO);
+		return;
+	}
+	
+	NSUInteger wordShift = AQWordIndexForBit(bits);
+	NSUInteger bitShift = AQBitOffsetInWord(bits);
+	
+	if ( wordShift >= s->count )
+	{
+		// every stored word drops off the bottom; only the fill remains
+		s->count = 0;
+		return;
+	}
+	
+	NSUInteger n = s->count - wordShift;
+	AQBitStorageReserve(s, s->count);
+	
+	if ( bitShift == 0 )
+	{
+		memmove(s->words, s->words + wordShift, n * sizeof(UInt64));
+	}
+	else
+	{
+		// funnel each pair of adjacent source words into one destination word
+		for ( NSUInteger i = 0; i < n; i++ )
+		{
+			UInt64 lo = s->words[i + wordShift];
+			UInt64 hi = AQBitStorageWordAtIndex(s, i + wordShift + 1);
+			s->words[i] = (lo >> bitShift) | (hi << (AQBitsPerWord - bitShift));
+		}
+	}
+	
+	s->count = n;
+	AQBitStorageTrim(s);
+}
+
+void AQBitStorageShiftUp( AQBitStorage * s, NSUInteger bits )
+{
+	if ( bits == 0 )
+		return;
+	
+	if ( bits >= NSNotFound )
+	{
+		// everything moves beyond the last valid index
+		AQBitStorageSetRange(s, NSMakeRange(0, NSNotFound), 0);
+		return;
+	}
+	
+	if ( s->mode == AQBitStorageChunked )
+	{
+		_ChunkedShift(s, bits, YES);
+		return;
+	}
+	
+	if ( s->count == 0 && s->fill == 0ull )
+		return;
+	
+	NSUInteger wordShift = AQWordIndexForBit(bits);
+	NSUInteger bitShift = AQBitOffsetInWord(bits);
+	NSUInteger oldCount = s->count;
+	NSUInteger newCount = oldCount + wordShift + (bitShift != 0 ? 1 : 0);
+	
+	AQBitStorageReserve(s, newCount);
+	
+	if ( bitShift == 0 )
+	{
+		memmove(s->words + wordShift, s->words, oldCount * sizeof(UInt64));
+	}
+	else
+	{
+		// work downwards so each source word is read before it's overwritten
+		for ( NSUInteger i = newCount; i-- > wordShift; )
+		{
+			NSUInteger src = i - wordShift;
+			UInt64 hi = (src < oldCount ? s->words[src] : s->fill);
+			UInt64 lo = (src > 0 ? s->words[src-1] : 0ull);
+			s->words[i] = (hi << bitShift) | (lo >> (AQBitsPerWord - bitShift));
+		}
+	}
+	
+	for ( NSUInteger i = 0; i < wordShift; i++ )
+		s->words[i] = 0ull;
+	
+	s->count = newCount;
+	AQBitStorageTrim(s);
+}
+
+// funnels 'count' words starting 'shift' bits into 'source' into 'words'; 'source' must hold count+1 words
+static inline void _FunnelWords( UInt64 * words, const UInt64 * source, NSUInteger count, NSUInteger shift )
+{
+	if ( shift == 0 )
+	{
+		memmove(words, source, count * sizeof(UInt64));
+		return;
+	}
+	
+	for ( NSUInteger i = 0; i < count; i++ )
+		words[i] = (source[i] >> shift) | (source[i+1] << (AQBitsPerWord - shift));
+}
+
+void AQBitStorageExtract( AQBitStorage * dst, const AQBitStorage * src, NSRange range )
+{
+	range = AQBitStorageClampRange(range);
+	
+	NSUInteger first = AQWordIndexForBit(range.location);
+	NSUInteger shift = AQBitOffsetInWord(range.location);
+	NSUInteger needed = (range.length == 0 ? 0 : AQWordIndexForBit(range.length - 1) + 1);
+	BOOL bounded = (NSMaxRange(range) != NSNotFound);
+	
+	// only destination words which draw on a stored source word need computing; the rest are src's fill
+	NSUInteger limit = _StoredWordLimit(src);
+	NSUInteger count = MIN(limit > first ? limit - first : 0, needed);
+	UInt64 fill = src->fill;
+	
+	if ( dst->mode == AQBitStorageDense )
+	{
+		// moving downwards, so each source word is read before it can be overwritten when dst is src
+		AQBitStorageReserve(dst, count);
+		
+		UInt64 buffer[_CombineBlockWords + 1];
+		for ( NSUInteger i = 0; i < count; i += _CombineBlockWords )
+		{
+			NSUInteger n = MIN(count - i, _CombineBlockWords);
+			_FunnelWords(dst->words + i, _BorrowWords(src, first + i, n + 1, buffer), n, shift);
+		}
+		
+		dst->count = count;
+	}
+	else
+	{
+		AQBitStorage result;
+		AQBitStorageInitChunked(&result);
+		result.fill = fill;
+		
+		UInt64 * source = (UInt64 *) _Reallocate(NULL, _WordsPerChunk * 2 + 1, sizeof(UInt64));
+		UInt64 * words = source + _WordsPerChunk + 1;
+		
+		for ( NSUInteger key = 0; key * _WordsPerChunk < count; )
+		{
+			// skip destination chunks whose source words are all implied by the fill value
+			NSUInteger start = first + key * _WordsPerChunk;
+			NSUInteger stored = _NextStoredKey(src, _ChunkKeyForWord(start));
+			if ( stored == NSNotFound )
+				break;
+			if ( stored * _WordsPerChunk > start + _WordsPerChunk )
+			{
+				key = (stored * _WordsPerChunk - first - 1) / _WordsPerChunk;
+				continue;
+			}
+			
+			// words from 'count' upwards draw on bits beyond the range, so they take the fill value
+			NSUInteger n = MIN(count - key * _WordsPerChunk, _WordsPerChunk);
+			_ReadWords(src, start, n + 1, source);
+			_FunnelWords(words, source, n, shift);
+			for ( NSUInteger i = n; i < _WordsPerChunk; i++ )
+				words[i] = fill;
+			if ( _WordsMatch(words, _WordsPerChunk, fill) == NO )
+				_AppendChunkWords(&result, key, words);
+			key++;
+		}
+		
+		free(source);
+		AQBitStorageDestroy(dst);
+		*dst = result;
+	}
+	
+	dst->fill = fill;
+	if ( bounded && fill != 0ull )
+	{
+		// everything at or above range.length came from outside the range
+		AQBitStorageSetRange(dst, NSMakeRange(range.length, NSNotFound - range.length), 0);
+	}
+	else if ( bounded && count != 0 && count == needed )
+	{
+		// only the top word can hold bits from beyond the range
+		if ( dst->mode == AQBitStorageDense )
+			dst->words[count-1] &= AQLowBitMask(AQBitOffsetInWord(range.length - 1) + 1);
+		else
+			AQBitStorageSetRange(dst, NSMakeRange(range.length, count * AQBitsPerWord - range.length), 0);
+	}
+	
+	if ( dst->mode == AQBitStorageDense )
+		AQBitStorageTrim(dst);
+}
+
+#pragma mark - Queries
+
+static NSUInteger _ChunkedCountOnes( const AQBitStorage * s, NSUInteger location, NSUInteger end )
+{
+	// start from the fill value's contribution, then correct it for each stored chunk
+	NSUInteger total = (s->fill != 0ull ? end - location : 0);
+	NSUInteger index;
+	_FindChunk(s, _ChunkKeyForBit(location), &index);
+	
+	for ( ; index < s->chunkCount; index++ )
+	{
+		const AQBitChunk * c = &s->chunks[index];
+		NSUInteger chunkStart = c->key * _BitsPerChunk;
+		if ( chunkStart >= end )
+			break;
+		
+		UInt32 lo = (UInt32)(MAX(location, chunkStart) - chunkStart);
+		UInt32 hi = (UInt32)(MIN(end, chunkStart + _BitsPerChunk) - chunkStart);
+		UInt32 ones = _ChunkCountOnes(c, lo, hi);
+		if ( s->fill != 0ull )
+			total -= (hi - lo) - ones;
+		else
+			total += ones;
+	}
+	
+	return ( total );
+}
+
+static NSUInteger _ChunkedNextIndexOfBit( const AQBitStorage * s, NSUInteger location, CFBit bit )
+{
+	BOOL fillMatches = ((s->fill != 0ull) == (bit != 0));
+	NSUInteger key = _ChunkKeyForBit(location);
+	NSUInteger from = location - key * _BitsPerChunk;
+	NSUInteger index;
+	BOOL found = _FindChunk(s, key, &index);
+	
+	for ( ;; )
+	{
+		if ( !found )
+		{
+			// an unallocated chunk holds nothing but the fill value
+			if ( fillMatches )
+				return ( _ClampIndex(key * _BitsPerChunk + from) );
+			if ( index == s->chunkCount )
+				return ( NSNotFound );
+			
+			key = s->chunks[index].key;
+			from = 0;
+		}
+		
+		UInt32 result = _ChunkNextBit(&s->chunks[index], (UInt32)from, bit);
+		if ( result < _BitsPerChunk )
+			return ( _ClampIndex(key * _BitsPerChunk + result) );
+		
+		index++;
+		key++;
+		from = 0;
+		found = (index < s->chunkCount && s->chunks[index].key == key);
+	}
+}
+
+static NSUInteger _ChunkedPreviousIndexOfBit( const AQBitStorage * s, NSUInteger location, CFBit bit )
+{
+	BOOL fillMatches = ((s->fill != 0ull) == (bit != 0));
+	NSUInteger key = _ChunkKeyForBit(location);
+	NSUInteger from = location - key * _BitsPerChunk;
+	NSUInteger index;
+	BOOL found = _FindChunk(s, key, &index);
+	
+	for ( ;; )
+	{
+		if ( !found )
+		{
+			// an unallocated chunk holds nothing but the fill value; 'index' is the next chunk above it
+			if ( fillMatches )
+				return ( key * _BitsPerChunk + from );
+			if ( index == 0 )
+				return ( NSNotFound );
+			
+			index--;
+			key = s->chunks[index].key;
+			from = _BitsPerChunk - 1;
+		}
+		
+		NSInteger result = _ChunkPreviousBit(&s->chunks[index], (UInt32)from, bit);
+		if ( result >= 0 )
+			return ( key * _BitsPerChunk + (NSUInteger)result );
+		if ( key == 0 )
+			return ( NSNotFound );
+		
+		key--;
+		from = _BitsPerChunk - 1;
+		found = (index > 0 && s->chunks[index-1].key == key);
+		if ( found )
+			index--;
+	}
+}
+
+NSUInteger AQBitStorageCountOnes( const AQBitStorage * s, NSRange range )
+{
+	range = AQBitStorageClampRange(range);
+	if ( range.length == 0 )
+		return ( 0 );
+	
+	NSUInteger end = NSMaxRange(range);
+	if ( s->mode == AQBitStorageChunked )
+		return ( _ChunkedCountOnes(s, range.location, end) );
+	
+	NSUInteger first = AQWordIndexForBit(range.location);
+	NSUInteger last = AQWordIndexForBit(end - 1);
+	NSUInteger total = 0;
+	
+	for ( NSUInteger i = first; i <= last && i < s->count; i++ )
+	{
+		UInt64 word = s->words[i];
+		if ( i == first )
+			word &= ~AQLowBitMask(AQBitOffsetInWord(range.location));
+		if ( i == last )
+			word &= AQLowBitMask(AQBitOffsetInWord(end - 1) + 1);
+		total += _CountSetBits(word);
+	}
+	
+	if ( s->fill != 0ull && last >= s->count )
+	{
+		// every bit above the stored words is set
+		NSUInteger from = MAX(range.location, s->count * AQBitsPerWord);
+		total += end - from;
+	}
+	
+	return ( total );
+}
+
+NSUInteger AQBitStorageNextIndex( const AQBitStorage * s, NSUInteger location, CFBit bit )
+{
+	if ( location >= NSNotFound )
+		return ( NSNotFound );
+	if ( s->mode == AQBitStorageChunked )
+		return ( _ChunkedNextIndexOfBit(s, location, bit) );
+	
+	// search for 1 bits in (word ^ flip)
+	UInt64 flip = (bit ? 0ull : ~0ull);
+	NSUInteger wordIndex = AQWordIndexForBit(location);
+	UInt64 word = (AQBitStorageWordAtIndex(s, wordIndex) ^ flip) & ~AQLowBitMask(AQBitOffsetInWord(location));
+	
+	while ( word == 0 )
+	{
+		if ( ++wordIndex >= s->count )
+		{
+			if ( (s->fill ^ flip) == 0ull )
+				return ( NSNotFound );
+			return ( _ClampIndex(MAX(wordIndex * AQBitsPerWord, location)) );
+		}
+		
+		word = s->words[wordIndex] ^ flip;
+	}
+	
+	return ( _ClampIndex(wordIndex * AQBitsPerWord + _LowestSetBit(word)) );
+}
+
+NSUInteger AQBitStorageFirstIndex( const AQBitStorage * s, CFBit bit )
+{
+	return ( AQBitStorageNextIndex(s, 0, bit) );
+}
+
+NSUInteger AQBitStoragePreviousIndex( const AQBitStorage * s, NSUInteger location, CFBit bit )
+{
+	if ( location == NSNotFound )
+		return ( NSNotFound );
+	location = MIN(location, NSNotFound - 1);
+	if ( s->mode == AQBitStorageChunked )
+		return ( _ChunkedPreviousIndexOfBit(s, location, bit) );
+	
+	// search for 1 bits in (word ^ flip)
+	UInt64 flip = (bit ? 0ull : ~0ull);
+	NSUInteger wordIndex = AQWordIndexForBit(location);
+	if ( wordIndex >= s->count )
+	{
+		if ( (s->fill ^ flip) != 0ull )
+			return ( location );
+		if ( s->count == 0 )
+			return ( NSNotFound );
+		
+		// continue from the top of the stored words
+		wordIndex = s->count - 1;
+		location = (wordIndex * AQBitsPerWord) + (AQBitsPerWord - 1);
+	}
+	
+	UInt64 word = (s->words[wordIndex] ^ flip) & AQLowBitMask(AQBitOffsetInWord(location) + 1);
+	while ( word == 0 )
+	{
+		if ( wordIndex-- == 0 )
+			return ( NSNotFound );
+		word = s->words[wordIndex] ^ flip;
+	}
+	
+	return ( wordIndex * AQBitsPerWord + _HighestSetBit(word) );
+}
+
+NSUInteger AQBitStorageLastIndex( const AQBitStorage * s, CFBit bit )
+{
+	return ( AQBitStoragePreviousIndex(s, NSNotFound - 1, bit) );
+}
+
+NSRange AQBitStorageNextRun( const AQBitStorage * s, NSUInteger location )
+{
+	NSUInteger start = AQBitStorageNextIndex(s, location, 1);
+	if ( start == NSNotFound )
+		return ( NSMakeRange(NSNotFound, 0) );
+	
+	NSUInteger end = AQBitStorageNextIndex(s, start, 0);
+	return ( NSMakeRange(start, end - start) );
+}
+
+BOOL AQBitStorageEqual( const AQBitStorage * a, const AQBitStorage * b )
+{
+	if ( a->fill != b->fill )
+		return ( NO );
+	
+	if ( a->mode == AQBitStorageDense && b->mode == AQBitStorageDense )
+	{
+		NSUInteger n = MAX(a->count, b->count);
+		for ( NSUInteger i = 0; i < n; i++ )
+		{
+			if ( AQBitStorageWordAtIndex(a, i) != AQBitStorageWordAtIndex(b, i) )
+				return ( NO );
+		}
+		
+		return ( YES );
+	}
+	
+	// compare a chunk-sized block at a time, visiting only blocks stored by either side
+	UInt64 * mine = (UInt64 *) _Reallocate(NULL, _WordsPerChunk * 2, sizeof(UInt64));
+	UInt64 * theirs = mine + _WordsPerChunk;
+	BOOL result = YES;
+	
+	for ( NSUInteger key = 0; result; key++ )
+	{
+		key = MIN(_NextStoredKey(a, key), _NextStoredKey(b, key));
+		if ( key == NSNotFound )
+			break;
+		
+		_ReadWords(a, key * _WordsPerChunk, _WordsPerChunk, mine);
+		_ReadWords(b, key * _WordsPerChunk, _WordsPerChunk, theirs);
+		result = (memcmp(mine, theirs, _WordsPerChunk * sizeof(UInt64)) == 0);
+	}
+	
+	free(mine);
+	return ( result );
+}
+
+static inline UInt64 _HashWord( UInt64 hash, NSUInteger index, UInt64 word )
+{
+	return ( (hash * 31ull) ^ word ^ ((UInt64)index * 0xC2B2AE3D27D4EB4Full) );
+}
+
+NSUInteger AQBitStorageHash( const AQBitStorage * s )
+{
+	// only words differing from the fill contribute, so equal bitfields hash identically in either mode
+	UInt64 hash = (s->fill != 0ull ? 0x9E3779B97F4A7C15ull : 0ull);
+	
+	if ( s->mode == AQBitStorageDense )
+	{
+		for ( NSUInteger i = 0; i < s->count; i++ )
+		{
+			if ( s->words[i] != s->fill )
+				hash = _HashWord(hash, i, s->words[i]);
+		}
+	}
+	else
+	{
+		UInt64 words[_WordsPerChunk];
+		for ( NSUInteger i = 0; i < s->chunkCount; i++ )
+		{
+			NSUInteger first = s->chunks[i].key * _WordsPerChunk;
+			_ChunkReadWords(&s->chunks[i], 0, _WordsPerChunk, words);
+			for ( NSUInteger j = 0; j < _WordsPerChunk; j++ )
+			{
+				if ( words[j] != s->fill )
+					hash = _HashWord(hash, first + j, words[j]);
+			}
+		}
+	}
+	
+	return ( (NSUInteger)(hash ^ (hash >> 32)) );
+}
+
+static BOOL _HasOnesFromWord( const AQBitStorage * s, NSUInteger wordIndex )
+{
+	if ( s->fill != 0ull )
+		return ( YES );
+	
+	for ( NSUInteger i = wordIndex; i < s->count; i++ )
+	{
+		if ( s->words[i] != 0ull )
+			return ( YES );
+	}
+	
+	return ( NO );
+}
+
+static NSComparisonResult _CompareRuns( const AQBitStorage * a, const AQBitStorage * b )
+{
+	// walk both sets of runs looking for the lowest index held by only one of the two
+	NSUInteger location = 0;
+	for ( ;; )
+	{
+		NSUInteger mine = AQBitStorageNextIndex(a, location, 1);
+		NSUInteger theirs = AQBitStorageNextIndex(b, location, 1);
+		if ( mine != theirs )
+		{
+			// whichever has the lower index sorts first, unless the other has no more set bits at all
+			if ( mine < theirs )
+				return ( theirs != NSNotFound ? NSOrderedAscending : NSOrderedDescending );
+			return ( mine != NSNotFound ? NSOrderedDescending : NSOrderedAscending );
+		}
+		if ( mine == NSNotFound )
+			return ( NSOrderedSame );
+		
+		NSUInteger myEnd = AQBitStorageNextIndex(a, mine, 0);
+		NSUInteger theirEnd = AQBitStorageNextIndex(b, theirs, 0);
+		if ( myEnd == theirEnd )
+		{
+			if ( myEnd == NSNotFound )
+				return ( NSOrderedSame );
+			location = myEnd;
+			continue;
+		}
+		
+		// the shorter run's owner lacks the first index past its end
+		if ( myEnd < theirEnd )
+			return ( AQBitStorageNextIndex(a, myEnd, 1) != NSNotFound ? NSOrderedDescending : NSOrderedAscending );
+		return ( AQBitStorageNextIndex(b, theirEnd, 1) != NSNotFound ? NSOrderedAscending : NSOrderedDescending );
+	}
+}
+
+NSComparisonResult AQBitStorageCompare( const AQBitStorage * a, const AQBitStorage * b )
+{
+	// Orders bitfields by their sorted lists of set indices, compared lexicographically.
+	if ( a->mode == AQBitStorageChunked || b->mode == AQBitStorageChunked )
+		return ( _CompareRuns(a, b) );
+	
+	NSUInteger n = MAX(a->count, b->count);
+	for ( NSUInteger i = 0; i <= n; i++ )
+	{
+		UInt64 mine = AQBitStorageWordAtIndex(a, i);
+		UInt64 theirs = AQBitStorageWordAtIndex(b, i);
+		if ( mine == theirs )
+			continue;
+		
+		// the lowest differing bit is set in exactly one of the two
+		NSUInteger bit = _LowestSetBit(mine ^ theirs);
+		UInt64 above = (bit == 63 ? 0ull : ~0ull << (bit + 1));
+		BOOL aHasBit = ((mine >> bit) & 1ull) != 0;
+		const AQBitStorage * other = (aHasBit ? b : a);
+		UInt64 otherWord = (aHasBit ? theirs : mine);
+		
+		// whichever has the bit sorts first, unless the other has no more set bits at all
+		BOOL otherContinues = ((otherWord & above) != 0ull) || _HasOnesFromWord(other, i + 1);
+		if ( aHasBit )
+			return ( otherContinues ? NSOrderedAscending : NSOrderedDescending );
+		return ( otherContinues ? NSOrderedDescending : NSOrderedAscending );
+	}
+	
+	return ( NSOrderedSame );
+}
+
+#pragma mark - Comparison Kernels
+
+// number of words compared per pass; source words are staged through stack buffers of this size
+#define _KernelBlockWords	256
+
+// returns YES if ((src >> shift) ^ value) & mask is zero for 'count' words; src must hold count+1 words
+static BOOL _KernelWordsMatch( const UInt64 * src, const UInt64 * value, const UInt64 * mask, NSUInteger count, NSUInteger shift )
+{
+	NSUInteger i = 0;
+	
+#if defined(__AVX2__)
+	__m128i right = _mm_cvtsi32_si128((int)shift);
+	__m128i left = _mm_cvtsi32_si128((int)(AQBitsPerWord - shift));		// shifting by 64 yields zero
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(src + i + 1));
+		__m256i diff = _mm256_xor_si256(_mm256_or_si256(_mm256_srl_epi64(lo, right), _mm256_sll_epi64(hi, left)),
+										 _mm256_loadu_si256((const __m256i *)(value + i)));
+		if ( mask != NULL )
+			diff = _mm256_and_si256(diff, _mm256_loadu_si256((const __m256i *)(mask + i)));
+		if ( _mm256_testz_si256(diff, diff) == 0 )
+			return ( NO );
+	}
+#elif defined(__SSE2__)
+	__m128i right = _mm_cvtsi32_si128((int)shift);
+	__m128i left = _mm_cvtsi32_si128((int)(AQBitsPerWord - shift));		// shifting by 64 yields zero
+	__m128i zero = _mm_setzero_si128();
+	for ( ; i + 2 <= count; i += 2 )
+	{
+		__m128i lo = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(src + i + 1));
+		__m128i diff = _mm_xor_si128(_mm_or_si128(_mm_srl_epi64(lo, right), _mm_sll_epi64(hi, left)),
+									 _mm_loadu_si128((const __m128i *)(value + i)));
+		if ( mask != NULL )
+			diff = _mm_and_si128(diff, _mm_loadu_si128((const __m128i *)(mask + i)));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi32(diff, zero)) != 0xFFFF )
+			return ( NO );
+	}
+#endif
+	
+	for ( ; i < count; i++ )
+	{
+		UInt64 word = (shift == 0 ? src[i] : (src[i] >> shift) | (src[i+1] << (AQBitsPerWord - shift)));
+		UInt64 diff = word ^ value[i];
+		if ( mask != NULL )
+			diff &= mask[i];
+		if ( diff != 0ull )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+BOOL AQBitStorageMaskedEqual( const AQBitStorage * s, NSUInteger location, NSUInteger length, const AQBitStorage * value, const AQBitStorage * mask )
+{
+	if ( location >= NSNotFound )
+		return ( YES );
+	length = MIN(length, NSNotFound - location);
+	if ( length == 0 )
+		return ( YES );
+	
+	NSUInteger base = AQWordIndexForBit(location);
+	NSUInteger shift = AQBitOffsetInWord(location);
+	NSUInteger count = AQWordIndexForBit(length - 1) + 1;
+	UInt64 tailMask = AQLowBitMask(AQBitOffsetInWord(length - 1) + 1);
+	
+	// past this word every input holds only its fill value, so one more word decides the rest
+	NSUInteger sourceLimit = _StoredWordLimit(s);
+	NSUInteger constant = MAX(_StoredWordLimit(value), (sourceLimit > base ? sourceLimit - base : 0));
+	if ( mask != NULL )
+	{
+		constant = MAX(constant, _StoredWordLimit(mask));
+		if ( mask->fill == 0ull )
+			count = MIN(count, constant);		// nothing above the mask's words is compared
+	}
+	if ( constant + 1 < count )
+	{
+		count = constant + 1;
+		tailMask = ~0ull;
+	}
+	
+	UInt64 sourceBuffer[_KernelBlockWords + 1];
+	UInt64 valueBuffer[_KernelBlockWords];
+	UInt64 maskBuffer[_KernelBlockWords];
+	NSUInteger i = 0;
+	
+	while ( i < count )
+	{
+		if ( mask != NULL && mask->fill == 0ull )
+		{
+			// skip whole chunks of a sparse mask which compare nothing
+			NSUInteger key = _NextStoredKey(mask, _ChunkKeyForWord(i));
+			if ( key == NSNotFound )
+				break;
+			i = MAX(i, key * _WordsPerChunk);
+			if ( i >= count )
+				break;
+		}
+		
+		NSUInteger n = MIN(count - i, _KernelBlockWords);
+		const UInt64 * words = _BorrowWords(s, base + i, n + 1, sourceBuffer);
+		const UInt64 * values = _BorrowWords(value, i, n, valueBuffer);
+		const UInt64 * masks = (mask != NULL ? _BorrowWords(mask, i, n, maskBuffer) : NULL);
+		
+		// the final word may only be partially covered by the range
+		NSUInteger full = (i + n == count && tailMask != ~0ull ? n - 1 : n);
+		if ( _KernelWordsMatch(words, values, masks, full, shift) == NO )
+			return ( NO );
+		
+		if ( full != n )
+		{
+			UInt64 word = (shift == 0 ? words[full] : (words[full] >> shift) | (words[full+1] << (AQBitsPerWord - shift)));
+			UInt64 diff = (word ^ values[full]) & tailMask;
+			if ( masks != NULL )
+				diff &= masks[full];
+			if ( diff != 0ull )
+				return ( NO );
+		}
+		
+		i += n;
+	}
+	
+	return ( YES );
+}
+
+#pragma mark - Serialization
+
+/*
+ Encoded layout, with every multi-byte value little-endian:
+ 
+	0	'A' 'Q' 'B' 'F'
+	4	UInt8	format version
+	5	UInt8	payload encoding: _EncodingWords or _EncodingRuns
+	6	UInt8	flags: _EncodingFlagFill, _EncodingFlagChunked
+	7	UInt8	reserved, always zero
+	8	UInt64	number of words covered by the payload; every bit above them has the fill value
+	16	payload
+ 
+ A word payload holds each word in turn as a UInt64. A run payload holds each run of set bits as a
+ pair of LEB128 integers: the number of clear bits since the end of the previous run, then its length.
+ The encoder writes whichever of the two is smaller.
+ */
+
+#define _EncodingVersion		1
+#define _EncodingHeaderLength	16
+
+enum
+{
+	_EncodingWords,
+	_EncodingRuns
+};
+
+enum
+{
+	_EncodingFlagFill		= 1 << 0,		// bits above the payload are all ones
+	_EncodingFlagChunked	= 1 << 1		// the storage used chunked mode
+};
+
+static const UInt8 _EncodingMagic[4] = { 'A', 'Q', 'B', 'F' };
+
+// run-encoded data can describe far more bits than it takes to store, so decoding it is limited to what the
+// payload could plausibly need: dense storage up to this many words, and beyond that one chunk per payload byte
+#define _MaxRunDecodeWords			(1u << 20)
+#define _MinRunDecodeChunks			1024u
+
+static inline NSUInteger _VarintLength( UInt64 value )
+{
+	NSUInteger length = 1;
+	for ( ; value >= 0x80; value >>= 7 )
+		length++;
+	return ( length );
+}
+
+static inline UInt8 * _WriteVarint( UInt8 * p, UInt64 value )
+{
+	for ( ; value >= 0x80; value >>= 7 )
+		*p++ = (UInt8)(value | 0x80);
+	*p++ = (UInt8)value;
+	return ( p );
+}
+
+static BOOL _ReadVarint( const UInt8 ** p, const UInt8 * end, UInt64 * value )
+{
+	UInt64 result = 0;
+	for ( NSUInteger shift = 0; shift < 64 && *p < end; shift += 7 )
+	{
+		UInt8 byte = *(*p)++;
+		
+		// the last byte holds a single bit, and _WriteVarint() never ends with a zero byte
+		if ( (shift == 63 && byte > 1) || (shift != 0 && byte == 0) )
+			return ( NO );
+		
+		result |= (UInt64)(byte & 0x7f) << shift;
+		if ( (byte & 0x80) == 0 )
+		{
+			*value = result;
+			return ( YES );
+		}
+	}
+	
+	return ( NO );		// truncated, or too long for 64 bits
+}
+
+// the number of words needed to hold every bit which differs from the fill value
+static NSUInteger _EncodedWordCount( const AQBitStorage * s )
+{
+	NSUInteger last = AQBitStoragePreviousIndex(s, NSNotFound - 1, (s->fill == 0ull ? 1 : 0));
+	return ( last == NSNotFound ? 0 : AQWordIndexForBit(last) + 1 );
+}
+
+// walks the runs of set bits below 'end', writing them out if 'p' is non-NULL; returns the encoded length
+static NSUInteger _EncodeRuns( const AQBitStorage * s, NSUInteger end, UInt8 * p )
+{
+	NSUInteger length = 0, previous = 0;
+	for ( NSRange run = AQBitStorageNextRun(s, 0); run.location < end; run = AQBitStorageNextRun(s, previous) )
+	{
+		NSUInteger last = MIN(NSMaxRange(run), end);
+		length += _VarintLength(run.location - previous) + _VarintLength(last - run.location);
+		if ( p != NULL )
+			p = _WriteVarint(_WriteVarint(p, run.location - previous), last - run.location);
+		
+		previous = last;
+		if ( previous == end )
+			break;
+	}
+	
+	return ( length );
+}
+
+NSUInteger AQBitStorageEncode( const AQBitStorage * s, UInt8 * bytes )
+{
+	NSUInteger wordCount = _EncodedWordCount(s);
+	NSUInteger wordsLength = wordCount * sizeof(UInt64);
+	NSUInteger bitCount = MIN(wordCount * AQBitsPerWord, NSNotFound);
+	NSUInteger runsLength = _EncodeRuns(s, bitCount, NULL);
+	UInt8 encoding = (runsLength < wordsLength ? _EncodingRuns : _EncodingWords);
+	
+	if ( bytes == NULL )
+		return ( _EncodingHeaderLength + MIN(wordsLength, runsLength) );
+	
+	memcpy(bytes, _EncodingMagic, sizeof(_EncodingMagic));
+	bytes[4] = _EncodingVersion;
+	bytes[5] = encoding;
+	bytes[6] = (s->fill != 0ull ? _EncodingFlagFill : 0) | (s->mode == AQBitStorageChunked ? _EncodingFlagChunked : 0);
+	bytes[7] = 0;
+	OSWriteLittleInt64(bytes, 8, (UInt64)wordCount);
+	
+	if ( encoding == _EncodingRuns )
+	{
+		_EncodeRuns(s, bitCount, bytes + _EncodingHeaderLength);
+		return ( _EncodingHeaderLength + runsLength );
+	}
+	
+	UInt64 buffer[_CombineBlockWords];
+	UInt8 * p = bytes + _EncodingHeaderLength;
+	for ( NSUInteger i = 0; i < wordCount; i += _CombineBlockWords )
+	{
+		NSUInteger count = MIN(wordCount - i, _CombineBlockWords);
+		const UInt64 * words = _BorrowWords(s, i, count, buffer);
+		for ( NSUInteger j = 0; j < count; j++, p += sizeof(UInt64) )
+			OSWriteLittleInt64(p, 0, words[j]);
+	}
+	
+	return ( _EncodingHeaderLength + wordsLength );
+}
+
+static BOOL _DecodeWords( AQBitStorage * s, const UInt8 * p, NSUInteger wordCount )
+{
+	if ( s->mode == AQBitStorageDense )
+	{
+		AQBitStorageReserve(s, wordCount);
+		for ( NSUInteger i = 0; i < wordCount; i++, p += sizeof(UInt64) )
+			s->words[i] = OSReadLittleInt64(p, 0);
+		s->count = wordCount;
+		AQBitStorageTrim(s);
+		return ( YES );
+	}
+	
+	UInt64 words[_WordsPerChunk];
+	for ( NSUInteger key = 0; key * _WordsPerChunk < wordCount; key++ )
+	{
+		NSUInteger count = MIN(wordCount - key * _WordsPerChunk, _WordsPerChunk);
+		for ( NSUInteger i = 0; i < _WordsPerChunk; i++ )
+			words[i] = (i < count ? OSReadLittleInt64(p, i * sizeof(UInt64)) : s->fill);
+		p += count * sizeof(UInt64);
+		
+		if ( _WordsMatch(words, _WordsPerChunk, s->fill) == NO )
+			_AppendChunkWords(s, key, words);
+	}
+	
+	return ( YES );
+}
+
+// sets a closed range, even one ending at NSNotFound which AQBitStorageSetRange() would treat as open-ended
+static void _DecodeRange( AQBitStorage * s, NSUInteger location, NSUInteger length, CFBit bit )
+{
+	if ( length == 0 )
+		return;
+	
+	if ( s->mode == AQBitStorageChunked )
+		_ChunkedModify(s, location, length, _ModifySet, (bit ? ~0ull : 0ull));
+	else
+		AQBitStorageSetRange(s, NSMakeRange(location, length), bit);
+}
+
+// the chunks spanned by a range of bits, used to measure what decoding it would allocate
+static inline NSUInteger _ChunksInRange( NSUInteger location, NSUInteger length )
+{
+	return ( length == 0 ? 0 : _ChunkKeyForBit(location + length - 1) - _ChunkKeyForBit(location) + 1 );
+}
+
+// validates a list of runs without decoding it, returning the dense words and the chunks it would write to
+static BOOL _MeasureRuns( const UInt8 * p, const UInt8 * end, NSUInteger bitCount, UInt64 fill, NSUInteger * words, NSUInteger * chunks )
+{
+	NSUInteger previous = 0, last = 0, count = 0;
+	while ( p < end )
+	{
+		UInt64 gap, length;
+		if ( _ReadVarint(&p, end, &gap) == NO || _ReadVarint(&p, end, &length) == NO )
+			return ( NO );
+		if ( gap > bitCount - previous || length == 0 || length > bitCount - previous - gap )
+			return ( NO );
+		
+		// the bits differing from the fill value are the ones which get stored
+		NSUInteger location = (fill == 0ull ? previous + (NSUInteger)gap : previous);
+		NSUInteger written = (NSUInteger)(fill == 0ull ? length : gap);
+		if ( written != 0 )
+		{
+			last = location + written;
+			count += MIN(_ChunksInRange(location, written), NSNotFound - count);
+		}
+		previous += (NSUInteger)(gap + length);
+	}
+	
+	if ( fill != 0ull && previous < bitCount )
+	{
+		last = bitCount;
+		count += MIN(_ChunksInRange(previous, bitCount - previous), NSNotFound - count);
+	}
+	
+	*words = (last == 0 ? 0 : AQWordIndexForBit(last - 1) + 1);
+	*chunks = count;
+	return ( YES );
+}
+
+static BOOL _DecodeRuns( AQBitStorage * s, const UInt8 * p, const UInt8 * end, NSUInteger bitCount )
+{
+	// only the bits which differ from the fill value are written, so nothing outside the runs is allocated
+	NSUInteger previous = 0;
+	while ( p < end )
+	{
+		UInt64 gap, length;
+		if ( _ReadVarint(&p, end, &gap) == NO || _ReadVarint(&p, end, &length) == NO )
+			return ( NO );
+		if ( gap > bitCount - previous || length == 0 || length > bitCount - previous - gap )
+			return ( NO );
+		
+		if ( s->fill == 0ull )
+			_DecodeRange(s, previous + (NSUInteger)gap, (NSUInteger)length, 1);
+		else
+			_DecodeRange(s, previous, (NSUInteger)gap, 0);
+		previous += (NSUInteger)(gap + length);
+	}
+	
+	if ( s->fill != 0ull )
+		_DecodeRange(s, previous, bitCount - previous, 0);
+	return ( YES );
+}
+
+BOOL AQBitStorageDecode( AQBitStorage * s, const UInt8 * bytes, NSUInteger length )
+{
+	if ( bytes == NULL || length < _EncodingHeaderLength || memcmp(bytes, _EncodingMagic, sizeof(_EncodingMagic)) != 0 )
+		return ( NO );
+	
+	UInt8 version = bytes[4], encoding = bytes[5], flags = bytes[6];
+	if ( version != _EncodingVersion || encoding > _EncodingRuns || (flags & ~(_EncodingFlagFill | _EncodingFlagChunked)) != 0 )
+		return ( NO );
+	
+	UInt64 wordCount = OSReadLittleInt64(bytes, 8);
+	UInt64 payloadLength = length - _EncodingHeaderLength;
+	if ( wordCount > AQWordIndexForBit(NSNotFound - 1) + 1 )
+		return ( NO );
+	if ( encoding == _EncodingWords && payloadLength != wordCount * sizeof(UInt64) )
+		return ( NO );
+	
+	// the last word may extend past the final valid index
+	NSUInteger bitCount = MIN((NSUInteger)wordCount * AQBitsPerWord, NSNotFound);
+	const UInt8 * payload = bytes + _EncodingHeaderLength;
+	UInt64 fill = ((flags & _EncodingFlagFill) ? ~0ull : 0ull);
+	BOOL chunked = ((flags & _EncodingFlagChunked) != 0);
+	
+	if ( encoding == _EncodingRuns )
+	{
+		// a few bytes of runs may claim an enormous bitfield: if that's too large to hold densely it's
+		// decoded into chunks, which only take space where bits are stored, and it's rejected if even those
+		// would be far larger than the data could justify
+		NSUInteger denseWords = 0, chunks = 0;
+		if ( _MeasureRuns(payload, bytes + length, bitCount, fill, &denseWords, &chunks) == NO )
+			return ( NO );
+		if ( denseWords > _MaxRunDecodeWords )
+			chunked = YES;
+		if ( chunked && chunks > MAX((NSUInteger)payloadLength, (NSUInteger)_MinRunDecodeChunks) )
+			return ( NO );
+	}
+	
+	AQBitStorage result;
+	if ( chunked )
+		AQBitStorageInitChunked(&result);
+	else
+		AQBitStorageInit(&result, 0);
+	result.fill = fill;
+	
+	BOOL decoded = (encoding == _EncodingWords ? _DecodeWords(&result, payload, (NSUInteger)wordCount) : _DecodeRuns(&result, payload, bytes + length, bitCount));
+	if ( decoded == NO )
+	{
+		AQBitStorageDestroy(&result);
+		return ( NO );
+	}
+	
+	AQBitStorageDestroy(s);
+	*s = result;
+	return ( YES );
+}
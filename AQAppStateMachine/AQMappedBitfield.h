@@ -0,0 +1,107 @@
+//
+//  AQMappedBitfield.h
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-12.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import <Foundation/Foundation.h>
+#import "AQNotifyingBitfield.h"
+
+/// When a mapped bitfield's changes are written back to its file.
+typedef enum
+{
+	/// Changes are only written out by flush:, or when the bitfield is deallocated.
+	AQMappedBitfieldFlushManually,
+	
+	/// Every modification schedules an asynchronous write of the mapping, without waiting for it to complete.
+	AQMappedBitfieldFlushAsynchronously,
+	
+	/// Every modification is written out, along with a new checksum, before the modifying method returns.
+	AQMappedBitfieldFlushSynchronously
+	
+} AQMappedBitfieldFlushPolicy;
+
+/// The error domain used when a file can't be attached as a mapped bitfield.
+extern NSString * const AQMappedBitfieldErrorDomain;
+
+enum
+{
+	/// The file is not a mapped bitfield, or its header is damaged.
+	AQMappedBitfieldUnrecognizedFileError = 1,
+	
+	/// The file was written using a layout version this class doesn't support.
+	AQMappedBitfieldUnsupportedVersionError,
+	
+	/// The file's contents don't match the checksum recorded when it was last flushed.
+	AQMappedBitfieldChecksumError
+};
+
+/**
+ A notifying bitfield whose bits live in a memory-mapped file.
+ 
+ The file holds a small header, recording a layout version and a checksum, followed by the bitfield's
+ storage words exactly as they're laid out in memory. Modifications land directly in the mapping, so
+ attaching to an existing file is a single `mmap()` call: no decoding or replaying of state is needed.
+ The file grows as higher bits are set.
+ 
+ Because every write goes straight into the shared mapping, it survives the process exiting or crashing.
+ The flushPolicy only determines when those writes are forced out to disk, which protects them against
+ a system crash as well. A file which was modified after its last flush is reopened without checking its
+ checksum, since the checksum is only recalculated by a flush.
+ 
+ Mapped bitfields always use dense storage. Copies are ordinary in-memory AQNotifyingBitfield instances.
+ */
+@interface AQMappedBitfield : AQNotifyingBitfield
+
+/**
+ Attach to the bitfield stored in a file, creating the file if it doesn't exist.
+ @param path The path of the file to map.
+ @param error On failure, set to an error in AQMappedBitfieldErrorDomain, or `NSPOSIXErrorDomain` if
+ the file couldn't be opened or mapped.
+ @return A bitfield containing the file's bits, or `nil` on failure.
+ */
+- (id) initWithContentsOfFile: (NSString *) path error: (NSError **) error;
+
+/// The path of the mapped file.
+@property (nonatomic, readonly) NSString * path;
+
+/// When modifications are written out to the file. Defaults to AQMappedBitfieldFlushManually. Modifications made within performBatchUpdates: are written out together, once the batch completes.
+@property (nonatomic) AQMappedBitfieldFlushPolicy flushPolicy;
+
+/**
+ Write all modifications out to the file, and record a checksum of its contents.
+ @param error On failure, set to an error in `NSPOSIXErrorDomain`.
+ @return `YES` if the file was written successfully, `NO` otherwise.
+ */
+- (BOOL) flush: (NSError **) error;
+
+@end
@@ -0,0 +1,374 @@
+//
+//  AQMappedBitfield.m
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-12.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQMappedBitfield.h"
+#import "AQBitfieldPrivate.h"
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <fcntl.h>
+#import <unistd.h>
+
+NSString * const AQMappedBitfieldErrorDomain = @"AQMappedBitfieldErrorDomain";
+
+/*
+ File layout: a _MappedHeaderSize-byte header, followed by the storage words. Everything is in host byte
+ order, so the words can be used in place; a file written with the other byte order fails the magic check.
+ */
+
+#define _MappedMagic			0x4D425141u		// 'AQBM'
+#define _MappedVersion			1
+#define _MappedHeaderSize		64				// keeps the words cache-line aligned
+#define _MappedFlagDirty		(1u << 0)		// modified since the checksum was last written
+
+typedef struct _MappedHeader
+{
+	UInt32	magic;
+	UInt16	version;
+	UInt16	headerSize;
+	UInt32	flags;
+	UInt32	reserved;
+	UInt64	checksum;		// covers count, fill, and the words in use
+	UInt64	count;			// number of words in use
+	UInt64	fill;			// value of every word at or above 'count'
+	
+} _MappedHeader;
+
+typedef struct _MappedFile
+{
+	AQBitStorageBacking		backing;		// first, so the storage's backing pointer leads back here
+	int						fd;
+	void *					mapping;
+	size_t					length;
+	
+} _MappedFile;
+
+static inline _MappedHeader * _HeaderOfFile( _MappedFile * file )
+{
+	return ( (_MappedHeader *)file->mapping );
+}
+
+static inline UInt64 * _WordsOfFile( _MappedFile * file )
+{
+	return ( (UInt64 *)((UInt8 *)file->mapping + _MappedHeaderSize) );
+}
+
+static inline NSUInteger _CapacityOfFile( _MappedFile * file )
+{
+	return ( (file->length - _MappedHeaderSize) / sizeof(UInt64) );
+}
+
+static UInt64 _Checksum( const UInt64 * words, NSUInteger count, UInt64 fill )
+{
+	// 64-bit FNV-1a, one word at a time
+	UInt64 sum = 0xcbf29ce484222325ull;
+	sum = (sum ^ (UInt64)count) * 0x100000001b3ull;
+	sum = (sum ^ fill) * 0x100000001b3ull;
+	for ( NSUInteger i = 0; i < count; i++ )
+		sum = (sum ^ words[i]) * 0x100000001b3ull;
+	
+	return ( sum );
+}
+
+static BOOL _SetError( NSError ** error, NSString * domain, NSInteger code, NSString * description )
+{
+	if ( error != NULL )
+	{
+		NSDictionary * info = (description == nil ? nil : [NSDictionary dictionaryWithObject: description forKey: NSLocalizedDescriptionKey]);
+		*error = [NSError errorWithDomain: domain code: code userInfo: info];
+	}
+	
+	return ( NO );
+}
+
+static inline BOOL _SetPOSIXError( NSError ** error )
+{
+	return ( _SetError(error, NSPOSIXErrorDomain, errno, nil) );
+}
+
+// maps 'length' bytes of the file, growing it first if necessary
+static BOOL _MapFile( _MappedFile * file, size_t length )
+{
+	size_t page = (size_t)getpagesize();
+	length = (length + page - 1) & ~(page - 1);
+	
+	struct stat info;
+	if ( fstat(file->fd, &info) != 0 )
+		return ( NO );
+	if ( (off_t)length > info.st_size && ftruncate(file->fd, (off_t)length) != 0 )
+		return ( NO );
+	
+	// map the new region before dropping the old one, so a failure leaves the bitfield intact
+	void * mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+	if ( mapping == MAP_FAILED )
+		return ( NO );
+	
+	if ( file->mapping != NULL )
+		munmap(file->mapping, file->length);
+	file->mapping = mapping;
+	file->length = length;
+	return ( YES );
+}
+
+static void _UnmapFile( _MappedFile * file )
+{
+	if ( file->mapping != NULL )
+		munmap(file->mapping, file->length);
+	if ( file->fd >= 0 )
+		close(file->fd);
+	
+	file->mapping = NULL;
+	file->length = 0;
+	file->fd = -1;
+}
+
+static UInt64 * _PrepareFileForWriting( AQBitStorageBacking * backing, NSUInteger capacity, NSUInteger * newCapacity )
+{
+	_MappedFile * file = (_MappedFile *)backing;
+	
+	// mark the file before any words change, so an interrupted write is never mistaken for a checksummed one
+	_MappedHeader * header = _HeaderOfFile(file);
+	header->flags |= _MappedFlagDirty;
+	
+	if ( capacity > _CapacityOfFile(file) )
+	{
+		// grow geometrically, as the heap-based storage does
+		NSUInteger words = MAX(capacity, _CapacityOfFile(file) * 2);
+		if ( _MapFile(file, _MappedHeaderSize + words * sizeof(UInt64)) == NO )
+			[NSException raise: NSMallocException format: @"Unable to grow mapped bitfield to %lu words (errno %d)", (unsigned long)words, errno];
+		header = _HeaderOfFile(file);
+	}
+	
+	if ( capacity > header->count )
+	{
+		// the header has to cover any words about to be written before they are, or they'd be lost if
+		// the process died before the next flush; until then the new words read as the fill value
+		UInt64 * words = _WordsOfFile(file);
+		for ( NSUInteger i = (NSUInteger)header->count; i < capacity; i++ )
+			words[i] = header->fill;
+		header->count = capacity;
+	}
+	
+	*newCapacity = _CapacityOfFile(file);
+	return ( _WordsOfFile(file) );
+}
+
+@implementation AQMappedBitfield
+{
+	NSString *					_path;
+	_MappedFile					_file;
+	AQMappedBitfieldFlushPolicy	_flushPolicy;
+	NSUInteger					_batchDepth;
+	BOOL						_batchModified;
+}
+
+@synthesize path=_path, flushPolicy=_flushPolicy;
+
+- (id) initWithCapacity: (NSUInteger) numberOfBits
+{
+	self = [super initWithCapacity: numberOfBits];
+	if ( self == nil )
+		return ( nil );
+	
+	_file.fd = -1;
+	
+	return ( self );
+}
+
+- (BOOL) _attachToFile: (NSError **) error
+{
+	_file.fd = open([_path fileSystemRepresentation], O_RDWR | O_CREAT, 0644);
+	if ( _file.fd < 0 )
+		return ( _SetPOSIXError(error) );
+	
+	struct stat info;
+	if ( fstat(_file.fd, &info) != 0 )
+		return ( _SetPOSIXError(error) );
+	
+	BOOL created = (info.st_size == 0);
+	if ( created == NO && info.st_size < _MappedHeaderSize + (off_t)sizeof(UInt64) )
+		return ( _SetError(error, AQMappedBitfieldErrorDomain, AQMappedBitfieldUnrecognizedFileError, @"The file is too small to hold a mapped bitfield") );
+	if ( created == NO && (info.st_size - _MappedHeaderSize) % (off_t)sizeof(UInt64) != 0 )
+		return ( _SetError(error, AQMappedBitfieldErrorDomain, AQMappedBitfieldUnrecognizedFileError, @"The mapped bitfield's size doesn't match its layout") );
+	
+	if ( _MapFile(&_file, (created ? _MappedHeaderSize + sizeof(UInt64) : (size_t)info.st_size)) == NO )
+		return ( _SetPOSIXError(error) );
+	
+	_MappedHeader * header = _HeaderOfFile(&_file);
+	if ( created )
+	{
+		header->magic = _MappedMagic;
+		header->version = _MappedVersion;
+		header->headerSize = _MappedHeaderSize;
+		header->checksum = _Checksum(NULL, 0, 0ull);
+	}
+	else if ( header->magic != _MappedMagic )
+	{
+		return ( _SetError(error, AQMappedBitfieldErrorDomain, AQMappedBitfieldUnrecognizedFileError, @"The file is not a mapped bitfield") );
+	}
+	else if ( header->version != _MappedVersion )
+	{
+		return ( _SetError(error, AQMappedBitfieldErrorDomain, AQMappedBitfieldUnsupportedVersionError, [NSString stringWithFormat: @"Mapped bitfield version %u is not supported", (unsigned)header->version]) );
+	}
+	// a file which wasn't flushed after its last change has no checksum to trust, so these checks of its
+	// layout are all it gets: the header has to describe words which actually exist in the file
+	else if ( header->headerSize != _MappedHeaderSize || header->count > _CapacityOfFile(&_file) || (header->fill != 0ull && header->fill != ~0ull) )
+	{
+		return ( _SetError(error, AQMappedBitfieldErrorDomain, AQMappedBitfieldUnrecognizedFileError, @"The mapped bitfield's header is damaged") );
+	}
+	else if ( (header->flags & _MappedFlagDirty) == 0 && header->checksum != _Checksum(_WordsOfFile(&_file), (NSUInteger)header->count, header->fill) )
+	{
+		return ( _SetError(error, AQMappedBitfieldErrorDomain, AQMappedBitfieldChecksumError, @"The mapped bitfield's contents don't match its checksum") );
+	}
+	
+	_file.backing.prepareForWriting = _PrepareFileForWriting;
+	AQBitStorageDestroy(&_storage);
+	AQBitStorageInitWithBacking(&_storage, &_file.backing, _WordsOfFile(&_file), (NSUInteger)header->count, _CapacityOfFile(&_file), header->fill);
+	return ( YES );
+}
+
+- (id) initWithContentsOfFile: (NSString *) path error: (NSError **) error
+{
+	self = [self initWithCapacity: 0];
+	if ( self == nil )
+		return ( nil );
+	
+	_path = [path copy];
+	if ( [self _attachToFile: error] == NO )
+	{
+		// leave a file we couldn't use exactly as we found it
+		_UnmapFile(&_file);
+#if !USING_ARC
+		[self release];
+#endif
+		return ( nil );
+	}
+	
+	return ( self );
+}
+
+- (void) dealloc
+{
+	if ( _file.mapping != NULL )
+	{
+		[self flush: NULL];
+		AQBitStorageDestroy(&_storage);
+	}
+	_UnmapFile(&_file);
+#if !USING_ARC
+	[_path release];
+	[super dealloc];
+#endif
+}
+
+- (id) copyWithZone: (NSZone *) zone
+{
+	// copies live on the heap, not in the file
+	AQNotifyingBitfield * bitfield = [[AQNotifyingBitfield alloc] init];
+	AQBitStorageDestroy(&bitfield->_storage);
+	AQBitStorageInitCopy(&bitfield->_storage, &_storage);
+	return ( bitfield );
+}
+
+- (void) _recordStorageState
+{
+	_MappedHeader * header = _HeaderOfFile(&_file);
+	header->count = _storage.count;
+	header->fill = _storage.fill;
+}
+
+- (BOOL) flush: (NSError **) error
+{
+	if ( _file.mapping == NULL )
+		return ( YES );
+	
+	[self _recordStorageState];
+	
+	// the words must be on disk before the header claims that the checksum describes them
+	if ( msync(_file.mapping, _file.length, MS_SYNC) != 0 )
+		return ( _SetPOSIXError(error) );
+	
+	_MappedHeader * header = _HeaderOfFile(&_file);
+	header->checksum = _Checksum(_storage.words, _storage.count, _storage.fill);
+	header->flags &= ~_MappedFlagDirty;
+	
+	if ( msync(_file.mapping, (size_t)getpagesize(), MS_SYNC) != 0 )
+		return ( _SetPOSIXError(error) );
+	
+	return ( YES );
+}
+
+- (void) _applyFlushPolicy
+{
+	switch ( _flushPolicy )
+	{
+		case AQMappedBitfieldFlushAsynchronously:
+			msync(_file.mapping, _file.length, MS_ASYNC);
+			break;
+		case AQMappedBitfieldFlushSynchronously:
+			[self flush: NULL];
+			break;
+		default:
+			break;
+	}
+}
+
+- (void) performBatchUpdates: (void (^)(void)) updates
+{
+	// a batch is written out once, when it completes
+	_batchDepth++;
+	[super performBatchUpdates: updates];
+	if ( --_batchDepth != 0 || _batchModified == NO )
+		return;
+	
+	_batchModified = NO;
+	if ( _file.mapping != NULL )
+		[self _applyFlushPolicy];
+}
+
+- (void) _updatedBitsInRange: (NSRange) range
+{
+	if ( _file.mapping != NULL )
+	{
+		[self _recordStorageState];
+		if ( _batchDepth == 0 )
+			[self _applyFlushPolicy];
+		else
+			_batchModified = YES;
+	}
+	
+	[super _updatedBitsInRange: range];
+}
+
+@end
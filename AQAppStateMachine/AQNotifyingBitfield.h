@@ -34,7 +34,9 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
 #import "AQBitfield.h"
+#import "AQBitfieldChange.h"
 
 /**
  A Block type for processing range modification notifications.
@@ -42,6 +44,47 @@
  */
 typedef void (^AQRangeNotification)(NSRange range);
 
+/**
+ A Block type for processing range modification notifications along with the values of the bits involved.
+ @param range The range of bits watched by the notifier.
+ @param change The values of the bits within _range_ before and after the modification.
+ */
+typedef void (^AQRangeChangeNotification)(NSRange range, AQBitfieldChange * change);
+
+/// How a notifier's block is run when the bits it watches are modified.
+typedef enum
+{
+	/// The block runs asynchronously on the default-priority global queue, possibly alongside other notifications.
+	AQNotificationDeliveryConcurrent,
+	
+	/// The block runs synchronously on the thread which modified the bitfield, before the modifying method returns.
+	AQNotificationDeliveryInline,
+	
+	/// The block runs asynchronously on a dispatch queue supplied by the caller.
+	AQNotificationDeliveryTargetQueue,
+	
+	/// The block runs asynchronously on a serial queue belonging to the notifier, so its notifications are delivered one at a time, in order.
+	AQNotificationDeliverySerial
+	
+} AQNotificationDelivery;
+
+/// What happens to a notifier's notifications when they arrive faster than its block can run them.
+typedef enum
+{
+	/// Every notification is queued separately, however many are waiting. This is the default.
+	AQNotificationBacklogUnbounded,
+	
+	/// A notification arriving while another is still waiting is folded into it, so at most one is ever pending.
+	AQNotificationBacklogMerge,
+	
+	/// Once the limit is reached, the oldest waiting notification is discarded to make room for each new one.
+	AQNotificationBacklogDropOldest,
+	
+	/// Once the limit is reached, the modifying thread waits until the oldest waiting notification has run.
+	AQNotificationBacklogBlock
+	
+} AQNotificationBacklog;
+
 /**
  A bitfield which supports calling notification callback blocks whenever bits within certain ranges
  are modified.
@@ -50,13 +93,57 @@ typedef void (^AQRangeNotification)(NSRange range);
 
 /**
  Install a notifier block for a given range of a bitfield.
+ 
+ Any number of notifiers may watch the same range.
+ @param range The range to watch.
+ @param block The block to run when any bits within _range_ are modified.
+ @return An opaque token identifying the new notifier, which can be passed to removeNotifier:.
+ */
+- (id) notifyModificationOfBitsInRange: (NSRange) range usingBlock: (AQRangeNotification) block;
+
+/**
+ Install a notifier block for a given range of a bitfield, choosing how its notifications are delivered.
+ 
+ Notifiers installed using notifyModificationOfBitsInRange:usingBlock: use AQNotificationDeliveryConcurrent.
+ @param range The range to watch.
+ @param delivery How _block_ is to be run.
+ @param queue For AQNotificationDeliveryTargetQueue, the queue on which to run _block_. For
+ AQNotificationDeliverySerial, an optional target queue for the notifier's serial queue. Ignored otherwise.
+ @param block The block to run when any bits within _range_ are modified.
+ @return An opaque token identifying the new notifier, which can be passed to removeNotifier:.
+ */
+- (id) notifyModificationOfBitsInRange: (NSRange) range
+							  delivery: (AQNotificationDelivery) delivery
+								 queue: (dispatch_queue_t) queue
+							usingBlock: (AQRangeNotification) block;
+
+/**
+ Install a notifier block which is told the values of the watched bits before and after each modification.
+ 
+ The values are recorded as the modification is made, so the block can use them rather than reading the
+ bitfield, which may have been modified again by the time it runs. Recording them has a small cost, which
+ is only paid by modifications made while at least one such notifier is installed. Within
+ performBatchUpdates:, the values before are those from before the batch began.
  @param range The range to watch.
+ @param delivery How _block_ is to be run.
+ @param queue A queue, used as for notifyModificationOfBitsInRange:delivery:queue:usingBlock:.
  @param block The block to run when any bits within _range_ are modified.
+ @return An opaque token identifying the new notifier, which can be passed to removeNotifier:.
  */
-- (void) notifyModificationOfBitsInRange: (NSRange) range usingBlock: (AQRangeNotification) block;
+- (id) notifyModificationOfBitsInRange: (NSRange) range
+							  delivery: (AQNotificationDelivery) delivery
+								 queue: (dispatch_queue_t) queue
+					  usingChangeBlock: (AQRangeChangeNotification) block;
 
 /**
- Remove a notifier for a specific range.
+ Remove a single notifier. This takes constant time, however many notifiers are installed.
+ @param token A token returned by notifyModificationOfBitsInRange:usingBlock:. Tokens for notifiers
+ which have already been removed are ignored.
+ */
+- (void) removeNotifier: (id) token;
+
+/**
+ Remove every notifier for a specific range.
  @param range The range for which to search. Must exactly match a range passed to
  notifyModificationOfBitsInRange:usingBlock:.
  */
@@ -69,4 +156,44 @@ typedef void (^AQRangeNotification)(NSRange range);
  */
 - (void) removeAllNotifiersWithinRange: (NSRange) range;
 
+/**
+ Bound the number of notifications which may be waiting to run for a single notifier.
+ 
+ With any policy but AQNotificationBacklogUnbounded, the notifier's notifications run one at a time,
+ in order, whatever its delivery queue. When merging, a change notifier's pending record is extended to
+ cover both modifications: it keeps the values before the first and takes the values after the last.
+ 
+ A notifier using AQNotificationBacklogBlock must not modify the bitfield from its own block, since that
+ could leave it waiting on itself. Inline notifiers have no backlog, so are unaffected by this setting.
+ @param backlog The policy to apply.
+ @param limit The number of notifications which may be waiting at once. Ignored when merging, where the limit is always one.
+ @param token A token returned when the notifier was installed.
+ */
+- (void) setBacklog: (AQNotificationBacklog) backlog limit: (NSUInteger) limit forNotifier: (id) token;
+
+/**
+ The number of notifications which have been merged into others under AQNotificationBacklogMerge.
+ @param token A token returned when the notifier was installed.
+ @return The number of merged notifications.
+ */
+- (NSUInteger) mergedNotificationCountForNotifier: (id) token;
+
+/**
+ The number of notifications which have been discarded under AQNotificationBacklogDropOldest.
+ @param token A token returned when the notifier was installed.
+ @return The number of dropped notifications.
+ */
+- (NSUInteger) droppedNotificationCountForNotifier: (id) token;
+
+/**
+ Make a group of modifications, delivering their notifications together once they're all complete.
+ 
+ Instead of notifying as each modification is made, the ranges modified within _updates_ are merged,
+ and the notifiers matching them are found in a single pass once _updates_ returns. Each notifier runs
+ at most once per batch, however many of its bits were modified. Batches may be nested, in which case
+ notifications are delivered when the outermost batch completes.
+ @param updates A block which modifies the receiver.
+ */
+- (void) performBatchUpdates: (void (^)(void)) updates;
+
 @end
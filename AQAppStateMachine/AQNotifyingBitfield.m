@@ -34,23 +34,228 @@
 //
 
 #import "AQNotifyingBitfield.h"
-#import "AQRange.h"
-#import "MutableSortedDictionary.h"
+#import "AQBitfieldPrivate.h"
+#import "AQRangeTree.h"
+#import <libkern/OSAtomic.h>
+
+// identifies one installed notifier; its slot is only accessed on the bitfield's sync queue
+@interface _AQNotifierToken : NSObject
+{
+@public
+	AQRangeNotification	_block;
+	AQRangeChangeNotification _changeBlock;	// set instead of _block for notifiers which want change records
+	NSRange				_range;
+	dispatch_queue_t	_queue;		// NULL for inline delivery
+	NSUInteger			_slot;
+	
+	// everything below is guarded by _backlogLock
+	OSSpinLock			_backlogLock;
+	AQNotificationBacklog _backlog;
+	NSUInteger			_backlogLimit;
+	NSMutableArray *	_pending;		// change records, or NSNull for notifiers without a change block
+	BOOL				_draining;
+	NSUInteger			_waitingItems;	// pending items which took a slot from _backlogSpace
+	dispatch_semaphore_t _backlogSpace;
+	NSUInteger			_mergedCount;
+	NSUInteger			_droppedCount;
+}
+- (void) setBacklog: (AQNotificationBacklog) backlog limit: (NSUInteger) limit;
+- (void) deliverChange: (id) change;
+@end
+
+@implementation _AQNotifierToken
+
+- (void) dealloc
+{
+	if ( _queue != NULL )
+		dispatch_release(_queue);
+	if ( _backlogSpace != NULL )
+		dispatch_release(_backlogSpace);
+#if !USING_ARC
+	[_block release];
+	[_changeBlock release];
+	[_pending release];
+	[super dealloc];
+#endif
+}
+
+- (void) setBacklog: (AQNotificationBacklog) backlog limit: (NSUInteger) limit
+{
+	// the blocking policy's semaphore is created up front, so it's only ever read under the lock
+	dispatch_semaphore_t space = NULL;
+	if ( backlog == AQNotificationBacklogBlock )
+		space = dispatch_semaphore_create((long)MAX(limit, (NSUInteger)1));
+	
+	OSSpinLockLock(&_backlogLock);
+	dispatch_semaphore_t old = _backlogSpace;
+	_backlog = backlog;
+	_backlogLimit = MAX(limit, (NSUInteger)1);
+	_backlogSpace = space;
+	if ( old != NULL )
+		_waitingItems = 0;		// anything still pending was admitted by the old semaphore
+	if ( _pending == nil && backlog != AQNotificationBacklogUnbounded )
+		_pending = [NSMutableArray new];
+	OSSpinLockUnlock(&_backlogLock);
+	
+	if ( old != NULL )
+		dispatch_release(old);
+}
+
+- (void) _invokeWithChange: (id) change
+{
+	if ( change != [NSNull null] )
+		_changeBlock(_range, change);
+	else
+		_block(_range);
+}
+
+// runs on the delivery queue, working through the backlog one notification at a time
+- (void) _drain
+{
+	for ( ;; )
+	{
+		OSSpinLockLock(&_backlogLock);
+		if ( [_pending count] == 0 )
+		{
+			_draining = NO;
+			OSSpinLockUnlock(&_backlogLock);
+			return;
+		}
+		
+		id change = [_pending objectAtIndex: 0];
+#if !USING_ARC
+		[change retain];
+#endif
+		[_pending removeObjectAtIndex: 0];
+		dispatch_semaphore_t space = NULL;
+		if ( _waitingItems != 0 )
+		{
+			_waitingItems--;
+			space = _backlogSpace;
+			dispatch_retain(space);
+		}
+		OSSpinLockUnlock(&_backlogLock);
+		
+		[self _invokeWithChange: change];
+		
+#if !USING_ARC
+		[change release];
+#endif
+		if ( space != NULL )
+		{
+			dispatch_semaphore_signal(space);
+			dispatch_release(space);
+		}
+	}
+}
+
+// called on the modifying thread, outside the bitfield's sync queue
+- (void) deliverChange: (id) change
+{
+	if ( change == nil )
+		change = [NSNull null];
+	
+	if ( _queue == NULL )
+	{
+		[self _invokeWithChange: change];
+		return;
+	}
+	
+	OSSpinLockLock(&_backlogLock);
+	AQNotificationBacklog backlog = _backlog;
+	dispatch_semaphore_t space = _backlogSpace;
+	if ( space != NULL )
+		dispatch_retain(space);
+	OSSpinLockUnlock(&_backlogLock);
+	
+	if ( backlog == AQNotificationBacklogUnbounded )
+	{
+		dispatch_async(_queue, ^{ [self _invokeWithChange: change]; });
+		return;
+	}
+	
+	// the writer waits here, rather than on the sync queue, so the notifier's block can still use the bitfield
+	if ( space != NULL )
+		dispatch_semaphore_wait(space, DISPATCH_TIME_FOREVER);
+	
+	BOOL startDrain = NO;
+	BOOL keptSlot = NO;
+	
+	OSSpinLockLock(&_backlogLock);
+	if ( _backlog == AQNotificationBacklogMerge && [_pending count] != 0 )
+	{
+		// fold into the notification which is still waiting, keeping the oldest values from before
+		id pending = [_pending lastObject];
+		if ( pending != [NSNull null] )
+		{
+			AQBitfieldChange * earlier = (AQBitfieldChange *)pending;
+			AQBitfieldChange * merged = [[AQBitfieldChange alloc] initWithRange: earlier.range bitsBefore: earlier.bitsBefore bitsAfter: ((AQBitfieldChange *)change).bitsAfter];
+			[_pending replaceObjectAtIndex: [_pending count] - 1 withObject: merged];
+#if !USING_ARC
+			[merged release];
+#endif
+		}
+		_mergedCount++;
+	}
+	else
+	{
+		if ( _backlog == AQNotificationBacklogDropOldest && [_pending count] >= _backlogLimit )
+		{
+			[_pending removeObjectAtIndex: 0];
+			_droppedCount++;
+		}
+		
+		[_pending addObject: change];
+		
+		// the drain hands the slot back once this notification has run
+		if ( space != NULL && space == _backlogSpace )
+		{
+			_waitingItems++;
+			keptSlot = YES;
+		}
+		
+		startDrain = (_draining == NO);
+		_draining = YES;
+	}
+	OSSpinLockUnlock(&_backlogLock);
+	
+	if ( space != NULL )
+	{
+		// the policy changed while this was waiting, or nothing was queued
+		if ( keptSlot == NO )
+			dispatch_semaphore_signal(space);
+		dispatch_release(space);
+	}
+	
+	if ( startDrain )
+		dispatch_async(_queue, ^{ [self _drain]; });
+}
+
+@end
 
 @implementation AQNotifyingBitfield
 {
-	MutableSortedDictionary *	_lookup;
-	dispatch_queue_t			_syncQ;
-	dispatch_group_t			_group;
+	AQRangeTree *		_lookup;
+	dispatch_queue_t	_syncQ;
+	dispatch_group_t	_group;
+	
+	NSUInteger			_batchDepth;
+	NSMutableIndexSet *	_batchRanges;		// bits modified by the current batch
+	
+	// previous values of the bits modified since notifications were last sent, kept only while a notifier wants them
+	volatile int32_t	_changeNotifierCount;
+	AQBitfield *		_before;
+	NSMutableIndexSet *	_beforeRanges;
 }
 
-- (id) init
+- (id) initWithCapacity: (NSUInteger) numberOfBits
 {
-    self = [super init];
+    self = [super initWithCapacity: numberOfBits];
 	if ( self == nil )
 		return ( nil );
 	
-	_lookup = [MutableSortedDictionary new];
+	_lookup = [AQRangeTree new];
+	_batchRanges = [NSMutableIndexSet new];
 	_syncQ = dispatch_queue_create("net.alanquatermain.notifyingbitfield.sync", DISPATCH_QUEUE_SERIAL);
 	
 	return ( self );
@@ -62,80 +267,325 @@
 		dispatch_release(_syncQ);
 #if !USING_ARC
 	[_lookup release];
+	[_batchRanges release];
+	[_before release];
+	[_beforeRanges release];
 	[super dealloc];
 #endif
 }
 
-- (void) notifyModificationOfBitsInRange: (NSRange) range usingBlock: (AQRangeNotification) block
+- (id) notifyModificationOfBitsInRange: (NSRange) range usingBlock: (AQRangeNotification) block
+{
+	return ( [self notifyModificationOfBitsInRange: range delivery: AQNotificationDeliveryConcurrent queue: NULL usingBlock: block] );
+}
+
+- (id) _addNotifierForRange: (NSRange) range
+				   delivery: (AQNotificationDelivery) delivery
+					  queue: (dispatch_queue_t) queue
+					  block: (AQRangeNotification) block
+				changeBlock: (AQRangeChangeNotification) changeBlock
 {
+	_AQNotifierToken * token = [_AQNotifierToken new];
+	token->_block = [block copy];
+	token->_changeBlock = [changeBlock copy];
+	token->_range = range;
+	token->_slot = NSNotFound;
+	
+	switch ( delivery )
+	{
+		case AQNotificationDeliveryInline:
+			token->_queue = NULL;
+			break;
+			
+		case AQNotificationDeliveryTargetQueue:
+			NSParameterAssert(queue != NULL);
+			token->_queue = queue;
+			dispatch_retain(queue);
+			break;
+			
+		case AQNotificationDeliverySerial:
+			token->_queue = dispatch_queue_create("net.alanquatermain.notifyingbitfield.notifier", DISPATCH_QUEUE_SERIAL);
+			if ( queue != NULL )
+				dispatch_set_target_queue(token->_queue, queue);
+			break;
+			
+		default:
+			token->_queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+			dispatch_retain(token->_queue);
+			break;
+	}
+	
+	// counted right away, so the very next modification records what it changes
+	if ( changeBlock != nil )
+		OSAtomicIncrement32Barrier(&_changeNotifierCount);
+	
 	dispatch_async(_syncQ, ^{
-		AQRange * rangeObject = [[AQRange alloc] initWithRange: range];
-		AQRangeNotification copied = [block copy];
-		[_lookup setObject: copied forKey: rangeObject];
-#if !USING_ARC
-		[rangeObject release];
-		[copied autorelease];
+		token->_slot = [_lookup addObject: token forRange: range];
+	});
+	
+#if USING_ARC
+	return ( token );
+#else
+	return ( [token autorelease] );
 #endif
+}
+
+- (id) notifyModificationOfBitsInRange: (NSRange) range
+							  delivery: (AQNotificationDelivery) delivery
+								 queue: (dispatch_queue_t) queue
+							usingBlock: (AQRangeNotification) block
+{
+	return ( [self _addNotifierForRange: range delivery: delivery queue: queue block: block changeBlock: nil] );
+}
+
+- (id) notifyModificationOfBitsInRange: (NSRange) range
+							  delivery: (AQNotificationDelivery) delivery
+								 queue: (dispatch_queue_t) queue
+					  usingChangeBlock: (AQRangeChangeNotification) block
+{
+	return ( [self _addNotifierForRange: range delivery: delivery queue: queue block: nil changeBlock: block] );
+}
+
+// called on the sync queue as each notifier is removed
+- (void) _forgetNotifier: (_AQNotifierToken *) notifier
+{
+	if ( notifier->_changeBlock != nil )
+		OSAtomicDecrement32Barrier(&_changeNotifierCount);
+}
+
+- (void) removeNotifier: (id) token
+{
+	if ( [token isKindOfClass: [_AQNotifierToken class]] == NO )
+		return;
+	
+	dispatch_async(_syncQ, ^{
+		_AQNotifierToken * notifier = (_AQNotifierToken *)token;
+		
+		// the slot is recycled once the notifier is gone, so make sure it's still this one
+		if ( [_lookup objectAtSlot: notifier->_slot] == notifier )
+		{
+			[self _forgetNotifier: notifier];
+			[_lookup removeObjectAtSlot: notifier->_slot];
+		}
+		notifier->_slot = NSNotFound;
 	});
 }
 
 - (void) removeNotifierForBitsInRange: (NSRange) range
 {
 	dispatch_async(_syncQ, ^{
-		AQRange * obj = [[AQRange alloc] initWithRange: range];
-		[_lookup removeObjectForKey: obj];
-#if !USING_ARC
-		[obj release];
-#endif
+		[_lookup enumerateRangesIntersectingRange: range usingBlock: ^(NSRange notifyRange, __strong id obj, BOOL *stop) {
+			if ( NSEqualRanges(notifyRange, range) )
+				[self _forgetNotifier: obj];
+		}];
+		[_lookup removeObjectsForRange: range];
 	});
 }
 
 - (void) removeAllNotifiersWithinRange: (NSRange) range
 {
 	dispatch_async(_syncQ, ^{
-		NSMutableSet * keys = [NSMutableSet new];
-		
-		[_lookup enumerateKeysAndObjectsUsingBlock: ^(__strong id key, __strong id obj, BOOL *stop) {
-			NSRange testRange = [key range];
-			if ( NSEqualRanges(testRange, NSIntersectionRange(range, testRange)) == NO )
+		[_lookup enumerateRangesIntersectingRange: range usingBlock: ^(NSRange notifyRange, __strong id obj, BOOL *stop) {
+			if ( notifyRange.location >= range.location && NSMaxRange(notifyRange) <= NSMaxRange(range) )
+				[self _forgetNotifier: obj];
+		}];
+		[_lookup removeObjectsForRangesWithinRange: range];
+	});
+}
+
+- (void) setBacklog: (AQNotificationBacklog) backlog limit: (NSUInteger) limit forNotifier: (id) token
+{
+	if ( [token isKindOfClass: [_AQNotifierToken class]] == NO )
+		return;
+	
+	[(_AQNotifierToken *)token setBacklog: backlog limit: limit];
+}
+
+- (NSUInteger) mergedNotificationCountForNotifier: (id) token
+{
+	if ( [token isKindOfClass: [_AQNotifierToken class]] == NO )
+		return ( 0 );
+	
+	_AQNotifierToken * notifier = (_AQNotifierToken *)token;
+	OSSpinLockLock(&notifier->_backlogLock);
+	NSUInteger result = notifier->_mergedCount;
+	OSSpinLockUnlock(&notifier->_backlogLock);
+	
+	return ( result );
+}
+
+- (NSUInteger) droppedNotificationCountForNotifier: (id) token
+{
+	if ( [token isKindOfClass: [_AQNotifierToken class]] == NO )
+		return ( 0 );
+	
+	_AQNotifierToken * notifier = (_AQNotifierToken *)token;
+	OSSpinLockLock(&notifier->_backlogLock);
+	NSUInteger result = notifier->_droppedCount;
+	OSSpinLockUnlock(&notifier->_backlogLock);
+	
+	return ( result );
+}
+
+// builds the record of a change to the bits in range since notifications were last sent
+- (AQBitfieldChange *) _changeForBitsInRange: (NSRange) range
+{
+	AQBitfield * after = [self bitfieldByExtractingBitsInRange: range];
+	AQBitfield * before = [after copy];
+	
+	// only the recorded bits differ; everything else in range still has its previous value
+	[_beforeRanges enumerateRangesInRange: range options: 0 usingBlock: ^(NSRange modified, BOOL *stop) {
+		NSRange relative = NSMakeRange(modified.location - range.location, modified.length);
+		AQBitfield * previous = [_before bitfieldByExtractingBitsInRange: modified];
+		[previous shiftBitsRightBy: relative.location];
+		[before setBitsInRange: relative usingBit: 0];
+		[before unionWithBitfield: previous];
+	}];
+	
+	AQBitfieldChange * result = [[AQBitfieldChange alloc] initWithRange: range bitsBefore: before bitsAfter: after];
+	
+#if USING_ARC
+	return ( result );
+#else
+	[before release];
+	return ( [result autorelease] );
+#endif
+}
+
+// finds the notifiers for the modified bits, then hands each its notification outside the sync queue
+- (void) _notifyModificationOfBitsInRange: (NSRange) range orRanges: (NSIndexSet *) ranges
+{
+	NSMutableArray * notifiers = [NSMutableArray new];
+	NSMutableArray * changes = [NSMutableArray new];
+	
+	dispatch_sync(_syncQ, ^{
+		// when there are several modified ranges, notifiers spanning more than one are still only run once
+		NSMutableSet * notified = (ranges != nil ? [NSMutableSet new] : nil);
+		void (^notifyBlock)(NSRange, id, BOOL *) = ^(NSRange notifyRange, __strong id obj, BOOL *stop) {
+			if ( notified != nil )
 			{
-				if ( testRange.location > NSMaxRange(range) )
-					*stop = YES;
-				return;		// not wholly contained in the input range
+				if ( [notified containsObject: obj] )
+					return;
+				[notified addObject: obj];
 			}
 			
-			[keys addObject: key];
-		}];
+			// the record has to be made now, before anything else can modify the bits
+			id change = [NSNull null];
+			if ( ((_AQNotifierToken *)obj)->_changeBlock != nil )
+				change = [self _changeForBitsInRange: notifyRange];
+			
+			[notifiers addObject: obj];
+			[changes addObject: change];
+		};
 		
-		for ( id key in keys )
+		// only visits subtrees holding a range which reaches the modified bits
+		if ( ranges == nil )
+		{
+			[_lookup enumerateRangesIntersectingRange: range usingBlock: notifyBlock];
+		}
+		else
 		{
-			[_lookup removeObjectForKey: key];
+			[ranges enumerateRangesUsingBlock: ^(NSRange modified, BOOL *stop) {
+				[_lookup enumerateRangesIntersectingRange: modified usingBlock: notifyBlock];
+			}];
 		}
 		
 #if !USING_ARC
-		[keys release];
+		[notified release];
 #endif
 	});
+	
+	// the recorded values are no longer needed
+	if ( _before != nil )
+	{
+#if !USING_ARC
+		[_before release];
+#endif
+		_before = nil;
+		[_beforeRanges removeAllIndexes];
+	}
+	
+	// outside the sync queue, writers may wait for space in a backlog and inline blocks may modify the
+	// bitfield or its notifiers; queued notifications go first, so inline blocks can't hold them up
+	[notifiers enumerateObjectsUsingBlock: ^(__strong id obj, NSUInteger idx, BOOL *stop) {
+		_AQNotifierToken * token = (_AQNotifierToken *)obj;
+		if ( token->_queue != NULL )
+			[token deliverChange: [changes objectAtIndex: idx]];
+	}];
+	[notifiers enumerateObjectsUsingBlock: ^(__strong id obj, NSUInteger idx, BOOL *stop) {
+		_AQNotifierToken * token = (_AQNotifierToken *)obj;
+		if ( token->_queue == NULL )
+			[token deliverChange: [changes objectAtIndex: idx]];
+	}];
+	
+#if !USING_ARC
+	[notifiers release];
+	[changes release];
+#endif
+}
+
+- (void) performBatchUpdates: (void (^)(void)) updates
+{
+	// the batch ends even if _updates_ raises, so later modifications still deliver their notifications
+	_batchDepth++;
+	@try
+	{
+		updates();
+	}
+	@finally
+	{
+		_batchDepth--;
+	}
+	if ( _batchDepth != 0 )
+		return;
+	
+	if ( [_batchRanges count] == 0 )
+		return;
+	
+	NSIndexSet * changed = [_batchRanges copy];
+	[_batchRanges removeAllIndexes];
+	[self _notifyModificationOfBitsInRange: NSMakeRange(NSNotFound, 0) orRanges: changed];
+	
+#if !USING_ARC
+	[changed release];
+#endif
+}
+
+- (void) _willUpdateBitsInRange: (NSRange) range
+{
+	if ( _changeNotifierCount == 0 || range.location == NSNotFound || range.length == 0 )
+		return;
+	
+	range = AQBitStorageClampRange(range);
+	if ( _before == nil )
+	{
+		_before = [AQBitfield new];
+		if ( _beforeRanges == nil )
+			_beforeRanges = [NSMutableIndexSet new];
+	}
+	
+	// within a batch, only the first value of each bit is kept
+	NSMutableIndexSet * unrecorded = [[NSMutableIndexSet alloc] initWithIndexesInRange: range];
+	[unrecorded removeIndexes: _beforeRanges];
+	[unrecorded enumerateRangesUsingBlock: ^(NSRange newRange, BOOL *stop) {
+		[_before unionWithBitfield: self inRange: newRange];
+	}];
+	[_beforeRanges addIndexesInRange: range];
+	
+#if !USING_ARC
+	[unrecorded release];
+#endif
 }
 
 - (void) _updatedBitsInRange: (NSRange) range
 {
-	dispatch_async(_syncQ, ^{
-		[_lookup enumerateKeysAndObjectsUsingBlock: ^(__strong id key, __strong id obj, BOOL *stop) {
-			if ( NSIntersectionRange(range, [key range]).length != 0 )
-			{
-				AQRangeNotification block = (AQRangeNotification)obj;
-				if ( block != nil )
-				{
-					dispatch_async(dispatch_get_global_queue(0, 0), ^{ block([key range]); });
-				}
-			}
-			else if ( NSMaxRange(range) < [key range].location )
-			{
-				*stop = YES;
-			}
-		}];
-	});
+	if ( _batchDepth != 0 )
+	{
+		[_batchRanges addIndexesInRange: range];
+		return;
+	}
+	
+	[self _notifyModificationOfBitsInRange: range orRanges: nil];
 }
 
 @end
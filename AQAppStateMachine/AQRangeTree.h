@@ -0,0 +1,109 @@
+//
+//  AQRangeTree.h
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-14.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ A collection of objects associated with ranges, able to find every range intersecting a given range in
+ O(log n + k) time.
+ 
+ Ranges are kept in an AVL tree ordered by location, then by length, in which every node also records
+ the highest end point found anywhere in its subtree. A search can therefore skip any subtree whose
+ ranges all end before the range being searched for, as well as everything starting after it.
+ 
+ Any number of objects may share a range. Each is identified by the slot number returned when it was
+ added, which remains valid until it's removed. Removing an object by slot takes constant time: the
+ object is released immediately, but its node is only unlinked when the tree is next compacted, which
+ happens once removed nodes outnumber live ones. Compaction rebuilds the tree in linear time, and puts the
+ removed slots back into use.
+ 
+ Instances are not thread-safe, and must not be modified from within an enumeration block.
+ */
+@interface AQRangeTree : NSObject
+
+/// The number of objects in the tree.
+@property (nonatomic, readonly) NSUInteger count;
+
+/**
+ Add an object to the tree.
+ @param object The object to store. Must not be `nil`.
+ @param range The range with which to associate _object_.
+ @return The slot identifying the new entry.
+ */
+- (NSUInteger) addObject: (id) object forRange: (NSRange) range;
+
+/**
+ Look up the object in a slot.
+ @param slot A slot returned by addObject:forRange:.
+ @return The object in _slot_, or `nil` if the slot is unused.
+ */
+- (id) objectAtSlot: (NSUInteger) slot;
+
+/**
+ Remove the object in a slot. Once removed, the slot may be reused by a later call to addObject:forRange:.
+ @param slot A slot returned by addObject:forRange:. Unused slots are ignored.
+ */
+- (void) removeObjectAtSlot: (NSUInteger) slot;
+
+/**
+ Remove every object associated with a range.
+ @param range The range to remove. Only objects added with exactly this range will be removed.
+ */
+- (void) removeObjectsForRange: (NSRange) range;
+
+/**
+ Remove every object whose range lies completely within a given range.
+ @param range The range to search.
+ */
+- (void) removeObjectsForRangesWithinRange: (NSRange) range;
+
+/// Remove every object from the tree.
+- (void) removeAllObjects;
+
+/**
+ Enumerate every range which shares at least one index with a given range, in order.
+ @param range The range to search.
+ @param block The block to call for each intersecting range and its object. Set _stop_ to `YES` to end
+ the enumeration.
+ */
+- (void) enumerateRangesIntersectingRange: (NSRange) range usingBlock: (void (^)(NSRange range, id object, BOOL *stop)) block;
+
+/**
+ Enumerate every range in the tree, in order.
+ @param block The block to call for each range and its object. Set _stop_ to `YES` to end the enumeration.
+ */
+- (void) enumerateRangesAndObjectsUsingBlock: (void (^)(NSRange range, id object, BOOL *stop)) block;
+
+@end
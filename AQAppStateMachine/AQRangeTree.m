@@ -0,0 +1,407 @@
+//
+//  AQRangeTree.m
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-14.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQRangeTree.h"
+
+#define _NoNode					NSNotFound
+#define _MinimumCompactionSize	32
+
+typedef struct _RangeNode
+{
+	NSRange		range;
+	NSUInteger	maxEnd;		// the highest NSMaxRange() of any range in this subtree
+	NSUInteger	left;		// for free slots, the next free slot
+	NSUInteger	right;
+	UInt32		height;
+	BOOL		removed;	// still linked into the tree, but skipped until the next compaction
+	
+} _RangeNode;
+
+typedef void (^_RangeTreeBlock)(NSRange range, id object, BOOL *stop);
+
+// same ordering as AQRange: by location, then by which range finishes first; entries sharing a range go by slot
+static inline NSComparisonResult _CompareNodes( const _RangeNode * nodes, NSUInteger a, NSUInteger b )
+{
+	NSRange ra = nodes[a].range, rb = nodes[b].range;
+	if ( ra.location != rb.location )
+		return ( ra.location < rb.location ? NSOrderedAscending : NSOrderedDescending );
+	if ( ra.length != rb.length )
+		return ( ra.length < rb.length ? NSOrderedAscending : NSOrderedDescending );
+	if ( a != b )
+		return ( a < b ? NSOrderedAscending : NSOrderedDescending );
+	return ( NSOrderedSame );
+}
+
+static inline UInt32 _Height( const _RangeNode * nodes, NSUInteger n )
+{
+	return ( n == _NoNode ? 0 : nodes[n].height );
+}
+
+static inline NSUInteger _MaxEnd( const _RangeNode * nodes, NSUInteger n )
+{
+	return ( n == _NoNode ? 0 : nodes[n].maxEnd );
+}
+
+static inline void _UpdateNode( _RangeNode * nodes, NSUInteger n )
+{
+	_RangeNode * node = &nodes[n];
+	node->height = 1 + MAX(_Height(nodes, node->left), _Height(nodes, node->right));
+	node->maxEnd = MAX(NSMaxRange(node->range), MAX(_MaxEnd(nodes, node->left), _MaxEnd(nodes, node->right)));
+}
+
+static NSUInteger _RotateLeft( _RangeNode * nodes, NSUInteger n )
+{
+	NSUInteger r = nodes[n].right;
+	nodes[n].right = nodes[r].left;
+	nodes[r].left = n;
+	_UpdateNode(nodes, n);
+	_UpdateNode(nodes, r);
+	return ( r );
+}
+
+static NSUInteger _RotateRight( _RangeNode * nodes, NSUInteger n )
+{
+	NSUInteger l = nodes[n].left;
+	nodes[n].left = nodes[l].right;
+	nodes[l].right = n;
+	_UpdateNode(nodes, n);
+	_UpdateNode(nodes, l);
+	return ( l );
+}
+
+// recomputes a node whose subtrees have changed, rotating it if they now differ in height by two
+static NSUInteger _Rebalance( _RangeNode * nodes, NSUInteger n )
+{
+	_UpdateNode(nodes, n);
+	
+	NSUInteger l = nodes[n].left, r = nodes[n].right;
+	if ( _Height(nodes, l) > _Height(nodes, r) + 1 )
+	{
+		if ( _Height(nodes, nodes[l].left) < _Height(nodes, nodes[l].right) )
+			nodes[n].left = _RotateLeft(nodes, l);
+		return ( _RotateRight(nodes, n) );
+	}
+	if ( _Height(nodes, r) > _Height(nodes, l) + 1 )
+	{
+		if ( _Height(nodes, nodes[r].right) < _Height(nodes, nodes[r].left) )
+			nodes[n].right = _RotateRight(nodes, r);
+		return ( _RotateLeft(nodes, n) );
+	}
+	
+	return ( n );
+}
+
+// inserts 'slot' into the subtree rooted at 'n', returning the subtree's new root
+static NSUInteger _InsertNode( _RangeNode * nodes, NSUInteger n, NSUInteger slot )
+{
+	if ( n == _NoNode )
+		return ( slot );
+	
+	if ( _CompareNodes(nodes, slot, n) == NSOrderedAscending )
+		nodes[n].left = _InsertNode(nodes, nodes[n].left, slot);
+	else
+		nodes[n].right = _InsertNode(nodes, nodes[n].right, slot);
+	
+	return ( _Rebalance(nodes, n) );
+}
+
+// links an ordered list of slots into a perfectly balanced subtree, returning its root
+static NSUInteger _BuildBalanced( _RangeNode * nodes, const NSUInteger * slots, NSUInteger count )
+{
+	if ( count == 0 )
+		return ( _NoNode );
+	
+	NSUInteger middle = count / 2;
+	NSUInteger n = slots[middle];
+	nodes[n].left = _BuildBalanced(nodes, slots, middle);
+	nodes[n].right = _BuildBalanced(nodes, slots + middle + 1, count - middle - 1);
+	_UpdateNode(nodes, n);
+	return ( n );
+}
+
+// collects the live and removed slots of a subtree separately, the live ones in order
+static void _CollectSlots( const _RangeNode * nodes, NSUInteger n, NSUInteger * live, NSUInteger * numLive, NSUInteger * removed, NSUInteger * numRemoved )
+{
+	if ( n == _NoNode )
+		return;
+	
+	_CollectSlots(nodes, nodes[n].left, live, numLive, removed, numRemoved);
+	if ( nodes[n].removed )
+		removed[(*numRemoved)++] = n;
+	else
+		live[(*numLive)++] = n;
+	_CollectSlots(nodes, nodes[n].right, live, numLive, removed, numRemoved);
+}
+
+static void _EnumerateIntersecting( const _RangeNode * nodes, NSUInteger n, NSRange range, NSArray * objects, _RangeTreeBlock block, BOOL * stop )
+{
+	// nothing in this subtree reaches the start of the range
+	if ( n == _NoNode || nodes[n].maxEnd <= range.location )
+		return;
+	
+	const _RangeNode * node = &nodes[n];
+	_EnumerateIntersecting(nodes, node->left, range, objects, block, stop);
+	if ( *stop )
+		return;
+	
+	// this node and everything to its right start beyond the range
+	if ( node->range.location >= NSMaxRange(range) )
+		return;
+	
+	if ( node->removed == NO && node->range.length != 0 && NSMaxRange(node->range) > range.location )
+	{
+		block(node->range, [objects objectAtIndex: n], stop);
+		if ( *stop )
+			return;
+	}
+	
+	_EnumerateIntersecting(nodes, node->right, range, objects, block, stop);
+}
+
+static void _EnumerateAll( const _RangeNode * nodes, NSUInteger n, NSArray * objects, _RangeTreeBlock block, BOOL * stop )
+{
+	if ( n == _NoNode )
+		return;
+	
+	_EnumerateAll(nodes, nodes[n].left, objects, block, stop);
+	if ( *stop )
+		return;
+	
+	if ( nodes[n].removed == NO )
+	{
+		block(nodes[n].range, [objects objectAtIndex: n], stop);
+		if ( *stop )
+			return;
+	}
+	
+	_EnumerateAll(nodes, nodes[n].right, objects, block, stop);
+}
+
+// collects the live slots whose ranges lie completely within 'range'
+static void _CollectContained( const _RangeNode * nodes, NSUInteger n, NSRange range, NSMutableData * found )
+{
+	if ( n == _NoNode )
+		return;
+	
+	const _RangeNode * node = &nodes[n];
+	if ( node->range.location >= range.location )
+		_CollectContained(nodes, node->left, range, found);
+	if ( node->range.location > NSMaxRange(range) )
+		return;
+	
+	if ( node->removed == NO && node->range.location >= range.location && NSMaxRange(node->range) <= NSMaxRange(range) )
+		[found appendBytes: &n length: sizeof(NSUInteger)];
+	
+	_CollectContained(nodes, node->right, range, found);
+}
+
+@implementation AQRangeTree
+{
+	_RangeNode *		_nodes;
+	NSUInteger			_capacity;
+	NSUInteger			_root;
+	NSUInteger			_freeSlot;
+	NSUInteger			_count;
+	NSUInteger			_removedCount;	// nodes still linked into the tree, awaiting compaction
+	NSMutableArray *	_objects;		// indexed by slot; NSNull for removed and free slots
+}
+
+@synthesize count=_count;
+
+- (id) init
+{
+	self = [super init];
+	if ( self == nil )
+		return ( nil );
+	
+	_root = _NoNode;
+	_freeSlot = _NoNode;
+	_objects = [NSMutableArray new];
+	
+	return ( self );
+}
+
+- (void) dealloc
+{
+	free(_nodes);
+#if !USING_ARC
+	[_objects release];
+	[super dealloc];
+#endif
+}
+
+- (NSUInteger) _allocateSlotWithObject: (id) object
+{
+	NSUInteger slot = _freeSlot;
+	if ( slot != _NoNode )
+	{
+		_freeSlot = _nodes[slot].left;
+		[_objects replaceObjectAtIndex: slot withObject: object];
+		return ( slot );
+	}
+	
+	slot = [_objects count];
+	if ( slot == _capacity )
+	{
+		_capacity = MAX(_capacity * 2, 16);
+		_nodes = (_RangeNode *) realloc(_nodes, _capacity * sizeof(_RangeNode));
+		if ( _nodes == NULL )
+			[NSException raise: NSMallocException format: @"Unable to allocate memory for %lu ranges", (unsigned long)_capacity];
+	}
+	
+	[_objects addObject: object];
+	return ( slot );
+}
+
+- (void) _compact
+{
+	NSUInteger total = _count + _removedCount;
+	NSUInteger * live = (NSUInteger *) malloc(total * sizeof(NSUInteger));
+	NSUInteger * removed = (NSUInteger *) malloc(_removedCount * sizeof(NSUInteger));
+	if ( live == NULL || removed == NULL )
+		[NSException raise: NSMallocException format: @"Unable to allocate memory to compact %lu ranges", (unsigned long)total];
+	
+	NSUInteger numLive = 0, numRemoved = 0;
+	_CollectSlots(_nodes, _root, live, &numLive, removed, &numRemoved);
+	_root = _BuildBalanced(_nodes, live, numLive);
+	
+	for ( NSUInteger i = 0; i < numRemoved; i++ )
+	{
+		_nodes[removed[i]].left = _freeSlot;
+		_freeSlot = removed[i];
+	}
+	_removedCount = 0;
+	
+	free(live);
+	free(removed);
+}
+
+- (NSUInteger) addObject: (id) object forRange: (NSRange) range
+{
+	NSParameterAssert(object != nil);
+	
+	NSUInteger n = [self _allocateSlotWithObject: object];
+	_RangeNode * node = &_nodes[n];
+	node->range = range;
+	node->maxEnd = NSMaxRange(range);
+	node->left = _NoNode;
+	node->right = _NoNode;
+	node->height = 1;
+	node->removed = NO;
+	
+	_root = _InsertNode(_nodes, _root, n);
+	_count++;
+	
+	return ( n );
+}
+
+- (id) objectAtSlot: (NSUInteger) slot
+{
+	if ( slot >= [_objects count] )
+		return ( nil );
+	
+	id object = [_objects objectAtIndex: slot];
+	return ( object == [NSNull null] ? nil : object );
+}
+
+- (void) removeObjectAtSlot: (NSUInteger) slot
+{
+	if ( [self objectAtSlot: slot] == nil )
+		return;
+	
+	// leave the node in place, so removal never has to search or rebalance
+	[_objects replaceObjectAtIndex: slot withObject: [NSNull null]];
+	_nodes[slot].removed = YES;
+	_count--;
+	_removedCount++;
+	
+	// each compaction is paid for by the removals since the last one
+	if ( _removedCount >= _MinimumCompactionSize && _removedCount > _count )
+		[self _compact];
+}
+
+- (void) _removeObjectsForRange: (NSRange) range exactMatchesOnly: (BOOL) exact
+{
+	NSMutableData * found = [NSMutableData new];
+	_CollectContained(_nodes, _root, range, found);
+	
+	const NSUInteger * slots = (const NSUInteger *)[found bytes];
+	NSUInteger numSlots = [found length] / sizeof(NSUInteger);
+	for ( NSUInteger i = 0; i < numSlots; i++ )
+	{
+		if ( exact == NO || NSEqualRanges(_nodes[slots[i]].range, range) )
+			[self removeObjectAtSlot: slots[i]];
+	}
+	
+#if !USING_ARC
+	[found release];
+#endif
+}
+
+- (void) removeObjectsForRange: (NSRange) range
+{
+	[self _removeObjectsForRange: range exactMatchesOnly: YES];
+}
+
+- (void) removeObjectsForRangesWithinRange: (NSRange) range
+{
+	[self _removeObjectsForRange: range exactMatchesOnly: NO];
+}
+
+- (void) removeAllObjects
+{
+	[_objects removeAllObjects];
+	_root = _NoNode;
+	_freeSlot = _NoNode;
+	_count = 0;
+	_removedCount = 0;
+}
+
+- (void) enumerateRangesIntersectingRange: (NSRange) range usingBlock: (void (^)(NSRange range, id object, BOOL *stop)) block
+{
+	if ( range.length == 0 )
+		return;
+	
+	BOOL stop = NO;
+	_EnumerateIntersecting(_nodes, _root, range, _objects, block, &stop);
+}
+
+- (void) enumerateRangesAndObjectsUsingBlock: (void (^)(NSRange range, id object, BOOL *stop)) block
+{
+	BOOL stop = NO;
+	_EnumerateAll(_nodes, _root, _objects, block, &stop);
+}
+
+@end
@@ -65,6 +65,53 @@
  */
 - (BOOL) matchesBitfield: (AQBitfield *) bitfield;
 
+/**
+ Determine whether a run of raw storage words matches the constraints from a descriptor.
+ 
+ Descriptors are compiled when initialized into one (word, mask, value) term per word they examine,
+ so this makes no allocations and reads only those words.
+ @param words The words holding the bits to compare, least-significant first, starting from bit zero.
+ @param count The number of words in _words_. Any words beyond these are treated as zero.
+ @result `YES` if the descriptors ranges/values all match the contents of _words_, `NO` otherwise.
+ */
+- (BOOL) matchesWords: (const UInt64 *) words count: (NSUInteger) count;
+
+/**
+ Count the compared bits which differ from the descriptor's value.
+ 
+ Together with mismatchDeltaForWordAtIndex:from:to:, this lets a caller keep a running count as
+ the words change, rather than re-evaluating the descriptor each time; it matches exactly when the
+ count is zero.
+ @param words The words holding the bits to compare, least-significant first, starting from bit zero.
+ @param count The number of words in _words_. Any words beyond these are treated as zero.
+ @result The number of mismatched bits, or `NSNotFound` if the descriptor's mask runs to the end of
+ the index space, in which case it can't be counted.
+ */
+- (NSUInteger) mismatchCountInWords: (const UInt64 *) words count: (NSUInteger) count;
+
+/**
+ Retrieve the single word compared by a descriptor.
+ 
+ Descriptors comparing bits in only one word are matched by any word _w_ where `(w & mask) == value`,
+ so many such descriptors can share a lookup keyed by the masked word.
+ @param index On return, the index of the compared word. May be `NULL`.
+ @param mask On return, the bits compared within the word. May be `NULL`.
+ @param value On return, the expected value of those bits. May be `NULL`.
+ @result `YES` if the descriptor compares bits in exactly one word, `NO` otherwise, in which case
+ the other arguments are left untouched.
+ */
+- (BOOL) getSingleWordIndex: (NSUInteger *) index mask: (UInt64 *) mask value: (UInt64 *) value;
+
+/**
+ Determine how a single changed word alters the count returned by mismatchCountInWords:count:.
+ @param index The index of the changed word.
+ @param oldWord The word's previous contents.
+ @param newWord The word's new contents.
+ @result The number of compared bits which now mismatch, less the number which now match. Zero if
+ the descriptor doesn't compare any bits within the word.
+ */
+- (NSInteger) mismatchDeltaForWordAtIndex: (NSUInteger) index from: (UInt64) oldWord to: (UInt64) newWord;
+
 /**
  Compare two descriptors.
  @param other The descriptor against which to compare the receiver.
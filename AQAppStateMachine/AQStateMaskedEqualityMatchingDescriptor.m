@@ -39,7 +39,21 @@
 #import "AQRange.h"
 #import "AQIndexSetMasking.h"
 
+// one word of a compiled descriptor: the bits of word 'index' selected by 'mask' must equal 'value'
+typedef struct _AQEqualityTerm
+{
+	NSUInteger	index;
+	UInt64		mask;
+	UInt64		value;
+	
+} _AQEqualityTerm;
+
 @implementation AQStateMaskedEqualityMatchingDescriptor
+{
+	_AQEqualityTerm *	_terms;
+	NSUInteger			_termCount;
+	BOOL				_compiled;
+}
 
 - (id)initWithRanges: (NSArray *) ranges masks: (NSArray *) masks matchingValues: (NSArray *) values
 {
@@ -48,7 +62,8 @@
     if ( self == nil )
 		return ( nil );
 	
-	_mask = [AQBitfield new];
+	// descriptors often span a handful of widely-separated ranges, so keep these sparse
+	_mask = [[AQBitfield alloc] initWithStorageMode: AQBitfieldStorageSparse];
 	
 	@autoreleasepool
 	{
@@ -60,17 +75,15 @@
 			
 			if ( mask == nil )
 			{
-				[_mask.indexSet addIndexesInRange: rng];
+				[_mask setBitsInRange: rng usingBit: 1];
 			}
 			else
 			{
-				NSMutableIndexSet * mutable = [mask.indexSet mutableCopy];
-				[mutable shiftIndexesStartingAtIndex: 0 by: rng.location];
-				[_mask.indexSet addIndexes: mutable];
+				[_mask unionWithBitfield: [mask bitfieldFromRightShiftingBy: rng.location]];
 			}
 		}];
 		
-		_value = [AQBitfield new];
+		_value = [[AQBitfield alloc] initWithStorageMode: AQBitfieldStorageSparse];
 		[values enumerateObjectsUsingBlock: ^(__strong id obj, NSUInteger idx, BOOL *stop) {
 			AQBitfield * mask = nil;
 			if ( [masks count] > idx )
@@ -96,21 +109,152 @@
 		}];
 	}
 	
+	[self _compileTerms];
+	
 	return ( self );
 }
 
-#if !USING_ARC
 - (void) dealloc
 {
+	free(_terms);
+#if !USING_ARC
 	[_value release];
 	[_mask release];
 	[super dealloc];
-}
 #endif
+}
+
+// reduces the mask and value to one term per word the mask touches, so matching needs no allocation
+- (void) _compileTerms
+{
+	const AQBitStorage * mask = &_mask->_storage;
+	const AQBitStorage * value = &_value->_storage;
+	
+	// a mask running to the end of the index space has no last word, so is compared the slow way
+	if ( mask->fill != 0ull )
+		return;
+	
+	NSUInteger capacity = 4;
+	_terms = malloc(capacity * sizeof(_AQEqualityTerm));
+	
+	NSUInteger bit = AQBitStorageNextIndex(mask, 0, 1);
+	while ( bit != NSNotFound )
+	{
+		NSUInteger index = AQWordIndexForBit(bit);
+		if ( _termCount == capacity )
+		{
+			capacity *= 2;
+			_terms = realloc(_terms, capacity * sizeof(_AQEqualityTerm));
+		}
+		
+		UInt64 wordMask = AQBitStorageWordAtIndex(mask, index);
+		_terms[_termCount].index = index;
+		_terms[_termCount].mask = wordMask;
+		_terms[_termCount].value = AQBitStorageWordAtIndex(value, index) & wordMask;
+		_termCount++;
+		
+		if ( index + 1 > AQWordIndexForBit(NSNotFound - 1) )
+			break;
+		bit = AQBitStorageNextIndex(mask, (index + 1) * AQBitsPerWord, 1);
+	}
+	
+	_compiled = YES;
+}
 
 - (BOOL) matchesBitfield: (AQBitfield *) bitfield
 {
-	return ( [_value isEqual: [bitfield bitfieldUsingMask: _mask]] );
+	if ( _compiled == NO )
+		return ( AQBitStorageMaskedEqual(&bitfield->_storage, 0, NSNotFound, &_value->_storage, &_mask->_storage) );
+	
+	const AQBitStorage * storage = &bitfield->_storage;
+	for ( NSUInteger i = 0; i < _termCount; i++ )
+	{
+		const _AQEqualityTerm * term = &_terms[i];
+		if ( ((AQBitStorageWordAtIndex(storage, term->index) ^ term->value) & term->mask) != 0ull )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+- (BOOL) matchesWords: (const UInt64 *) words count: (NSUInteger) count
+{
+	if ( _compiled == NO )
+	{
+		AQBitfield * bitfield = [[AQBitfield alloc] initWithCapacity: count * AQBitsPerWord];
+		for ( NSUInteger i = 0; i < count; i++ )
+			[bitfield setBitsInRange: NSMakeRange(i * AQBitsPerWord, AQBitsPerWord) from64BitValue: words[i]];
+		
+		BOOL result = [self matchesBitfield: bitfield];
+#if !USING_ARC
+		[bitfield release];
+#endif
+		return ( result );
+	}
+	
+	for ( NSUInteger i = 0; i < _termCount; i++ )
+	{
+		const _AQEqualityTerm * term = &_terms[i];
+		UInt64 word = (term->index < count ? words[term->index] : 0ull);
+		if ( ((word ^ term->value) & term->mask) != 0ull )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+- (NSUInteger) mismatchCountInWords: (const UInt64 *) words count: (NSUInteger) count
+{
+	if ( _compiled == NO )
+		return ( NSNotFound );
+	
+	NSUInteger result = 0;
+	for ( NSUInteger i = 0; i < _termCount; i++ )
+	{
+		const _AQEqualityTerm * term = &_terms[i];
+		UInt64 word = (term->index < count ? words[term->index] : 0ull);
+		result += (NSUInteger)__builtin_popcountll((word ^ term->value) & term->mask);
+	}
+	
+	return ( result );
+}
+
+- (BOOL) getSingleWordIndex: (NSUInteger *) index mask: (UInt64 *) mask value: (UInt64 *) value
+{
+	if ( _compiled == NO || _termCount != 1 )
+		return ( NO );
+	
+	if ( index != NULL )
+		*index = _terms[0].index;
+	if ( mask != NULL )
+		*mask = _terms[0].mask;
+	if ( value != NULL )
+		*value = _terms[0].value;
+	
+	return ( YES );
+}
+
+- (NSInteger) mismatchDeltaForWordAtIndex: (NSUInteger) index from: (UInt64) oldWord to: (UInt64) newWord
+{
+	// terms are sorted by word index
+	NSUInteger low = 0, high = _termCount;
+	while ( low < high )
+	{
+		NSUInteger mid = (low + high) / 2;
+		if ( _terms[mid].index < index )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if ( low == _termCount || _terms[low].index != index )
+		return ( 0 );
+	
+	// only the watched bits which actually flipped can change the count
+	const _AQEqualityTerm * term = &_terms[low];
+	UInt64 flipped = (oldWord ^ newWord) & term->mask;
+	NSInteger nowWrong = __builtin_popcountll((newWord ^ term->value) & flipped);
+	NSInteger nowRight = __builtin_popcountll((oldWord ^ term->value) & flipped);
+	return ( nowWrong - nowRight );
 }
 
 - (BOOL) isEqual: (id) object
@@ -35,6 +35,7 @@
 
 #import "AQAppStateMachineCoreTests.h"
 #import "AQAppStateMachine.h"
+#import <libkern/OSAtomic.h>
 
 static NSString * const kSampleOneName = @"Sample One";
 static NSString * const kSampleTwoName = @"Sample Two";
@@ -104,6 +105,40 @@ enum
 	STAssertTrue(NSEqualRanges(NSMakeRange(sampleOneBitCount, sampleTwoBitCount), [stateMachine underlyingBitfieldRangeForName: kSampleTwoName]), @"The underlying range is unexpectedly %@", NSStringFromRange([stateMachine underlyingBitfieldRangeForName: kSampleTwoName]));
 }
 
+- (void) testStateKeys
+{
+	AQStateKey key = [stateMachine addStateMachineValuesFromZeroTo: 200 withName: @"Keyed"];
+	AQStateKey lookedUp = [stateMachine keyForEnumerationWithName: @"Keyed"];
+	NSRange range = [stateMachine underlyingBitfieldRangeForName: @"Keyed"];
+	STAssertTrue(key.offset == range.location && key.width == range.length, @"Expected key {%lu, %lu} to match range %@", (unsigned long)key.offset, (unsigned long)key.width, NSStringFromRange(range));
+	STAssertTrue(lookedUp.offset == key.offset && lookedUp.width == key.width, @"Expected looked-up key to match the one returned on creation");
+	STAssertFalse(AQStateKeyIsValid([stateMachine keyForEnumerationWithName: @"Missing"]), @"Expected no key for an unknown enumeration");
+	
+	// values too wide for the scalar accessors are only available as bitfields, in the same form however they're read
+	AQStateKey wide = [stateMachine addStateMachineValuesUsingBitfieldOfLength: 96 withName: @"Wide"];
+	[stateMachine setBitAtIndex: 80 ofStateKey: wide];
+	STAssertThrowsSpecificNamed([stateMachine valueForStateKey: wide], NSException, NSRangeException, @"Expected a 96-bit value not to fit in 32 bits");
+	STAssertThrowsSpecificNamed([stateMachine largeValueForEnumerationWithName: @"Wide"], NSException, NSRangeException, @"Expected a 96-bit value not to fit in 64 bits");
+	AQBitfield * wideBits = [[stateMachine valuesForEnumerationsWithNames: [NSArray arrayWithObject: @"Wide"]] objectForKey: @"Wide"];
+	STAssertEqualObjects(wideBits, [stateMachine bitsForEnumerationWithName: @"Wide"], @"Expected both accessors to return the same bits");
+	STAssertTrue([wideBits bitAtIndex: wide.offset + 80] == 1, @"Expected bits at their indices within the state");
+	
+	__block BOOL matched = NO;
+	[stateMachine notifyEqualityOfStateKey: key toUInt64: 150 usingBlock: ^{ matched = YES; }];
+	
+	[stateMachine setValue: 150 forStateKey: key];
+	STAssertTrue([stateMachine valueForStateKey: key] == 150, @"Expected keyed value to be 150, got %lu", (unsigned long)[stateMachine valueForStateKey: key]);
+	STAssertTrue([stateMachine valueForEnumerationWithName: @"Keyed"] == 150, @"Expected named and keyed values to agree");
+	
+	[stateMachine clearBitAtIndex: 1 ofStateKey: key];
+	STAssertFalse([stateMachine bitIsSetAtIndex: 1 forStateKey: key], @"Expected bit one to be clear");
+	[stateMachine setBitAtIndex: 1 ofStateKey: key];
+	STAssertTrue([stateMachine bitIsSetAtIndex: 1 forStateKey: key], @"Expected bit one to be set");
+	
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(matched, @"Expected keyed equality notification to fire");
+}
+
 - (void) testChangesToSingleBitInRange
 {
 	STAssertTrue([stateMachine bitIsSetAtIndex: 1 forName: kSampleTwoName], @"Expected bit one of %@ to be set", kSampleTwoName);
@@ -140,6 +175,305 @@ enum
 	STAssertFalse(matched, @"Expected block NOT to be called upon change to value in %@", kSampleTwoName);
 }
 
+- (void) testBatchedNotifications
+{
+	__block NSUInteger sampleOneNotifications = 0;
+	__block NSUInteger sampleTwoNotifications = 0;
+	[stateMachine notifyChangesToStateMachineValuesWithName: kSampleOneName usingBlock: ^{ sampleOneNotifications++; }];
+	[stateMachine notifyChangesToStateMachineValuesWithName: kSampleTwoName usingBlock: ^{ sampleTwoNotifications++; }];
+	
+	[stateMachine performBatchUpdates: ^{
+		[stateMachine setValue: kSampleOneFirst forEnumerationWithName: kSampleOneName];
+		[stateMachine setValue: kSampleOneFourth forEnumerationWithName: kSampleOneName];
+		[stateMachine setValue: kSampleTwoFirst forEnumerationWithName: kSampleTwoName];
+		[stateMachine setBitAtIndex: 1 ofEnumerationWithName: kSampleTwoName];
+	}];
+	
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(sampleOneNotifications == 1, @"Expected one notification for %@ after a batch, got %lu", kSampleOneName, (unsigned long)sampleOneNotifications);
+	STAssertTrue(sampleTwoNotifications == 1, @"Expected one notification for %@ after a batch, got %lu", kSampleTwoName, (unsigned long)sampleTwoNotifications);
+	STAssertTrue([stateMachine valueForEnumerationWithName: kSampleOneName] == kSampleOneFourth, @"Expected batched changes to be applied");
+}
+
+- (void) testMultipleValueWrites
+{
+	AQStateKey first = [stateMachine addStateMachineValuesFromZeroTo: 1000 withName: @"First"];
+	AQStateKey second = [stateMachine addStateMachineValuesFromZeroTo: 1000 withName: @"Second"];
+	NSArray * names = [NSArray arrayWithObjects: @"First", @"Second", nil];
+	
+	__block volatile int32_t changes = 0;
+	__block volatile int32_t matches = 0;
+	[stateMachine notifyChangesToStateMachineValuesWithName: @"First" usingBlock: ^{ OSAtomicIncrement32Barrier(&changes); }];
+	[stateMachine notifyChangesToStateMachineValuesWithName: @"Second" usingBlock: ^{ OSAtomicIncrement32Barrier(&changes); }];
+	NSArray * masks = [NSArray arrayWithObjects: [NSNull null], [NSNull null], nil];
+	NSArray * targets = [NSArray arrayWithObjects: [NSNumber numberWithInt: 7], [NSNumber numberWithInt: 9], nil];
+	[stateMachine notifyEqualityOfStateMachineValuesWithNames: names matchingMasks: masks toValues: targets usingBlock: ^{ OSAtomicIncrement32Barrier(&matches); }];
+	
+	NSDictionary * values = [NSDictionary dictionaryWithObjectsAndKeys: [NSNumber numberWithInt: 7], @"First", [NSNumber numberWithInt: 9], @"Second", [NSNumber numberWithInt: 1], @"Missing", nil];
+	[stateMachine setValuesForEnumerationsWithNames: values];
+	
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue([stateMachine valueForStateKey: first] == 7 && [stateMachine valueForStateKey: second] == 9, @"Expected both values to be set");
+	STAssertTrue(changes == 2, @"Expected one notification per enumeration, got %d", changes);
+	STAssertTrue(matches == 1, @"Expected the equality notification to run once, got %d", matches);
+	
+	// a value too wide to set rejects the whole call, and leaves the state machine usable
+	AQStateKey wide = [stateMachine addStateMachineValuesUsingBitfieldOfLength: 128 withName: @"Wide"];
+	AQStateKeyValue rejected[2] = { { first, 1 }, { wide, 1 } };
+	STAssertThrowsSpecificNamed([stateMachine setValues: rejected count: 2], NSException, NSInvalidArgumentException, @"Expected a 128-bit enumeration to be rejected");
+	STAssertTrue([stateMachine valueForStateKey: first] == 7, @"Expected no values to be set by a rejected call");
+	
+	STAssertThrows([stateMachine performBatchUpdates: ^{
+		[stateMachine setValue: 8 forStateKey: first];
+		[NSException raise: NSGenericException format: @"Failing batch"];
+	}], @"Expected the batch's exception to reach the caller");
+	[stateMachine setValue: 9 forStateKey: first];
+	STAssertTrue([stateMachine valueForStateKey: first] == 9, @"Expected writes to proceed after a failed batch");
+	
+	// readers must never see one value without the other
+	__block BOOL writing = YES;
+	dispatch_group_t group = dispatch_group_create();
+	dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		for ( UInt64 i = 1; i <= 1000; i++ )
+		{
+			AQStateKeyValue pair[2] = { { first, i }, { second, i } };
+			[stateMachine setValues: pair count: 2];
+		}
+		writing = NO;
+	});
+	
+	__block BOOL torn = NO;
+	dispatch_apply(4, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t idx) {
+		while ( writing )
+		{
+			@autoreleasepool
+			{
+				NSDictionary * current = [stateMachine valuesForEnumerationsWithNames: names];
+				if ( [[current objectForKey: @"First"] isEqual: [current objectForKey: @"Second"]] == NO )
+					torn = YES;
+			}
+		}
+	});
+	
+	dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+	dispatch_release(group);
+	
+	STAssertFalse(torn, @"Expected readers never to see a partially-applied set of values");
+	STAssertTrue([stateMachine valueForStateKey: second] == 1000, @"Expected the final values once writes complete");
+}
+
+- (void) testNotificationsReachOnlyAffectedDescriptors
+{
+	// lots of watchers spread across the state, with only a few on the bits which change
+	NSMutableArray * names = [NSMutableArray new];
+	for ( NSUInteger i = 0; i < 256; i++ )
+	{
+		NSString * name = [NSString stringWithFormat: @"Watched %lu", (unsigned long)i];
+		[stateMachine addStateMachineValuesFromZeroTo: 4 withName: name];
+		[names addObject: name];
+	}
+	
+	__block volatile int32_t unaffected = 0;
+	__block volatile int32_t affected = 0;
+	for ( NSString * name in names )
+	{
+		[stateMachine notifyChangesToStateMachineValuesWithName: name usingBlock: ^{ OSAtomicIncrement32Barrier(&unaffected); }];
+	}
+	
+	NSString * target = [names objectAtIndex: 200];
+	[stateMachine notifyChangesToStateMachineValuesWithName: target usingBlock: ^{ OSAtomicIncrement32Barrier(&affected); }];
+	[stateMachine notifyEqualityOfStateMachineValuesWithName: target toInteger: 3 usingBlock: ^{ OSAtomicIncrement32Barrier(&affected); }];
+	
+	[stateMachine setValue: 3 forEnumerationWithName: target];
+	
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(affected == 2, @"Expected both notifiers on %@ to run, got %d", target, affected);
+	STAssertTrue(unaffected == 1, @"Expected only the watcher of %@ among the others to run, got %d", target, unaffected);
+	
+#if !USING_ARC
+	[names release];
+#endif
+}
+
+- (void) testRemovingNotifiers
+{
+	__block volatile int32_t removed = 0;
+	__block volatile int32_t kept = 0;
+	id changeToken = [stateMachine notifyChangesToStateMachineValuesWithName: kSampleOneName usingBlock: ^{ OSAtomicIncrement32Barrier(&removed); }];
+	id equalityToken = [stateMachine notifyEqualityOfStateMachineValuesWithName: kSampleOneName toInteger: kSampleOneFourth usingBlock: ^{ OSAtomicIncrement32Barrier(&removed); }];
+	id valuesToken = [stateMachine notifyChangesToStateMachineValuesWithName: kSampleOneName usingChangeBlock: ^(AQBitfieldChange * change) { OSAtomicIncrement32Barrier(&removed); }];
+	STAssertNotNil(changeToken, @"Expected a token for a change notification");
+	STAssertNotNil(equalityToken, @"Expected a token for an equality notification");
+	STAssertNotNil(valuesToken, @"Expected a token for a change value notification");
+	STAssertNil([stateMachine notifyChangesToStateMachineValuesWithName: @"Missing" usingBlock: ^{}], @"Expected no token for an unknown enumeration");
+	
+	[stateMachine removeNotifier: changeToken];
+	[stateMachine removeNotifier: equalityToken];
+	[stateMachine removeNotifier: valuesToken];
+	[stateMachine removeNotifier: equalityToken];		// already removed, so ignored
+	
+	// these take over the removed notifications' slots
+	[stateMachine notifyChangesToStateMachineValuesWithName: kSampleOneName usingBlock: ^{ OSAtomicIncrement32Barrier(&kept); }];
+	[stateMachine notifyEqualityOfStateMachineValuesWithName: kSampleOneName toInteger: kSampleOneFourth usingBlock: ^{ OSAtomicIncrement32Barrier(&kept); }];
+	
+	[stateMachine setValue: kSampleOneFourth forEnumerationWithName: kSampleOneName];
+	
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(removed == 0, @"Expected removed notifications NOT to run, but %d did", removed);
+	STAssertTrue(kept == 2, @"Expected both remaining notifications to run, got %d", kept);
+}
+
+- (void) testConcurrentReads
+{
+	// this one straddles two words of the underlying state
+	[stateMachine addStateMachineValuesUsingBitfieldOfLength: 64 withName: @"Wide"];
+	
+	__block BOOL writing = YES;
+	dispatch_group_t group = dispatch_group_create();
+	dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		for ( UInt64 i = 1; i <= 10000; i++ )
+			[stateMachine setValue: (i << 32) | i forEnumerationWithName: @"Wide"];
+		writing = NO;
+	});
+	
+	__block BOOL torn = NO;
+	__block BOOL mismatched = NO;
+	dispatch_apply(4, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t idx) {
+		NSArray * names = [NSArray arrayWithObjects: kSampleOneName, @"Wide", nil];
+		while ( writing )
+		{
+			UInt64 value = [stateMachine largeValueForEnumerationWithName: @"Wide"];
+			if ( (value >> 32) != (value & 0xffffffffull) )
+				torn = YES;
+			
+			@autoreleasepool
+			{
+				NSDictionary * values = [stateMachine valuesForEnumerationsWithNames: names];
+				value = [[values objectForKey: @"Wide"] unsignedLongLongValue];
+				if ( (value >> 32) != (value & 0xffffffffull) )
+					torn = YES;
+				if ( [[values objectForKey: kSampleOneName] unsignedIntegerValue] != kSampleOneSecond )
+					mismatched = YES;
+			}
+		}
+	});
+	
+	dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+	dispatch_release(group);
+	
+	STAssertFalse(torn, @"Expected readers never to see a partially-written value");
+	STAssertFalse(mismatched, @"Expected unrelated values to be unaffected by concurrent writes");
+	STAssertTrue([stateMachine largeValueForEnumerationWithName: @"Wide"] == ((10000ull << 32) | 10000ull), @"Expected readers to see the final value once writes complete");
+}
+
+- (void) testConcurrentWriters
+{
+	// one enumeration per 512-bit cache line, so each writer has a shard to itself, plus one straddling two shards
+	NSMutableArray * names = [NSMutableArray new];
+	AQStateKey padding = { 0, 0 };
+	for ( NSUInteger i = 0; i < 8; i++ )
+	{
+		NSString * name = [NSString stringWithFormat: @"Writer %lu", (unsigned long)i];
+		[stateMachine addStateMachineValuesUsingBitfieldOfLength: 64 withName: name];
+		padding = [stateMachine addStateMachineValuesUsingBitfieldOfLength: 448 withName: [name stringByAppendingString: @" Padding"]];
+		[names addObject: name];
+	}
+	
+	NSUInteger next = padding.offset + padding.width;
+	[stateMachine addStateMachineValuesUsingBitfieldOfLength: ((next / 512) + 1) * 512 - 32 - next withName: @"Padding"];
+	[stateMachine addStateMachineValuesUsingBitfieldOfLength: 64 withName: @"Straddling"];
+	
+	__block volatile int32_t matches = 0;
+	for ( NSString * name in names )
+	{
+		[stateMachine notifyEqualityOfStateMachineValuesWithName: name toInteger: 10000 usingBlock: ^{ OSAtomicIncrement32Barrier(&matches); }];
+	}
+	
+	__block BOOL torn = NO;
+	dispatch_apply(9, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t idx) {
+		if ( idx == 8 )
+		{
+			for ( UInt64 i = 1; i <= 10000; i++ )
+			{
+				[stateMachine setValue: (i << 32) | i forEnumerationWithName: @"Straddling"];
+				UInt64 value = [stateMachine largeValueForEnumerationWithName: @"Straddling"];
+				if ( (value >> 32) != (value & 0xffffffffull) )
+					torn = YES;
+			}
+			return;
+		}
+		
+		NSString * name = [names objectAtIndex: idx];
+		for ( NSUInteger i = 1; i <= 10000; i++ )
+			[stateMachine setValue: i forEnumerationWithName: name];
+	});
+	
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	for ( NSString * name in names )
+	{
+		STAssertTrue([stateMachine largeValueForEnumerationWithName: name] == 10000, @"Expected %@ to hold its final value, got %llu", name, [stateMachine largeValueForEnumerationWithName: name]);
+	}
+	STAssertFalse(torn, @"Expected a value spanning two shards never to be seen partially written");
+	STAssertTrue(matches == 8, @"Expected each writer's equality notification to run once, got %d", matches);
+	
+#if !USING_ARC
+	[names release];
+#endif
+}
+
+- (void) testChangeValueNotifications
+{
+	__block UInt64 before = NSNotFound;
+	__block UInt64 after = NSNotFound;
+	[stateMachine notifyChangesToStateMachineValuesWithName: kSampleTwoName usingChangeBlock: ^(AQBitfieldChange * change) {
+		before = change.valueBefore;
+		after = change.valueAfter;
+	}];
+	
+	[stateMachine setValue: kSampleTwoFourth forEnumerationWithName: kSampleTwoName];
+	
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(before == kSampleTwoThird, @"Expected old value %d, got %llu", kSampleTwoThird, before);
+	STAssertTrue(after == kSampleTwoFourth, @"Expected new value %d, got %llu", kSampleTwoFourth, after);
+}
+
+- (void) testEdgeTriggeredEqualityNotifications
+{
+	__block NSUInteger entries = 0;
+	__block NSUInteger exits = 0;
+	[stateMachine notifyEqualityOfStateMachineValuesWithName: kSampleOneName toUInt64: kSampleOneFourth usingEntryBlock: ^{ entries++; } exitBlock: ^{ exits++; }];
+	
+	// only bit zero is compared, so changes to bit one are irrelevant
+	__block NSUInteger maskedEntries = 0;
+	NSArray * names = [NSArray arrayWithObject: kSampleTwoName];
+	NSArray * masks = [NSArray arrayWithObject: [NSNumber numberWithInt: 0x01]];
+	NSArray * values = [NSArray arrayWithObject: [NSNumber numberWithInt: 0x01]];
+	[stateMachine notifyEqualityOfStateMachineValuesWithNames: names matchingMasks: masks toValues: values usingEntryBlock: ^{ maskedEntries++; } exitBlock: nil];
+	
+	[stateMachine setValue: kSampleOneFourth forEnumerationWithName: kSampleOneName];
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(entries == 1 && exits == 0, @"Expected one entry on first match, got %lu entries and %lu exits", (unsigned long)entries, (unsigned long)exits);
+	
+	[stateMachine setValue: kSampleOneFourth forEnumerationWithName: kSampleOneName];
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(entries == 1 && exits == 0, @"Expected nothing while the match persists, got %lu entries and %lu exits", (unsigned long)entries, (unsigned long)exits);
+	
+	[stateMachine setValue: kSampleOneFirst forEnumerationWithName: kSampleOneName];
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(entries == 1 && exits == 1, @"Expected one exit on leaving the match, got %lu entries and %lu exits", (unsigned long)entries, (unsigned long)exits);
+	
+	[stateMachine setValue: kSampleOneSecond forEnumerationWithName: kSampleOneName];
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(entries == 1 && exits == 1, @"Expected nothing while the match remains absent, got %lu entries and %lu exits", (unsigned long)entries, (unsigned long)exits);
+	
+	// kSampleTwoThird (10) becomes kSampleTwoFourth (11), then kSampleTwoSecond (01)
+	[stateMachine setValue: kSampleTwoFourth forEnumerationWithName: kSampleTwoName];
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	[stateMachine setValue: kSampleTwoSecond forEnumerationWithName: kSampleTwoName];
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	STAssertTrue(maskedEntries == 1, @"Expected one entry despite changes to unmasked bits, got %lu", (unsigned long)maskedEntries);
+}
+
 - (void) testSingleBitChangeNotifications
 {
 	__block BOOL matched = NO;
@@ -217,6 +551,35 @@ enum
 	STAssertTrue(matched, @"Expected equality notifier on %@ to fire when value was re-set to %lu", kEqualityEnum, (unsigned long)kMatchValue);
 }
 
+- (void) testSharedEqualityNotifications
+{
+	static NSString * const kRuleEnum = @"Rules";
+	static const NSUInteger kRuleCount = 256;
+	
+	[stateMachine addStateMachineValuesFromZeroTo: kRuleCount - 1 withName: kRuleEnum];
+	
+	// one rule per value of the same enumeration, all of which share a single lookup
+	volatile int32_t * fired = calloc(kRuleCount, sizeof(int32_t));
+	for ( NSUInteger i = 0; i < kRuleCount; i++ )
+	{
+		[stateMachine notifyEqualityOfStateMachineValuesWithName: kRuleEnum toInteger: i usingBlock: ^{ OSAtomicIncrement32Barrier(&fired[i]); }];
+	}
+	
+	[stateMachine setValue: 37 forEnumerationWithName: kRuleEnum];
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	
+	[stateMachine setValue: 200 forEnumerationWithName: kRuleEnum];
+	[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+	
+	for ( NSUInteger i = 0; i < kRuleCount; i++ )
+	{
+		int32_t expected = (i == 37 || i == 200 ? 1 : 0);
+		STAssertTrue(fired[i] == expected, @"Expected the rule for %lu to fire %d times, got %d", (unsigned long)i, expected, fired[i]);
+	}
+	
+	free((void *)fired);
+}
+
 - (void) testMultipleValueChangeNotifications
 {
 	__block BOOL matched = NO;
@@ -0,0 +1,234 @@
+//
+//  AQBitfieldBenchmarks.m
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-12.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQBitfieldBenchmarks.h"
+#import "AQBitfield.h"
+#import "AQAppStateMachine.h"
+#import "AQRange.h"
+#import "AQRangeTree.h"
+#import "MutableSortedDictionary.h"
+#import <mach/mach_time.h>
+
+#define kBenchmarkIterations	100000
+#define kBenchmarkFieldCount	16
+#define kBenchmarkRangeCount	100000
+#define kBenchmarkQueryCount	100
+
+static double ElapsedMilliseconds( uint64_t start, uint64_t end )
+{
+	static mach_timebase_info_data_t timebase = { 0, 0 };
+	if ( timebase.denom == 0 )
+		mach_timebase_info(&timebase);
+	
+	return ( (double)((end - start) * timebase.numer / timebase.denom) / 1000000.0 );
+}
+
+static inline UInt64 BenchmarkValue( NSUInteger i )
+{
+	return ( (UInt64)(i + 1) * 0x9E3779B97F4A7C15ull );
+}
+
+@implementation AQBitfieldBenchmarks
+
+- (void) testSetScalar64ValuePerformance
+{
+	// the 64-bit fields start at bit 8, so every write straddles two storage words
+	NSRange ranges[kBenchmarkFieldCount];
+	for ( NSUInteger i = 0; i < kBenchmarkFieldCount; i++ )
+		ranges[i] = NSMakeRange(8 + (i * 64), 64);
+	
+	// reference: the per-bit loop the NSIndexSet-based storage used for -setBitsInRange:from64BitValue:
+	NSMutableIndexSet * indexSet = [NSMutableIndexSet new];
+	uint64_t start = mach_absolute_time();
+	for ( NSUInteger i = 0; i < kBenchmarkIterations; i++ )
+	{
+		NSRange range = ranges[i % kBenchmarkFieldCount];
+		UInt64 value = BenchmarkValue(i);
+		for ( NSUInteger j = 0; j < range.length; j++, value >>= 1 )
+		{
+			if ( (value & 1) == 1 )
+				[indexSet addIndex: range.location + j];
+			else
+				[indexSet removeIndex: range.location + j];
+		}
+	}
+	double indexSetTime = ElapsedMilliseconds(start, mach_absolute_time());
+	
+	AQBitfield * bitfield = [[AQBitfield alloc] initWithCapacity: NSMaxRange(ranges[kBenchmarkFieldCount-1])];
+	start = mach_absolute_time();
+	for ( NSUInteger i = 0; i < kBenchmarkIterations; i++ )
+	{
+		[bitfield setBitsInRange: ranges[i % kBenchmarkFieldCount] from64BitValue: BenchmarkValue(i)];
+	}
+	double bitfieldTime = ElapsedMilliseconds(start, mach_absolute_time());
+	
+	// the same writes, made through the state machine's named enumerations
+	AQAppStateMachine * stateMachine = [AQAppStateMachine new];
+	NSMutableArray * names = [NSMutableArray new];
+	[stateMachine addStateMachineValuesUsingBitfieldOfLength: 8 withName: @"Padding"];
+	for ( NSUInteger i = 0; i < kBenchmarkFieldCount; i++ )
+	{
+		NSString * name = [NSString stringWithFormat: @"Benchmark %lu", (unsigned long)i];
+		[stateMachine addStateMachineValuesUsingBitfieldOfLength: 64 withName: name];
+		[names addObject: name];
+	}
+	
+	start = mach_absolute_time();
+	for ( NSUInteger i = 0; i < kBenchmarkIterations; i++ )
+	{
+		[stateMachine setValue: BenchmarkValue(i) forEnumerationWithName: [names objectAtIndex: i % kBenchmarkFieldCount]];
+	}
+	double stateMachineTime = ElapsedMilliseconds(start, mach_absolute_time());
+	
+	NSLog(@"%d 64-bit scalar writes: NSIndexSet %.2fms, AQBitfield %.2fms, AQAppStateMachine %.2fms", kBenchmarkIterations, indexSetTime, bitfieldTime, stateMachineTime);
+	
+	STAssertTrue([[indexSet bitfieldRepresentation] isEqual: bitfield], @"Expected word-array bitfield %@ to match reference index set %@", bitfield, indexSet);
+	for ( NSUInteger i = 0; i < kBenchmarkFieldCount; i++ )
+	{
+		NSString * name = [names objectAtIndex: i];
+		AQBitfield * expected = [bitfield bitfieldByExtractingBitsInRange: ranges[i]];
+		STAssertTrue([stateMachine largeValueForEnumerationWithName: name] == [expected scalarBitsFrom64BitRange: NSMakeRange(0, 64)], @"Expected state machine value for %@ to match the bitfield", name);
+	}
+	
+#if !USING_ARC
+	[indexSet release];
+	[bitfield release];
+	[stateMachine release];
+	[names release];
+#endif
+}
+
+- (void) testConcurrentWritePerformance
+{
+	// one 64-bit enumeration per 512-bit shard, so writers on different threads never share a lock or a cache line
+	NSUInteger threadCount = MAX(MIN([[NSProcessInfo processInfo] activeProcessorCount], (NSUInteger)8), (NSUInteger)2);
+	NSUInteger perThread = kBenchmarkIterations / threadCount;
+	AQAppStateMachine * stateMachine = [AQAppStateMachine new];
+	AQStateKey * keys = malloc(threadCount * sizeof(AQStateKey));
+	for ( NSUInteger i = 0; i < threadCount; i++ )
+	{
+		keys[i] = [stateMachine addStateMachineValuesUsingBitfieldOfLength: 64 withName: [NSString stringWithFormat: @"Writer %lu", (unsigned long)i]];
+		[stateMachine addStateMachineValuesUsingBitfieldOfLength: 448 withName: [NSString stringWithFormat: @"Padding %lu", (unsigned long)i]];
+	}
+	
+	// reference: the same number of writes, all from one thread
+	uint64_t start = mach_absolute_time();
+	for ( NSUInteger i = 0; i < perThread * threadCount; i++ )
+	{
+		[stateMachine setValue: BenchmarkValue(i) forStateKey: keys[i % threadCount]];
+	}
+	double serialTime = ElapsedMilliseconds(start, mach_absolute_time());
+	
+	start = mach_absolute_time();
+	dispatch_apply(threadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+		for ( NSUInteger i = 0; i < perThread; i++ )
+		{
+			[stateMachine setValue: BenchmarkValue(thread * perThread + i) forStateKey: keys[thread]];
+		}
+	});
+	double concurrentTime = ElapsedMilliseconds(start, mach_absolute_time());
+	
+	NSLog(@"%lu enumeration writes: 1 thread %.2fms, %lu threads %.2fms (%.2fx)", (unsigned long)(perThread * threadCount), serialTime, (unsigned long)threadCount, concurrentTime, serialTime / concurrentTime);
+	
+	for ( NSUInteger i = 0; i < threadCount; i++ )
+	{
+		UInt64 expected = BenchmarkValue(i * perThread + perThread - 1);
+		STAssertTrue([stateMachine largeValueForStateKey: keys[i]] == expected, @"Expected writer %lu's last value %llu, got %llu", (unsigned long)i, expected, [stateMachine largeValueForStateKey: keys[i]]);
+	}
+	
+	free(keys);
+#if !USING_ARC
+	[stateMachine release];
+#endif
+}
+
+- (void) testNotifierLookupPerformance
+{
+	// 100k small ranges spread across the state space, as registered by many notifiers
+	MutableSortedDictionary * dictionary = [MutableSortedDictionary new];
+	AQRangeTree * tree = [AQRangeTree new];
+	for ( NSUInteger i = 0; i < kBenchmarkRangeCount; i++ )
+	{
+		NSRange range = NSMakeRange(i * 16, 1 + (i % 32));
+		AQRange * key = [[AQRange alloc] initWithRange: range];
+		[dictionary setObject: key forKey: key];
+		[tree addObject: key forRange: range];
+#if !USING_ARC
+		[key release];
+#endif
+	}
+	
+	// changes near the top of the state space, where a sorted walk visits almost every range first
+	NSRange queries[kBenchmarkQueryCount];
+	for ( NSUInteger i = 0; i < kBenchmarkQueryCount; i++ )
+		queries[i] = NSMakeRange((kBenchmarkRangeCount - 1 - i) * 16, 8);
+	
+	// reference: the MutableSortedDictionary walk AQNotifyingBitfield used before
+	__block NSUInteger dictionaryHits = 0;
+	uint64_t start = mach_absolute_time();
+	for ( NSUInteger i = 0; i < kBenchmarkQueryCount; i++ )
+	{
+		NSRange query = queries[i];
+		[dictionary enumerateKeysAndObjectsUsingBlock: ^(__strong id key, __strong id obj, BOOL *stop) {
+			if ( NSIntersectionRange(query, [key range]).length != 0 )
+				dictionaryHits++;
+			else if ( NSMaxRange(query) < [key range].location )
+				*stop = YES;
+		}];
+	}
+	double dictionaryTime = ElapsedMilliseconds(start, mach_absolute_time());
+	
+	__block NSUInteger treeHits = 0;
+	start = mach_absolute_time();
+	for ( NSUInteger i = 0; i < kBenchmarkQueryCount; i++ )
+	{
+		[tree enumerateRangesIntersectingRange: queries[i] usingBlock: ^(NSRange range, id object, BOOL *stop) {
+			treeHits++;
+		}];
+	}
+	double treeTime = ElapsedMilliseconds(start, mach_absolute_time());
+	
+	NSLog(@"%d notifier lookups among %d ranges: MutableSortedDictionary %.2fms, AQRangeTree %.2fms", kBenchmarkQueryCount, kBenchmarkRangeCount, dictionaryTime, treeTime);
+	
+	STAssertTrue(treeHits == dictionaryHits, @"Expected interval tree to find the same %lu ranges as a sorted walk, found %lu", (unsigned long)dictionaryHits, (unsigned long)treeHits);
+	STAssertTrue(treeHits >= kBenchmarkQueryCount, @"Every lookup should find at least one range");
+	
+#if !USING_ARC
+	[dictionary release];
+	[tree release];
+#endif
+}
+
+@end
@@ -229,6 +229,38 @@
 	STAssertEqualObjects(bitfield, theCopy, @"Expected %@ to be equal to its copy %@", bitfield, theCopy);
 }
 
+- (void) testCopiesModifiedIndependently
+{
+	for ( NSUInteger mode = AQBitfieldStorageDense; mode <= AQBitfieldStorageSparse; mode++ )
+	{
+		AQBitfield * original = [[AQBitfield alloc] initWithStorageMode: mode];
+		[original setBitsInRange: NSMakeRange(100, 200000) usingBit: 1];
+		
+		AQBitfield * theCopy = [original copy];
+		AQBitfield * secondCopy = [theCopy copy];
+		
+		[theCopy flipBitAtIndex: 150000];
+		STAssertTrue([original bitAtIndex: 150000] == 1, @"Modifying a copy should leave the original unchanged");
+		STAssertTrue([secondCopy bitAtIndex: 150000] == 1, @"Modifying a copy should leave other copies unchanged");
+		STAssertTrue([theCopy bitAtIndex: 150000] == 0, @"Modified copy should contain the new value");
+		
+		[original setBitsInRange: NSMakeRange(0, 100) usingBit: 1];
+		STAssertTrue([original countOfBit: 1 inRange: NSMakeRange(0, 300000)] == 200100, @"Original should contain its own modification");
+		STAssertTrue([theCopy countOfBit: 1 inRange: NSMakeRange(0, 300000)] == 199999, @"Copy should not see modifications made to the original");
+		STAssertEqualObjects(secondCopy, [original bitfieldFromRange: NSMakeRange(100, 200000)], @"Unmodified copy should still match the original's starting contents");
+		
+		[secondCopy shiftBitsLeftBy: 100];
+		STAssertTrue([secondCopy firstIndexOfBit: 1] == 0, @"Shifted copy should have moved its bits down");
+		STAssertTrue([original firstIndexOfBit: 1] == 0 && [original lastIndexOfBit: 1] == 200099, @"Shifting a copy should leave the original unchanged");
+		
+#if !USING_ARC
+		[secondCopy release];
+		[theCopy release];
+		[original release];
+#endif
+	}
+}
+
 - (void) testFirstIndexOfBit
 {
 	AQBitfield * bitfield = [AQBitfield new];
@@ -248,6 +280,32 @@
 	STAssertTrue([bitfield lastIndexOfBit: 0] == 19, @"Expected last index of bit 0 in %@ to be 19, instead got %lu", bitfield, (unsigned long)[bitfield lastIndexOfBit: 0]);
 }
 
+- (void) testNextAndPreviousIndexOfBit
+{
+	for ( AQBitfield * bitfield in [NSArray arrayWithObjects: [AQBitfield new], [[AQBitfield alloc] initWithStorageMode: AQBitfieldStorageSparse], nil] )
+	{
+		[bitfield setBit: 1 atIndex: 3];
+		[bitfield setBitsInRange: NSMakeRange(64, 64) usingBit: 1];
+		[bitfield setBit: 1 atIndex: 200000];
+		
+		STAssertTrue([bitfield nextIndexOfBit: 1 afterIndex: 0] == 3, @"Expected next 1 bit after 0 in %@ to be at 3, got %lu", bitfield, (unsigned long)[bitfield nextIndexOfBit: 1 afterIndex: 0]);
+		STAssertTrue([bitfield nextIndexOfBit: 1 afterIndex: 3] == 64, @"Expected next 1 bit after 3 in %@ to be at 64, got %lu", bitfield, (unsigned long)[bitfield nextIndexOfBit: 1 afterIndex: 3]);
+		STAssertTrue([bitfield nextIndexOfBit: 1 afterIndex: 127] == 200000, @"Expected next 1 bit after 127 in %@ to be at 200000, got %lu", bitfield, (unsigned long)[bitfield nextIndexOfBit: 1 afterIndex: 127]);
+		STAssertTrue([bitfield nextIndexOfBit: 1 afterIndex: 200000] == NSNotFound, @"Expected no 1 bits after 200000 in %@", bitfield);
+		STAssertTrue([bitfield nextIndexOfBit: 0 afterIndex: 63] == 128, @"Expected next 0 bit after 63 in %@ to be at 128, got %lu", bitfield, (unsigned long)[bitfield nextIndexOfBit: 0 afterIndex: 63]);
+		
+		STAssertTrue([bitfield previousIndexOfBit: 1 beforeIndex: NSNotFound] == 200000, @"Expected last 1 bit in %@ to be at 200000, got %lu", bitfield, (unsigned long)[bitfield previousIndexOfBit: 1 beforeIndex: NSNotFound]);
+		STAssertTrue([bitfield previousIndexOfBit: 1 beforeIndex: 200000] == 127, @"Expected previous 1 bit before 200000 in %@ to be at 127, got %lu", bitfield, (unsigned long)[bitfield previousIndexOfBit: 1 beforeIndex: 200000]);
+		STAssertTrue([bitfield previousIndexOfBit: 1 beforeIndex: 64] == 3, @"Expected previous 1 bit before 64 in %@ to be at 3, got %lu", bitfield, (unsigned long)[bitfield previousIndexOfBit: 1 beforeIndex: 64]);
+		STAssertTrue([bitfield previousIndexOfBit: 1 beforeIndex: 3] == NSNotFound, @"Expected no 1 bits before 3 in %@", bitfield);
+		STAssertTrue([bitfield previousIndexOfBit: 0 beforeIndex: 128] == 63, @"Expected previous 0 bit before 128 in %@ to be at 63, got %lu", bitfield, (unsigned long)[bitfield previousIndexOfBit: 0 beforeIndex: 128]);
+		
+		STAssertTrue([bitfield containsBit: 1 inRange: NSMakeRange(4, 60)] == NO, @"Expected no 1 bits in range 4..63 of %@", bitfield);
+		STAssertTrue([bitfield containsBit: 0 inRange: NSMakeRange(64, 64)] == NO, @"Expected no 0 bits in range 64..127 of %@", bitfield);
+		STAssertTrue([bitfield containsBit: 1 inRange: NSMakeRange(4, 61)], @"Expected a 1 bit in range 4..64 of %@", bitfield);
+	}
+}
+
 - (void) testFlipBitAtIndex
 {
 	AQBitfield * bitfield = [AQBitfield new];
@@ -448,6 +506,255 @@
 	STAssertFalse([bitfield bitsInRange: rng maskedWith: mask equalToBitfield: test], @"Expected bits in range %@ of %@ to NOT match %@", NSStringFromRange(rng), bitfield, test);
 }
 
+- (void) testSparseStorage
+{
+	AQBitfield * dense = [AQBitfield new];
+	AQBitfield * sparse = [[AQBitfield alloc] initWithStorageMode: AQBitfieldStorageSparse];
+	STAssertTrue(sparse.storageMode == AQBitfieldStorageSparse, @"Expected a sparse bitfield, got storage mode %d", sparse.storageMode);
+	
+	// scattered bits, a long run crossing several chunks, and a dense patch of alternating bits
+	NSRange run = NSMakeRange(100000, 300000);
+	for ( AQBitfield * bitfield in [NSArray arrayWithObjects: dense, sparse, nil] )
+	{
+		[bitfield setBit: 1 atIndex: 7];
+		[bitfield setBit: 1 atIndex: 5000000];
+		[bitfield setBitsInRange: run usingBit: 1];
+		for ( NSUInteger i = 0; i < 10000; i += 2 )
+			[bitfield setBit: 1 atIndex: 2000000 + i];
+	}
+	
+	STAssertEqualObjects(sparse, dense, @"Expected sparse bitfield %@ to equal dense bitfield %@", sparse, dense);
+	STAssertTrue([sparse hash] == [dense hash], @"Equal bitfields should have equal hashes regardless of storage mode");
+	STAssertTrue([sparse compare: dense] == NSOrderedSame, @"Equal bitfields should compare as the same regardless of storage mode");
+	STAssertTrue(sparse.count == 5000001, @"Expected a count of 5000001, got %lu", (unsigned long)sparse.count);
+	STAssertTrue([sparse countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == run.length + 5002, @"Expected %lu 1 bits, got %lu", (unsigned long)(run.length + 5002), (unsigned long)[sparse countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)]);
+	STAssertTrue([sparse firstIndexOfBit: 0] == 0, @"Expected first zero bit at index 0");
+	
+	[sparse shiftBitsRightBy: 70000];
+	[dense shiftBitsRightBy: 70000];
+	STAssertEqualObjects(sparse, dense, @"Expected shifted sparse bitfield %@ to equal shifted dense bitfield %@", sparse, dense);
+	
+	[sparse flipBitsInRange: NSMakeRange(150000, 1000000)];
+	[dense flipBitsInRange: NSMakeRange(150000, 1000000)];
+	STAssertEqualObjects(sparse, dense, @"Expected flipped sparse bitfield %@ to equal flipped dense bitfield %@", sparse, dense);
+}
+
+- (void) testStorageModeConversion
+{
+	AQBitfield * bitfield = [AQBitfield new];
+	[bitfield setBitsInRange: NSMakeRange(60000, 10000) usingBit: 1];
+	[bitfield setBit: 1 atIndex: 1000000];
+	AQBitfield * original = [bitfield copy];
+	
+	bitfield.storageMode = AQBitfieldStorageSparse;
+	STAssertEqualObjects(bitfield, original, @"Converting %@ to sparse storage should not change its contents", original);
+	STAssertTrue([[bitfield copy] storageMode] == AQBitfieldStorageSparse, @"Copies should keep the storage mode of the original");
+	
+	AQBitfield * unarchived = [NSKeyedUnarchiver unarchiveObjectWithData: [NSKeyedArchiver archivedDataWithRootObject: bitfield]];
+	STAssertEqualObjects(unarchived, original, @"Archived sparse bitfield %@ should unarchive as %@", bitfield, unarchived);
+	STAssertTrue(unarchived.storageMode == AQBitfieldStorageSparse, @"Unarchived bitfields should keep their storage mode");
+	
+	bitfield.storageMode = AQBitfieldStorageDense;
+	STAssertEqualObjects(bitfield, original, @"Converting %@ back to dense storage should not change its contents", original);
+	
+	AQBitfield * mask = [[AQBitfield alloc] initWithStorageMode: AQBitfieldStorageSparse];
+	[mask setBitsInRange: NSMakeRange(65000, 2000) usingBit: 1];
+	[bitfield maskWithBits: mask];
+	STAssertTrue([bitfield countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 2000, @"Masking with a sparse bitfield should leave 2000 bits set, got %@", bitfield);
+}
+
+- (void) testDataRepresentation
+{
+	// one bitfield with long runs, one with scattered bits, and one which is set all the way up to NSNotFound
+	AQBitfield * runs = [[AQBitfield alloc] initWithStorageMode: AQBitfieldStorageSparse];
+	[runs setBitsInRange: NSMakeRange(100, 500000) usingBit: 1];
+	[runs setBitsInRange: NSMakeRange(2000000, 64) usingBit: 1];
+	
+	AQBitfield * scattered = [AQBitfield new];
+	for ( NSUInteger i = 0; i < 4096; i += 3 )
+		[scattered setBit: 1 atIndex: i];
+	
+	AQBitfield * filled = [AQBitfield new];
+	[filled setAllBits: 1];
+	[filled setBitsInRange: NSMakeRange(10, 20) usingBit: 0];
+	
+	for ( AQBitfield * bitfield in [NSArray arrayWithObjects: runs, scattered, filled, [AQBitfield new], nil] )
+	{
+		NSData * data = [bitfield dataRepresentation];
+		AQBitfield * decoded = [[AQBitfield alloc] initWithData: data];
+		STAssertEqualObjects(decoded, bitfield, @"Bitfield %@ should decode from its data representation, got %@", bitfield, decoded);
+		STAssertTrue(decoded.storageMode == bitfield.storageMode, @"Decoded bitfields should keep their storage mode");
+		
+		AQBitfield * unarchived = [NSKeyedUnarchiver unarchiveObjectWithData: [NSKeyedArchiver archivedDataWithRootObject: bitfield]];
+		STAssertEqualObjects(unarchived, bitfield, @"Archived bitfield %@ should unarchive as %@", bitfield, unarchived);
+		
+#if !USING_ARC
+		[decoded release];
+#endif
+	}
+	
+	STAssertTrue([[runs dataRepresentation] length] < 64, @"Runs should be encoded as a list of runs, got %lu bytes", (unsigned long)[[runs dataRepresentation] length]);
+	STAssertTrue([[scattered dataRepresentation] length] == 16 + 64 * sizeof(UInt64), @"Scattered bits should be encoded as raw words, got %lu bytes", (unsigned long)[[scattered dataRepresentation] length]);
+	
+	NSData * truncated = [[runs dataRepresentation] subdataWithRange: NSMakeRange(0, 10)];
+	STAssertNil([[AQBitfield alloc] initWithData: truncated], @"Truncated data should not decode");
+	STAssertNil([[AQBitfield alloc] initWithData: [NSData dataWithBytes: "not a bitfield!!" length: 16]], @"Unrecognized data should not decode");
+	
+	// a dense bitfield of 2^40 words, with one bit set far away and then one enormous run
+	UInt8 forged[32] = { 'A', 'Q', 'B', 'F', 1, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0 };
+	UInt8 * p = forged + 16;
+	*p++ = 0x80; *p++ = 0x80; *p++ = 0x80; *p++ = 0x80; *p++ = 0x40;		// gap of 2^34 bits
+	*p++ = 0x01;
+	AQBitfield * distant = [[AQBitfield alloc] initWithData: [NSData dataWithBytes: forged length: p - forged]];
+	STAssertTrue([distant countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 1, @"A single distant bit should decode without allocating the bits before it, got %@", distant);
+	
+	*p++ = 0x00;
+	*p++ = 0x80; *p++ = 0x80; *p++ = 0x80; *p++ = 0x80; *p++ = 0x10;		// run of 2^32 bits
+	STAssertNil([[AQBitfield alloc] initWithData: [NSData dataWithBytes: forged length: p - forged]], @"Runs needing far more storage than their data should not decode");
+	
+	UInt8 overlong[] = { 'A', 'Q', 'B', 'F', 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0x81, 0x00, 0x01 };
+	STAssertNil([[AQBitfield alloc] initWithData: [NSData dataWithBytes: overlong length: sizeof(overlong)]], @"Overlong varints should not decode");
+	
+#if !USING_ARC
+	[runs release];
+	[scattered release];
+	[filled release];
+	[distant release];
+#endif
+}
+
+static BOOL _ReferenceMaskedMatch( AQBitfield * bitfield, NSRange range, AQBitfield * mask, AQBitfield * value )
+{
+	// the straightforward bit-by-bit version of ((bitfield >> location) ^ value) & mask == 0
+	for ( NSUInteger i = 0; i < range.length; i++ )
+	{
+		if ( mask != nil && [mask bitAtIndex: i] == 0 )
+			continue;
+		if ( [bitfield bitAtIndex: range.location + i] != [value bitAtIndex: i] )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+static AQBitfield * _RandomBitfield( NSUInteger span )
+{
+	AQBitfield * result = [[AQBitfield alloc] initWithStorageMode: (random() & 1 ? AQBitfieldStorageSparse : AQBitfieldStorageDense)];
+	for ( NSUInteger i = 0; i < span; i += 64 )
+		[result setBitsInRange: NSMakeRange(i, 64) from64BitValue: ((UInt64)random() << 32) ^ (UInt64)random()];
+	return ( result );
+}
+
+- (void) testMaskedComparisonKernels
+{
+	srandom(1234);
+	for ( NSUInteger trial = 0; trial < 500; trial++ )
+	{
+		NSUInteger span = 64 + (NSUInteger)random() % 2000;
+		AQBitfield * bitfield = _RandomBitfield(span);
+		NSRange range = NSMakeRange((NSUInteger)random() % span, 1 + (NSUInteger)random() % (span / 2));
+		
+		// half the time compare against the exact contents, so that matches happen too
+		AQBitfield * value = [bitfield bitfieldFromRange: range];
+		[value shiftBitsLeftBy: range.location];
+		if ( random() & 1 )
+			[value flipBitAtIndex: (NSUInteger)random() % range.length];
+		AQBitfield * mask = _RandomBitfield(range.length);
+		
+		STAssertTrue([bitfield bitsInRange: range equalToBitfield: value] == _ReferenceMaskedMatch(bitfield, range, nil, value), @"Unmasked comparison of %@ in range %@ against %@ disagrees with the reference", bitfield, NSStringFromRange(range), value);
+		STAssertTrue([bitfield bitsInRange: range maskedWith: mask equalToBitfield: value] == _ReferenceMaskedMatch(bitfield, range, mask, value), @"Masked comparison of %@ in range %@ against %@ disagrees with the reference", bitfield, NSStringFromRange(range), value);
+		
+		NSRange scalarRange = NSMakeRange(range.location, MIN(range.length, sizeof(NSUInteger)*8));
+		NSUInteger scalarValue = (NSUInteger)[value scalarBitsFrom64BitRange: NSMakeRange(0, scalarRange.length)];
+		NSUInteger scalarMask = (NSUInteger)[mask scalarBitsFrom64BitRange: NSMakeRange(0, scalarRange.length)];
+		STAssertTrue([bitfield bitsInRange: scalarRange matchBits: scalarValue] == _ReferenceMaskedMatch(bitfield, scalarRange, nil, value), @"Scalar comparison of %@ in range %@ against %lx disagrees with the reference", bitfield, NSStringFromRange(scalarRange), (unsigned long)scalarValue);
+		STAssertTrue([bitfield bitsInRange: scalarRange maskedWith: scalarMask matchBits: scalarValue] == _ReferenceMaskedMatch(bitfield, scalarRange, mask, value), @"Masked scalar comparison of %@ in range %@ against %lx disagrees with the reference", bitfield, NSStringFromRange(scalarRange), (unsigned long)scalarValue);
+	}
+}
+
+- (void) testExtractBitsInRange
+{
+	srandom(4321);
+	for ( NSUInteger trial = 0; trial < 500; trial++ )
+	{
+		NSUInteger span = 64 + (NSUInteger)random() % 4000;
+		AQBitfield * bitfield = _RandomBitfield(span);
+		NSRange range = NSMakeRange((NSUInteger)random() % span, (NSUInteger)random() % span);
+		if ( (random() % 8) == 0 )
+			[bitfield setBitsInRange: NSMakeRange(span, NSNotFound - span) usingBit: 1];
+		
+		AQBitfield * expected = [bitfield bitfieldFromRange: range];
+		[expected shiftBitsLeftBy: range.location];
+		
+		AQBitfield * extracted = [bitfield bitfieldByExtractingBitsInRange: range];
+		STAssertEqualObjects(extracted, expected, @"Extracting range %@ of %@ should match a copy shifted into place", NSStringFromRange(range), bitfield);
+		
+		// into an existing bitfield of either storage mode, replacing its contents
+		AQBitfield * destination = _RandomBitfield(span);
+		[bitfield extractBitsInRange: range intoBitfield: destination];
+		STAssertEqualObjects(destination, expected, @"Extracting range %@ of %@ into another bitfield should replace its contents", NSStringFromRange(range), bitfield);
+		
+		// and in place
+		[bitfield extractBitsInRange: range intoBitfield: bitfield];
+		STAssertEqualObjects(bitfield, expected, @"Extracting range %@ in place should match a copy shifted into place", NSStringFromRange(range));
+	}
+	
+	AQBitfield * filled = [AQBitfield new];
+	[filled setAllBits: 1];
+	AQBitfield * extracted = [filled bitfieldByExtractingBitsInRange: NSMakeRange(100, 10)];
+	STAssertTrue([extracted countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 10, @"Extracting 10 bits of a filled bitfield should yield exactly 10 set bits, got %@", extracted);
+	extracted = [filled bitfieldByExtractingBitsInRange: NSMakeRange(100, NSNotFound - 100)];
+	STAssertTrue([extracted lastIndexOfBit: 0] == NSNotFound, @"Extracting to the end of a filled bitfield should keep every bit set, got %@", extracted);
+#if !USING_ARC
+	[filled release];
+#endif
+}
+
+- (void) testSetAlgebra
+{
+	AQBitfield * a = [AQBitfield new];
+	[a setBitsInRange: NSMakeRange(0, 100) usingBit: 1];
+	[a setBit: 1 atIndex: 70000];
+	
+	AQBitfield * b = [[AQBitfield alloc] initWithStorageMode: AQBitfieldStorageSparse];
+	[b setBitsInRange: NSMakeRange(50, 100) usingBit: 1];
+	[b setBit: 1 atIndex: 70000];
+	
+	AQBitfield * result = [[AQBitfield alloc] initWithCapacity: 70001];
+	
+	[a intersectWithBitfield: b intoBitfield: result];
+	STAssertTrue([result countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 51 && [result firstIndexOfBit: 1] == 50, @"Expected the intersection of %@ and %@ to hold bits 50..99 and 70000, got %@", a, b, result);
+	
+	[a symmetricDifferenceWithBitfield: b intoBitfield: result];
+	STAssertTrue([result countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 100 && [result bitAtIndex: 70000] == 0, @"Expected the symmetric difference of %@ and %@ to hold bits 0..49 and 100..149, got %@", a, b, result);
+	
+	[a subtractBitfield: b intoBitfield: result];
+	STAssertTrue([result countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 50 && [result lastIndexOfBit: 1] == 49, @"Expected %@ minus %@ to hold bits 0..49, got %@", a, b, result);
+	
+	[a complementBitsInRange: NSMakeRange(90, 20) intoBitfield: result];
+	STAssertTrue([result countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 10 && [result firstIndexOfBit: 1] == 100, @"Expected the complement of %@ within 90..109 to hold bits 100..109, got %@", a, result);
+	
+	// range-restricted forms leave everything outside the range alone
+	AQBitfield * copy = [a copy];
+	[copy intersectWithBitfield: b inRange: NSMakeRange(0, 60)];
+	STAssertTrue([copy countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 51 && [copy firstIndexOfBit: 1] == 50, @"Expected %@ intersected with %@ in 0..59 to hold bits 50..99 and 70000, got %@", a, b, copy);
+	
+	copy = [a copy];
+	[copy symmetricDifferenceWithBitfield: b inRange: NSMakeRange(100, NSNotFound - 100)];
+	STAssertTrue([copy countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 150, @"Expected %@ xor %@ above 100 to hold bits 0..149, got %@", a, b, copy);
+	
+	copy = [b copy];
+	[copy subtractBitfield: a inRange: NSMakeRange(0, 1000)];
+	STAssertTrue([copy countOfBit: 1 inRange: NSMakeRange(0, NSNotFound)] == 51 && [copy firstIndexOfBit: 1] == 100, @"Expected %@ minus %@ in 0..999 to hold bits 100..149 and 70000, got %@", b, a, copy);
+	
+	// in-place forms, including the receiver as its own destination
+	[a symmetricDifferenceWithBitfield: a intoBitfield: a];
+	STAssertTrue([a firstIndexOfBit: 1] == NSNotFound, @"Expected a bitfield xor itself to be empty, got %@", a);
+	[a unionWithBitfield: b];
+	[a subtractBitfield: b];
+	STAssertTrue([a firstIndexOfBit: 1] == NSNotFound, @"Expected a bitfield minus itself to be empty, got %@", a);
+}
+
 #endif
 
 @end
@@ -0,0 +1,257 @@
+//
+//  AQMappedBitfieldTests.m
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-12.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQMappedBitfieldTests.h"
+#import "AQMappedBitfield.h"
+#import "AQAppStateMachine.h"
+
+@implementation AQMappedBitfieldTests
+
+@synthesize path;
+
+- (void) setUp
+{
+	NSString * name = [NSString stringWithFormat: @"AQMappedBitfieldTests-%@.bits", [[NSProcessInfo processInfo] globallyUniqueString]];
+	self.path = [NSTemporaryDirectory() stringByAppendingPathComponent: name];
+}
+
+- (void) tearDown
+{
+	[[NSFileManager defaultManager] removeItemAtPath: self.path error: NULL];
+	self.path = nil;
+}
+
+- (AQMappedBitfield *) openBitfield
+{
+	NSError * error = nil;
+	AQMappedBitfield * bitfield = [[AQMappedBitfield alloc] initWithContentsOfFile: self.path error: &error];
+	STAssertNotNil(bitfield, @"Failed to map bitfield file: %@", error);
+#if !USING_ARC
+	[bitfield autorelease];
+#endif
+	return ( bitfield );
+}
+
+- (void) writeBytes: (const void *) bytes length: (NSUInteger) length atOffset: (unsigned long long) offset
+{
+	NSFileHandle * handle = [NSFileHandle fileHandleForUpdatingAtPath: self.path];
+	[handle seekToFileOffset: offset];
+	[handle writeData: [NSData dataWithBytes: bytes length: length]];
+	[handle closeFile];
+}
+
+- (void) testPersistence
+{
+	@autoreleasepool
+	{
+		AQMappedBitfield * bitfield = [self openBitfield];
+		STAssertTrue([bitfield countOfBit: 1 inRange: NSMakeRange(0, 1024)] == 0, @"A new mapped bitfield should be empty");
+		
+		[bitfield setBitsInRange: NSMakeRange(3, 10) usingBit: 1];
+		[bitfield setBit: 1 atIndex: 5000];
+		STAssertTrue([bitfield flush: NULL], @"Flushing a mapped bitfield should succeed");
+	}
+	
+	@autoreleasepool
+	{
+		AQMappedBitfield * bitfield = [self openBitfield];
+		STAssertTrue([bitfield countOfBit: 1 inRange: NSMakeRange(0, 10000)] == 11, @"Reopened bitfield should contain the bits set before, found %lu",
+					 (unsigned long)[bitfield countOfBit: 1 inRange: NSMakeRange(0, 10000)]);
+		STAssertTrue([bitfield bitAtIndex: 12] == 1, @"Bit 12 should have been persisted");
+		STAssertTrue([bitfield bitAtIndex: 13] == 0, @"Bit 13 should not have been set");
+		STAssertTrue([bitfield bitAtIndex: 5000] == 1, @"Bit 5000 should have been persisted");
+	}
+}
+
+- (void) testUnflushedChangesPersist
+{
+	@autoreleasepool
+	{
+		AQMappedBitfield * bitfield = [self openBitfield];
+		[bitfield flush: NULL];
+		
+		// not flushed: the file is now marked dirty, and is reopened without checking its checksum
+		[bitfield setBit: 1 atIndex: 64];
+		STAssertTrue([[NSFileManager defaultManager] fileExistsAtPath: self.path], @"Mapped bitfield file should exist");
+		
+		AQMappedBitfield * other = [self openBitfield];
+		STAssertTrue([other bitAtIndex: 64] == 1, @"Writes to the mapping should be visible before a flush");
+	}
+}
+
+- (void) testFlushPolicies
+{
+	@autoreleasepool
+	{
+		AQMappedBitfield * bitfield = [self openBitfield];
+		STAssertTrue(bitfield.flushPolicy == AQMappedBitfieldFlushManually, @"Mapped bitfields should default to manual flushing");
+		
+		bitfield.flushPolicy = AQMappedBitfieldFlushAsynchronously;
+		[bitfield setBitsInRange: NSMakeRange(0, 100) usingBit: 1];
+		
+		bitfield.flushPolicy = AQMappedBitfieldFlushSynchronously;
+		[bitfield flipBitAtIndex: 50];
+	}
+	
+	@autoreleasepool
+	{
+		AQMappedBitfield * bitfield = [self openBitfield];
+		STAssertTrue([bitfield countOfBit: 1 inRange: NSMakeRange(0, 200)] == 99, @"Expected 99 set bits, found %lu",
+					 (unsigned long)[bitfield countOfBit: 1 inRange: NSMakeRange(0, 200)]);
+		STAssertTrue([bitfield bitAtIndex: 50] == 0, @"Bit 50 should have been cleared");
+	}
+}
+
+- (void) testChecksumMismatch
+{
+	@autoreleasepool
+	{
+		AQMappedBitfield * bitfield = [self openBitfield];
+		[bitfield setBit: 1 atIndex: 7];
+		[bitfield flush: NULL];
+	}
+	
+	// flip a bit in the first storage word, which follows the 64-byte header
+	UInt8 corrupt = 0x01;
+	[self writeBytes: &corrupt length: 1 atOffset: 64];
+	
+	NSError * error = nil;
+	AQMappedBitfield * bitfield = [[AQMappedBitfield alloc] initWithContentsOfFile: self.path error: &error];
+	STAssertNil(bitfield, @"A corrupted file should not be mapped");
+	STAssertEqualObjects([error domain], AQMappedBitfieldErrorDomain, @"Unexpected error domain %@", [error domain]);
+	STAssertTrue([error code] == AQMappedBitfieldChecksumError, @"Expected a checksum error, got %ld", (long)[error code]);
+}
+
+- (void) testDamagedDirtyFile
+{
+	@autoreleasepool
+	{
+		AQMappedBitfield * bitfield = [self openBitfield];
+		[bitfield setBit: 1 atIndex: 100];
+		[bitfield flush: NULL];
+	}
+	
+	// as left by a crash: marked dirty, so no checksum can be relied upon
+	UInt32 flags = 1;
+	[self writeBytes: &flags length: sizeof(flags) atOffset: 8];
+	@autoreleasepool
+	{
+		AQMappedBitfield * bitfield = [self openBitfield];
+		STAssertTrue([bitfield bitAtIndex: 100] == 1, @"A dirty file with an intact layout should still be mapped");
+	}
+	
+	// ...but it can't claim more words than the file holds
+	UInt64 count = 1ull << 40;
+	[self writeBytes: &flags length: sizeof(flags) atOffset: 8];
+	[self writeBytes: &count length: sizeof(count) atOffset: 24];
+	
+	NSError * error = nil;
+	AQMappedBitfield * bitfield = [[AQMappedBitfield alloc] initWithContentsOfFile: self.path error: &error];
+	STAssertNil(bitfield, @"A dirty file whose header doesn't match its size should not be mapped");
+	STAssertTrue([error code] == AQMappedBitfieldUnrecognizedFileError, @"Expected an unrecognized file error, got %ld", (long)[error code]);
+}
+
+- (void) testUnsupportedVersion
+{
+	@autoreleasepool
+	{
+		[[self openBitfield] flush: NULL];
+	}
+	
+	UInt16 version = 99;
+	[self writeBytes: &version length: sizeof(version) atOffset: 4];
+	
+	NSError * error = nil;
+	AQMappedBitfield * bitfield = [[AQMappedBitfield alloc] initWithContentsOfFile: self.path error: &error];
+	STAssertNil(bitfield, @"A file with an unknown version should not be mapped");
+	STAssertTrue([error code] == AQMappedBitfieldUnsupportedVersionError, @"Expected an unsupported version error, got %ld", (long)[error code]);
+}
+
+- (void) testUnrecognizedFile
+{
+	NSData * junk = [@"This is not a bitfield" dataUsingEncoding: NSUTF8StringEncoding];
+	[junk writeToFile: self.path atomically: NO];
+	
+	NSError * error = nil;
+	AQMappedBitfield * bitfield = [[AQMappedBitfield alloc] initWithContentsOfFile: self.path error: &error];
+	STAssertNil(bitfield, @"A file which isn't a bitfield should not be mapped");
+	STAssertTrue([error code] == AQMappedBitfieldUnrecognizedFileError, @"Expected an unrecognized file error, got %ld", (long)[error code]);
+}
+
+- (void) testNotifications
+{
+	AQMappedBitfield * bitfield = [self openBitfield];
+	
+	__block BOOL notified = NO;
+	[bitfield notifyModificationOfBitsInRange: NSMakeRange(0, 5) usingBlock: ^(NSRange range) {
+		notified = YES;
+	}];
+	
+	[bitfield flipBitAtIndex: 4];
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(notified, @"Mapped bitfields should notify of modifications");
+	
+	AQNotifyingBitfield * theCopy = [bitfield copy];
+	[theCopy flipBitAtIndex: 4];
+	STAssertTrue([bitfield bitAtIndex: 4] == 1, @"Modifying a copy should leave the mapped bitfield unchanged");
+#if !USING_ARC
+	[theCopy release];
+#endif
+}
+
+- (void) testPersistentStateMachine
+{
+	@autoreleasepool
+	{
+		AQAppStateMachine * stateMachine = [[AQAppStateMachine alloc] initWithPersistentStateAtPath: self.path error: NULL];
+		STAssertNotNil(stateMachine, @"Failed to create a persistent state machine");
+		
+		[stateMachine addStateMachineValuesFromZeroTo: 7 withName: @"values"];
+		[stateMachine setValue: 5 forEnumerationWithName: @"values"];
+		STAssertTrue([stateMachine synchronizePersistentState: NULL], @"Failed to synchronize state machine");
+#if !USING_ARC
+		[stateMachine release];
+#endif
+	}
+	
+	AQAppStateMachine * stateMachine = [[AQAppStateMachine alloc] initWithPersistentStateAtPath: self.path error: NULL];
+	[stateMachine addStateMachineValuesFromZeroTo: 7 withName: @"values"];
+	STAssertTrue([stateMachine valueForEnumerationWithName: @"values"] == 5, @"State machine values should persist");
+#if !USING_ARC
+	[stateMachine release];
+#endif
+}
+
+@end
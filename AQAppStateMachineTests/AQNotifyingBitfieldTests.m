@@ -35,6 +35,7 @@
 
 #import "AQNotifyingBitfieldTests.h"
 #import "AQNotifyingBitfield.h"
+#import <libkern/OSAtomic.h>
 
 @implementation AQNotifyingBitfieldTests
 
@@ -109,6 +110,262 @@
 	STAssertTrue(notified, @"Modifying bits 8..17 should trigger notification for bits 3..12");
 }
 
+- (void) testNotificationsAfterCopy
+{
+	__block NSUInteger notifications = 0;
+	[self.bitfield notifyModificationOfBitsInRange: NSMakeRange(0, 5) usingBlock: ^(NSRange range) {
+		notifications += 1;
+	}];
+	
+	AQNotifyingBitfield * theCopy = [self.bitfield copy];
+	STAssertTrue([theCopy isKindOfClass: [AQNotifyingBitfield class]], @"Copy of a notifying bitfield should also notify");
+	
+	[theCopy flipBitAtIndex: 2];
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(notifications == 0, @"Modifying a copy should NOT trigger the original's notifications");
+	STAssertTrue([self.bitfield bitAtIndex: 2] == 1, @"Modifying a copy should leave the original unchanged");
+	
+	__block BOOL copyNotified = NO;
+	[theCopy notifyModificationOfBitsInRange: NSMakeRange(0, 5) usingBlock: ^(NSRange range) {
+		copyNotified = YES;
+	}];
+	
+	[self.bitfield flipBitAtIndex: 3];
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(notifications == 1, @"Modifying the original after a copy should still trigger its notifications");
+	STAssertFalse(copyNotified, @"Modifying the original should NOT trigger the copy's notifications");
+	STAssertTrue([theCopy bitAtIndex: 3] == 1, @"Modifying the original should leave the copy unchanged");
+	
+	[theCopy flipBitAtIndex: 3];
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(copyNotified, @"Modifying the copy should trigger its own notifications");
+	STAssertTrue(notifications == 1, @"Modifying the copy should NOT trigger the original's notifications");
+	
+#if !USING_ARC
+	[theCopy release];
+#endif
+}
+
+- (void) testMultipleNotifiersForRange
+{
+	__block NSUInteger notifications1 = 0;
+	__block NSUInteger notifications2 = 0;
+	id token1 = [self.bitfield notifyModificationOfBitsInRange: NSMakeRange(0, 5) usingBlock: ^(NSRange range) {
+		notifications1 += 1;
+	}];
+	id token2 = [self.bitfield notifyModificationOfBitsInRange: NSMakeRange(0, 5) usingBlock: ^(NSRange range) {
+		notifications2 += 1;
+	}];
+	STAssertNotNil(token1, @"Installing a notifier should return a token");
+	STAssertFalse([token1 isEqual: token2], @"Each notifier should have its own token");
+	
+	[self.bitfield flipBitAtIndex: 2];
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(notifications1 == 1, @"First notifier for bits 0..4 should fire");
+	STAssertTrue(notifications2 == 1, @"Second notifier for bits 0..4 should fire too");
+	
+	[self.bitfield removeNotifier: token1];
+	[self.bitfield flipBitAtIndex: 2];
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(notifications1 == 1, @"A notifier removed by token should NOT fire");
+	STAssertTrue(notifications2 == 2, @"Removing one notifier by token should leave the other in place");
+	
+	// removing twice, or after the slot has been reused, must not affect anyone else
+	[self.bitfield removeNotifier: token1];
+	[self.bitfield notifyModificationOfBitsInRange: NSMakeRange(0, 5) usingBlock: ^(NSRange range) {}];
+	[self.bitfield removeNotifier: token1];
+	[self.bitfield flipBitAtIndex: 2];
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(notifications2 == 3, @"Removing a stale token should leave other notifiers in place");
+}
+
+- (void) testBatchUpdates
+{
+	__block NSUInteger notifications = 0;
+	__block NSUInteger otherNotifications = 0;
+	[self.bitfield notifyModificationOfBitsInRange: NSMakeRange(0, 100) usingBlock: ^(NSRange range) {
+		notifications += 1;
+	}];
+	[self.bitfield notifyModificationOfBitsInRange: NSMakeRange(200, 10) usingBlock: ^(NSRange range) {
+		otherNotifications += 1;
+	}];
+	
+	[self.bitfield performBatchUpdates: ^{
+		for ( NSUInteger i = 0; i < 100; i += 10 )
+			[self.bitfield flipBitAtIndex: i];
+		
+		[self.bitfield performBatchUpdates: ^{
+			[self.bitfield setBitsInRange: NSMakeRange(50, 20) usingBit: 1];
+		}];
+		
+		[NSThread sleepForTimeInterval: 0.1];
+		STAssertTrue(notifications == 0, @"Notifications should not be delivered until the outermost batch completes");
+	}];
+	
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(notifications == 1, @"Notifier for bits 0..99 should fire once per batch, but fired %lu times", (unsigned long)notifications);
+	STAssertTrue(otherNotifications == 0, @"Notifier for bits 200..209 should NOT fire for a batch which didn't modify them");
+	STAssertTrue([self.bitfield bitAtIndex: 50] == 1, @"Modifications within a batch should be applied immediately");
+	
+	[self.bitfield flipBitAtIndex: 5];
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(notifications == 2, @"Modifications after a batch should notify immediately again");
+}
+
+- (void) testNotificationDelivery
+{
+	__block NSUInteger inlineNotifications = 0;
+	[self.bitfield notifyModificationOfBitsInRange: NSMakeRange(0, 10) delivery: AQNotificationDeliveryInline queue: NULL usingBlock: ^(NSRange range) {
+		inlineNotifications += 1;
+	}];
+	
+	[self.bitfield setBit: 1 atIndex: 5];
+	STAssertTrue(inlineNotifications == 1, @"Inline notifier should have run before the modification returned");
+	
+	dispatch_queue_t queue = dispatch_queue_create("net.alanquatermain.notifyingbitfieldtests.target", DISPATCH_QUEUE_SERIAL);
+	static char queueKey;
+	dispatch_queue_set_specific(queue, &queueKey, &queueKey, NULL);
+	__block BOOL onTargetQueue = NO;
+	[self.bitfield notifyModificationOfBitsInRange: NSMakeRange(20, 10) delivery: AQNotificationDeliveryTargetQueue queue: queue usingBlock: ^(NSRange range) {
+		onTargetQueue = (dispatch_get_specific(&queueKey) == &queueKey);
+	}];
+	
+	NSMutableArray * delivered = [NSMutableArray new];
+	__block int32_t running = 0;
+	__block BOOL overlapped = NO;
+	[self.bitfield notifyModificationOfBitsInRange: NSMakeRange(40, 100) delivery: AQNotificationDeliverySerial queue: NULL usingBlock: ^(NSRange range) {
+		// a serial notifier never has more than one notification running at once
+		if ( OSAtomicIncrement32(&running) != 1 )
+			overlapped = YES;
+		[delivered addObject: [NSNumber numberWithUnsignedInteger: range.location]];
+		OSAtomicDecrement32(&running);
+	}];
+	
+	[self.bitfield setBit: 1 atIndex: 25];
+	for ( NSUInteger i = 40; i < 140; i++ )
+		[self.bitfield setBit: 1 atIndex: i];
+	
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(onTargetQueue, @"Target-queue notifier should run on the queue it was given");
+	STAssertTrue([delivered count] == 100, @"Serial notifier should see every modification, but saw %lu", (unsigned long)[delivered count]);
+	STAssertFalse(overlapped, @"Serial notifier should only run one notification at a time");
+	STAssertTrue(inlineNotifications == 1, @"Inline notifier should not fire for bits outside its range");
+	
+	dispatch_release(queue);
+#if !USING_ARC
+	[delivered release];
+#endif
+}
+
+- (void) testChangeNotifications
+{
+	[self.bitfield setBitsInRange: NSMakeRange(8, 8) from32BitValue: 0xA5];
+	
+	__block AQBitfieldChange * lastChange = nil;
+	__block NSUInteger notifications = 0;
+	id token = [self.bitfield notifyModificationOfBitsInRange: NSMakeRange(8, 8) delivery: AQNotificationDeliveryInline queue: NULL usingChangeBlock: ^(NSRange range, AQBitfieldChange * change) {
+		notifications += 1;
+#if USING_ARC
+		lastChange = change;
+#else
+		[lastChange release];
+		lastChange = [change retain];
+#endif
+	}];
+	
+	// only part of the watched range is modified, but the change describes all of it
+	[self.bitfield setBitsInRange: NSMakeRange(8, 4) from32BitValue: 0xC];
+	STAssertTrue(notifications == 1, @"Expected one notification, got %lu", (unsigned long)notifications);
+	STAssertTrue(NSEqualRanges(lastChange.range, NSMakeRange(8, 8)), @"Expected the change to cover the watched range, got %@", NSStringFromRange(lastChange.range));
+	STAssertTrue(lastChange.valueBefore == 0xA5, @"Expected value before of 0xA5, got 0x%llx", lastChange.valueBefore);
+	STAssertTrue(lastChange.valueAfter == 0xAC, @"Expected value after of 0xAC, got 0x%llx", lastChange.valueAfter);
+	STAssertTrue([lastChange changedAnyBits], @"Expected the change to report modified bits");
+	
+	// a batch reports the values from before it began, whatever happened in between
+	[self.bitfield performBatchUpdates: ^{
+		[self.bitfield setBitsInRange: NSMakeRange(8, 8) from32BitValue: 0x00];
+		[self.bitfield flipBitAtIndex: 15];
+		[self.bitfield setBit: 1 atIndex: 8];
+	}];
+	STAssertTrue(notifications == 2, @"Expected one notification for the batch, got %lu", (unsigned long)notifications);
+	STAssertTrue(lastChange.valueBefore == 0xAC, @"Expected value before the batch of 0xAC, got 0x%llx", lastChange.valueBefore);
+	STAssertTrue(lastChange.valueAfter == 0x81, @"Expected value after the batch of 0x81, got 0x%llx", lastChange.valueAfter);
+	
+	[self.bitfield setBit: 1 atIndex: 8];
+	STAssertFalse([lastChange changedAnyBits], @"Expected rewriting a bit with its own value to change nothing");
+	
+	[self.bitfield removeNotifier: token];
+#if !USING_ARC
+	[lastChange release];
+#endif
+}
+
+- (void) testNotificationBacklogs
+{
+	// notifications pile up on a suspended queue until it's resumed
+	dispatch_queue_t queue = dispatch_queue_create("net.alanquatermain.notifyingbitfieldtests.backlog", DISPATCH_QUEUE_SERIAL);
+	dispatch_suspend(queue);
+	
+	__block NSUInteger merged = 0;
+	__block UInt64 mergedBefore = 0, mergedAfter = 0;
+	id mergeToken = [self.bitfield notifyModificationOfBitsInRange: NSMakeRange(0, 8) delivery: AQNotificationDeliveryTargetQueue queue: queue usingChangeBlock: ^(NSRange range, AQBitfieldChange * change) {
+		merged += 1;
+		mergedBefore = change.valueBefore;
+		mergedAfter = change.valueAfter;
+	}];
+	[self.bitfield setBacklog: AQNotificationBacklogMerge limit: 1 forNotifier: mergeToken];
+	
+	NSMutableArray * kept = [NSMutableArray new];
+	id dropToken = [self.bitfield notifyModificationOfBitsInRange: NSMakeRange(8, 8) delivery: AQNotificationDeliveryTargetQueue queue: queue usingChangeBlock: ^(NSRange range, AQBitfieldChange * change) {
+		[kept addObject: [NSNumber numberWithUnsignedLongLong: change.valueAfter]];
+	}];
+	[self.bitfield setBacklog: AQNotificationBacklogDropOldest limit: 3 forNotifier: dropToken];
+	
+	for ( UInt32 i = 1; i <= 10; i++ )
+	{
+		[self.bitfield setBitsInRange: NSMakeRange(0, 8) from32BitValue: i];
+		[self.bitfield setBitsInRange: NSMakeRange(8, 8) from32BitValue: i];
+	}
+	
+	dispatch_resume(queue);
+	[NSThread sleepForTimeInterval: 0.1];
+	
+	STAssertTrue(merged == 1, @"Expected merged notifications to run once, ran %lu times", (unsigned long)merged);
+	STAssertTrue(mergedBefore == 0 && mergedAfter == 10, @"Expected the merged change to run from 0 to 10, got %llu to %llu", mergedBefore, mergedAfter);
+	STAssertTrue([self.bitfield mergedNotificationCountForNotifier: mergeToken] == 9, @"Expected 9 merged notifications, got %lu", (unsigned long)[self.bitfield mergedNotificationCountForNotifier: mergeToken]);
+	
+	NSArray * expected = [NSArray arrayWithObjects: [NSNumber numberWithInt: 8], [NSNumber numberWithInt: 9], [NSNumber numberWithInt: 10], nil];
+	STAssertEqualObjects(kept, expected, @"Expected only the newest notifications to be kept");
+	STAssertTrue([self.bitfield droppedNotificationCountForNotifier: dropToken] == 7, @"Expected 7 dropped notifications, got %lu", (unsigned long)[self.bitfield droppedNotificationCountForNotifier: dropToken]);
+	
+	[self.bitfield removeNotifier: mergeToken];
+	[self.bitfield removeNotifier: dropToken];
+	
+	// a full backlog holds up the writer until there's room again
+	dispatch_suspend(queue);
+	id blockToken = [self.bitfield notifyModificationOfBitsInRange: NSMakeRange(16, 8) delivery: AQNotificationDeliveryTargetQueue queue: queue usingBlock: ^(NSRange range) {}];
+	[self.bitfield setBacklog: AQNotificationBacklogBlock limit: 1 forNotifier: blockToken];
+	[self.bitfield flipBitAtIndex: 16];
+	
+	__block BOOL written = NO;
+	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		[self.bitfield flipBitAtIndex: 17];
+		written = YES;
+	});
+	
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertFalse(written, @"Expected the writer to wait while the backlog is full");
+	
+	dispatch_resume(queue);
+	[NSThread sleepForTimeInterval: 0.1];
+	STAssertTrue(written, @"Expected the writer to continue once the backlog has room");
+	
+	dispatch_release(queue);
+#if !USING_ARC
+	[kept release];
+#endif
+}
+
 - (void) testNotificationRemoval
 {
 	__block BOOL notified = NO;
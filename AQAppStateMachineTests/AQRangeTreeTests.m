@@ -0,0 +1,190 @@
+//
+//  AQRangeTreeTests.m
+//  AQAppStateMachine
+//
+//  Created by Jim Dovey on 11-07-14.
+//  Copyright 2011 Jim Dovey. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions
+//  are met:
+//
+//  Redistributions of source code must retain the above copyright notice,
+//  this list of conditions and the following disclaimer.
+//
+//  Redistributions in binary form must reproduce the above copyright
+//  notice, this list of conditions and the following disclaimer in the
+//  documentation and/or other materials provided with the distribution.
+//
+//  Neither the name of the project's author nor the names of its
+//  contributors may be used to endorse or promote products derived from
+//  this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+//  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#import "AQRangeTreeTests.h"
+#import "AQRangeTree.h"
+#import "AQRange.h"
+
+@implementation AQRangeTreeTests
+
+- (void) testStorage
+{
+	AQRangeTree * tree = [AQRangeTree new];
+	NSUInteger a = [tree addObject: @"a" forRange: NSMakeRange(0, 10)];
+	NSUInteger b = [tree addObject: @"b" forRange: NSMakeRange(0, 20)];
+	NSUInteger c = [tree addObject: @"c" forRange: NSMakeRange(0, 10)];
+	
+	STAssertTrue(tree.count == 3, @"Objects sharing a range should be stored separately, but tree has %lu objects", (unsigned long)tree.count);
+	STAssertEqualObjects([tree objectAtSlot: a], @"a", @"Expected first object for range 0..9");
+	STAssertEqualObjects([tree objectAtSlot: b], @"b", @"Expected object for range 0..19");
+	STAssertEqualObjects([tree objectAtSlot: c], @"c", @"Expected second object for range 0..9");
+	STAssertNil([tree objectAtSlot: 1000], @"Expected no object for an unused slot");
+	
+	[tree removeObjectAtSlot: a];
+	STAssertNil([tree objectAtSlot: a], @"Expected removed slot to have no object");
+	STAssertEqualObjects([tree objectAtSlot: c], @"c", @"Removing one object for a range should leave the others");
+	STAssertTrue(tree.count == 2, @"Expected two objects left after removal, found %lu", (unsigned long)tree.count);
+	
+	[tree removeObjectsForRange: NSMakeRange(0, 10)];
+	STAssertNil([tree objectAtSlot: c], @"Expected every object for range 0..9 to be removed");
+	STAssertTrue(tree.count == 1, @"Expected one object left after removal, found %lu", (unsigned long)tree.count);
+	
+#if !USING_ARC
+	[tree release];
+#endif
+}
+
+- (void) testSlotRecycling
+{
+	AQRangeTree * tree = [AQRangeTree new];
+	NSMutableIndexSet * slots = [NSMutableIndexSet new];
+	
+	// repeatedly add and remove, as listeners come and go; compaction returns the slots for reuse
+	for ( NSUInteger i = 0; i < 10000; i++ )
+	{
+		NSUInteger slot = [tree addObject: [NSNumber numberWithUnsignedInteger: i] forRange: NSMakeRange(i % 100, 10)];
+		[slots addIndex: slot];
+		if ( i >= 50 )
+		{
+			NSUInteger oldSlot = [slots firstIndex];
+			[tree removeObjectAtSlot: oldSlot];
+			[slots removeIndex: oldSlot];
+		}
+	}
+	
+	STAssertTrue(tree.count == 50, @"Expected 50 objects left, found %lu", (unsigned long)tree.count);
+	STAssertTrue([slots lastIndex] < 200, @"Removed slots should be reused, but slot %lu is in use", (unsigned long)[slots lastIndex]);
+	
+	__block NSUInteger found = 0;
+	[tree enumerateRangesIntersectingRange: NSMakeRange(0, 200) usingBlock: ^(NSRange range, id object, BOOL *stop) {
+		found++;
+	}];
+	STAssertTrue(found == 50, @"Removed objects should not be enumerated, but found %lu", (unsigned long)found);
+	
+#if !USING_ARC
+	[tree release];
+	[slots release];
+#endif
+}
+
+- (void) testIntersectionAgainstLinearSearch
+{
+	AQRangeTree * tree = [AQRangeTree new];
+	NSMutableArray * ranges = [NSMutableArray new];
+	NSMutableArray * slots = [NSMutableArray new];
+	
+	srandom(2011);
+	for ( NSUInteger op = 0; op < 20000; op++ )
+	{
+		NSRange range = NSMakeRange((NSUInteger)random() % 10000, (NSUInteger)random() % ((random() & 3) ? 50 : 5000));
+		long choice = random() % 10;
+		
+		if ( choice < 5 )
+		{
+			AQRange * obj = [[AQRange alloc] initWithRange: range];
+			[ranges addObject: obj];
+			[slots addObject: [NSNumber numberWithUnsignedInteger: [tree addObject: obj forRange: range]]];
+#if !USING_ARC
+			[obj release];
+#endif
+		}
+		else if ( choice < 8 && [ranges count] != 0 )
+		{
+			// remove an existing entry
+			NSUInteger idx = (NSUInteger)random() % [ranges count];
+			[tree removeObjectAtSlot: [[slots objectAtIndex: idx] unsignedIntegerValue]];
+			[ranges removeObjectAtIndex: idx];
+			[slots removeObjectAtIndex: idx];
+		}
+		else
+		{
+			NSMutableArray * expected = [NSMutableArray new];
+			for ( AQRange * obj in ranges )
+			{
+				if ( NSIntersectionRange(obj.range, range).length != 0 )
+					[expected addObject: obj];
+			}
+			[expected sortUsingSelector: @selector(compare:)];
+			
+			NSMutableArray * found = [NSMutableArray new];
+			[tree enumerateRangesIntersectingRange: range usingBlock: ^(NSRange foundRange, id object, BOOL *stop) {
+				STAssertTrue([object isEqualToNSRange: foundRange], @"Object %@ doesn't match its range %@", object, NSStringFromRange(foundRange));
+				[found addObject: object];
+			}];
+			
+			STAssertEqualObjects(found, expected, @"Tree search for %@ should match a linear search", NSStringFromRange(range));
+#if !USING_ARC
+			[expected release];
+			[found release];
+#endif
+		}
+	}
+	
+	STAssertTrue(tree.count == [ranges count], @"Expected %lu ranges in tree, found %lu", (unsigned long)[ranges count], (unsigned long)tree.count);
+	
+#if !USING_ARC
+	[tree release];
+	[ranges release];
+	[slots release];
+#endif
+}
+
+- (void) testRemoveRangesWithinRange
+{
+	AQRangeTree * tree = [AQRangeTree new];
+	for ( NSUInteger i = 0; i < 100; i++ )
+		[tree addObject: [NSNumber numberWithUnsignedInteger: i] forRange: NSMakeRange(i, 10)];
+	
+	[tree removeObjectsForRangesWithinRange: NSMakeRange(20, 30)];
+	STAssertTrue(tree.count == 79, @"Expected ranges 20..29 through 40..49 to be removed, leaving 79, found %lu", (unsigned long)tree.count);
+	STAssertNotNil([tree objectAtSlot: 41], @"Range 41..50 extends beyond 20..49, so shouldn't be removed");
+	STAssertNotNil([tree objectAtSlot: 19], @"Range 19..28 starts before 20..49, so shouldn't be removed");
+	STAssertNil([tree objectAtSlot: 30], @"Range 30..39 lies within 20..49, so should be removed");
+	
+	__block NSUInteger last = 0;
+	__block BOOL ordered = YES;
+	[tree enumerateRangesAndObjectsUsingBlock: ^(NSRange range, id object, BOOL *stop) {
+		if ( range.location < last )
+			ordered = NO;
+		last = range.location;
+	}];
+	STAssertTrue(ordered, @"Ranges should be enumerated in order");
+	
+#if !USING_ARC
+	[tree release];
+#endif
+}
+
+@end
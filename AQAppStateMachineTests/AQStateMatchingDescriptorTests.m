@@ -149,4 +149,56 @@
 	STAssertFalse([desc matchesBitfield: bitfield], @"Expected equality descriptor %@ NOT to match bitfield %@", desc, bitfield);
 }
 
+- (void) testMultipleRangeWordEquality
+{
+	// one range straddles the first two words, the other sits in the fourth
+	NSArray * ranges = [NSArray arrayWithObjects: [[AQRange alloc] initWithRange: NSMakeRange(60, 8)], [[AQRange alloc] initWithRange: NSMakeRange(200, 4)], nil];
+	NSArray * values = [NSArray arrayWithObjects: [NSNumber numberWithUnsignedLongLong: 0xA5], [NSNumber numberWithUnsignedLongLong: 0x9], nil];
+	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWithRanges: ranges masks: nil matchingValues: values];
+	
+	UInt64 words[4] = { 0x5ull << 60, 0xAull, 0ull, 0x9ull << 8 };
+	STAssertTrue([desc matchesWords: words count: 4], @"Expected equality descriptor %@ to match words", desc);
+	
+	AQBitfield * bitfield = [AQBitfield new];
+	for ( NSUInteger i = 0; i < 4; i++ )
+		[bitfield setBitsInRange: NSMakeRange(i * 64, 64) from64BitValue: words[i]];
+	STAssertTrue([desc matchesBitfield: bitfield], @"Expected equality descriptor %@ to match bitfield %@", desc, bitfield);
+	
+	// bits outside the ranges are ignored, missing words read as zero
+	words[2] = ~0ull;
+	STAssertTrue([desc matchesWords: words count: 4], @"Expected equality descriptor %@ to ignore unwatched words", desc);
+	STAssertFalse([desc matchesWords: words count: 3], @"Expected equality descriptor %@ NOT to match truncated words", desc);
+	
+	words[1] ^= 0x2ull;
+	STAssertFalse([desc matchesWords: words count: 4], @"Expected equality descriptor %@ NOT to match words", desc);
+	
+	[bitfield flipBitAtIndex: 65];
+	STAssertFalse([desc matchesBitfield: bitfield], @"Expected equality descriptor %@ NOT to match bitfield %@", desc, bitfield);
+}
+
+- (void) testIncrementalMismatchCounts
+{
+	AQStateMaskedEqualityMatchingDescriptor * desc = [[AQStateMaskedEqualityMatchingDescriptor alloc] initWith64BitValue: 0xF0F0 forRange: NSMakeRange(64, 16)];
+	
+	UInt64 words[2] = { ~0ull, 0x0F0Full };
+	NSUInteger count = [desc mismatchCountInWords: words count: 2];
+	STAssertTrue(count == 16, @"Expected every compared bit to mismatch, got %lu", (unsigned long)count);
+	
+	// changing bits outside the compared range makes no difference
+	STAssertTrue([desc mismatchDeltaForWordAtIndex: 0 from: words[0] to: 0ull] == 0, @"Expected no change for an unwatched word");
+	STAssertTrue([desc mismatchDeltaForWordAtIndex: 1 from: words[1] to: words[1] | (1ull << 40)] == 0, @"Expected no change for unwatched bits");
+	
+	// walk the word towards the value, keeping a running count
+	UInt64 steps[3] = { 0x0FF0ull, 0xFFF0ull, 0xF0F0ull };
+	for ( NSUInteger i = 0; i < 3; i++ )
+	{
+		count += [desc mismatchDeltaForWordAtIndex: 1 from: words[1] to: steps[i]];
+		words[1] = steps[i];
+		STAssertTrue(count == [desc mismatchCountInWords: words count: 2], @"Expected running count %lu to match a full recount", (unsigned long)count);
+	}
+	
+	STAssertTrue(count == 0, @"Expected no mismatches once the value is reached, got %lu", (unsigned long)count);
+	STAssertTrue([desc matchesWords: words count: 2], @"Expected equality descriptor %@ to match words", desc);
+}
+
 @end